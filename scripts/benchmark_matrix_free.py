@@ -0,0 +1,94 @@
+#!/usr/bin/env python
+""" Compare memory and time per iteration of the assembled and the matrix-free
+(-taras_matrix_free) Stokes operator of simul@atrophy on the same inputs.
+"""
+
+import os.path as op
+import re
+import subprocess
+import argparse as ag
+import bish_utils as bu
+
+# Format of the line printed by PetscAdLemTaras3D::solveModel() after each solve.
+STATS_RE = re.compile(
+    r'solve stats: (\d+) iterations, ([\d.eE+-]+) s, ([\d.eE+-]+) s per '
+    r'iteration \(setup included\), memory ([\d.eE+-]+) MB')
+
+def get_input_options():
+    """ command line interface, get input options and interact with the user
+    """
+    parser = ag.ArgumentParser()
+    parser.add_argument(
+        'simul_atrophy', help='simul_atrophy executable, e.g. '
+        'build/src/simul_atrophy')
+    parser.add_argument(
+        'lame_paras', help='input lame parameters: Format: muTissue,muCsf,'
+        'lambdaTissue,lambdaCsf')
+    parser.add_argument(
+        'atrophy', help='input atrophy file.')
+    parser.add_argument(
+        'in_seg', help='input brain seg ')
+    parser.add_argument(
+        'in_img', help='input image.')
+    parser.add_argument(
+        'res_path', help='directory where the results of both runs are '
+        'written.')
+    parser.add_argument(
+        'petsc_op_file', help='file with petsc options, used for both runs.')
+    parser.add_argument(
+        '-b', '--boundary_condition', default='dirichlet_at_skull',
+        help='Default: dirichlet_at_skull')
+    parser.add_argument(
+        '-t', '--time_steps', default='1', help='Default: 1')
+    parser.add_argument(
+        '-n', '--num_procs', help='If given, runs with mpiexec -n num_procs.')
+    parser.add_argument(
+        '--div12pt_stencil', action='store_true',
+        help='If given, use 12pt stencil for divergence.')
+    parser.add_argument(
+        '--relax_ic_in_csf', action='store_true', help='If given, relaxes IC.')
+    return parser.parse_args()
+
+
+def run(ops, prefix, extra_args):
+    """ run simul_atrophy and return the list of (iterations, time,
+    time per iteration, memory) of each solve found in its output."""
+    petsc_ops = bu.get_lines_as_list(ops.petsc_op_file, '#')
+    bool_args = []
+    if ops.div12pt_stencil:
+        bool_args.append('--div12pt_stencil')
+    if ops.relax_ic_in_csf:
+        bool_args.append('--relax_ic_in_csf')
+    cmd = ('%s -parameters %s -boundary_condition %s -atrophyFile %s '
+           '-maskFile %s -imageFile %s -numOfTimeSteps %s -resPath %s '
+           '-resultsFilenamesPrefix %s %s'
+           % (ops.simul_atrophy, ops.lame_paras, ops.boundary_condition,
+              ops.atrophy, ops.in_seg, ops.in_img, ops.time_steps,
+              op.join(ops.res_path, ''), prefix,
+              ' '.join(bool_args + extra_args + petsc_ops)))
+    if ops.num_procs:
+        cmd = 'mpiexec -n %s %s' % (ops.num_procs, cmd)
+    print cmd + '\n'
+    out = subprocess.Popen(cmd, shell=True,
+                           stdout=subprocess.PIPE).communicate()[0]
+    return [(int(m.group(1)), float(m.group(2)), float(m.group(3)),
+             float(m.group(4))) for m in STATS_RE.finditer(out)]
+
+
+def main():
+    """ Run both operator modes and print the statistics side by side."""
+    ops = get_input_options()
+    modes = [('assembled', 'benchAssembled_', []),
+             ('matrix-free', 'benchMatrixFree_', ['-taras_matrix_free'])]
+    results = [(name, run(ops, prefix, args)) for name, prefix, args in modes]
+    print '%-12s %5s %6s %12s %16s %12s' % (
+        'operator', 'step', 'its', 'time (s)', 's/iteration', 'memory (MB)')
+    for name, stats in results:
+        if not stats:
+            print '%-12s no solve stats found in the output.' % name
+        for step, (its, time, time_per_it, mem) in enumerate(stats):
+            print '%-12s %5d %6d %12.3f %16.5f %12.1f' % (
+                name, step + 1, its, time, time_per_it, mem)
+
+if __name__ == "__main__":
+    main()
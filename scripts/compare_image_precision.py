@@ -0,0 +1,97 @@
+#!/usr/bin/env python
+""" Compare the outputs of simul@atrophy built with double ITK images (default)
+and with float ITK images (cmake -DUSE_FLOAT_IMAGES:bool=true) on the basic
+example of the readme.
+"""
+
+import os.path as op
+import subprocess
+import argparse as ag
+import numpy as np
+import nibabel as ni
+
+# Outputs of the basic example (two time steps) compared between both builds:
+# velocity, composed field and warped image, then divergence.
+OUTPUTS = ['T1vel.nii.gz', 'T2vel.nii.gz', 'ComposedField.nii.gz',
+           'WarpedImageBsplineT1.nii.gz', 'WarpedImageBsplineT2.nii.gz',
+           'T1div.nii.gz', 'T2div.nii.gz']
+
+def get_input_options():
+    """ command line interface, get input options and interact with the user
+    """
+    parser = ag.ArgumentParser()
+    parser.add_argument(
+        'simul_atrophy_double', help='simul_atrophy executable built with '
+        'double images, e.g. build/src/simul_atrophy')
+    parser.add_argument(
+        'simul_atrophy_float', help='simul_atrophy executable built with '
+        '-DUSE_FLOAT_IMAGES:bool=true')
+    parser.add_argument(
+        'res_path', help='directory where the results of both runs are '
+        'written.')
+    parser.add_argument(
+        '-e', '--example_dir', default=op.join(
+            op.dirname(op.abspath(__file__)), '..', 'basicExample'),
+        help='Default: basicExample directory of the repository.')
+    parser.add_argument(
+        '-n', '--num_procs', help='If given, runs with mpiexec -n num_procs.')
+    parser.add_argument(
+        '-o', '--results_file', help='File where the table of the '
+        'differences is written. Default: precision_comparison.txt in '
+        'res_path.')
+    return parser.parse_args()
+
+
+def run(ops, simul_atrophy, prefix):
+    """ run the basic example of the readme with the given executable."""
+    ex = ops.example_dir
+    cmd = ('%s -parameters 1,1,1,1 -boundary_condition dirichlet_at_skull '
+           '--relax_ic_in_csf -atrophyFile %s -maskFile %s -imageFile %s '
+           '--invert_field_to_warp -numOfTimeSteps 2 -resPath %s '
+           '-resultsFilenamesPrefix %s'
+           % (simul_atrophy, op.join(ex, 'test1Atrophy1.mha'),
+              op.join(ex, 'bMask1.mha'), op.join(ex, 'bTest1.mha'),
+              op.join(ops.res_path, ''), prefix))
+    if ops.num_procs:
+        cmd = 'mpiexec -n %s %s' % (ops.num_procs, cmd)
+    print cmd + '\n'
+    subprocess.call(cmd, shell=True)
+
+
+def compare(ops):
+    """ table of the differences between the outputs of both runs: max of
+    the double output, max and RMS of the absolute difference (over all the
+    components of vector images)."""
+    lines = ['%-30s %14s %14s %14s' % (
+        'output', 'max |double|', 'max abs diff', 'RMS diff')]
+    for out in OUTPUTS:
+        double_file = op.join(ops.res_path, 'precDouble_' + out)
+        float_file = op.join(ops.res_path, 'precFloat_' + out)
+        if not (op.exists(double_file) and op.exists(float_file)):
+            lines.append('%-30s missing output.' % out)
+            continue
+        ref = ni.load(double_file).get_data().astype(np.float64)
+        test = ni.load(float_file).get_data().astype(np.float64)
+        diff = test - ref
+        lines.append('%-30s %14.6e %14.6e %14.6e' % (
+            out, np.amax(np.abs(ref)), np.amax(np.abs(diff)),
+            np.sqrt(np.mean(diff * diff))))
+    return lines
+
+
+def main():
+    """ Run both builds, print the differences of their outputs and write
+    them to the results file."""
+    ops = get_input_options()
+    run(ops, ops.simul_atrophy_double, 'precDouble_')
+    run(ops, ops.simul_atrophy_float, 'precFloat_')
+    lines = compare(ops)
+    results_file = ops.results_file or op.join(
+        ops.res_path, 'precision_comparison.txt')
+    with open(results_file, 'w') as res:
+        res.write('\n'.join(lines) + '\n')
+    print '\n'.join(lines)
+    print '\nwritten to %s' % results_file
+
+if __name__ == "__main__":
+    main()
@@ -80,6 +80,9 @@ def get_input_options():
         '--wrt_force', action='store_true', help='Write force file.')
     parser.add_argument(
         '--wrt_residual', action='store_true', help='Write residual file.')
+    parser.add_argument(
+        '--write_steps', help='Steps whose outputs are written, separated by '
+        'comma, e.g. 5,10,20. Default: all the steps.')
     cluster = parser.add_mutually_exclusive_group()
     cluster.add_argument(
         '--in_legacy_cluster', action='store_true',
@@ -168,6 +171,8 @@ def main():
         bool_args.append('--writeForce')
     if ops.wrt_residual:
         bool_args.append('--writeResidual')
+    if ops.write_steps is not None:
+        optional_args.append('-writeSteps ' + ops.write_steps)
 
     cmd = ('%s -parameters %s -boundary_condition %s -atrophyFile %s '
            '-maskFile %s -imageFile %s -numOfTimeSteps %s -resPath %s '
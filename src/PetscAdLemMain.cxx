@@ -1,16 +1,24 @@
 #include "AdLem3D.h"
 #include "GlobalConstants.h"
+#include "AsyncImageWriter.h"
 
 #include <iostream>
 #include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
 #include <petscsys.h>
 
 #include <itkImage.h>
 #include <itkImageFileReader.h>
 #include <itkImageFileWriter.h>
 
-#include <itkWarpImageFilter.h>
+#include "FusedWarpImages.h"
+#include "MaskChangeDetector.h"
 #include "InverseDisplacementImageFilter.h"
+#include "MpiChunkedTransfer.h"
+#include <itkPasteImageFilter.h>
 #include <itkNearestNeighborInterpolateImageFunction.h>
 #include <itkLinearInterpolateImageFunction.h>
 #include <itkBSplineInterpolateImageFunction.h>
@@ -18,8 +26,6 @@
 
 #include <itkComposeDisplacementFieldsImageFilter.h>
 
-#include <itkAbsoluteValueDifferenceImageFilter.h>
-#include <itkStatisticsImageFilter.h>
 #include <itkMultiplyImageFilter.h>
 
 static char help[] = "Solves AdLem model. Equations solved: "
@@ -56,17 +62,77 @@ static char help[] = "Solves AdLem model. Equations solved: "
     "-domainRegion		: Origin (in image coordinate => integer values) and size (in image coord => integer values) "
     "of the image region selected as computational domain.\n"
     "    x y z sx sy sz e.g. '0 0 0 30 40 50' Selects the region with origin at (0, 0, 0) and size (30, 40, 50) \n"
-    "    If not provided uses full image regions.\n\n"
+    "    If not provided uses full image regions.\n"
+    "    auto[:pad] selects the bounding box of all the non-NBR labels of the mask, enlarged by pad voxels (default 3) on "
+    "each side, and writes all the outputs back in the full image geometry. e.g. 'auto' or 'auto:5'\n\n"
     "--invert_field_to_warp	: If given, inverts the obtained displacement field to warp the baseline image. This means the output field from the model is considered to be taking a point in baseline to follow-up. "
     "Otherwise the field  is assumed to be taking a point in follow-up to baseline and hence when warping the baseline image does not invert the field to perform warping..\n\n"
     "--useTensorLambda		: true or false. If true must provide a DTI image for lame parameter lambda.\n\n"
     "-lambdaFile		: filename of the DTI lambda-value image. Used when -useTensorlambda is true.\n\n"
+    "--distributed_input	: If given, each process reads only its block of the solver grid from the -muFile and -lambdaFile "
+    "images (streamed read for uncompressed files, read by the first process and scattered for .gz files). With -solution_layout "
+    "writer or slab, the first process, which warps them, also keeps the mask and atrophy whole while the other processes "
+    "only keep their block of them, sent after each warp, and do not read the baseline image. With the replicated layout "
+    "every process warps, so the mask, atrophy and baseline images stay whole on all of them.\n\n"
+    "-input_ghost_width	: voxels added on each side of the block of a process with --distributed_input. Default 2; use at "
+    "least 2^L with the staggered multigrid (-fieldsplit_0_pc_type mg -fieldsplit_0_pc_mg_levels L).\n\n"
     "-numOfTimeSteps		: number of time-steps to run the model.\n\n"
+    "-writeSteps		: steps whose outputs are written, separated by comma WITHOUT SPACE, e.g. -writeSteps 5,10,20.\n\n"
+    "-writeEvery		: N. The outputs of every N-th step are written. With -writeSteps, the steps of both options are "
+    "written. If none of the two is given, the outputs of all the steps are written. The other steps only update the "
+    "composed field, the mask and the atrophy of the next step: the baseline image is not warped and no per-step file is "
+    "written.\n\n"
     "-resPath			: Path where all the results are to be placed.\n\n"
     "-resultsFilenamesPrefix	: Prefix to be added to all output files.\n\n"
     "--writePressure		: If given, writes the pressure image file output.\n\n"
     "--writeForce		: If given, writes the force image file output.\n\n"
     "--writeResidual		: If given, writes the residual image file output.\n\n"
+    "--writeJacobian		: If given, writes the Jacobian determinant of the displacement of each step.\n\n"
+    "--writeLogJacobian		: If given, writes the logarithm of the Jacobian determinant of the displacement of each step "
+    "(NaN where the determinant is not positive).\n\n"
+    "--writeMpiIo		: If given, the velocity, pressure, force, divergence and Jacobian outputs are written as .mha files "
+    "directly from the distributed solver vectors with collective MPI-IO, instead of being gathered and written by ITK.\n\n"
+    "-async_write_queue	: N. If N > 0, the output images are written (and compressed) on a background thread while the "
+    "next step proceeds, with at most N images queued or being written. All the writes are completed before exit. Default 0 "
+    "(images written before the step continues).\n\n"
+    "-checkpoint_every	: N. If N > 0, the state needed to continue the run (step index, composed field, current mask, current "
+    "atrophy, stored solutions of -taras_initial_guess and a hash of the model options) is written every N steps as uncompressed "
+    ".mha images and a PETSc binary file, indexed by <resPath><prefix>checkpoint.txt. Only the latest checkpoint is kept. "
+    "Default 0 (no checkpoint).\n\n"
+    "-restart		: If given, resumes from the latest checkpoint of the same -resPath and -resultsFilenamesPrefix, "
+    "which must have been written with the same model options. Starts from the first step when there is no checkpoint.\n\n"
+    "Solver options (PetscAdLemTaras3D):\n\n"
+    "-taras_dmda_prealloc	: true or false. If true, preallocates the operator with the BOX stencil of the DMDA instead of "
+    "the exact nonzero pattern of the staggered discretization. Default false.\n\n"
+    "-taras_incremental_update	: true or false. If true, when the mask changes between time steps only the operator rows touched "
+    "by the changed voxels are recomputed. Default false.\n\n"
+    "-taras_incremental_max_fraction	: fraction of the domain voxels above which the whole operator is recomputed even "
+    "with -taras_incremental_update. Default 0.05.\n\n"
+    "-solution_layout	: replicated, writer or slab. How the solution is extracted to build the output images: "
+    "gathered on every process (replicated), gathered on the first process only (writer), or kept as the owned part "
+    "of the grid with one ghost layer on each process, the output voxels of each slab being sent to the first process "
+    "(slab). With writer and slab, only the first process holds the solution images: it writes the outputs, composes "
+    "and warps, and broadcasts the warped mask and atrophy map. Default replicated.\n\n"
+    "-taras_lambda_float	: true or false. If true, the tensor lambda of --useTensorLambda is kept by the solver in single "
+    "precision. Default false.\n\n"
+    "-taras_matrix_free	: true or false. If true, the operator is applied matrix-free from the coefficient fields. Only "
+    "the blocks extracted by the preconditioner (e.g. fieldsplit blocks) are assembled. Default false.\n\n"
+    "-pc_fieldsplit_schur_precondition user	: with the schur fieldsplit, precondition the Schur complement with the "
+    "diagonal matrix 1/mu + k (k: pressure coefficient of the continuity equation), rebuilt when the mask changes. "
+    "Use e.g. -fieldsplit_1_pc_type jacobi.\n\n"
+    "-taras_initial_guess	: zero, previous or extrapolate. Initial guess of the solve of each time step: zero, the solution of "
+    "the previous step or the linear extrapolation of the last two, with the unknowns fixed by the current mask set to zero. "
+    "Default zero.\n\n"
+    "-taras_pc_reuse	: true or false. If true, when the operator changes between time steps the preconditioner of the last "
+    "fresh setup is kept, until the iterations grow past -taras_pc_reuse_factor (default 1.5) times those of that setup "
+    "or for at most -taras_pc_reuse_max_steps (default 5) steps. Default false.\n\n"
+    "-taras_reduced_system	: true or false. If true, the unknowns fixed by the boundary conditions (ghost layer, walls and, "
+    "with dirichlet_at_skull, the non-brain region) are eliminated and the solver options apply to the system of the remaining "
+    "unknowns. Fieldsplit options work with the splits 0 (velocity) and 1 (pressure). Default false.\n\n"
+    "-fieldsplit_0_pc_type mg	: with the user defined split -pc_fieldsplit_0_fields 0,1,2, precondition the velocity block with "
+    "geometric multigrid on coarsened staggered grids. -fieldsplit_0_pc_mg_levels sets the number of levels, by default "
+    "the grid is coarsened while it keeps at least 4 cells in each direction.\n\n"
+
     ;
 
 struct UserOptions {
@@ -75,6 +141,8 @@ struct UserOptions {
 
     unsigned int	domainOrigin[3], domainSize[3]; //Currently not taken from commaind line!
     bool		isDomainFullSize;
+    bool		isDomainAuto;	//bounding box of the brain, see -domainRegion auto.
+    unsigned int	domainPadding;	//voxels added on each side of the bounding box.
 
     std::string boundaryCondition;
     bool	div12ptStencil, noLameInRhs;
@@ -83,11 +151,20 @@ struct UserOptions {
     float	relaxIcCoeff;	//compressibility coefficient k for CSF region.
     int		falxZeroVelDir; //Component of the velocity to be set to zero in the Falx sliding boundary condition.
     bool        useTensorLambda, isMuConstant, invertFieldToWarp;
+    bool        distributedInput;	// Read mu and lambda images per process.
+    PetscInt    inputGhostWidth;
     int         numOfTimeSteps;
+    std::vector<int> writeSteps;	// Steps whose outputs are written (-writeSteps).
+    PetscInt    writeEvery;	// Outputs written every writeEvery steps, 0 if not given.
 
     std::string resultsPath;    // Directory where all the results will be stored.
     std::string resultsFilenamesPrefix;	// Prefix for all the filenames of the results to be stored in the resultsPath.
     bool        writePressure, writeForce, writeResidual;
+    bool        writeJacobian, writeLogJacobian;
+    bool        writeMpiIo;     // Write the solution fields with collective MPI-IO (.mha).
+    PetscInt    asyncWriteQueue;	// Images queued for the background writer, 0 to write synchronously.
+    PetscInt    checkpointEvery;	// Steps between two checkpoints, 0 for none.
+    bool        restart;	// Resume from the latest checkpoint.
 };
 
 
@@ -177,11 +254,26 @@ int opsParser(UserOptions &ops) {
     if(optionFlag) ops.baselineImageFileName = optionString;
 
     ierr = PetscOptionsGetString(NULL,"-domainRegion",optionString,PETSC_MAX_PATH_LEN,&optionFlag);CHKERRQ(ierr);
+    ops.isDomainAuto = false;
+    ops.domainPadding = 3;
     if(optionFlag) {
 	ops.isDomainFullSize = false;
-	std::stringstream regionStream(optionString);
-	for(int i=0; i<3; ++i) regionStream >> ops.domainOrigin[i];
-	for(int i=0; i<3; ++i) regionStream >> ops.domainSize[i];
+	std::string region(optionString);
+	if(region.compare(0,4,"auto") == 0) {	//exactly auto or auto:<padding>.
+	    ops.isDomainAuto = true;
+	    if(region.size() > 4) {
+		const std::string padding(region.substr(5));
+		if(region[4] != ':' || padding.empty() || padding.size() > 6
+		   || padding.find_first_not_of("0123456789") != std::string::npos)
+		    throw "-domainRegion auto takes an optional non-negative padding: auto or auto:<padding>, e.g. auto:3.\n";
+		std::stringstream paddingStream(padding);
+		paddingStream >> ops.domainPadding;
+	    }
+	} else {
+	    std::stringstream regionStream(optionString);
+	    for(int i=0; i<3; ++i) regionStream >> ops.domainOrigin[i];
+	    for(int i=0; i<3; ++i) regionStream >> ops.domainSize[i];
+	}
     }else ops.isDomainFullSize = true;
 
     ierr = PetscOptionsGetString(NULL,"--invert_field_to_warp",optionString,PETSC_MAX_PATH_LEN,&optionFlag);CHKERRQ(ierr);
@@ -190,6 +282,12 @@ int opsParser(UserOptions &ops) {
     ierr = PetscOptionsGetString(NULL,"--useTensorLambda",optionString,PETSC_MAX_PATH_LEN,&optionFlag);CHKERRQ(ierr);
     ops.useTensorLambda = (bool)optionFlag;
 
+    ierr = PetscOptionsGetString(NULL,"--distributed_input",optionString,PETSC_MAX_PATH_LEN,&optionFlag);CHKERRQ(ierr);
+    ops.distributedInput = (bool)optionFlag;
+    ops.inputGhostWidth = 2;
+    ierr = PetscOptionsGetInt(NULL,"-input_ghost_width",&ops.inputGhostWidth,&optionFlag);CHKERRQ(ierr);
+    if(ops.inputGhostWidth < 0) throw "-input_ghost_width must not be negative.\n";
+
     ierr = PetscOptionsGetInt(NULL,"-numOfTimeSteps",&ops.numOfTimeSteps,&optionFlag);CHKERRQ(ierr);
     if(!optionFlag) {
 	ops.numOfTimeSteps = 1;
@@ -198,6 +296,18 @@ int opsParser(UserOptions &ops) {
 	PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n Model will be run for %d time steps\n", ops.numOfTimeSteps);
     }
 
+    // ---------- Set output schedule.
+    {
+	PetscInt numOfWriteSteps = PetscMax(ops.numOfTimeSteps,1);
+	std::vector<PetscInt> writeSteps(numOfWriteSteps);
+	ierr = PetscOptionsGetIntArray(NULL,"-writeSteps",&writeSteps[0],&numOfWriteSteps,&optionFlag);CHKERRQ(ierr);
+	if(!optionFlag) numOfWriteSteps = 0;
+	ops.writeSteps.assign(writeSteps.begin(),writeSteps.begin()+numOfWriteSteps);
+    }
+    ops.writeEvery = 0;
+    ierr = PetscOptionsGetInt(NULL,"-writeEvery",&ops.writeEvery,&optionFlag);CHKERRQ(ierr);
+    if(ops.writeEvery < 0) throw "-writeEvery must not be negative.\n";
+
     ierr = PetscOptionsGetString(NULL,"-lambdaFile",optionString,PETSC_MAX_PATH_LEN,&optionFlag);CHKERRQ(ierr);
     if (ops.useTensorLambda) {
 	if(!optionFlag) throw "Must provide valid tensor image filename when using --useTensorLambda.\n";
@@ -220,12 +330,101 @@ int opsParser(UserOptions &ops) {
     ops.writePressure = (bool)optionFlag;
     ierr = PetscOptionsGetString(NULL,"--writeForce",optionString,PETSC_MAX_PATH_LEN,&optionFlag);CHKERRQ(ierr);
     ops.writeForce = (bool)optionFlag;
+    ierr = PetscOptionsGetString(NULL,"--writeJacobian",optionString,PETSC_MAX_PATH_LEN,&optionFlag);CHKERRQ(ierr);
+    ops.writeJacobian = (bool)optionFlag;
+    ierr = PetscOptionsGetString(NULL,"--writeLogJacobian",optionString,PETSC_MAX_PATH_LEN,&optionFlag);CHKERRQ(ierr);
+    ops.writeLogJacobian = (bool)optionFlag;
+    ierr = PetscOptionsGetString(NULL,"--writeMpiIo",optionString,PETSC_MAX_PATH_LEN,&optionFlag);CHKERRQ(ierr);
+    ops.writeMpiIo = (bool)optionFlag;
     ierr = PetscOptionsGetString(NULL,"--writeResidual",optionString,PETSC_MAX_PATH_LEN,&optionFlag);CHKERRQ(ierr);
     ops.writeResidual = (bool)optionFlag;
+
+    ops.asyncWriteQueue = 0;
+    ierr = PetscOptionsGetInt(NULL,"-async_write_queue",&ops.asyncWriteQueue,&optionFlag);CHKERRQ(ierr);
+    if(ops.asyncWriteQueue < 0) throw "-async_write_queue must not be negative.\n";
+
+    // ---------- Set checkpointing options.
+    ops.checkpointEvery = 0;
+    ierr = PetscOptionsGetInt(NULL,"-checkpoint_every",&ops.checkpointEvery,&optionFlag);CHKERRQ(ierr);
+    if(ops.checkpointEvery < 0) throw "-checkpoint_every must not be negative.\n";
+    ierr = PetscOptionsHasName(NULL,"-restart",&optionFlag);CHKERRQ(ierr);
+    ops.restart = (bool)optionFlag;
     return 0;
 
 }
 
+/*
+  Return whether the outputs of step t are written, according to -writeSteps and -writeEvery.
+*/
+bool isOutputStep(const UserOptions &ops, int t) {
+    if(ops.writeSteps.empty() && ops.writeEvery == 0)
+	return true;
+    if(ops.writeEvery > 0 && t % ops.writeEvery == 0)
+	return true;
+    return std::find(ops.writeSteps.begin(), ops.writeSteps.end(), t) != ops.writeSteps.end();
+}
+
+/*
+  Hash (djb2) of the options that define the model, stored in the checkpoints so that a run is not
+  resumed with a different model. The number of steps and the output options may change on restart.
+*/
+unsigned long modelOptionsHash(const UserOptions &ops) {
+    std::stringstream opsStream;
+    opsStream << ops.atrophyFileName << '|' << ops.maskFileName << '|' << ops.lambdaFileName << '|'
+	      << ops.muFileName << '|' << ops.baselineImageFileName << '|' << ops.boundaryCondition << '|'
+	      << ops.div12ptStencil << ops.noLameInRhs << ops.relaxIcInCsf << ops.zeroVelAtFalx
+	      << ops.slidingAtFalx << ops.useTensorLambda << ops.isMuConstant << ops.invertFieldToWarp << '|'
+	      << ops.relaxIcCoeff << '|' << ops.falxZeroVelDir << '|';
+    for(int i=0; i<4; ++i) opsStream << ops.lameParas[i] << ',';
+    if(ops.isDomainFullSize) opsStream << "full";
+    else if(ops.isDomainAuto) opsStream << "auto:" << ops.domainPadding;
+    else for(int i=0; i<3; ++i) opsStream << ops.domainOrigin[i] << ',' << ops.domainSize[i] << ',';
+    const std::string opsString(opsStream.str());
+    unsigned long hash = 5381;
+    for(size_t i=0; i<opsString.size(); ++i)
+	hash = hash*33 + (unsigned char)opsString[i];
+    return hash;
+}
+
+/*
+  Read an image of a checkpoint. MetaImage files do not keep the start index of the region, so the
+  geometry is taken from the reference image of the model domain.
+*/
+template <typename TImage>
+typename TImage::Pointer readCheckpointImage(const std::string &fileName, const itk::ImageBase<3> *reference) {
+    typedef itk::ImageFileReader<TImage> ReaderType;
+    typename ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName(fileName);
+    reader->Update();
+    typename TImage::Pointer image = reader->GetOutput();
+    image->DisconnectPipeline();
+    if(image->GetLargestPossibleRegion().GetSize() != reference->GetLargestPossibleRegion().GetSize())
+	throw "checkpoint image size does not match the model domain.";
+    image->CopyInformation(reference);
+    image->SetRegions(reference->GetLargestPossibleRegion());
+    return image;
+}
+
+/*
+  Broadcast an image of the model domain from the first process. The other processes allocate it with the
+  geometry of the reference image.
+*/
+template <typename TImage>
+typename TImage::Pointer broadcastImage(typename TImage::Pointer image, const itk::ImageBase<3> *reference,
+					MPI_Datatype valueType) {
+    PetscMPIInt rank;
+    MPI_Comm_rank(PETSC_COMM_WORLD,&rank);
+    if(rank != 0) {
+	image = TImage::New();
+	image->CopyInformation(reference);
+	image->SetRegions(reference->GetLargestPossibleRegion());
+	image->Allocate();
+    }
+    MpiChunkedTransfer::bcast(image->GetBufferPointer(), image->GetLargestPossibleRegion().GetNumberOfPixels(),
+			      valueType, 0, PETSC_COMM_WORLD);
+    return image;
+}
+
 #undef __FUNCT__
 #define __FUNCT__ "main"
 int main(int argc,char **argv)
@@ -250,6 +449,7 @@ int main(int argc,char **argv)
     typedef AdLem3D<DIM>::ScalarImageReaderType ScalarImageReaderType;
     typedef AdLem3D<DIM>::ScalarImageWriterType ScalarImageWriterType;
     typedef AdLem3D<DIM>::VectorImageWriterType VectorImageWriterType;
+    typedef AdLem3D<DIM>::IntegerImageWriterType IntegerImageWriterType;
 
     PetscInitialize(&argc,&argv,(char*)0,help);
     {
@@ -262,20 +462,24 @@ int main(int argc,char **argv)
 	    std::cerr<<msg<<std::endl;
 	    return EXIT_FAILURE;
 	}
-        // ---------- Read input baseline image
+	AdLem3D<DIM>		AdLemModel;
+	AdLemModel.setDistributedInput(ops.distributedInput, ops.inputGhostWidth);
+        // ---------- Read input baseline image, only warped by the processes holding the solution images
         ScalarImageType::Pointer baselineImage = ScalarImageType::New();
-        {
+        if(AdLemModel.hasSolutionImages()) {
             ScalarImageReaderType::Pointer   imageReader = ScalarImageReaderType::New();
             imageReader->SetFileName(ops.baselineImageFileName);
             imageReader->Update();
             baselineImage = imageReader->GetOutput();
         }
-        // ---------- Read input baseline brainMask image
+        // ---------- Read input baseline brainMask image and atrophy map. With a distributed mask the other
+        // ---------- processes only read the headers, their local regions are sent once the domain is set.
         IntegerImageType::Pointer baselineBrainMask = IntegerImageType::New();
         {
             AdLem3D<DIM>::IntegerImageReaderType::Pointer   imageReader = AdLem3D<DIM>::IntegerImageReaderType::New();
             imageReader->SetFileName(ops.maskFileName);
-            imageReader->Update();
+            if(AdLemModel.holdsWholeMask()) imageReader->Update();
+            else imageReader->UpdateOutputInformation();
             baselineBrainMask = imageReader->GetOutput();
         }
         // ---------- Read input atrophy map
@@ -283,14 +487,14 @@ int main(int argc,char **argv)
         {
             ScalarImageReaderType::Pointer   imageReader = ScalarImageReaderType::New();
             imageReader->SetFileName(ops.atrophyFileName);
-            imageReader->Update();
+            if(AdLemModel.holdsWholeMask()) imageReader->Update();
+            else imageReader->UpdateOutputInformation();
             baselineAtrophy = imageReader->GetOutput();
         }
 
 	// ---------- Set up output prefix with proper path
 	std::string filesPref(ops.resultsPath+ops.resultsFilenamesPrefix);
 
-	AdLem3D<DIM>		AdLemModel;
 	try { // ---------- Set up the model parameters
 	    AdLemModel.setBoundaryConditions(ops.boundaryCondition, ops.relaxIcInCsf, ops.relaxIcCoeff, ops.zeroVelAtFalx,
 					     ops.slidingAtFalx, ops.falxZeroVelDir);
@@ -306,11 +510,16 @@ int main(int argc,char **argv)
 	    // ---------- Set the computational region (Can be set only after setting all required images!)
 	    if(ops.isDomainFullSize)
 		AdLemModel.setDomainRegionFullImage();
+	    else if(ops.isDomainAuto)
+		AdLemModel.setDomainRegionBrainBoundingBox(ops.domainPadding);
 	    else
 		AdLemModel.setDomainRegion(ops.domainOrigin, ops.domainSize);
 	    if (!ops.relaxIcInCsf) {
-		AdLemModel.prescribeUniformExpansionInCsf();
-		baselineAtrophy = AdLemModel.getAtrophyImage();
+		if(AdLemModel.holdsWholeMask()) {
+		    AdLemModel.prescribeUniformExpansionInCsf();
+		    baselineAtrophy = AdLemModel.getAtrophyImage();
+		}
+		AdLemModel.distributeMaskAndAtrophy(false);
 		AdLemModel.writeAtrophyToFile(filesPref + "T0AtrophyModified.nii.gz");
 
 	    }
@@ -321,18 +530,83 @@ int main(int argc,char **argv)
 
         // ---------- Define itk types required for the warping of the mask and atrophy map:
         typedef InverseDisplacementImageFilter<VectorImageType> FPInverseType;
-        typedef itk::WarpImageFilter<ScalarImageType,ScalarImageType,VectorImageType> WarpFilterType;
-	typedef itk::WarpImageFilter<IntegerImageType,IntegerImageType,VectorImageType> IntegerWarpFilterType;
-        typedef itk::NearestNeighborInterpolateImageFunction<IntegerImageType> InterpolatorFilterNnType;
+        typedef FusedWarpImages<ScalarImageType,IntegerImageType,VectorImageType> FusedWarpType;
 	//typedef itk::LabelImageGenericInterpolateImageFunction<ScalarImageType, itk::LinearInterpolateImageFunction> InterpolatorGllType; //General Label interpolator with linear interpolation.
-        typedef itk::AbsoluteValueDifferenceImageFilter<IntegerImageType,IntegerImageType,ScalarImageType> AbsDiffImageFilterType;
-        typedef itk::StatisticsImageFilter<ScalarImageType> StatisticsImageFilterType;
+        typedef MaskChangeDetector<IntegerImageType> MaskChangeDetectorType;
         typedef itk::ComposeDisplacementFieldsImageFilter<VectorImageType, VectorImageType> VectorComposerType;
         VectorImageType::Pointer composedDisplacementField; //declared outside loop because we need this for two different iteration steps.
 
 
 	bool isMaskChanged(true);	//tracker flag to see if the brain mask is changed or not after the previous warp and NN interpolation.
-        for (int t=1; t<=ops.numOfTimeSteps; ++t) {
+	bool isMaskUnwritten(false);	//the mask changed since the last written Mask file (at a step skipped by the output schedule).
+	std::vector<unsigned int> changedMaskVoxels;	//x,y,z of the voxels whose label changed in the last warp.
+	// The list of the changed voxels is only used by the incremental operator update, else a yes/no answer is enough.
+	PetscBool incrementalUpdate = PETSC_FALSE;
+	PetscOptionsGetBool(NULL,"-taras_incremental_update",&incrementalUpdate,NULL);
+
+	// ---------- Checkpoints: files of step t are prefixed with checkpointT<t>_, the index file names the latest.
+	PetscMPIInt rank;
+	MPI_Comm_rank(PETSC_COMM_WORLD,&rank);
+	const std::string checkpointIndexFile(filesPref+"checkpoint.txt");
+	const unsigned long optionsHash = modelOptionsHash(ops);
+	int firstStep = 1;
+	int lastCheckpointStep = 0;	//0 when there is no checkpoint to remove.
+	if(ops.restart) {
+	    std::ifstream indexStream(checkpointIndexFile.c_str());
+	    if(!indexStream) {
+		PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n No checkpoint %s found, starting from the first step.\n",
+					checkpointIndexFile.c_str());
+	    } else {
+		std::string key;
+		int checkpointStep = 0;
+		unsigned long checkpointHash = 0;
+		indexStream >> key >> checkpointStep >> key >> std::hex >> checkpointHash;
+		if(!indexStream || checkpointStep < 1) {
+		    std::cerr<<"invalid checkpoint index "<<checkpointIndexFile<<std::endl;
+		    return EXIT_FAILURE;
+		}
+		if(checkpointHash != optionsHash) {
+		    std::cerr<<"checkpoint "<<checkpointIndexFile<<" was written with different model options."<<std::endl;
+		    return EXIT_FAILURE;
+		}
+		std::stringstream checkpointStepStream;
+		checkpointStepStream << checkpointStep;
+		const std::string checkpointPref(filesPref+"checkpointT"+checkpointStepStream.str()+"_");
+		try {
+		    const IntegerImageType::Pointer domainMask = AdLemModel.getBrainMaskImage();
+		    if(AdLemModel.hasSolutionImages())
+			composedDisplacementField = readCheckpointImage<VectorImageType>(checkpointPref+"ComposedField.mha", domainMask);
+		    if(AdLemModel.holdsWholeMask()) {
+			AdLemModel.setBrainMask(readCheckpointImage<IntegerImageType>(checkpointPref+"Mask.mha", domainMask),
+						maskLabels::NBR, maskLabels::CSF, maskLabels::FALX_CEREBRI);
+			AdLemModel.setAtrophy(readCheckpointImage<ScalarImageType>(checkpointPref+"Atrophy.mha", domainMask));
+		    }
+		    AdLemModel.distributeMaskAndAtrophy();
+		    AdLemModel.readSolverState(checkpointPref+"Solver.bin");
+		} catch(const char* msg) {
+		    std::cerr<<msg<<std::endl;
+		    return EXIT_FAILURE;
+		} catch(itk::ExceptionObject &err) {
+		    std::cerr<<"reading checkpoint failed: "<<err<<std::endl;
+		    return EXIT_FAILURE;
+		}
+		firstStep = checkpointStep + 1;
+		lastCheckpointStep = checkpointStep;
+		PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n Restarting after step %d from checkpoint %s\n",
+					checkpointStep,checkpointIndexFile.c_str());
+	    }
+	}
+
+	const bool solutionReplicated = (PetscAdLem3D<3>::readSolutionLayout() == PetscAdLem3D<3>::SOLUTION_REPLICATED);
+
+	// ---------- Background writer of the output images, flushed when deleted after the last step.
+	AsyncImageWriter *asyncWriter = NULL;
+	if(ops.asyncWriteQueue > 0) {
+	    asyncWriter = new AsyncImageWriter(ops.asyncWriteQueue);
+	    AdLemModel.setAsyncWriter(asyncWriter);
+	}
+
+        for (int t=firstStep; t<=ops.numOfTimeSteps; ++t) {
             //-------------- Get the string for the current time step and add it to the prefix of all the files to be saved -----//
             std::stringstream	timeStep;
             timeStep << t;
@@ -341,92 +615,138 @@ int main(int argc,char **argv)
 	    // ---------- do the modification after the first step. That means I expect the atrophy map to be valid
 	    // ---------- when input by the user. i.e. only GM/WM has atrophy and 0 on CSF and NBR regions.
             // ---------- Solve the system of equations
-            AdLemModel.solveModel(ops.noLameInRhs, ops.div12ptStencil, isMaskChanged);
-            // ---------- Write the solutions and residuals
-            AdLemModel.writeVelocityImage(filesPref+stepString+"vel.nii.gz");
-	    if(!ops.div12ptStencil) //Div computation from within Adlem3d supported only for 9 point div stencil.
-		AdLemModel.writeDivergenceImage(filesPref+stepString+"div.nii.gz");
-            if (ops.writeForce) AdLemModel.writeForceImage(filesPref+stepString+"force.nii.gz");
-            if (ops.writePressure) AdLemModel.writePressureImage(filesPref+stepString+"press.nii.gz");
-            if (ops.writeResidual) AdLemModel.writeResidual(filesPref+stepString);
-	    VectorImageType::Pointer currentDisplacementField = AdLemModel.getVelocityImage();
-	    if(ops.invertFieldToWarp)
-	    {// Invert the current displacement field to create warping field
-		FPInverseType::Pointer inverter = FPInverseType::New();
-		inverter->SetInput(AdLemModel.getVelocityImage());
-		inverter->SetErrorTolerance(1e-1);
-		inverter->SetMaximumNumberOfIterations(50);
-		inverter->Update();
-		PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n Displacement field inversion: tolerance not reached in %d voxels \n\n",
-					inverter->GetNumberOfErrorToleranceFailures());
-		currentDisplacementField = inverter->GetOutput();
-	    }
-            if(t == 1) composedDisplacementField = currentDisplacementField;
-            else
-	    { // Compose the velocity field.
-                VectorComposerType::Pointer vectorComposer = VectorComposerType::New();
-                vectorComposer->SetDisplacementField(currentDisplacementField);
-                vectorComposer->SetWarpingField(composedDisplacementField);
-                vectorComposer->Update();
-                composedDisplacementField = vectorComposer->GetOutput();
+            // After a restart the whole operator is computed, as in the first step.
+            AdLemModel.solveModel(ops.noLameInRhs, ops.div12ptStencil, isMaskChanged, (t > firstStep && incrementalUpdate) ? &changedMaskVoxels : NULL);
+            const bool isWriteStep = isOutputStep(ops, t);
+            if (!isWriteStep) {
+		// ---------- Only the velocity image, for the composed field
+		AdLemModel.updateOutputImages(true, false, false, false);
+            } else if (ops.writeMpiIo) {
+		// ---------- Write the solutions from the distributed vectors, nothing gathered
+		AdLemModel.writeSolutionFieldsMpiIo(filesPref+stepString+"vel.mha",
+						    (ops.writePressure) ? filesPref+stepString+"press.mha" : "",
+						    (ops.writeForce) ? filesPref+stepString+"force.mha" : "",
+						    filesPref+stepString+"div.mha",
+						    (ops.writeJacobian) ? filesPref+stepString+"jac.mha" : "",
+						    (ops.writeLogJacobian) ? filesPref+stepString+"logJac.mha" : "");
+		// ---------- The velocity image is still needed for the warping
+		AdLemModel.updateOutputImages(true, false, false, false);
+            } else {
+		// ---------- Convert the solution into all the required output images in one pass
+		AdLemModel.updateOutputImages(true, ops.writePressure, false, ops.writeForce);
+		// ---------- Write the solutions and residuals
+		AdLemModel.writeVelocityImage(filesPref+stepString+"vel.nii.gz");
+		// ---------- Divergence (with either stencil) and Jacobian, computed in parallel on the solver grid
+		AdLemModel.writeDiagnosticImages(filesPref+stepString+"div.nii.gz",
+						 (ops.writeJacobian) ? filesPref+stepString+"jac.nii.gz" : "",
+						 (ops.writeLogJacobian) ? filesPref+stepString+"logJac.nii.gz" : "");
+		if (ops.writeForce) AdLemModel.writeForceImage(filesPref+stepString+"force.nii.gz");
+		if (ops.writePressure) AdLemModel.writePressureImage(filesPref+stepString+"press.nii.gz");
             }
-	    // ---------- Warp the baseline image with the composed field with BSpline interpolation
-	    typedef itk::BSplineInterpolateImageFunction<ScalarImageType> InterpolatorFilterType;
-	    InterpolatorFilterType::Pointer interpolatorFilter = InterpolatorFilterType::New();
-	    interpolatorFilter->SetSplineOrder(3);
-	    WarpFilterType::Pointer baselineWarper = WarpFilterType::New();
-	    baselineWarper->SetDisplacementField(composedDisplacementField);
-	    baselineWarper->SetInterpolator(interpolatorFilter);
-	    baselineWarper->SetInput(baselineImage);
-	    baselineWarper->SetOutputSpacing(baselineImage->GetSpacing());
-	    baselineWarper->SetOutputOrigin(baselineImage->GetOrigin());
-	    baselineWarper->SetOutputDirection(baselineImage->GetDirection());
-	    baselineWarper->Update();
-	    ScalarImageWriterType::Pointer imageWriter = ScalarImageWriterType::New();
-	    imageWriter->SetFileName(filesPref + "WarpedImageBspline" + stepString+ ".nii.gz"); //step at the end facilitate external tools to combine images later into 4D.
-	    imageWriter->SetInput(baselineWarper->GetOutput());
-	    imageWriter->Update();
-
-            if(ops.numOfTimeSteps > 1)
-	    { // Prepare brain mask and atrophy map for next step by warping them with current composed displacement field.
-                // ---------- Warp baseline brain mask with an itk warpFilter, nearest neighbor.
-                IntegerWarpFilterType::Pointer brainMaskWarper = IntegerWarpFilterType::New();
-                brainMaskWarper->SetDisplacementField(composedDisplacementField);
-                brainMaskWarper->SetInput(baselineBrainMask);
-                brainMaskWarper->SetOutputSpacing(baselineBrainMask->GetSpacing());
-                brainMaskWarper->SetOutputOrigin(baselineBrainMask->GetOrigin());
-                brainMaskWarper->SetOutputDirection(baselineBrainMask->GetDirection());
-
-                InterpolatorFilterNnType::Pointer nnInterpolatorFilter = InterpolatorFilterNnType::New();
-                brainMaskWarper->SetInterpolator(nnInterpolatorFilter);
-                brainMaskWarper->Update();
-
-                // ---------- Compare warped mask with the previous mask
-                AbsDiffImageFilterType::Pointer absDiffImageFilter = AbsDiffImageFilterType::New();
-                absDiffImageFilter->SetInput1(AdLemModel.getBrainMaskImage());
-                absDiffImageFilter->SetInput2(brainMaskWarper->GetOutput());
-                absDiffImageFilter->Update();
-
-                StatisticsImageFilterType::Pointer statisticsImageFilter = StatisticsImageFilterType::New();
-                statisticsImageFilter->SetInput(absDiffImageFilter->GetOutput());
-                statisticsImageFilter->Update();
-                if(statisticsImageFilter->GetSum() < 1) {
+            if (isWriteStep && ops.writeResidual) AdLemModel.writeResidual(filesPref+stepString);
+	    // ---------- With the writer and slab layouts only the first process holds the velocity image: it composes
+	    // ---------- the fields and warps, the warped mask and atrophy map are broadcast to the other processes
+	    // ---------- or, with a distributed mask, prepared by the first process and sent by local regions.
+	    FusedWarpType::Pointer fusedWarper = FusedWarpType::New();
+	    if(AdLemModel.hasSolutionImages())
+	    {
+		VectorImageType::Pointer currentDisplacementField = AdLemModel.getVelocityImage();
+		if(ops.invertFieldToWarp)
+		{// Invert the current displacement field to create warping field
+		    FPInverseType::Pointer inverter = FPInverseType::New();
+		    inverter->SetInput(AdLemModel.getVelocityImage());
+		    inverter->SetErrorTolerance(1e-1);
+		    inverter->SetMaximumNumberOfIterations(50);
+		    inverter->Update();
+		    PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n Displacement field inversion: tolerance not reached in %d voxels \n\n",
+					    inverter->GetNumberOfErrorToleranceFailures());
+		    currentDisplacementField = inverter->GetOutput();
+		}
+		if(composedDisplacementField.IsNull()) composedDisplacementField = currentDisplacementField;
+		else
+		{ // Compose the velocity field.
+		    VectorComposerType::Pointer vectorComposer = VectorComposerType::New();
+		    vectorComposer->SetDisplacementField(currentDisplacementField);
+		    vectorComposer->SetWarpingField(composedDisplacementField);
+		    vectorComposer->Update();
+		    composedDisplacementField = vectorComposer->GetOutput();
+		}
+		// ---------- Warp in one pass, with the composed field, the baseline image (BSpline interpolation) when
+		// ---------- written and, to prepare the next step, the baseline brain mask (nearest neighbor) and atrophy map (linear).
+		fusedWarper->SetDisplacementField(composedDisplacementField);
+		fusedWarper->SetSplineOrder(3);
+		if(isWriteStep)
+		    fusedWarper->SetBSplineInput(baselineImage);
+		if(ops.numOfTimeSteps > 1) {
+		    fusedWarper->SetNearestInput(baselineBrainMask);
+		    fusedWarper->SetLinearInput(baselineAtrophy);
+		}
+		if(isWriteStep || ops.numOfTimeSteps > 1)
+		    fusedWarper->Update();
+		if(isWriteStep) {
+		    ScalarImageType::Pointer warpedImage = fusedWarper->GetBSplineOutput();
+		    if(AdLemModel.writeFullSizeImages())
+		    { // Full size output with -domainRegion auto: the baseline image is unchanged out of the domain.
+			typedef itk::PasteImageFilter<ScalarImageType> PasteImageFilterType;
+			PasteImageFilterType::Pointer paster = PasteImageFilterType::New();
+			paster->InPlaceOff();	//the baseline image is warped again in the next steps.
+			paster->SetDestinationImage(baselineImage);
+			paster->SetSourceImage(warpedImage);
+			paster->SetSourceRegion(warpedImage->GetLargestPossibleRegion());
+			paster->SetDestinationIndex(warpedImage->GetLargestPossibleRegion().GetIndex());
+			paster->Update();
+			warpedImage = paster->GetOutput();
+		    }
+		    //step at the end facilitate external tools to combine images later into 4D.
+		    const std::string warpedImageFile(filesPref + "WarpedImageBspline" + stepString+ ".nii.gz");
+		    if(asyncWriter) {
+			asyncWriter->write<ScalarImageType>(warpedImage, warpedImageFile, true);
+		    } else {
+			ScalarImageWriterType::Pointer imageWriter = ScalarImageWriterType::New();
+			imageWriter->SetFileName(warpedImageFile);
+			imageWriter->SetInput(warpedImage);
+			imageWriter->Update();
+		    }
+		}
+	    }
+            if(ops.numOfTimeSteps > 1 && AdLemModel.holdsWholeMask())
+	    { // Prepare brain mask and atrophy map for next step from the warped baseline ones.
+                // ---------- Compare warped mask with the previous mask; collect the changed voxels, in the model
+                // ---------- coordinates, for the incremental operator update.
+                IntegerImageType::Pointer warpedMask = fusedWarper->GetNearestOutput();
+                ScalarImageType::Pointer warpedAtrophy = fusedWarper->GetLinearOutput();
+                if(!solutionReplicated && !AdLemModel.isMaskDistributed()) {
+                    warpedMask = broadcastImage<IntegerImageType>(warpedMask, AdLemModel.getBrainMaskImage(), MPI_INT);
+                    warpedAtrophy = broadcastImage<ScalarImageType>(warpedAtrophy, AdLemModel.getBrainMaskImage(),
+                                                                    (sizeof(ScalarImageType::PixelType) == sizeof(float)) ? MPI_FLOAT : MPI_DOUBLE);
+                }
+                MaskChangeDetectorType::Pointer maskChangeDetector = MaskChangeDetectorType::New();
+                maskChangeDetector->SetPreviousMask(AdLemModel.getBrainMaskImage());
+                maskChangeDetector->SetCurrentMask(warpedMask);
+                maskChangeDetector->SetCollectChangedVoxels(incrementalUpdate);
+                maskChangeDetector->SetStopAtFirstChange(!incrementalUpdate);
+                maskChangeDetector->Compute();
+                changedMaskVoxels.swap(maskChangeDetector->GetChangedVoxels());
+                if(!maskChangeDetector->HasChanged()) {
                     isMaskChanged = false;
                 } else {
+                    if(incrementalUpdate) {
+                        const IntegerImageType::RegionType changedBox = maskChangeDetector->GetBoundingBox();
+                        PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n %d mask voxels changed, within the box at (%d, %d, %d) of size (%d, %d, %d)\n",
+                                                (int)maskChangeDetector->GetNumberOfChangedVoxels(),
+                                                (int)changedBox.GetIndex()[0],(int)changedBox.GetIndex()[1],(int)changedBox.GetIndex()[2],
+                                                (int)changedBox.GetSize()[0],(int)changedBox.GetSize()[1],(int)changedBox.GetSize()[2]);
+                    }
                     isMaskChanged = true;
-                    AdLemModel.setBrainMask(brainMaskWarper->GetOutput(), maskLabels::NBR, maskLabels::CSF, maskLabels::FALX_CEREBRI);
+                    AdLemModel.setBrainMask(warpedMask, maskLabels::NBR, maskLabels::CSF, maskLabels::FALX_CEREBRI);
+                    isMaskUnwritten = true;
+                }
+                if(isWriteStep && isMaskUnwritten) {
                     AdLemModel.writeBrainMaskToFile(filesPref+stepString+"Mask.nii.gz");
+                    isMaskUnwritten = false;
                 }
 
-                // ---------- Warp baseline atrophy with an itk WarpFilter, linear interpolation; using composed field.
-                WarpFilterType::Pointer atrophyWarper = WarpFilterType::New();
-                atrophyWarper->SetDisplacementField(composedDisplacementField);
-                atrophyWarper->SetInput(baselineAtrophy);
-                atrophyWarper->SetOutputSpacing(baselineAtrophy->GetSpacing());
-                atrophyWarper->SetOutputOrigin(baselineAtrophy->GetOrigin());
-                atrophyWarper->SetOutputDirection(baselineAtrophy->GetDirection());
-                atrophyWarper->Update();
-                AdLemModel.setAtrophy(atrophyWarper->GetOutput());
+                AdLemModel.setAtrophy(warpedAtrophy);
 		//AdLemModel.writeAtrophyToFile(filesPref+stepString+"AtrophyWarpedNotModified.nii.gz"); //Useful to see
 		// how i) warping  ii) modifying affects the total atrophy in the image.
                 //Atrophy present at the newly created CSF regions are redistributed to the nearest GM/WM tissues voxels.
@@ -434,17 +754,75 @@ int main(int argc,char **argv)
 	        AdLemModel.modifyAtrophy(maskLabels::CSF, 0, true, ops.relaxIcInCsf);
 		//AdLemModel.modifyAtrophy(maskLabels::CSF,0,false, ops.relaxIcInCsf); //no redistribution.
 		AdLemModel.modifyAtrophy(maskLabels::NBR,0);  //set zero atrophy at non-brain region., don't change values elsewhere.
-		AdLemModel.writeAtrophyToFile(filesPref+stepString+"AtrophyModified.nii.gz");
+		if(isWriteStep) AdLemModel.writeAtrophyToFile(filesPref+stepString+"AtrophyModified.nii.gz");
 
             }
+            if(ops.numOfTimeSteps > 1 && AdLemModel.isMaskDistributed())
+	    { // ---------- The other processes get the mask change and their local regions of the new mask and atrophy map.
+		int maskChanged = isMaskChanged;
+		MPI_Bcast(&maskChanged,1,MPI_INT,0,PETSC_COMM_WORLD);
+		isMaskChanged = maskChanged;
+		unsigned long numOfChangedValues = changedMaskVoxels.size();
+		MPI_Bcast(&numOfChangedValues,1,MPI_UNSIGNED_LONG,0,PETSC_COMM_WORLD);
+		changedMaskVoxels.resize(numOfChangedValues);
+		MpiChunkedTransfer::bcast(changedMaskVoxels.empty() ? NULL : &changedMaskVoxels[0], numOfChangedValues,
+					  MPI_UNSIGNED, 0, PETSC_COMM_WORLD);
+		AdLemModel.distributeMaskAndAtrophy(isMaskChanged);
+	    }
+            if(ops.checkpointEvery > 0 && t % ops.checkpointEvery == 0 && t < ops.numOfTimeSteps)
+	    { // ---------- Checkpoint the state for step t+1; the index is replaced only once all the files are written.
+		const std::string checkpointPref(filesPref+"checkpoint"+stepString+"_");
+		if(asyncWriter) //the outputs of the steps up to t must be on disk before the index names t.
+		    asyncWriter->flush();
+		AdLemModel.writeSolverState(checkpointPref+"Solver.bin");
+		if(rank == 0) {
+		    VectorImageWriterType::Pointer fieldWriter = VectorImageWriterType::New();
+		    fieldWriter->SetFileName(checkpointPref+"ComposedField.mha");
+		    fieldWriter->SetInput(composedDisplacementField);
+		    fieldWriter->Update();
+		    IntegerImageWriterType::Pointer maskWriter = IntegerImageWriterType::New();
+		    maskWriter->SetFileName(checkpointPref+"Mask.mha");
+		    maskWriter->SetInput(AdLemModel.getBrainMaskImage());
+		    maskWriter->Update();
+		    ScalarImageWriterType::Pointer atrophyWriter = ScalarImageWriterType::New();
+		    atrophyWriter->SetFileName(checkpointPref+"Atrophy.mha");
+		    atrophyWriter->SetInput(AdLemModel.getAtrophyImage());
+		    atrophyWriter->Update();
+
+		    const std::string tmpIndexFile(checkpointIndexFile+".tmp");
+		    {
+			std::ofstream indexStream(tmpIndexFile.c_str());
+			indexStream << "step " << t << "\noptions_hash " << std::hex << optionsHash << "\n";
+		    }
+		    if(std::rename(tmpIndexFile.c_str(),checkpointIndexFile.c_str()) != 0) {
+			std::cerr<<"could not write the checkpoint index "<<checkpointIndexFile<<std::endl;
+		    } else if(lastCheckpointStep > 0) {
+			std::stringstream lastStepStream;
+			lastStepStream << lastCheckpointStep;
+			const std::string lastPref(filesPref+"checkpointT"+lastStepStream.str()+"_");
+			const char* suffixes[] = {"Solver.bin", "Solver.bin.info", "ComposedField.mha", "Mask.mha", "Atrophy.mha"};
+			for(int i=0; i<5; ++i)
+			    std::remove((lastPref+suffixes[i]).c_str());
+		    }
+		}
+		lastCheckpointStep = t;
+		MPI_Barrier(PETSC_COMM_WORLD);
+		PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n Checkpoint written after step %d\n",t);
+	    }
         }
-	if(ops.numOfTimeSteps > 1) //Write composed field only if num_of_time_steps > 1
+	if(ops.numOfTimeSteps > 1 && AdLemModel.hasSolutionImages()) //Write composed field only if num_of_time_steps > 1
 	{
 	    VectorImageWriterType::Pointer   displacementWriter = VectorImageWriterType::New();
 	    displacementWriter->SetFileName(filesPref+"ComposedField.nii.gz");
-	    displacementWriter->SetInput(composedDisplacementField);
+	    displacementWriter->SetInput(AdLemModel.toOutputGeometry<VectorImageType>(composedDisplacementField));
 	    displacementWriter->Update();
 	}
+	if(asyncWriter) {
+	    if(asyncWriter->flush() > 0)
+		std::cerr<<"some output images could not be written."<<std::endl;
+	    AdLemModel.setAsyncWriter(NULL);
+	    delete asyncWriter;
+	}
     }
     PetscErrorCode ierr;
     ierr = PetscFinalize();CHKERRQ(ierr);
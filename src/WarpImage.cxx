@@ -21,6 +21,7 @@ Asclepios, INRIA Sophia Antipolis
 #include <itkImageAdaptor.h>
 #include <itkImageFileReader.h>
 #include <itkImageFileWriter.h>
+#include <itkImageRegionIterator.h>
 
 #include "InverseDisplacementImageFilter.h"
 #include <itkWarpImageFilter.h>
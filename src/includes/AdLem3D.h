@@ -5,6 +5,7 @@ class PetscAdLemTaras3D; //CAN'T seem to get away with this forward declaration!
 
 
 #include<string>
+#include<vector>
 
 #include <iostream>
 #include <itkImage.hxx>
@@ -13,6 +14,8 @@ class PetscAdLemTaras3D; //CAN'T seem to get away with this forward declaration!
 #include <itkImageFileReader.hxx>
 #include <itkImageFileWriter.hxx>
 
+#include "AsyncImageWriter.h"
+
 //#include<petscsys.h>
 
 /* Linear Elastic Model/Viscous fluid model? 3D for AD deformation. This model contains parameters and
@@ -40,10 +43,17 @@ enum bcType {
     DIRICHLET_AT_WALLS, DIRICHLET_AT_SKULL
 };
 
-typedef typename itk::Image<double, DIM>                  ScalarImageType;
+//Value type of the non-integer images, float when built with USE_FLOAT_IMAGES. The solver works in
+//double in both cases.
+#ifdef USE_FLOAT_IMAGES
+typedef float                                             PixelValueType;
+#else
+typedef double                                            PixelValueType;
+#endif
+typedef typename itk::Image<PixelValueType, DIM>          ScalarImageType;
 typedef typename itk::Image<int, DIM>                     IntegerImageType;
-typedef typename itk::Image<itk::Vector<double,DIM>, DIM>   VectorImageType;
-typedef typename itk::Image<itk::DiffusionTensor3D< double >, DIM>  TensorImageType;
+typedef typename itk::Image<itk::Vector<PixelValueType,DIM>, DIM>   VectorImageType;
+typedef typename itk::Image<itk::DiffusionTensor3D< PixelValueType >, DIM>  TensorImageType;
 
 typedef typename itk::ImageFileReader<IntegerImageType> IntegerImageReaderType;
 typedef typename itk::ImageFileReader<ScalarImageType>  ScalarImageReaderType;
@@ -73,12 +83,28 @@ void setWallVelocities(std::vector<double>& wallVelocities);
 void getWallVelocities(std::vector<double>& wallVelocities); //copies mWallVelocities content.
 
 //--***********Model parameters related functions***************//
+//If distributedInput, the mu and lambda images given to setLameParameters() are not read there but when the
+//domain region is set, and each process then reads only the voxels of its block of the solver grid enlarged
+//by ghostWidth voxels (with a streamed read, or read by the first process and scattered for compressed files).
+//With the writer and slab solution layouts the mask and atrophy are distributed too: the first process, which
+//warps them, keeps them whole and the others only hold the image headers until the domain region is set,
+//then their local region, see distributeMaskAndAtrophy().
+//Must be called before setLameParameters().
+void setDistributedInput(bool distributedInput, unsigned int ghostWidth = 2);
+bool isMaskDistributed() const; //same on all the processes.
+bool holdsWholeMask() const;    //false on the processes that only hold their local region of the mask and atrophy.
+//Collective. With a distributed mask, sends the local regions of the mask (only when isMaskChanged) and of
+//the atrophy held whole by the first process to the other ones; does nothing otherwise.
+void distributeMaskAndAtrophy(bool isMaskChanged = true);
 void setLameParameters(bool isMuConstant, bool useTensorLambda,
 		       double muBrain = 1, double muCsf = 1,
 		       double lambdaBrain = 1, double lambdaCsf = 1,
 		       std::string lambdaImageFile = "", std::string muImageFile = "");
 bool isMuConstant() const;
 bool isLambdaTensor() const;
+//Frees the tensor lambda image once the solver keeps its own distributed copy; lambda can no longer
+//be read through dataAt() after this.
+void releaseLambdaImage();
 
 double getMuBrain() const;
 double getMuCsf() const;
@@ -121,9 +147,31 @@ void setDomainRegionFullImage(); //sets largestPossibleRegion.
 //Selected region. This will itkExtractImageFilter and all the image pointers
 //will then point to the output of this filter.
 void setDomainRegion(unsigned int origin[3], unsigned int size[3]);
+//Selected region is the bounding box of all the voxels not labelled as skull, enlarged by padding
+//voxels on each side (within the image). Computed in parallel by the processes of PETSC_COMM_WORLD.
+//If writeFullSizeImages, the write*() fxs paste their output back in the full image geometry.
+void setDomainRegionBrainBoundingBox(unsigned int padding, bool writeFullSizeImages = true);
+//image (in the domain region) pasted in a zero image with the full image geometry when the outputs
+//are written full size, image itself otherwise.
+template <class ImageType>
+typename ImageType::Pointer toOutputGeometry(typename ImageType::Pointer image);
+bool writeFullSizeImages() const; //Return whether the outputs are written in the full image geometry.
+//With a writer set, the write* methods below queue their images to it instead of writing them before
+//returning. The writer is not owned by the model and must outlive it or be reset to NULL.
+void setAsyncWriter(AsyncImageWriter *writer);
 
 //solver related functions
-void solveModel(bool noLameInRhs=false, bool tarasUse12pointStencilForDiv=false, bool operatorChanged = false);
+//changedMaskVoxels: optional x,y,z triplets of the voxels whose mask label changed since the previous
+//call, in the same coordinates as dataAt(). Lets the solver update only the affected rows of the operator.
+void solveModel(bool noLameInRhs=false, bool tarasUse12pointStencilForDiv=false, bool operatorChanged = false,
+		const std::vector<unsigned int> *changedMaskVoxels = NULL);
+//Converts the solution into the selected output images in a single threaded pass. The get*Image()
+//fxs call it for their own image when it is not up to date.
+void updateOutputImages(bool velocity, bool pressure, bool divergence, bool force);
+//True if this process holds the solution images: every process with the replicated -solution_layout, only
+//the first one with the writer and slab layouts. Elsewhere the get*Image() fxs return NULL and the
+//write*() fxs do nothing.
+bool hasSolutionImages() const;
 typename VectorImageType::Pointer getVelocityImage();
 typename ScalarImageType::Pointer getPressureImage();
 typename ScalarImageType::Pointer getDivergenceImage();
@@ -134,8 +182,23 @@ void writeSolutionForMatlab(std::string resultsPath,
 void writeVelocityImage(std::string fileName);
 void writePressureImage(std::string fileName);
 void writeDivergenceImage(std::string fileName);
+//Divergence (with the stencil used by the solver, 9 or 12 point), Jacobian determinant and log-Jacobian of the
+//last solution, computed in parallel on the solver grid and written by the first process only. An empty
+//file name skips that image.
+void writeDiagnosticImages(const std::string& divergenceFile, const std::string& jacobianFile,
+			   const std::string& logJacobianFile);
+//Velocity, pressure, force and diagnostics written straight from the distributed solver vectors to
+//MetaImage (.mha) files with collective MPI-IO, in the output geometry (see toOutputGeometry()). Does not
+//update the output images. An empty file name skips that field.
+void writeSolutionFieldsMpiIo(const std::string& velocityFile, const std::string& pressureFile,
+			      const std::string& forceFile, const std::string& divergenceFile,
+			      const std::string& jacobianFile, const std::string& logJacobianFile);
 void writeForceImage(std::string fileName);
 void writeResidual(std::string fileName);
+//Checkpointing: warm start state of the solver (the stored solutions of -taras_initial_guess). The
+//state given to readSolverState() is loaded when the solver is created, i.e. in the next solveModel().
+void writeSolverState(const std::string& fileName);
+void readSolverState(const std::string& fileName);
 
 //Atrophy related functions
 void setAtrophy(typename ScalarImageType::Pointer inputAtrophy);
@@ -152,8 +215,39 @@ typename ScalarImageType::Pointer getAtrophyImage();
 //else:
 //          set maskValue in the atrophy map in the regions where brainMask has label maskLabel.
 void modifyAtrophy(int maskLabel, double maskValue, bool redistributeAtrophy = false, bool relaxIcInCsf = true);
+//State of the two threaded passes of modifyAtrophy(), see AtrophyModificationThreader. Arrays over the
+//voxels (x fastest) or the rows (y + ny*z) of the domain.
+typedef struct {
+    const int		*mask;
+    PixelValueType	*atrophy;
+    long		size[3];
+    std::vector<PixelValueType>	increment;	//share of the atrophy of a band CSF voxel for each tissue neighbour, else 0.
+    std::vector<long>	bandFirst, bandLast;	//x range of the band voxels of each row, bandFirst > bandLast if none.
+    bool		redistribute, applyMask;
+    int			maskLabel;
+    PixelValueType	maskValue;
+} AtrophyModification;
+//pass 0: find the band and its increments; pass 1: add the increments to the tissue and mask, in the slices
+//[zFirst, zLast]. Called by AtrophyModificationThreader.
+void modifyAtrophySlices(AtrophyModification& mod, unsigned int pass, long zFirst, long zLast) const;
 void scaleAtrophy(double factor);
 void prescribeUniformExpansionInCsf();//Set atrophy_in_csf  = - total_atrophy_elsewhere/num_of_csf_voxels.
+//Single pass kernels of isAtrophySumZero(), prescribeUniformExpansionInCsf() and scaleAtrophy() over the
+//atrophy (and mask) buffers, see AtrophyKernelThreader. Sums are Kahan compensated, one per thread.
+enum atrophyKernelType {
+    SUM_ATROPHY, SUM_NON_CSF_COUNT_CSF, SCALE_ATROPHY, SET_CSF_ATROPHY
+};
+typedef struct {
+    atrophyKernelType	type;
+    const int		*mask;		//only for the kernels using the CSF label.
+    PixelValueType	*atrophy;
+    long		size[3];
+    double		value;		//factor of SCALE_ATROPHY, CSF value of SET_CSF_ATROPHY.
+    std::vector<double>	sum, compensation;	//per thread.
+    std::vector<unsigned long>	csfCount;	//per thread.
+} AtrophyKernel;
+//Run kernel in the slices [zFirst, zLast]. Called by AtrophyKernelThreader.
+void atrophyKernelSlices(AtrophyKernel& kernel, long zFirst, long zLast, itk::ThreadIdType threadId) const;
 void writeAtrophyToFile(std::string fileName);
 
 protected:
@@ -177,6 +271,8 @@ int	 mFalxCerebriLabel;
 typename ScalarImageType::RegionType	mDomainRegion;	//Set this only when all the images
 // that are going to be used in the model are set! This will be used to
 //extract the desired region will be extracted the corresponding images.
+bool				mWriteFullSizeImages;	//true => outputs pasted back in the geometry of mFullSizeImage.
+typename IntegerImageType::Pointer	mFullSizeImage;	//brain mask before extracting the domain region.
 
 typename ScalarImageType::Pointer    mAtrophy;	//Input atrophy-map.
 bool			mIsAtrophySet; //true when mAtrophy is set.
@@ -188,6 +284,13 @@ bool			mIsLambdaImageSet;	//true when mLambda is set.
 typename ScalarImageType::Pointer    mMu;	//Input Mu image; used when isMuConstant is false.
 bool			mIsMuImageSet;	// true when mMu is set.
 
+//distributed input: mMu and mLambda only hold the local block of each process, read from these files (and so
+//do mBrainMask and mAtrophy, but on the first process, when isMaskDistributed()).
+bool			mDistributedInput;
+unsigned int		mInputGhostWidth;
+typename ScalarImageType::RegionType	mLocalInputRegion;	//set by readDistributedInputs().
+std::string		mMuImageFile, mLambdaImageFile;
+
 double			mMuBrain, mMuCsf;
 double			mLambdaBrain, mLambdaCsf;
 bool			mIsMuConstant;	//piecewise constant can have different mu values in tissue and CSF. Currently mUseMuImage has the same value as mIsMuConstant. This could change later!
@@ -223,12 +326,28 @@ bool                        mDivergenceLatest;
 //Solver option
 PetscAdLemTaras3D   *mPetscSolverTaras;
 bool                mPetscSolverTarasUsed;
+std::string         mSolverStateFile;	//set by readSolverState(), loaded in solveModel().
+
+AsyncImageWriter    *mAsyncWriter;	//NULL: images written synchronously.
+//Write image in the output geometry, synchronously or with mAsyncWriter. ownImage: image is not used
+//by the model afterwards and need not be copied.
+template <class ImageType>
+void writeImage(typename ImageType::Pointer image, const std::string& fileName, bool ownImage = false);
 
 // Hide this from the user, user must use setLameParameters interface to set lambda.
 // This method will be called by setLameParameters depending on user's argument to that
 // method.
 void setLambda(typename TensorImageType::Pointer inputLambda);
 void setMu(typename ScalarImageType::Pointer inputMu);
+//distributed input: reads the local blocks of mMu and mLambda once mDomainRegion is known.
+void readDistributedInputs();
+typename ScalarImageType::RegionType getLocalInputRegion(); //in the index space of the input images.
+template <class ImageType>
+typename ImageType::Pointer readImageRegion(const std::string& fileName,
+					    const typename ScalarImageType::RegionType& localRegion);
+template <class ImageType>
+typename ImageType::Pointer scatterImageRegion(typename ImageType::Pointer fullImage, const itk::ImageBase<3> *information,
+					       const typename ScalarImageType::RegionType& localRegion);
 
 // Internal data access utility methods.
 // The class that inherits will have to provide public interface to these by
@@ -250,6 +369,14 @@ void createForceImage();
 void createDivergenceImage();
 
 void updateImages(const std::string& whichImage);
+//Run kernel of the given type on mAtrophy with all the threads; sum and csfCount merge the per thread
+//results of the reductions.
+void runAtrophyKernel(atrophyKernelType type, double value, double& sum, unsigned long& csfCount);
+//Slab layout: the processes other than the first send the outputs of their voxels [start, start+size), x
+//fastest, to the first one, which copies them into its images (the buffers are those of the images there).
+//NULL for the outputs that are not updated.
+void gatherSolutionSlabs(const long start[3], const long size[3], const PixelValueType *velocity,
+			 const PixelValueType *pressure, const PixelValueType *divergence, const PixelValueType *force);
 };
 
 #include "AdLem3D.hxx"
@@ -4,18 +4,19 @@
 
 #include "GlobalConstants.h"
 #include"PetscAdLemTaras3D.hxx"
+#include "SolutionImagesThreader.h"
+#include "AtrophyModificationThreader.h"
+#include "AtrophyKernelThreader.h"
+#include "MpiChunkedTransfer.h"
 #include <itkImageRegionIteratorWithIndex.h>
-#include <itkMultiplyImageFilter.h>
-#include <itkMaskImageFilter.h>
-#include <itkStatisticsImageFilter.h>
-#include <itkLabelStatisticsImageFilter.h>
-#include "itkConstShapedNeighborhoodIterator.h"
-#include "itkConstNeighborhoodIterator.h"
-#include "itkShapedNeighborhoodIterator.h"
-#include "itkNeighborhoodAlgorithm.h"
-#include "itkConstantBoundaryCondition.h"
 #include "itkExtractImageFilter.h"
+#include "itkPasteImageFilter.h"
+#include <itkImageRegionConstIteratorWithIndex.h>
+#include <itkImageRegionIterator.h>
 #include<iostream>
+#include<limits>
+#include<algorithm>
+#include<cmath>
 
 #undef __FUNCT__
 #define __FUNCT__ "AdLem3D"
@@ -32,6 +33,10 @@ AdLem3D<DIM>::AdLem3D():mWallVelocities(18)
     mZeroVelAtFalx	  = false;
     mSlidingAtFalx	  = false;
     mPetscSolverTarasUsed = false;
+    mWriteFullSizeImages  = false;
+    mDistributedInput	  = false;
+    mAsyncWriter	  = NULL;
+    mInputGhostWidth	  = 2;
     mRelaxIcPressureCoeff = 0;  //This default changed only when setting brain mask.
 
     // number of times the solver is called.
@@ -93,6 +98,37 @@ void AdLem3D<DIM>::setWallVelocities(std::vector<double>& wallVelocities) {
     mWallVelocities = wallVelocities;
 }
 
+#undef __FUNCT__
+#define __FUNCT__ "setDistributedInput"
+template <unsigned int DIM>
+void AdLem3D<DIM>::setDistributedInput(bool distributedInput, unsigned int ghostWidth)
+{
+    mDistributedInput = distributedInput;
+    mInputGhostWidth = ghostWidth;
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "isMaskDistributed"
+/*The mask and atrophy are only distributed when a single process warps them, i.e. when the solution
+ images are not replicated.*/
+template <unsigned int DIM>
+bool AdLem3D<DIM>::isMaskDistributed() const
+{
+    return mDistributedInput && PetscAdLem3D<3>::readSolutionLayout() != PetscAdLem3D<3>::SOLUTION_REPLICATED;
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "holdsWholeMask"
+template <unsigned int DIM>
+bool AdLem3D<DIM>::holdsWholeMask() const
+{
+    if(!isMaskDistributed())
+	return true;
+    PetscMPIInt rank;
+    MPI_Comm_rank(PETSC_COMM_WORLD,&rank);
+    return rank == 0;
+}
+
 #undef __FUNCT__
 #define __FUNCT__ "setLameParameters"
 template <unsigned int DIM>
@@ -108,6 +144,13 @@ void AdLem3D<DIM>::setLameParameters(bool isMuConstant, bool useTensorLambda,
     mMuCsf		= muCsf;
     mLambdaBrain	= lambdaBrain;
     mLambdaCsf		= lambdaCsf;
+    if(mDistributedInput) { //read in readDistributedInputs(), once the domain region is known.
+	mMuImageFile = muImageFile;
+	mLambdaImageFile = lambdaImageFile;
+	mIsMuImageSet = !isMuConstant;
+	mIsLambdaImageSet = useTensorLambda;
+	return;
+    }
     if(!isMuConstant) { // That is if not even piecewise constant, use image.
         typename ScalarImageReaderType::Pointer   scalarImageReader = ScalarImageReaderType::New();
         scalarImageReader->SetFileName(muImageFile);
@@ -122,6 +165,14 @@ void AdLem3D<DIM>::setLameParameters(bool isMuConstant, bool useTensorLambda,
     }
 }
 
+#undef __FUNCT__
+#define __FUNCT__ "releaseLambdaImage"
+template <unsigned int DIM>
+void AdLem3D<DIM>::releaseLambdaImage()
+{
+    mLambda = NULL;
+}
+
 #undef __FUNCT__
 #define __FUNCT__ "setMu"
 template <unsigned int DIM>
@@ -192,6 +243,8 @@ void AdLem3D<DIM>::setDomainRegionFullImage()
 	throw "for the given choices, lambda image is expected to be set. Domain region can be set only after setting this image!\n";
     mDomainRegion = mBrainMask->GetLargestPossibleRegion();
     // No need to extract when using the full image.
+    if(mDistributedInput)
+	readDistributedInputs();
 }
 
 #undef __FUNCT__
@@ -216,24 +269,29 @@ void AdLem3D<DIM>::setDomainRegion(unsigned int origin[], unsigned int size[])
     typedef itk::ExtractImageFilter<ScalarImageType, ScalarImageType> ExtractScalarImageFilterType;
     typedef itk::ExtractImageFilter<TensorImageType, TensorImageType> ExtractTensorImageFilterType;
 
-    if(mIsBrainMaskSet) {
-	typename ExtractIntegerImageFilterType::Pointer imageExtracter = ExtractIntegerImageFilterType::New();
-	imageExtracter->SetInput(mBrainMask);
-	imageExtracter->SetExtractionRegion(mDomainRegion);
-	imageExtracter->Update();
-	mBrainMask = imageExtracter->GetOutput();
-    }else
+    if(!mIsBrainMaskSet)
         throw "must set brain mask image before setting domain region.\n";
-
-    if(mIsAtrophySet){
-	typename ExtractScalarImageFilterType::Pointer imageExtracter = ExtractScalarImageFilterType::New();
-	imageExtracter->SetInput(mAtrophy);
-	imageExtracter->SetExtractionRegion(mDomainRegion);
-	imageExtracter->Update();
-	mAtrophy = imageExtracter->GetOutput();
-	//FIXME: 1. Do I need disconnectPipeline() here ? 2. DirectionCollapse ?
-    }else
+    if(!mIsAtrophySet)
 	throw "must set atrophy image before setting domain region.\n";
+    if(holdsWholeMask()) { //else only the headers are held, the local regions are sent by readDistributedInputs().
+	typename ExtractIntegerImageFilterType::Pointer maskExtracter = ExtractIntegerImageFilterType::New();
+	maskExtracter->SetInput(mBrainMask);
+	maskExtracter->SetExtractionRegion(mDomainRegion);
+	maskExtracter->Update();
+	mBrainMask = maskExtracter->GetOutput();
+
+	typename ExtractScalarImageFilterType::Pointer atrophyExtracter = ExtractScalarImageFilterType::New();
+	atrophyExtracter->SetInput(mAtrophy);
+	atrophyExtracter->SetExtractionRegion(mDomainRegion);
+	atrophyExtracter->Update();
+	mAtrophy = atrophyExtracter->GetOutput();
+	//FIXME: 1. Do I need disconnectPipeline() here ? 2. DirectionCollapse ?
+    }
+
+    if(mDistributedInput) {
+	readDistributedInputs();
+	return;
+    }
 
     if(mUseMuImage){
 	if(mIsMuImageSet){
@@ -260,6 +318,298 @@ void AdLem3D<DIM>::setDomainRegion(unsigned int origin[], unsigned int size[])
     }
 }
 
+#undef __FUNCT__
+#define __FUNCT__ "getLocalInputRegion"
+/*Voxels read by this process in the distributed input mode: the voxels of the block of the grid points
+ the solver DMDA gives to this process, enlarged by mInputGhostWidth voxels and clipped to the domain. The
+ partition is the one of PetscAdLemTaras3D::mDa, whose DMDA is created with the same sizes and PETSC_DECIDE.*/
+template <unsigned int DIM>
+typename AdLem3D<DIM>::ScalarImageType::RegionType AdLem3D<DIM>::getLocalInputRegion()
+{
+    PetscErrorCode  ierr;
+    DM              da;
+    PetscInt        first[3], num[3];
+    const long      voxels[3] = {getXnum(), getYnum(), getZnum()};
+    ierr = DMDACreate3d(PETSC_COMM_WORLD,DM_BOUNDARY_NONE,DM_BOUNDARY_NONE,DM_BOUNDARY_NONE,
+                        DMDA_STENCIL_BOX,voxels[0]+1,voxels[1]+1,voxels[2]+1,
+                        PETSC_DECIDE,PETSC_DECIDE,PETSC_DECIDE,1,1,0,0,0,&da);CHKERRXX(ierr);
+    ierr = DMDAGetCorners(da,&first[0],&first[1],&first[2],&num[0],&num[1],&num[2]);CHKERRXX(ierr);
+    ierr = DMDestroy(&da);CHKERRXX(ierr);
+
+    typename ScalarImageType::RegionType localRegion;
+    for(int i=0; i<3; ++i) {
+	//grid point p touches the voxels p-1 and p.
+	const long lower = std::max((long)first[i] - 1 - (long)mInputGhostWidth, 0L);
+	const long upper = std::min((long)(first[i] + num[i]) + (long)mInputGhostWidth, voxels[i]);
+	localRegion.SetIndex(i, mDomainRegion.GetIndex()[i] + lower);
+	localRegion.SetSize(i, upper - lower);
+    }
+    return localRegion;
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "readImageRegion"
+/*Image holding localRegion of the file, with the domain region as largest possible region so that the
+ xxAt() accessors keep their indexing. Streamed read when the file format allows it, otherwise the first
+ process reads the whole image and sends each process its region.*/
+template <unsigned int DIM>
+template <class ImageType>
+typename ImageType::Pointer AdLem3D<DIM>::readImageRegion(const std::string& fileName,
+							  const typename ScalarImageType::RegionType& localRegion)
+{
+    typedef itk::ImageFileReader<ImageType>	ReaderType;
+    typename ImageType::RegionType region;
+    region.SetIndex(localRegion.GetIndex());
+    region.SetSize(localRegion.GetSize());
+
+    typename ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName(fileName);
+    reader->UpdateOutputInformation(); //header only.
+    if(!reader->GetOutput()->GetLargestPossibleRegion().IsInside(region))
+	throw "the domain region is not inside the input image.\n";
+    const bool isCompressed = (fileName.size() > 3 && fileName.compare(fileName.size()-3,3,".gz") == 0);
+    typename ImageType::Pointer image;
+    if(reader->GetImageIO()->CanStreamRead() && !isCompressed) {
+	reader->GetOutput()->SetRequestedRegion(region);
+	reader->Update();
+	image = reader->GetOutput();
+	image->DisconnectPipeline();
+    } else {
+	PetscMPIInt rank;
+	MPI_Comm_rank(PETSC_COMM_WORLD,&rank);
+	typename ImageType::Pointer fullImage;
+	if(rank == 0) {
+	    reader->Update();
+	    fullImage = reader->GetOutput();
+	}
+	image = scatterImageRegion<ImageType>(fullImage, reader->GetOutput(), localRegion);
+	if(rank == 0) { //own region of the whole image.
+	    typedef itk::ExtractImageFilter<ImageType, ImageType> ExtractFilterType;
+	    typename ExtractFilterType::Pointer imageExtracter = ExtractFilterType::New();
+	    imageExtracter->SetInput(fullImage);
+	    imageExtracter->SetExtractionRegion(region);
+	    imageExtracter->Update();
+	    image = imageExtracter->GetOutput();
+	    image->DisconnectPipeline();
+	}
+    }
+    typename ImageType::RegionType domainRegion;
+    domainRegion.SetIndex(mDomainRegion.GetIndex());
+    domainRegion.SetSize(mDomainRegion.GetSize());
+    image->SetLargestPossibleRegion(domainRegion);
+    return image;
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "scatterImageRegion"
+/*Collective. The first process holds fullImage whole and sends each other process its localRegion (fullImage
+ is not used there, information gives the geometry). Returns the received region, with the domain region as
+ largest possible region, and fullImage itself on the first process.*/
+template <unsigned int DIM>
+template <class ImageType>
+typename ImageType::Pointer AdLem3D<DIM>::scatterImageRegion(typename ImageType::Pointer fullImage,
+							     const itk::ImageBase<3> *information,
+							     const typename ScalarImageType::RegionType& localRegion)
+{
+    typedef typename ImageType::PixelType	PixelType;
+    PetscMPIInt rank, numOfProcs;
+    MPI_Comm_rank(PETSC_COMM_WORLD,&rank);
+    MPI_Comm_size(PETSC_COMM_WORLD,&numOfProcs);
+    long bounds[6];
+    for(int i=0; i<3; ++i) {
+	bounds[i] = localRegion.GetIndex()[i];
+	bounds[3+i] = localRegion.GetSize()[i];
+    }
+    std::vector<long> allBounds((rank == 0) ? 6*numOfProcs : 0);
+    MPI_Gather(bounds,6,MPI_LONG,(rank == 0) ? &allBounds[0] : NULL,6,MPI_LONG,0,PETSC_COMM_WORLD);
+    if(rank == 0) {
+	std::vector<PixelType> buffer;
+	for(PetscMPIInt r=1; r<numOfProcs; ++r) {
+	    typename ImageType::RegionType procRegion;
+	    for(int i=0; i<3; ++i) {
+		procRegion.SetIndex(i, allBounds[6*r+i]);
+		procRegion.SetSize(i, allBounds[6*r+3+i]);
+	    }
+	    buffer.resize(procRegion.GetNumberOfPixels());
+	    size_t n = 0;
+	    itk::ImageRegionConstIterator<ImageType> it(fullImage, procRegion);
+	    for(it.GoToBegin(); !it.IsAtEnd(); ++it)
+		buffer[n++] = it.Get();
+	    //a region of a tensor image can exceed the int count of MPI.
+	    if(MpiChunkedTransfer::send(buffer.empty() ? NULL : &buffer[0],buffer.size()*sizeof(PixelType),
+					MPI_BYTE,r,0,PETSC_COMM_WORLD) != MPI_SUCCESS)
+		throw "sending an input image region failed.\n";
+	}
+	return fullImage;
+    }
+    typename ImageType::RegionType region;
+    region.SetIndex(localRegion.GetIndex());
+    region.SetSize(localRegion.GetSize());
+    typename ImageType::Pointer image = ImageType::New();
+    image->CopyInformation(information);
+    image->SetRegions(region);
+    image->Allocate();
+    //pixels in the order of the region iterator, i.e. the buffer order of image.
+    if(MpiChunkedTransfer::recv(image->GetBufferPointer(),region.GetNumberOfPixels()*sizeof(PixelType),
+				MPI_BYTE,0,0,PETSC_COMM_WORLD) != MPI_SUCCESS)
+	throw "receiving an input image region failed.\n";
+    typename ImageType::RegionType domainRegion;
+    domainRegion.SetIndex(mDomainRegion.GetIndex());
+    domainRegion.SetSize(mDomainRegion.GetSize());
+    image->SetLargestPossibleRegion(domainRegion);
+    return image;
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "distributeMaskAndAtrophy"
+template <unsigned int DIM>
+void AdLem3D<DIM>::distributeMaskAndAtrophy(bool isMaskChanged)
+{
+    if(!isMaskDistributed())
+	return;
+    if(isMaskChanged)
+	mBrainMask = scatterImageRegion<IntegerImageType>(mBrainMask, mBrainMask.GetPointer(), mLocalInputRegion);
+    mAtrophy = scatterImageRegion<ScalarImageType>(mAtrophy, mAtrophy.GetPointer(), mLocalInputRegion);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "readDistributedInputs"
+template <unsigned int DIM>
+void AdLem3D<DIM>::readDistributedInputs()
+{
+    mLocalInputRegion = getLocalInputRegion();
+    const typename ScalarImageType::RegionType& localRegion = mLocalInputRegion;
+    if(mUseMuImage)
+	setMu(readImageRegion<ScalarImageType>(mMuImageFile, localRegion));
+    if(mUseTensorLambda)
+	setLambda(readImageRegion<TensorImageType>(mLambdaImageFile, localRegion));
+    distributeMaskAndAtrophy();
+    PetscMPIInt rank;
+    MPI_Comm_rank(PETSC_COMM_WORLD,&rank);
+    PetscSynchronizedPrintf(PETSC_COMM_WORLD,"distributed input: process %d reads %d of the %d voxels of the domain\n",
+			    rank,(int)localRegion.GetNumberOfPixels(),(int)mDomainRegion.GetNumberOfPixels());
+    PetscSynchronizedFlush(PETSC_COMM_WORLD,PETSC_STDOUT);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "setDomainRegionBrainBoundingBox"
+template <unsigned int DIM>
+void AdLem3D<DIM>::setDomainRegionBrainBoundingBox(unsigned int padding, bool writeFullSizeImages)
+{
+    if(!mIsBrainMaskSet)
+        throw "must set brain mask image before setting domain region.\n";
+    const typename IntegerImageType::RegionType fullRegion = mBrainMask->GetLargestPossibleRegion();
+
+    // ---------- Each process scans a slab of z slices, then the boxes are merged. A distributed mask is
+    // ---------- only held whole, and scanned, by the first process.
+    PetscMPIInt rank, numOfProcs;
+    MPI_Comm_rank(PETSC_COMM_WORLD,&rank);
+    MPI_Comm_size(PETSC_COMM_WORLD,&numOfProcs);
+    typename IntegerImageType::RegionType slab(fullRegion);
+    const long nz = fullRegion.GetSize()[2];
+    if(isMaskDistributed()) {
+        slab.SetSize(2, (rank == 0) ? nz : 0);
+    } else {
+        slab.SetIndex(2, fullRegion.GetIndex()[2] + (nz*rank)/numOfProcs);
+        slab.SetSize(2, (nz*(rank+1))/numOfProcs - (nz*rank)/numOfProcs);
+    }
+    long lower[3], upper[3], globalLower[3], globalUpper[3];
+    for(int i=0; i<3; ++i) {
+        lower[i] = std::numeric_limits<long>::max();
+        upper[i] = std::numeric_limits<long>::min();
+    }
+    if(slab.GetNumberOfPixels() > 0) {
+        itk::ImageRegionConstIteratorWithIndex<IntegerImageType> it(mBrainMask, slab);
+        for(it.GoToBegin(); !it.IsAtEnd(); ++it) {
+            if(it.Get() != mSkullLabel) {
+                for(int i=0; i<3; ++i) {
+                    lower[i] = std::min(lower[i], (long)it.GetIndex()[i]);
+                    upper[i] = std::max(upper[i], (long)it.GetIndex()[i]);
+                }
+            }
+        }
+    }
+    MPI_Allreduce(lower, globalLower, 3, MPI_LONG, MPI_MIN, PETSC_COMM_WORLD);
+    MPI_Allreduce(upper, globalUpper, 3, MPI_LONG, MPI_MAX, PETSC_COMM_WORLD);
+    if(globalLower[0] > globalUpper[0])
+        throw "brain mask has only skull label, cannot compute the domain region.\n";
+
+    unsigned int origin[3], size[3];
+    for(int i=0; i<3; ++i) {
+        const long first = std::max(globalLower[i] - (long)padding, (long)fullRegion.GetIndex()[i]);
+        const long last = std::min(globalUpper[i] + (long)padding,
+                                   (long)(fullRegion.GetIndex()[i] + fullRegion.GetSize()[i]) - 1);
+        origin[i] = first;
+        size[i] = last - first + 1;
+    }
+    PetscSynchronizedPrintf(PETSC_COMM_WORLD,"domain region: brain bounding box with padding %d, origin (%d,%d,%d), size (%d,%d,%d), %f of the image\n",
+                            padding,origin[0],origin[1],origin[2],size[0],size[1],size[2],
+                            ((double)size[0]*size[1]*size[2])/fullRegion.GetNumberOfPixels());
+    mFullSizeImage = mBrainMask;
+    mWriteFullSizeImages = writeFullSizeImages;
+    setDomainRegion(origin, size);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "toOutputGeometry"
+template <unsigned int DIM>
+template <class ImageType>
+typename ImageType::Pointer AdLem3D<DIM>::toOutputGeometry(typename ImageType::Pointer image)
+{
+    if(!mWriteFullSizeImages)
+        return image;
+    typename ImageType::Pointer fullImage = ImageType::New();
+    fullImage->SetRegions(mFullSizeImage->GetLargestPossibleRegion());
+    fullImage->SetOrigin(mFullSizeImage->GetOrigin());
+    fullImage->SetSpacing(mFullSizeImage->GetSpacing());
+    fullImage->SetDirection(mFullSizeImage->GetDirection());
+    fullImage->Allocate();
+    fullImage->FillBuffer(itk::NumericTraits<typename ImageType::PixelType>::ZeroValue());
+
+    //The extracted images keep the index of the domain region in the full image.
+    typedef itk::PasteImageFilter<ImageType> PasteImageFilterType;
+    typename PasteImageFilterType::Pointer paster = PasteImageFilterType::New();
+    paster->SetDestinationImage(fullImage);
+    paster->SetSourceImage(image);
+    paster->SetSourceRegion(image->GetLargestPossibleRegion());
+    paster->SetDestinationIndex(image->GetLargestPossibleRegion().GetIndex());
+    paster->Update();
+    return paster->GetOutput();
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "writeFullSizeImages"
+template <unsigned int DIM>
+bool AdLem3D<DIM>::writeFullSizeImages() const { return mWriteFullSizeImages; }
+
+#undef __FUNCT__
+#define __FUNCT__ "writeImage"
+template <unsigned int DIM>
+template <class ImageType>
+void AdLem3D<DIM>::writeImage(typename ImageType::Pointer image, const std::string& fileName, bool ownImage)
+{
+    if(!hasSolutionImages()) //writer and slab layouts: the first process writes all the outputs.
+	return;
+    typename ImageType::Pointer outputImage = toOutputGeometry<ImageType>(image);
+    if(mAsyncWriter) { //the full size output image is a new image, not one of the model.
+	mAsyncWriter->write<ImageType>(outputImage.GetPointer(), fileName, ownImage || mWriteFullSizeImages);
+	return;
+    }
+    typedef itk::ImageFileWriter<ImageType> WriterType;
+    typename WriterType::Pointer writer = WriterType::New();
+    writer->SetFileName(fileName);
+    writer->SetInput(outputImage);
+    writer->Update();
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "setAsyncWriter"
+template <unsigned int DIM>
+void AdLem3D<DIM>::setAsyncWriter(AsyncImageWriter *writer)
+{
+    mAsyncWriter = writer;
+}
+
 #undef __FUNCT__
 #define __FUNCT__ "isLameInRhs"
 template <unsigned int DIM>
@@ -364,6 +714,8 @@ double AdLem3D<DIM>::muAt(int x, int y, int z) const
 	pos.SetElement(0, mMu->GetLargestPossibleRegion().GetIndex()[0] + x);
         pos.SetElement(1, mMu->GetLargestPossibleRegion().GetIndex()[1] + y);
         pos.SetElement(2, mMu->GetLargestPossibleRegion().GetIndex()[2] + z);
+        if(mDistributedInput && !mMu->GetBufferedRegion().IsInside(pos))
+            throw "mu requested outside the local input region of this process, increase -input_ghost_width.\n";
         return (mMu->GetPixel(pos));
     }
     else {
@@ -381,10 +733,14 @@ double AdLem3D<DIM>::lambdaAt(int x, int y, int z,
 			      unsigned int Li, unsigned int Lj) const
 {
     if (mUseTensorLambda) {
+        if(mLambda.IsNull())
+            throw "lambda image already released to the solver.\n";
         typename TensorImageType::IndexType pos;
         pos.SetElement(0, mLambda->GetLargestPossibleRegion().GetIndex()[0] + x);
         pos.SetElement(1, mLambda->GetLargestPossibleRegion().GetIndex()[1] + y);
         pos.SetElement(2, mLambda->GetLargestPossibleRegion().GetIndex()[2] + z);
+        if(mDistributedInput && !mLambda->GetBufferedRegion().IsInside(pos))
+            throw "lambda requested outside the local input region of this process, increase -input_ghost_width.\n";
         return (mLambda->GetPixel(pos)(Li,Lj));
     }
     // If the model is initialized for scalar lambda then it is same as
@@ -410,6 +766,8 @@ double AdLem3D<DIM>::aAt(int x, int y, int z) const
     pos.SetElement(0, mAtrophy->GetLargestPossibleRegion().GetIndex()[0] + x);
     pos.SetElement(1, mAtrophy->GetLargestPossibleRegion().GetIndex()[1] + y);
     pos.SetElement(2, mAtrophy->GetLargestPossibleRegion().GetIndex()[2] + z);
+    if(mDistributedInput && !mAtrophy->GetBufferedRegion().IsInside(pos))
+        throw "atrophy requested outside the local input region of this process, increase -input_ghost_width.\n";
     return(mAtrophy->GetPixel(pos));
 
 }
@@ -423,7 +781,8 @@ double AdLem3D<DIM>::brainMaskAt(int x, int y, int z) const
     pos.SetElement(0, mBrainMask->GetLargestPossibleRegion().GetIndex()[0] + x);
     pos.SetElement(1, mBrainMask->GetLargestPossibleRegion().GetIndex()[1] + y);
     pos.SetElement(2, mBrainMask->GetLargestPossibleRegion().GetIndex()[2] + z);
-
+    if(mDistributedInput && !mBrainMask->GetBufferedRegion().IsInside(pos))
+        throw "brain mask requested outside the local input region of this process, increase -input_ghost_width.\n";
     return(mBrainMask->GetPixel(pos));
 
 }
@@ -541,14 +900,20 @@ double AdLem3D<DIM>::getZspacing() const
 #undef __FUNCT__
 #define __FUNCT__ "solveModel"
 template <unsigned int DIM>
-void AdLem3D<DIM>::solveModel(bool noLameInRhs, bool tarasUse12pointStencilForDiv, bool operatorChanged)
+void AdLem3D<DIM>::solveModel(bool noLameInRhs, bool tarasUse12pointStencilForDiv, bool operatorChanged,
+			      const std::vector<unsigned int> *changedMaskVoxels)
 {
     mNoLameInRhs = noLameInRhs;
     if(!mPetscSolverTarasUsed) {
         mPetscSolverTarasUsed = true;
 	mPetscSolverTaras = new PetscAdLemTaras3D(this,tarasUse12pointStencilForDiv,false);
     }
-    mPetscSolverTaras->solveModel(operatorChanged);
+    if(!mSolverStateFile.empty()) {
+	PetscErrorCode ierr;
+	ierr = mPetscSolverTaras->loadState(mSolverStateFile);CHKERRXX(ierr);
+	mSolverStateFile.clear();
+    }
+    mPetscSolverTaras->solveModel(operatorChanged, changedMaskVoxels);
     updateStateAfterSolveCall();
 
 }
@@ -590,12 +955,9 @@ void AdLem3D<DIM>::setAtrophy(typename ScalarImageType::Pointer inputAtrophy)
 template <unsigned int DIM>
 void AdLem3D<DIM>::scaleAtrophy(double factor)
 {
-    typedef itk::MultiplyImageFilter<ScalarImageType, ScalarImageType, ScalarImageType> MultiplyImageFilterType;
-    typename MultiplyImageFilterType::Pointer multiplyImageFilter = MultiplyImageFilterType::New();
-    multiplyImageFilter->SetInput(mAtrophy);
-    multiplyImageFilter->SetConstant(factor);
-    multiplyImageFilter->Update();
-    mAtrophy=multiplyImageFilter->GetOutput();
+    double sum;
+    unsigned long csfCount;
+    runAtrophyKernel(SCALE_ATROPHY, factor, sum, csfCount);
 }
 
 #undef __FUNCT__
@@ -606,13 +968,9 @@ template <unsigned int DIM>
 // This could be important when relaxIcIncsf is false, where compatibility condition is important.
 bool AdLem3D<DIM>::isAtrophySumZero(double sumMaxValue) {
     //Check if sum is zero:
-    itk::ImageRegionIterator<ScalarImageType> it(mAtrophy, mAtrophy->GetLargestPossibleRegion());
-    it.GoToBegin();
-    double sum = 0;
-    while(!it.IsAtEnd()) {
-        sum+=it.Get();
-        ++it;
-    }
+    double sum;
+    unsigned long csfCount;
+    runAtrophyKernel(SUM_ATROPHY, 0, sum, csfCount);
     if(std::abs(sum) > sumMaxValue) return false;
 
     //Check whether the boundary should have zero atrophy.
@@ -632,128 +990,225 @@ void AdLem3D<DIM>::prescribeUniformExpansionInCsf(){//Need to check this functio
   // 	//And CHECK how Dirichlet condition at the skull creates issues because CSF voxels touching
   // 	//skull voxels possibly won't get the desired expansion. But hopefully it shouldn't cause problems!
   */
-    typedef itk::MaskImageFilter< ScalarImageType, IntegerImageType, ScalarImageType> MaskFilterType;
-    typedef itk::StatisticsImageFilter<ScalarImageType> StatisticsImageFilterType;
-    typedef itk::LabelStatisticsImageFilter<ScalarImageType, IntegerImageType> LabelStatisticsImageFilterType;
-    // ---------- First set atrophy in CSF region to zero before taking total sum of atrophy.
-    {
-	typename MaskFilterType::Pointer maskFilter = MaskFilterType::New();
-	maskFilter->SetInput(mAtrophy);
-	maskFilter->SetMaskImage(mBrainMask);
-	maskFilter->SetMaskingValue(maskLabels::CSF);
-	maskFilter->SetOutsideValue(0.);
-	maskFilter->Update();
-	setAtrophy(maskFilter->GetOutput());
-    }
-
-    typename StatisticsImageFilterType::Pointer statisticsImageFilter = StatisticsImageFilterType::New();
-    statisticsImageFilter->SetInput(mAtrophy);
-    statisticsImageFilter->Update();
-    float total_atrophy = statisticsImageFilter->GetSum();
+    // ---------- Total atrophy outside the CSF and number of CSF voxels in one pass.
+    double total_atrophy;
+    unsigned long csf_voxel_count;
+    runAtrophyKernel(SUM_NON_CSF_COUNT_CSF, 0, total_atrophy, csf_voxel_count);
+    if(csf_voxel_count == 0)
+	return;
     //std::cout<<"total atrophy = "<<total_atrophy<<std::endl;
-
-    typename LabelStatisticsImageFilterType::Pointer labelStatisticsImageFilter = LabelStatisticsImageFilterType::New();
-    labelStatisticsImageFilter->SetInput(mAtrophy);
-    labelStatisticsImageFilter->SetLabelInput(mBrainMask);
-    labelStatisticsImageFilter->Update();
-    unsigned int csf_voxel_count = labelStatisticsImageFilter->GetCount(maskLabels::CSF);
     //std::cout<<"total number of voxels with csf labels = "<<csf_voxel_count<<std::endl;
 
-    float expansion = -total_atrophy / (float)csf_voxel_count;
+    double expansion = -total_atrophy / (double)csf_voxel_count;
     //std::cout<<"csf expansion values = "<<expansion<<std::endl;
+    runAtrophyKernel(SET_CSF_ATROPHY, expansion, total_atrophy, csf_voxel_count);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "runAtrophyKernel"
+template <unsigned int DIM>
+void AdLem3D<DIM>::runAtrophyKernel(atrophyKernelType type, double value, double& sum, unsigned long& csfCount)
+{
+    if(!holdsWholeMask())
+	throw "the atrophy sums and changes are computed by the first process with a distributed mask.";
+    AtrophyKernel kernel;
+    kernel.type = type;
+    kernel.mask = NULL;
+    if(type == SUM_NON_CSF_COUNT_CSF || type == SET_CSF_ATROPHY) {
+	if(mBrainMask->GetBufferedRegion() != mAtrophy->GetBufferedRegion())
+	    throw "brain mask and atrophy must have the same region to compute the CSF expansion.";
+	kernel.mask = mBrainMask->GetBufferPointer();
+    }
+    kernel.atrophy = mAtrophy->GetBufferPointer();
+    for(unsigned int d=0; d<3; ++d)
+	kernel.size[d] = mAtrophy->GetBufferedRegion().GetSize()[d];
+    kernel.value = value;
+
+    typedef AtrophyKernelThreader< AdLem3D<DIM> > ThreaderType;
+    typename ThreaderType::Pointer threader = ThreaderType::New();
+    const itk::ThreadIdType numOfThreads = threader->GetMaximumNumberOfThreads();
+    kernel.sum.assign(numOfThreads, 0.);
+    kernel.compensation.assign(numOfThreads, 0.);
+    kernel.csfCount.assign(numOfThreads, 0);
+    typename ThreaderType::DomainType slices;
+    slices[0] = 0;
+    slices[1] = kernel.size[2] - 1;
+    threader->SetKernel(&kernel);
+    threader->Execute(this, slices);
+
+    // ---------- Merge the partial results in the order of the threads, still compensated.
+    sum = 0;
+    csfCount = 0;
+    double compensation = 0;
+    for(itk::ThreadIdType n=0; n<numOfThreads; ++n) {
+	const double y = (kernel.sum[n] - kernel.compensation[n]) - compensation;
+	const double t = sum + y;
+	compensation = (t - sum) - y;
+	sum = t;
+	csfCount += kernel.csfCount[n];
+    }
+    if(type == SCALE_ATROPHY || type == SET_CSF_ATROPHY)
+	mAtrophy->Modified();
+}
 
-    typename MaskFilterType::Pointer maskFilter = MaskFilterType::New();
-    maskFilter->SetInput(mAtrophy);
-    maskFilter->SetMaskImage(mBrainMask);
-    maskFilter->SetMaskingValue(maskLabels::CSF);
-    maskFilter->SetOutsideValue(expansion);
-    maskFilter->Update();
-    setAtrophy(maskFilter->GetOutput());
+#undef __FUNCT__
+#define __FUNCT__ "atrophyKernelSlices"
+template <unsigned int DIM>
+void AdLem3D<DIM>::atrophyKernelSlices(AtrophyKernel& kernel, long zFirst, long zLast, itk::ThreadIdType threadId) const
+{
+    const long sliceSize = kernel.size[0]*kernel.size[1];
+    const long first = sliceSize*zFirst, end = sliceSize*(zLast+1);
+    PixelValueType *atrophy = kernel.atrophy;
+    const int *mask = kernel.mask;
+    double sum = 0, compensation = 0; //Kahan summation: compensation holds the lost low order part.
+    unsigned long csfCount = 0;
+    switch(kernel.type) {
+    case SUM_ATROPHY:
+	for(long n=first; n<end; ++n) {
+	    const double y = atrophy[n] - compensation;
+	    const double t = sum + y;
+	    compensation = (t - sum) - y;
+	    sum = t;
+	}
+	break;
+    case SUM_NON_CSF_COUNT_CSF:
+	for(long n=first; n<end; ++n) {
+	    if(mask[n] == maskLabels::CSF) {
+		++csfCount;
+		continue;
+	    }
+	    const double y = atrophy[n] - compensation;
+	    const double t = sum + y;
+	    compensation = (t - sum) - y;
+	    sum = t;
+	}
+	break;
+    case SCALE_ATROPHY:
+	for(long n=first; n<end; ++n)
+	    atrophy[n] *= kernel.value;
+	break;
+    case SET_CSF_ATROPHY:
+	for(long n=first; n<end; ++n) {
+	    if(mask[n] == maskLabels::CSF)
+		atrophy[n] = kernel.value;
+	}
+	break;
+    }
+    kernel.sum[threadId] = sum;
+    kernel.compensation[threadId] = compensation;
+    kernel.csfCount[threadId] = csfCount;
 }
 
 #undef __FUNCT__
 #define __FUNCT__ "modifyAtrophy"
 template <unsigned int DIM>
 void AdLem3D<DIM>::modifyAtrophy(int maskLabel, double maskValue, bool redistributeAtrophy, bool relaxIcInCsf) {
-    if(redistributeAtrophy) {
-	int rad = 1; 	// redistribution only on 3X3 neigborhood at present.
-	typedef itk::ConstShapedNeighborhoodIterator< ScalarImageType > ConstShapedNeighborhoodIteratorType;
-	typedef itk::ConstantBoundaryCondition<IntegerImageType>  BoundaryConditionType; //to prevent outside border voxels of mBrainMask to be considred as tissue label.
-	typedef itk::ConstNeighborhoodIterator<	IntegerImageType, BoundaryConditionType > ConstNeighborhoodIteratorType;
-	typedef itk::ShapedNeighborhoodIterator< ScalarImageType > ShapedNeighborhoodIteratorType;
-
-	typename ConstShapedNeighborhoodIteratorType::RadiusType radius;
-	radius.Fill(rad);
-
-	typedef itk::NeighborhoodAlgorithm::ImageBoundaryFacesCalculator< ScalarImageType > FaceCalculatorType;
-	FaceCalculatorType faceCalculator;
-	typename FaceCalculatorType::FaceListType faceList;
-	faceList = faceCalculator( mAtrophy, mAtrophy->GetRequestedRegion(), radius );
-	typename FaceCalculatorType::FaceListType::iterator fit;
-	for ( fit=faceList.begin(); fit != faceList.end(); ++fit) {
-	    BoundaryConditionType constBoundaryCondition;
-	    constBoundaryCondition.SetConstant(maskLabels::CSF); //Set outside image label to be of CSF.
-	    ConstNeighborhoodIteratorType maskIt( radius, mBrainMask, *fit); //iterate over brain mask to find CSF voxel and its neighboring tissue voxels.
-	    maskIt.SetBoundaryCondition(constBoundaryCondition); //Outside image boundary consider labels to be of CSF. This ensures we don't try to modify
-	    //values in these invalid position since we modify only tissue label voxels.
-	    ShapedNeighborhoodIteratorType atrophyIt (radius, mAtrophy, *fit); //iterate over atrophy map to change neighborhood values if required.
-	    for (maskIt.GoToBegin(), atrophyIt.GoToBegin(); !maskIt.IsAtEnd(); ++maskIt, ++atrophyIt) {
-		double eps = 1e-6;
-		if ( (int)maskIt.GetCenterPixel() == maskLabels::CSF) {
-		    typename ScalarImageType::PixelType atrophyCurrentPixel = atrophyIt.GetCenterPixel();
-		    if (std::abs(atrophyCurrentPixel) > eps) {
-			atrophyIt.ClearActiveList();
-			for (int z = -rad; z <= rad; z++) { //activateIndex is protected so must create offset!
-			    for (int y = -rad; y <= rad; y++) {
-				for (int x = -rad; x <= rad; x++) {
-				    typename ConstShapedNeighborhoodIteratorType::OffsetType off;
-				    off[0] = x; off[1] = y; off[2] = z;
-				    int neighbMaskPixel = maskIt.GetPixel(off);
-				    if (neighbMaskPixel == maskLabels::GM || neighbMaskPixel == maskLabels::WM)
-				    { //When atrophyIt is at the image border, the offsets can go outside the image. But I have set the
-					// boundary condition s.t. values outside the border of the mask image = maskLabels::CSF which means
-					// in this if condition, they won't get activated.
-					// This way I will not try to redistribute values to these invalid regions below.
-					atrophyIt.ActivateOffset(off);
-				    }
-				}
+    if(!holdsWholeMask())
+	throw "the atrophy sums and changes are computed by the first process with a distributed mask.";
+    if(mBrainMask->GetBufferedRegion() != mAtrophy->GetBufferedRegion())
+	throw "brain mask and atrophy must have the same region to modify the atrophy.";
+    AtrophyModification mod;
+    mod.mask = mBrainMask->GetBufferPointer();
+    mod.atrophy = mAtrophy->GetBufferPointer();
+    for(unsigned int d=0; d<3; ++d)
+	mod.size[d] = mAtrophy->GetBufferedRegion().GetSize()[d];
+    mod.redistribute = redistributeAtrophy;
+    mod.applyMask = relaxIcInCsf; //If IC is relaxed, set atrophy values to maskValue in regions with label maskLabel.
+    mod.maskLabel = maskLabel;
+    mod.maskValue = maskValue;
+    if(redistributeAtrophy || relaxIcInCsf) {
+	typedef AtrophyModificationThreader< AdLem3D<DIM> > ThreaderType;
+	typename ThreaderType::Pointer threader = ThreaderType::New();
+	typename ThreaderType::DomainType slices;
+	slices[0] = 0;
+	slices[1] = mod.size[2] - 1;
+	threader->SetModification(&mod);
+	if(redistributeAtrophy) {
+	    mod.increment.resize(mod.size[0]*mod.size[1]*mod.size[2]);
+	    mod.bandFirst.resize(mod.size[1]*mod.size[2]);
+	    mod.bandLast.resize(mod.size[1]*mod.size[2]);
+	    threader->SetPass(0);
+	    threader->Execute(this, slices);
+	}
+	threader->SetPass(1);
+	threader->Execute(this, slices);
+	mAtrophy->Modified();
+    }
+    if(!relaxIcInCsf) //not relaxing IC => need to have uniformcsfexpansion!
+	prescribeUniformExpansionInCsf();
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "modifyAtrophySlices"
+//Redistribution: the non-zero atrophy of a CSF voxel is shared equally among its GM/WM neighbours in the
+//3x3x3 neighbourhood (voxels outside the image are not neighbours). Rather than scattering each share, the
+//tissue voxels near the band gather the shares of their neighbours, so that the threads never write the same
+//voxel. The CSF values are left for the masking or prescribeUniformExpansionInCsf().
+template <unsigned int DIM>
+void AdLem3D<DIM>::modifyAtrophySlices(AtrophyModification& mod, unsigned int pass, long zFirst, long zLast) const
+{
+    const long nx = mod.size[0], ny = mod.size[1], nz = mod.size[2];
+    const double eps = 1e-6;
+    for(long z=zFirst; z<=zLast; ++z) {
+	for(long y=0; y<ny; ++y) {
+	    const long row = y + ny*z;
+	    const long rowStart = nx*row;
+	    if(pass == 0) { // ---------- band of the CSF voxels with atrophy and tissue neighbours.
+		mod.bandFirst[row] = nx;
+		mod.bandLast[row] = -1;
+		for(long x=0; x<nx; ++x) {
+		    const long n = rowStart + x;
+		    mod.increment[n] = 0;
+		    if(mod.mask[n] != maskLabels::CSF || std::abs(mod.atrophy[n]) <= eps)
+			continue;
+		    int numOfTissueNeighbours = 0;
+		    for(long k=std::max(z-1,0L); k<=std::min(z+1,nz-1); ++k) {
+			for(long j=std::max(y-1,0L); j<=std::min(y+1,ny-1); ++j) {
+			    for(long i=std::max(x-1,0L); i<=std::min(x+1,nx-1); ++i) {
+				const int label = mod.mask[i + nx*(j + ny*k)];
+				if(label == maskLabels::GM || label == maskLabels::WM)
+				    ++numOfTissueNeighbours;
 			    }
 			}
-			if (atrophyIt.GetActiveIndexListSize() > 0)
-			{  //There is at least one neighboring tissue voxel.
-			    float inc = atrophyCurrentPixel/(float)atrophyIt.GetActiveIndexListSize();
-			    // std::cout <<std::endl << "Redistributing atrophy in CSF at " << atrophyIt.GetIndex()
-			    // 	      << " by adding " << inc << " to each of " << atrophyIt.GetActiveIndexListSize()
-			    // 	      << " neighboring tissue voxels " << std::endl;
-			    typename ShapedNeighborhoodIteratorType::Iterator neighbTissueIt = atrophyIt.Begin();
-			    while(! neighbTissueIt.IsAtEnd())
-			    {
-				// std::cout << "offset " << neighbTissueIt.GetNeighborhoodOffset()
-				// 	  << ", old value = " << neighbTissueIt.Get()
-				// 	  << ", new value = " << (neighbTissueIt.Get()+inc)
-				// 	  << ". The real index = " << atrophyIt.GetIndex() + neighbTissueIt.GetNeighborhoodOffset() << std::endl;
-				neighbTissueIt.Set(neighbTissueIt.Get() + inc); //The offsets of bordering voxels lying outside the image are never activated
-				// so it's safe to set here without checking if the position pointed by neighbTissueIt is valid or not.
-				++neighbTissueIt;
+		    }
+		    if(numOfTissueNeighbours > 0) {
+			mod.increment[n] = mod.atrophy[n]/(float)numOfTissueNeighbours;
+			mod.bandFirst[row] = std::min(mod.bandFirst[row],x);
+			mod.bandLast[row] = x;
+		    }
+		}
+	    } else {
+		if(mod.redistribute) { // ---------- tissue voxels next to the band gather the shares.
+		    long first = nx, last = -1;
+		    for(long k=std::max(z-1,0L); k<=std::min(z+1,nz-1); ++k) {
+			for(long j=std::max(y-1,0L); j<=std::min(y+1,ny-1); ++j) {
+			    first = std::min(first, mod.bandFirst[j + ny*k]);
+			    last = std::max(last, mod.bandLast[j + ny*k]);
+			}
+		    }
+		    for(long x=std::max(first-1,0L); x<=std::min(last+1,nx-1); ++x) {
+			const long n = rowStart + x;
+			if(mod.mask[n] != maskLabels::GM && mod.mask[n] != maskLabels::WM)
+			    continue;
+			PixelValueType gathered = 0;
+			for(long k=std::max(z-1,0L); k<=std::min(z+1,nz-1); ++k) {
+			    for(long j=std::max(y-1,0L); j<=std::min(y+1,ny-1); ++j) {
+				for(long i=std::max(x-1,0L); i<=std::min(x+1,nx-1); ++i)
+				    gathered += mod.increment[i + nx*(j + ny*k)];
 			    }
 			}
+			mod.atrophy[n] += gathered;
+		    }
+		}
+		if(mod.applyMask) { // ---------- same as itk::MaskImageFilter with masking value maskLabel.
+		    for(long x=0; x<nx; ++x) {
+			if(mod.mask[rowStart + x] == mod.maskLabel)
+			    mod.atrophy[rowStart + x] = mod.maskValue;
 		    }
 		}
 	    }
 	}
     }
-    if(relaxIcInCsf) { //If IC is relaxed, set atrophy values to maskValue in regions with label maskLabel.
-        typedef itk::MaskImageFilter< ScalarImageType, IntegerImageType,
-				      ScalarImageType> MaskFilterType;
-        typename MaskFilterType::Pointer maskFilter = MaskFilterType::New();
-        maskFilter->SetInput(mAtrophy);
-        maskFilter->SetMaskImage(mBrainMask);
-        maskFilter->SetMaskingValue(maskLabel); //The naming conventions are tricky :)
-        maskFilter->SetOutsideValue(maskValue); //with itk's convention for mask label and values.
-        maskFilter->Update();
-        mAtrophy = maskFilter->GetOutput();
-    } else //not relaxing IC => need to have uniformcsfexpansion!
-	prescribeUniformExpansionInCsf();
 }
 
 #undef __FUNCT__
@@ -768,20 +1223,26 @@ typename AdLem3D<DIM>::ScalarImageType::Pointer AdLem3D<DIM>::getAtrophyImage()
 #define __FUNCT__ "writeAtrophyToFile"
 template <unsigned int DIM>
 void AdLem3D<DIM>::writeAtrophyToFile(std::string fileName) {
-    typename ScalarImageWriterType::Pointer writer = ScalarImageWriterType::New();
-    writer->SetFileName(fileName);
-    writer->SetInput(mAtrophy);
-    writer->Update();
+    writeImage<ScalarImageType>(mAtrophy, fileName);
 }
 
 #undef __FUNCT__
 #define __FUNCT__ "writeBrainMaskToFile"
 template <unsigned int DIM>
 void AdLem3D<DIM>::writeBrainMaskToFile(std::string fileName) {
-    typename IntegerImageWriterType::Pointer writer = IntegerImageWriterType::New();
-    writer->SetFileName(fileName);
-    writer->SetInput(mBrainMask);
-    writer->Update();
+    writeImage<IntegerImageType>(mBrainMask, fileName);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "hasSolutionImages"
+template <unsigned int DIM>
+bool AdLem3D<DIM>::hasSolutionImages() const
+{
+    if(PetscAdLem3D<3>::readSolutionLayout() == PetscAdLem3D<3>::SOLUTION_REPLICATED)
+	return true;
+    PetscMPIInt rank;
+    MPI_Comm_rank(PETSC_COMM_WORLD,&rank);
+    return (rank == 0);
 }
 
 #undef __FUNCT__
@@ -793,6 +1254,8 @@ typename AdLem3D<DIM>::VectorImageType::Pointer AdLem3D<DIM>::getVelocityImage()
         std::cerr<<"the model is not solved yet, first solve the system to get the solution."<<std::endl;
         return NULL;
     }
+    if(!hasSolutionImages())
+        return NULL;
     if(!mVelocityAllocated) {
         createVelocityImage();
     }
@@ -811,6 +1274,8 @@ typename AdLem3D<DIM>::ScalarImageType::Pointer AdLem3D<DIM>::getPressureImage()
         std::cerr<<"the model is not solved yet, first solve the system to get the solution."<<std::endl;
         return NULL;
     }
+    if(!hasSolutionImages())
+        return NULL;
     if(!mPressureAllocated) {
         createPressureImage();
     }
@@ -829,6 +1294,8 @@ typename AdLem3D<DIM>::ScalarImageType::Pointer AdLem3D<DIM>::getDivergenceImage
         std::cerr<<"the model is not solved yet, first solve the system to get the solution."<<std::endl;
         return NULL;
     }
+    if(!hasSolutionImages())
+        return NULL;
     if(!mDivergenceAllocated) {
         createDivergenceImage();
     }
@@ -847,6 +1314,8 @@ typename AdLem3D<DIM>::VectorImageType::Pointer AdLem3D<DIM>::getForceImage()
         std::cerr<<"the model is not solved yet, first solve the system to get the solution."<<std::endl;
         return NULL;
     }
+    if(!hasSolutionImages())
+        return NULL;
     if(!mForceAllocated) {
         createForceImage();
     }
@@ -862,10 +1331,7 @@ typename AdLem3D<DIM>::VectorImageType::Pointer AdLem3D<DIM>::getForceImage()
 template <unsigned int DIM>
 void AdLem3D<DIM>::writeVelocityImage(std::string fileName)
 {
-    typename VectorImageWriterType::Pointer   velocityWriter = VectorImageWriterType::New();
-    velocityWriter->SetFileName(fileName);
-    velocityWriter->SetInput(getVelocityImage());
-    velocityWriter->Update();
+    writeImage<VectorImageType>(getVelocityImage(), fileName);
 }
 
 #undef __FUNCT__
@@ -873,10 +1339,7 @@ void AdLem3D<DIM>::writeVelocityImage(std::string fileName)
 template <unsigned int DIM>
 void AdLem3D<DIM>::writePressureImage(std::string fileName)
 {
-    typename ScalarImageWriterType::Pointer   pressureWriter = ScalarImageWriterType::New();
-    pressureWriter->SetFileName(fileName);
-    pressureWriter->SetInput(getPressureImage());
-    pressureWriter->Update();
+    writeImage<ScalarImageType>(getPressureImage(), fileName);
 }
 
 #undef __FUNCT__
@@ -884,10 +1347,111 @@ void AdLem3D<DIM>::writePressureImage(std::string fileName)
 template <unsigned int DIM>
 void AdLem3D<DIM>::writeDivergenceImage(std::string fileName)
 {
-    typename ScalarImageWriterType::Pointer divWriter = ScalarImageWriterType::New();
-    divWriter->SetFileName(fileName);
-    divWriter->SetInput(getDivergenceImage());
-    divWriter->Update();
+    writeImage<ScalarImageType>(getDivergenceImage(), fileName);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "writeDiagnosticImages"
+template <unsigned int DIM>
+void AdLem3D<DIM>::writeDiagnosticImages(const std::string& divergenceFile, const std::string& jacobianFile,
+					 const std::string& logJacobianFile)
+{
+    if(mNumOfSolveCalls == 0) {
+        std::cerr<<"the model is not solved yet, first solve the system to get the solution."<<std::endl;
+        return;
+    }
+    PetscErrorCode ierr;
+    std::vector<double> values;
+    ierr = mPetscSolverTaras->computeDiagnostics();CHKERRXX(ierr);
+    ierr = mPetscSolverTaras->gatherDiagnostics(values);CHKERRXX(ierr);
+    if(values.empty()) //not the first process.
+	return;
+    const std::string files[PetscAdLem3D<3>::DIAG_NUM_FIELDS] = {divergenceFile, jacobianFile, logJacobianFile};
+    for(unsigned int c=0; c<PetscAdLem3D<3>::DIAG_NUM_FIELDS; ++c) {
+	if(files[c].empty())
+	    continue;
+	typename ScalarImageType::Pointer img = ScalarImageType::New();
+	img->SetRegions(mAtrophy->GetLargestPossibleRegion());
+	img->SetOrigin(mAtrophy->GetOrigin());
+	img->SetSpacing(mAtrophy->GetSpacing());
+	img->SetDirection(mAtrophy->GetDirection());
+	img->Allocate();
+	PixelValueType *buffer = img->GetBufferPointer();
+	const size_t numOfVoxels = values.size()/PetscAdLem3D<3>::DIAG_NUM_FIELDS;
+	for(size_t n=0; n<numOfVoxels; ++n)
+	    buffer[n] = values[n*PetscAdLem3D<3>::DIAG_NUM_FIELDS + c];
+	writeImage<ScalarImageType>(img, files[c], true);
+    }
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "writeSolutionFieldsMpiIo"
+template <unsigned int DIM>
+void AdLem3D<DIM>::writeSolutionFieldsMpiIo(const std::string& velocityFile, const std::string& pressureFile,
+					    const std::string& forceFile, const std::string& divergenceFile,
+					    const std::string& jacobianFile, const std::string& logJacobianFile)
+{
+    if(mNumOfSolveCalls == 0) {
+        std::cerr<<"the model is not solved yet, first solve the system to get the solution."<<std::endl;
+        return;
+    }
+    PetscAdLem3D<3>::MhaFileNames files;
+    files.velocity = velocityFile;
+    files.pressure = pressureFile;
+    files.force = forceFile;
+    files.divergence = divergenceFile;
+    files.jacobian = jacobianFile;
+    files.logJacobian = logJacobianFile;
+    PetscAdLem3D<3>::MhaGeometry geom;
+    typename ScalarImageType::IndexType domainIndex = mAtrophy->GetLargestPossibleRegion().GetIndex();
+    if(mWriteFullSizeImages) { //model domain at its place in the full image.
+	typename IntegerImageType::RegionType fullRegion = mFullSizeImage->GetLargestPossibleRegion();
+	for(unsigned int d=0; d<3; ++d) {
+	    geom.size[d] = fullRegion.GetSize()[d];
+	    geom.offset[d] = domainIndex[d] - fullRegion.GetIndex()[d];
+	    geom.origin[d] = mFullSizeImage->GetOrigin()[d];
+	    geom.spacing[d] = mFullSizeImage->GetSpacing()[d];
+	    for(unsigned int e=0; e<3; ++e)
+		geom.direction[d*3+e] = mFullSizeImage->GetDirection()[d][e];
+	}
+    } else { //image of the model domain only, with its first voxel as origin.
+	typename ScalarImageType::PointType domainOrigin;
+	mAtrophy->TransformIndexToPhysicalPoint(domainIndex,domainOrigin);
+	for(unsigned int d=0; d<3; ++d) {
+	    geom.size[d] = mAtrophy->GetLargestPossibleRegion().GetSize()[d];
+	    geom.offset[d] = 0;
+	    geom.origin[d] = domainOrigin[d];
+	    geom.spacing[d] = mAtrophy->GetSpacing()[d];
+	    for(unsigned int e=0; e<3; ++e)
+		geom.direction[d*3+e] = mAtrophy->GetDirection()[d][e];
+	}
+    }
+    PetscErrorCode ierr;
+    ierr = mPetscSolverTaras->writeFieldsToMha(files,geom);CHKERRXX(ierr);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "writeSolverState"
+template <unsigned int DIM>
+void AdLem3D<DIM>::writeSolverState(const std::string& fileName)
+{
+    if(!mPetscSolverTarasUsed)
+	throw "the model is not solved yet, no solver state to write.";
+    PetscErrorCode ierr;
+    ierr = mPetscSolverTaras->saveState(fileName);CHKERRXX(ierr);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "readSolverState"
+template <unsigned int DIM>
+void AdLem3D<DIM>::readSolverState(const std::string& fileName)
+{
+    mSolverStateFile = fileName;
+    if(mPetscSolverTarasUsed) {
+	PetscErrorCode ierr;
+	ierr = mPetscSolverTaras->loadState(mSolverStateFile);CHKERRXX(ierr);
+	mSolverStateFile.clear();
+    }
 }
 
 #undef __FUNCT__
@@ -895,10 +1459,7 @@ void AdLem3D<DIM>::writeDivergenceImage(std::string fileName)
 template <unsigned int DIM>
 void AdLem3D<DIM>::writeForceImage(std::string fileName)
 {
-    typename VectorImageWriterType::Pointer   forceWriter = VectorImageWriterType::New();
-    forceWriter->SetFileName(fileName);
-    forceWriter->SetInput(getForceImage());
-    forceWriter->Update();
+    writeImage<VectorImageType>(getForceImage(), fileName);
 }
 
 
@@ -991,91 +1552,142 @@ void AdLem3D<DIM>::createDivergenceImage()
 #define __FUNCT__ "updateImages"
 template <unsigned int DIM>
 void AdLem3D<DIM>::updateImages(const std::string& whichImage){
-    if (whichImage.compare("pressure") == 0 || whichImage.compare("divergence") == 0) {
-	typename ScalarImageType::Pointer img;
-	bool isPressure; //Create bool var because perhaps faster to check bool than doing
-	//string compare below inside the loop.
-	if(whichImage.compare("pressure")==0){
-	    isPressure = true;
-	    img = mPressure;
-	}else{
-	    isPressure = false;
-	    img = mDivergence;
-	    if(mPetscSolverTaras->isDiv12pointStencil())
-	    {
-		std::cerr<<"Taras solver doesn't write divergence when using 12 point stencil for it."<<std::endl;
-		return;
-	    }
+    if (whichImage.compare("velocity") == 0)
+	updateOutputImages(true, false, false, false);
+    else if (whichImage.compare("pressure") == 0)
+	updateOutputImages(false, true, false, false);
+    else if (whichImage.compare("divergence") == 0)
+	updateOutputImages(false, false, true, false);
+    else if (whichImage.compare("force") == 0)
+	updateOutputImages(false, false, false, true);
+    else
+	std::cout<<"invalid image type string: "<<whichImage<<" : for function updateImages"<<std::endl; //FIXME: Exception handling!
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "updateOutputImages"
+template <unsigned int DIM>
+void AdLem3D<DIM>::updateOutputImages(bool velocity, bool pressure, bool divergence, bool force)
+{
+    if(mNumOfSolveCalls == 0) {
+        std::cerr<<"the model is not solved yet, first solve the system to get the solution."<<std::endl;
+        return;
+    }
+    velocity = velocity && !mVelocityLatest;
+    pressure = pressure && !mPressureLatest;
+    divergence = divergence && !mDivergenceLatest;
+    force = force && !mForceLatest;
+    if(divergence && mPetscSolverTaras->isDiv12pointStencil()) {
+	std::cerr<<"Taras solver doesn't write divergence when using 12 point stencil for it."<<std::endl;
+	divergence = false;
+    }
+    if(!(velocity || pressure || divergence || force))
+	return;
+    // ---------- Image buffers over the whole domain in the processes holding the images; with the slab
+    // ---------- layout the other processes fill buffers over their own voxels only, sent to the first one.
+    PetscInt start[3], size[3];
+    mPetscSolverTaras->getSolutionRegion(start, size);
+    const bool isSlab = (mPetscSolverTaras->getSolutionLayout() == PetscAdLem3D<3>::SOLUTION_SLAB);
+    typename PetscAdLemTaras3D::OutputBuffers buffers;
+    buffers.velocity = buffers.pressure = buffers.divergence = buffers.force = NULL;
+    std::vector<PixelValueType> localVelocity, localPressure, localDivergence, localForce;
+    if(hasSolutionImages()) {
+	if(velocity && !mVelocityAllocated) createVelocityImage();
+	if(pressure && !mPressureAllocated) createPressureImage();
+	if(divergence && !mDivergenceAllocated) createDivergenceImage();
+	if(force && !mForceAllocated) createForceImage();
+	buffers.start[0] = buffers.start[1] = buffers.start[2] = 0;
+	buffers.size[0] = getXnum();    buffers.size[1] = getYnum();    buffers.size[2] = getZnum();
+	if(velocity) buffers.velocity = reinterpret_cast<PixelValueType*>(mVelocity->GetBufferPointer());
+	if(pressure) buffers.pressure = mPressure->GetBufferPointer();
+	if(divergence) buffers.divergence = mDivergence->GetBufferPointer();
+	if(force) buffers.force = reinterpret_cast<PixelValueType*>(mForce->GetBufferPointer());
+    } else {
+	const size_t numOfVoxels = (size_t)size[0]*size[1]*size[2];
+	for(unsigned int d=0; d<3; ++d) {
+	    buffers.start[d] = start[d];
+	    buffers.size[d] = size[d];
 	}
-	typename ScalarImageType::RegionType roi = img->GetLargestPossibleRegion();
-	//std::cout<<whichImage<<" image region: "<<roi<<std::endl;
-	typedef itk::ImageRegionIterator<ScalarImageType> ImageIteratorType;
-	ImageIteratorType it(img, roi);
-	typename ScalarImageType::PixelType pix;
-	unsigned int pos[3];
-	it.GoToBegin();
-	// printf("From (0, 0, 0) to (%lu, %lu, %lu)\n", roi.GetSize()[2], roi.GetSize()[1], roi.GetSize()[0]);
-	for(unsigned int k = 0; k<roi.GetSize()[2]; ++k){
-	    pos[2] = k;
-	    for(unsigned int j = 0; j<roi.GetSize()[1]; ++j){
-		pos[1] = j;
-		for(unsigned int i = 0; i<roi.GetSize()[0]; ++i){
-		    pos[0] = i;
-		    if(isPressure)
-			pix = mPetscSolverTaras->getSolPressureAt(pos);
-		    else
-			pix = mPetscSolverTaras->getDivergenceAt(pos);
-		    it.Set(pix);
-		    ++it;
-		}
-	    }
+	if(numOfVoxels > 0) {
+	    if(velocity) { localVelocity.resize(3*numOfVoxels);	buffers.velocity = &localVelocity[0]; }
+	    if(pressure) { localPressure.resize(numOfVoxels);	buffers.pressure = &localPressure[0]; }
+	    if(divergence) { localDivergence.resize(numOfVoxels);	buffers.divergence = &localDivergence[0]; }
+	    if(force) { localForce.resize(3*numOfVoxels);	buffers.force = &localForce[0]; }
 	}
-	if(isPressure)
-	    mPressureLatest = true;
-	else
-	    mDivergenceLatest = true;
-    }else if (whichImage.compare("velocity") == 0 || whichImage.compare("force") == 0){
-	typename VectorImageType::Pointer img;
-	bool isVelocity; //Create bool var because perhaps faster to check bool than doing
-	//string compare below inside the loop.
-	if(whichImage.compare("velocity")==0){
-	    isVelocity = true;
-	    img = mVelocity;
-	}else{
-	    isVelocity = false;
-	    img = mForce;
+    }
+
+    // ---------- One threaded pass over the voxels whose solution is in this process.
+    if(size[0] > 0 && size[1] > 0 && size[2] > 0) {
+	typedef SolutionImagesThreader<PetscAdLemTaras3D> SolutionThreaderType;
+	typename SolutionThreaderType::Pointer threader = SolutionThreaderType::New();
+	typename SolutionThreaderType::DomainType domain;
+	for(unsigned int d=0; d<3; ++d) {
+	    domain.SetIndex(d, start[d]);
+	    domain.SetSize(d, size[d]);
 	}
-	typename VectorImageType::RegionType roi = img->GetLargestPossibleRegion();
-	typedef itk::ImageRegionIterator<VectorImageType> VectorIteratorType;
-	//std::cout<<whichImage<<"  image region: "<<roi<<std::endl;
-	VectorIteratorType it(img, roi);
-	typename VectorImageType::PixelType pix;
-	unsigned int pos[3];
-	it.GoToBegin();
-	// printf("From (0, 0, 0) to (%lu, %lu, %lu)\n", roi.GetSize()[2], roi.GetSize()[1], roi.GetSize()[0]);
-	for(unsigned int k = 0; k<roi.GetSize()[2]; ++k){
-	    pos[2] = k;
-	    for(unsigned int j = 0; j<roi.GetSize()[1]; ++j){
-		pos[1] = j;
-		for(unsigned int i = 0; i<roi.GetSize()[0]; ++i){
-		    pos[0] = i;
-		    for(int cc = 0; cc<3; ++cc) {
-			if(isVelocity)
-			    pix[cc] = mPetscSolverTaras->getSolVelocityAt(pos, cc);
-			else
-			    pix[cc] = mPetscSolverTaras->getRhsAt(pos,cc);
-		    }
-		    it.Set(pix);
-		    ++it;
+	threader->SetOutputBuffers(buffers);
+	threader->Execute(mPetscSolverTaras, domain);
+    }
+    if(isSlab) {
+	const long slabStart[3] = {start[0], start[1], start[2]};
+	const long slabSize[3] = {size[0], size[1], size[2]};
+	gatherSolutionSlabs(slabStart, slabSize, buffers.velocity, buffers.pressure, buffers.divergence, buffers.force);
+    }
+
+    if(velocity) mVelocityLatest = true;
+    if(pressure) mPressureLatest = true;
+    if(divergence) mDivergenceLatest = true;
+    if(force) mForceLatest = true;
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "gatherSolutionSlabs"
+template <unsigned int DIM>
+void AdLem3D<DIM>::gatherSolutionSlabs(const long start[3], const long size[3], const PixelValueType *velocity,
+				       const PixelValueType *pressure, const PixelValueType *divergence,
+				       const PixelValueType *force)
+{
+    PetscMPIInt rank, numOfProcs;
+    MPI_Comm_rank(PETSC_COMM_WORLD,&rank);
+    MPI_Comm_size(PETSC_COMM_WORLD,&numOfProcs);
+    const MPI_Datatype valueType = (sizeof(PixelValueType) == sizeof(float)) ? MPI_FLOAT : MPI_DOUBLE;
+    const PixelValueType *fields[4] = {velocity, pressure, divergence, force};
+    const unsigned int components[4] = {3, 1, 1, 3};
+
+    long region[6] = {start[0], start[1], start[2], size[0], size[1], size[2]};
+    std::vector<long> regions((rank == 0) ? 6*numOfProcs : 0);
+    MPI_Gather(region,6,MPI_LONG,(rank == 0) ? &regions[0] : NULL,6,MPI_LONG,0,PETSC_COMM_WORLD);
+    if(rank != 0) {
+	const size_t numOfVoxels = (size_t)size[0]*size[1]*size[2];
+	for(int f=0; f<4; ++f) {
+	    if(fields[f] && numOfVoxels > 0)
+		MpiChunkedTransfer::send(fields[f], components[f]*numOfVoxels, valueType, 0, f, PETSC_COMM_WORLD);
+	}
+	return;
+    }
+    // ---------- First process: copy the rows of each slab at their place in the images.
+    const long nx = getXnum(), ny = getYnum();
+    std::vector<PixelValueType> slab;
+    for(PetscMPIInt p=1; p<numOfProcs; ++p) {
+	const long *s = &regions[6*p], *n = &regions[6*p+3];
+	const size_t numOfVoxels = (size_t)n[0]*n[1]*n[2];
+	if(numOfVoxels == 0)
+	    continue;
+	for(int f=0; f<4; ++f) {
+	    if(!fields[f])
+		continue;
+	    const unsigned int c = components[f];
+	    slab.resize(c*numOfVoxels);
+	    MpiChunkedTransfer::recv(&slab[0], slab.size(), valueType, p, f, PETSC_COMM_WORLD);
+	    PixelValueType *image = const_cast<PixelValueType*>(fields[f]);
+	    for(long z=0; z<n[2]; ++z) {
+		for(long y=0; y<n[1]; ++y) {
+		    const PixelValueType *row = &slab[c*(size_t)n[0]*(y + n[1]*z)];
+		    std::copy(row, row + c*n[0], image + c*(s[0] + nx*((s[1]+y) + ny*(size_t)(s[2]+z))));
 		}
 	    }
 	}
-	if(isVelocity)
-	    mVelocityLatest = true;
-	else
-	    mForceLatest = true;
-    }else
-	std::cout<<"invalid image type string: "<<whichImage<<" : for function updateImages"<<std::endl; //FIXME: Exception handling!
+    }
 }
 
 // template class AdLem3D<3>;
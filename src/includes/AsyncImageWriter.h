@@ -0,0 +1,169 @@
+#ifndef ASYNC_IMAGE_WRITER_H
+#define ASYNC_IMAGE_WRITER_H
+
+/*
+    class AsyncImageWriter
+        Writes images on a background thread, so that the (gzip) compression of the outputs of a time
+        step overlaps with the warping and the solve of the next one. write() takes a copy of the image
+        (or the image itself when the caller hands it over) and queues it; it waits for a free slot
+        before copying, while maxPending images are queued or being written, so at most maxPending
+        copies are alive. flush() waits for all the queued images and is also called by the destructor.
+        The image IO is created by write(), in the calling thread, since the ITK object factories are
+        not thread safe; the worker thread only runs the ITK writers.
+*/
+#include <deque>
+#include <string>
+#include <iostream>
+
+#include "itkMultiThreader.h"
+#include "itkMutexLock.h"
+#include "itkConditionVariable.h"
+#include "itkImageFileWriter.h"
+#include "itkImageIOFactory.h"
+#include "itkImageDuplicator.h"
+
+class AsyncImageWriter
+{
+public:
+    explicit AsyncImageWriter(unsigned int maxPending = 2)
+        : mMaxPending(maxPending > 0 ? maxPending : 1), mNumOfPending(0), mNumOfFailures(0), mStop(false)
+    {
+        mQueueChanged = itk::ConditionVariable::New();
+        mThreader = itk::MultiThreader::New();
+        mThreadId = mThreader->SpawnThread(&AsyncImageWriter::threadEntry, this);
+    }
+
+    ~AsyncImageWriter()
+    {
+        flush();
+        mMutex.Lock();
+        mStop = true;
+        mQueueChanged->Broadcast();
+        mMutex.Unlock();
+        mThreader->TerminateThread(mThreadId);
+    }
+
+    // Queue image to be written to fileName. With ownImage the image is not copied but disconnected from
+    // its pipeline: the caller must not use it afterwards.
+    template <class TImage>
+    void write(TImage *image, const std::string& fileName, bool ownImage = false)
+    {
+        itk::ImageIOBase::Pointer imageIO = itk::ImageIOFactory::CreateImageIO(fileName.c_str(),
+                                                                               itk::ImageIOFactory::WriteMode);
+        if(imageIO.IsNull()) {
+            std::cerr<<"no image IO to write "<<fileName<<std::endl;
+            mMutex.Lock();
+            ++mNumOfFailures;
+            mMutex.Unlock();
+            return;
+        }
+
+        mMutex.Lock();  //reserve a slot before copying the image.
+        while(mNumOfPending >= mMaxPending)
+            mQueueChanged->Wait(&mMutex);
+        ++mNumOfPending;
+        mMutex.Unlock();
+
+        typename TImage::Pointer imageToWrite = image;
+        if(ownImage) {
+            image->DisconnectPipeline();
+        } else {
+            typedef itk::ImageDuplicator<TImage> DuplicatorType;
+            typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
+            duplicator->SetInputImage(image);
+            try {
+                duplicator->Update();
+            } catch(...) { //release the slot, else flush() would wait forever.
+                mMutex.Lock();
+                --mNumOfPending;
+                mQueueChanged->Broadcast();
+                mMutex.Unlock();
+                throw;
+            }
+            imageToWrite = duplicator->GetOutput();
+        }
+        typedef itk::ImageFileWriter<TImage> WriterType;
+        typename WriterType::Pointer writer = WriterType::New();
+        writer->SetFileName(fileName);
+        writer->SetInput(imageToWrite);
+        writer->SetImageIO(imageIO);
+
+        mMutex.Lock();
+        Job job;
+        job.writer = writer.GetPointer();
+        job.fileName = fileName;
+        mQueue.push_back(job);
+        mQueueChanged->Broadcast();
+        mMutex.Unlock();
+    }
+
+    // Wait until all the queued images are written. Returns the number of images that could not be
+    // written since the writer was created.
+    unsigned int flush()
+    {
+        mMutex.Lock();
+        while(mNumOfPending > 0)
+            mQueueChanged->Wait(&mMutex);
+        const unsigned int numOfFailures = mNumOfFailures;
+        mMutex.Unlock();
+        return numOfFailures;
+    }
+
+private:
+    AsyncImageWriter(const AsyncImageWriter &);   //purposely not implemented
+    void operator=(const AsyncImageWriter &);     //purposely not implemented
+
+    struct Job {
+        itk::ProcessObject::Pointer writer;     //holds the image to write as its input.
+        std::string                 fileName;
+    };
+
+    static ITK_THREAD_RETURN_TYPE threadEntry(void *arg)
+    {
+        itk::MultiThreader::ThreadInfoStruct *info = static_cast<itk::MultiThreader::ThreadInfoStruct *>(arg);
+        static_cast<AsyncImageWriter *>(info->UserData)->run();
+        return ITK_THREAD_RETURN_VALUE;
+    }
+
+    void run()
+    {
+        mMutex.Lock();
+        while(true) {
+            while(mQueue.empty() && !mStop)
+                mQueueChanged->Wait(&mMutex);
+            if(mQueue.empty()) //stopped with nothing left to write.
+                break;
+            Job job = mQueue.front();
+            mQueue.pop_front();
+            mMutex.Unlock();
+
+            bool failed = false;
+            try {
+                job.writer->Update();
+            } catch(itk::ExceptionObject &err) {
+                std::cerr<<"writing "<<job.fileName<<" failed: "<<err<<std::endl;
+                failed = true;
+            }
+            job.writer = NULL;  //release the image before the next one is queued.
+
+            mMutex.Lock();
+            if(failed)
+                ++mNumOfFailures;
+            --mNumOfPending;
+            mQueueChanged->Broadcast();
+        }
+        mMutex.Unlock();
+    }
+
+    itk::MultiThreader::Pointer mThreader;
+    itk::ThreadIdType           mThreadId;
+    itk::SimpleMutexLock        mMutex;
+    itk::ConditionVariable::Pointer mQueueChanged;  //signalled when a job is queued or done, and on stop.
+    std::deque<Job>             mQueue;
+    unsigned int                mMaxPending;    //queued images plus the one being written.
+    unsigned int                mNumOfPending;
+    unsigned int                mNumOfFailures;
+    bool                        mStop;
+};
+
+#endif
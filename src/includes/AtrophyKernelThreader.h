@@ -0,0 +1,52 @@
+#ifndef ATROPHY_KERNEL_THREADER_H
+#define ATROPHY_KERNEL_THREADER_H
+
+/*
+    class AtrophyKernelThreader
+        Splits the z slices of the model among the threads for one of the single pass kernels of
+        TModel::atrophyKernelSlices(): the reductions (sum of the atrophy, sum outside the CSF and count
+        of the CSF voxels) keep one partial result per thread, merged in the order of the threads by the
+        model, and the in-place writes (scaling, CSF expansion) touch only the slices of the thread.
+*/
+#include "itkDomainThreader.h"
+#include "itkThreadedIndexedContainerPartitioner.h"
+
+template<typename TModel>
+class AtrophyKernelThreader: public itk::DomainThreader< itk::ThreadedIndexedContainerPartitioner, TModel >
+{
+	public:
+	/* Standard class typedefs. */
+	typedef AtrophyKernelThreader													Self;
+	typedef itk::DomainThreader< itk::ThreadedIndexedContainerPartitioner, TModel >	Superclass;
+	typedef itk::SmartPointer< Self >												Pointer;
+	typedef itk::SmartPointer< const Self >											ConstPointer;
+
+	typedef typename Superclass::DomainType					DomainType;	//first and last slice.
+	typedef typename TModel::AtrophyKernel					AtrophyKernelType;
+
+	/* Method for creation through the object factory. */
+	itkNewMacro(Self);
+
+	/* Run-time type information (and related methods). */
+	itkTypeMacro(AtrophyKernelThreader, itk::DomainThreader);
+
+	void SetKernel(AtrophyKernelType *kernel) { m_Kernel = kernel; }
+
+protected:
+	AtrophyKernelThreader(): m_Kernel(NULL) {}
+	~AtrophyKernelThreader() {}
+
+	/** Does the real work. */
+	virtual void ThreadedExecution(const DomainType & subdomain, const itk::ThreadIdType threadId)
+	{
+		this->m_Associate->atrophyKernelSlices(*m_Kernel, subdomain[0], subdomain[1], threadId);
+	}
+
+private:
+	AtrophyKernelThreader(const Self &);	//purposely not implemented
+	void operator=(const Self &);			//purposely not implemented
+
+	AtrophyKernelType	*m_Kernel;
+};
+
+#endif
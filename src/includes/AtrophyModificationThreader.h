@@ -0,0 +1,54 @@
+#ifndef ATROPHY_MODIFICATION_THREADER_H
+#define ATROPHY_MODIFICATION_THREADER_H
+
+/*
+    class AtrophyModificationThreader
+        Splits the z slices of the model among the threads for one pass of TModel::modifyAtrophySlices():
+        the CSF voxels of the band bordering the tissue are found in the first pass, the tissue voxels
+        gather the atrophy of their CSF neighbours and the masking is done in the second one. Each thread
+        only writes the voxels of its slices, so the result does not depend on the number of threads.
+*/
+#include "itkDomainThreader.h"
+#include "itkThreadedIndexedContainerPartitioner.h"
+
+template<typename TModel>
+class AtrophyModificationThreader: public itk::DomainThreader< itk::ThreadedIndexedContainerPartitioner, TModel >
+{
+	public:
+	/* Standard class typedefs. */
+	typedef AtrophyModificationThreader													Self;
+	typedef itk::DomainThreader< itk::ThreadedIndexedContainerPartitioner, TModel >	Superclass;
+	typedef itk::SmartPointer< Self >													Pointer;
+	typedef itk::SmartPointer< const Self >												ConstPointer;
+
+	typedef typename Superclass::DomainType					DomainType;	//first and last slice.
+	typedef typename TModel::AtrophyModification			AtrophyModificationType;
+
+	/* Method for creation through the object factory. */
+	itkNewMacro(Self);
+
+	/* Run-time type information (and related methods). */
+	itkTypeMacro(AtrophyModificationThreader, itk::DomainThreader);
+
+	void SetModification(AtrophyModificationType *modification) { m_Modification = modification; }
+	void SetPass(unsigned int pass) { m_Pass = pass; }
+
+protected:
+	AtrophyModificationThreader(): m_Modification(NULL), m_Pass(0) {}
+	~AtrophyModificationThreader() {}
+
+	/** Does the real work. */
+	virtual void ThreadedExecution(const DomainType & subdomain, const itk::ThreadIdType)
+	{
+		this->m_Associate->modifyAtrophySlices(*m_Modification, m_Pass, subdomain[0], subdomain[1]);
+	}
+
+private:
+	AtrophyModificationThreader(const Self &);	//purposely not implemented
+	void operator=(const Self &);				//purposely not implemented
+
+	AtrophyModificationType	*m_Modification;
+	unsigned int			m_Pass;
+};
+
+#endif
@@ -0,0 +1,236 @@
+#ifndef FUSED_WARP_IMAGES_H
+#define FUSED_WARP_IMAGES_H
+
+/*
+    class FusedWarpImages
+        Warps up to three images with the same displacement field in a single multithreaded pass, as
+        itk::WarpImageFilter would do for each of them: the scalar image with cubic B-spline
+        interpolation, the label image with nearest neighbour and the second scalar image (e.g. the
+        atrophy map) with linear interpolation. The mapped continuous index is computed once per
+        voxel and shared by the three interpolators, which requires the inputs to have the same
+        origin, spacing and direction (their regions may differ, e.g. an extracted region).
+        The outputs have the geometry of the displacement field; samples falling outside an input
+        get the edge padding value (zero).
+*/
+#include <cmath>
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkDomainThreader.h"
+#include "itkThreadedImageRegionPartitioner.h"
+#include "itkImageRegionIterator.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkBSplineInterpolateImageFunction.h"
+#include "itkNearestNeighborInterpolateImageFunction.h"
+#include "itkLinearInterpolateImageFunction.h"
+
+template<typename TAssociate>
+class FusedWarpImagesThreader: public itk::DomainThreader< itk::ThreadedImageRegionPartitioner<TAssociate::Dimension>, TAssociate >
+{
+	public:
+	/* Standard class typedefs. */
+	typedef FusedWarpImagesThreader																		Self;
+	typedef itk::DomainThreader< itk::ThreadedImageRegionPartitioner<TAssociate::Dimension>, TAssociate >	Superclass;
+	typedef itk::SmartPointer< Self >																	Pointer;
+	typedef itk::SmartPointer< const Self >																ConstPointer;
+
+	typedef typename Superclass::DomainType					DomainType;
+
+	/* Method for creation through the object factory. */
+	itkNewMacro(Self);
+
+	/* Run-time type information (and related methods). */
+	itkTypeMacro(FusedWarpImagesThreader, itk::DomainThreader);
+
+protected:
+	FusedWarpImagesThreader() {}
+	~FusedWarpImagesThreader() {}
+
+	/** Does the real work. */
+	virtual void ThreadedExecution(const DomainType & subdomain, const itk::ThreadIdType threadId)
+	{
+		this->m_Associate->ThreadedWarp(subdomain, threadId);
+	}
+
+private:
+	FusedWarpImagesThreader(const Self &);	//purposely not implemented
+	void operator=(const Self &);			//purposely not implemented
+};
+
+template<typename TScalarImage, typename TLabelImage, typename TDisplacementField>
+class FusedWarpImages: public itk::Object
+{
+	public:
+	/* Standard class typedefs. */
+	typedef FusedWarpImages								Self;
+	typedef itk::Object									Superclass;
+	typedef itk::SmartPointer< Self >					Pointer;
+	typedef itk::SmartPointer< const Self >				ConstPointer;
+
+	/* ImageDimension constants */
+	itkStaticConstMacro(Dimension, unsigned int, TDisplacementField::ImageDimension);
+
+	/* Image typedefs */
+	typedef TScalarImage								ScalarImageType;
+	typedef TLabelImage									LabelImageType;
+	typedef TDisplacementField							DisplacementFieldType;
+	typedef typename DisplacementFieldType::RegionType	RegionType;
+
+	/* Interpolator typedefs */
+	typedef itk::BSplineInterpolateImageFunction<ScalarImageType>			BSplineInterpolatorType;
+	typedef itk::NearestNeighborInterpolateImageFunction<LabelImageType>	NearestInterpolatorType;
+	typedef itk::LinearInterpolateImageFunction<ScalarImageType>			LinearInterpolatorType;
+	typedef typename BSplineInterpolatorType::ContinuousIndexType			ContinuousIndexType;
+
+	/* Method for creation through the object factory. */
+	itkNewMacro(Self);
+
+	/* Run-time type information (and related methods). */
+	itkTypeMacro(FusedWarpImages, itk::Object);
+
+	/* Set\get methods. Any of the three inputs may be left unset. */
+	itkSetConstObjectMacro(DisplacementField, DisplacementFieldType);
+	itkSetConstObjectMacro(BSplineInput, ScalarImageType);
+	itkSetConstObjectMacro(NearestInput, LabelImageType);
+	itkSetConstObjectMacro(LinearInput, ScalarImageType);
+	itkSetMacro(SplineOrder, unsigned int);
+
+	ScalarImageType * GetBSplineOutput() { return m_BSplineOutput.GetPointer(); }
+	LabelImageType * GetNearestOutput() { return m_NearestOutput.GetPointer(); }
+	ScalarImageType * GetLinearOutput() { return m_LinearOutput.GetPointer(); }
+
+	void Update()
+	{
+		if(m_DisplacementField.IsNull())
+			itkExceptionMacro(<< "displacement field not set.");
+		const itk::ImageBase<Dimension> *reference = NULL;
+		if(m_BSplineInput) reference = m_BSplineInput;
+		else if(m_NearestInput) reference = m_NearestInput;
+		else if(m_LinearInput) reference = m_LinearInput;
+		if(!reference)
+			itkExceptionMacro(<< "no input image to warp.");
+		CheckSameGeometry(reference, m_NearestInput);
+		CheckSameGeometry(reference, m_LinearInput);
+		m_Reference = reference;
+
+		typedef FusedWarpImagesThreader<Self> ThreaderType;
+		typename ThreaderType::Pointer threader = ThreaderType::New();
+		const itk::ThreadIdType numOfThreads = threader->GetMaximumNumberOfThreads();
+		m_BSplineOutput = NULL;	m_NearestOutput = NULL;	m_LinearOutput = NULL;
+		if(m_BSplineInput) {
+			m_BSplineInterpolator = BSplineInterpolatorType::New();
+			m_BSplineInterpolator->SetSplineOrder(m_SplineOrder);
+			m_BSplineInterpolator->SetNumberOfThreads(numOfThreads);	//per thread weights of EvaluateAtContinuousIndex().
+			m_BSplineInterpolator->SetInputImage(m_BSplineInput);
+			m_BSplineOutput = AllocateOutput<ScalarImageType>(reference);
+		}
+		if(m_NearestInput) {
+			m_NearestInterpolator = NearestInterpolatorType::New();
+			m_NearestInterpolator->SetInputImage(m_NearestInput);
+			m_NearestOutput = AllocateOutput<LabelImageType>(reference);
+		}
+		if(m_LinearInput) {
+			m_LinearInterpolator = LinearInterpolatorType::New();
+			m_LinearInterpolator->SetInputImage(m_LinearInput);
+			m_LinearOutput = AllocateOutput<ScalarImageType>(reference);
+		}
+		threader->Execute(this, m_DisplacementField->GetLargestPossibleRegion());
+		//the interpolators keep the inputs (and the B-spline coefficients) alive otherwise.
+		m_BSplineInterpolator = NULL;	m_NearestInterpolator = NULL;	m_LinearInterpolator = NULL;
+	}
+
+	/* Warp subregion of the field region; called by FusedWarpImagesThreader. */
+	void ThreadedWarp(const RegionType & subregion, const itk::ThreadIdType threadId)
+	{
+		typedef itk::ImageRegionConstIteratorWithIndex<DisplacementFieldType>	FieldIteratorType;
+		typedef itk::ImageRegionIterator<ScalarImageType>				ScalarIteratorType;
+		typedef itk::ImageRegionIterator<LabelImageType>				LabelIteratorType;
+		FieldIteratorType fieldIt(m_DisplacementField, subregion);
+		ScalarIteratorType bsplineIt, linearIt;
+		LabelIteratorType nearestIt;
+		if(m_BSplineOutput) bsplineIt = ScalarIteratorType(m_BSplineOutput, subregion);
+		if(m_NearestOutput) nearestIt = LabelIteratorType(m_NearestOutput, subregion);
+		if(m_LinearOutput) linearIt = ScalarIteratorType(m_LinearOutput, subregion);
+
+		typename DisplacementFieldType::PointType	point;
+		ContinuousIndexType							mappedIndex;
+		for(fieldIt.GoToBegin(); !fieldIt.IsAtEnd(); ++fieldIt) {
+			m_DisplacementField->TransformIndexToPhysicalPoint(fieldIt.GetIndex(), point);
+			const typename DisplacementFieldType::PixelType displacement = fieldIt.Get();
+			for(unsigned int d=0; d<Dimension; ++d)
+				point[d] += displacement[d];
+			m_Reference->TransformPhysicalPointToContinuousIndex(point, mappedIndex);
+			if(m_BSplineOutput) {
+				bsplineIt.Set((m_BSplineInterpolator->IsInsideBuffer(mappedIndex))
+							  ? static_cast<typename ScalarImageType::PixelType>(
+								  m_BSplineInterpolator->EvaluateAtContinuousIndex(mappedIndex, threadId))
+							  : itk::NumericTraits<typename ScalarImageType::PixelType>::ZeroValue());
+				++bsplineIt;
+			}
+			if(m_NearestOutput) {
+				nearestIt.Set((m_NearestInterpolator->IsInsideBuffer(mappedIndex))
+							  ? static_cast<typename LabelImageType::PixelType>(
+								  m_NearestInterpolator->EvaluateAtContinuousIndex(mappedIndex))
+							  : itk::NumericTraits<typename LabelImageType::PixelType>::ZeroValue());
+				++nearestIt;
+			}
+			if(m_LinearOutput) {
+				linearIt.Set((m_LinearInterpolator->IsInsideBuffer(mappedIndex))
+							 ? static_cast<typename ScalarImageType::PixelType>(
+								 m_LinearInterpolator->EvaluateAtContinuousIndex(mappedIndex))
+							 : itk::NumericTraits<typename ScalarImageType::PixelType>::ZeroValue());
+				++linearIt;
+			}
+		}
+	}
+
+protected:
+	FusedWarpImages(): m_SplineOrder(3), m_Reference(NULL) {}
+	~FusedWarpImages() {}
+
+	void CheckSameGeometry(const itk::ImageBase<Dimension> *reference, const itk::ImageBase<Dimension> *image) const
+	{
+		if(!image)
+			return;
+		const double tolerance = 1e-6;
+		for(unsigned int d=0; d<Dimension; ++d) {
+			bool same = std::abs(image->GetOrigin()[d] - reference->GetOrigin()[d]) <= tolerance*reference->GetSpacing()[d]
+				&& std::abs(image->GetSpacing()[d] - reference->GetSpacing()[d]) <= tolerance*reference->GetSpacing()[d];
+			for(unsigned int e=0; e<Dimension; ++e)
+				same = same && std::abs(image->GetDirection()[d][e] - reference->GetDirection()[d][e]) <= tolerance;
+			if(!same)
+				itkExceptionMacro(<< "the images to warp must have the same origin, spacing and direction.");
+		}
+	}
+
+	template<typename TImage>
+	typename TImage::Pointer AllocateOutput(const itk::ImageBase<Dimension> *reference) const
+	{
+		typename TImage::Pointer output = TImage::New();
+		output->SetRegions(m_DisplacementField->GetLargestPossibleRegion());
+		output->SetOrigin(reference->GetOrigin());
+		output->SetSpacing(reference->GetSpacing());
+		output->SetDirection(reference->GetDirection());
+		output->Allocate();
+		return output;
+	}
+
+private:
+	FusedWarpImages(const Self &);		//purposely not implemented
+	void operator=(const Self &);		//purposely not implemented
+
+	typename DisplacementFieldType::ConstPointer	m_DisplacementField;
+	typename ScalarImageType::ConstPointer			m_BSplineInput, m_LinearInput;
+	typename LabelImageType::ConstPointer			m_NearestInput;
+	unsigned int									m_SplineOrder;
+	const itk::ImageBase<Dimension>					*m_Reference;	//geometry used to map the points to continuous indices.
+
+	typename BSplineInterpolatorType::Pointer		m_BSplineInterpolator;
+	typename NearestInterpolatorType::Pointer		m_NearestInterpolator;
+	typename LinearInterpolatorType::Pointer		m_LinearInterpolator;
+
+	typename ScalarImageType::Pointer				m_BSplineOutput, m_LinearOutput;
+	typename LabelImageType::Pointer				m_NearestOutput;
+};
+
+#endif
@@ -3,18 +3,27 @@
 
 /*
     class InverseDisplacementImageFilter
-        Numerical "inverse" for (possibly non-invertible) displacement fields. Uses a simple fixed point scheme that should do well for relatively smooth fields:
-			v_0 = 0
+        Numerical "inverse" for (possibly non-invertible) displacement fields. Solves for each voxel x the fixed point equation
+			v = -u( x + v )
+		in continuous index space, with Newton steps using the Jacobian of u at the grid voxel nearest to x + v. When that
+		Jacobian is (nearly) singular, or the previous step did not reduce the residual, the simple fixed point step
 			v_{i+1} = -u( x + v_i )
+		is taken instead, which should do well for relatively smooth fields. The iteration starts from the inverse of the
+		previous voxel of the scanline when it converged, else from v_0 = -u(x). Voxels with zero displacement are their
+		own inverse and are skipped.
 		The input image is simply here to define the domain and resolution of interest over which to sample the inverse field.
 
 		itk::Vector<T,d> pixel type expected for the displacement field.
 */
+#include <vector>
+
 #include "itkImageToImageFilter.h"
 //#include "itkVectorLinearInterpolateImageFunction.h"
 #include <itkVectorLinearInterpolateNearestNeighborExtrapolateImageFunction.h>
-#include "itkImageRegionIterator.h"
-#include "itkImageRegionIteratorWithIndex.h"
+#include "itkImageScanlineIterator.h"
+#include "itkImageScanlineConstIterator.h"
+#include "itkContinuousIndex.h"
+#include "itkMatrix.h"
 
 template<typename TDisplacementField>
 class InverseDisplacementImageFilter: public itk::ImageToImageFilter< TDisplacementField, TDisplacementField >
@@ -47,6 +56,10 @@ class InverseDisplacementImageFilter: public itk::ImageToImageFilter< TDisplacem
 
     typedef typename Superclass::OutputImageRegionType OutputImageRegionType;
 
+	/* Continuous index arithmetic typedefs */
+	typedef itk::ContinuousIndex<RealValueType, Dimension>	ContinuousIndexType;
+	typedef itk::Matrix<RealValueType, Dimension, Dimension>	MatrixType;
+
 	/* Method for creation through the object factory. */
 	itkNewMacro(Self);
  
@@ -60,22 +73,43 @@ class InverseDisplacementImageFilter: public itk::ImageToImageFilter< TDisplacem
 	itkGetMacro(MaximumNumberOfIterations, unsigned int);
 	itkGetMacro(ErrorTolerance, RealValueType);
 
+	/* Newton steps are only taken when the determinant of their Jacobian is above this value. */
+	itkSetMacro(MinimumJacobianDeterminant, RealValueType);
+	itkGetMacro(MinimumJacobianDeterminant, RealValueType);
+
     itkGetMacro(NumberOfErrorToleranceFailures, unsigned int);
 
 protected:
     InverseDisplacementImageFilter();
     ~InverseDisplacementImageFilter() {}
 
+	/** The whole field is needed to interpolate at x + v. */
+	virtual void GenerateInputRequestedRegion();
+
+	virtual void BeforeThreadedGenerateData();
+
 	/** Does the real work. */
     virtual void ThreadedGenerateData(const OutputImageRegionType & outputRegionForThread, itk::ThreadIdType threadId);
 
+	/** Sums the failures of the threads. */
+	virtual void AfterThreadedGenerateData();
+
+	/** Iterates from the continuous index q of x + v_0 for the voxel of continuous index c; q is left at x + v. Returns
+		true when the tolerance is reached. */
+	bool SolveInverse(const ContinuousIndexType & c, ContinuousIndexType & q, VectorType & v) const;
+
 private:
     InverseDisplacementImageFilter(const Self &);	//purposely not implemented
 	void operator=(const Self &);								//purposely not implemented
 
 	unsigned int m_MaximumNumberOfIterations;					// hard cut regardless of convergence in the fixed point scheme
 	RealValueType m_ErrorTolerance;								// if we go below this tolerance, convergence is reached.
+	RealValueType m_MinimumJacobianDeterminant;					// below it, fixed point step instead of Newton step.
     unsigned int m_NumberOfErrorToleranceFailures;              // total number of voxels for which convergence was not reached.
+	std::vector<unsigned int> m_ThreadFailures;					// failures counted by each thread, summed after the threads.
+
+	FieldInterpolatorPointer m_Interpolator;					// shared by the threads.
+	MatrixType m_PointToIndex, m_IndexToPoint;					// maps of the input between physical and index vectors.
 };
 
 #include "InverseDisplacementImageFilter.txx"
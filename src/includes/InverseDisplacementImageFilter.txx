@@ -1,53 +1,153 @@
 #include "InverseDisplacementImageFilter.h"
+#include <algorithm>
+#include "itkMath.h"
+#include <vnl/vnl_inverse.h>
+#include <vnl/vnl_det.h>
 
 //** GAUSSIANTRANSFORMNUMERICALINVERSEIMAGEFILTER **//
 
 template<typename TDisplacementField >
 InverseDisplacementImageFilter<TDisplacementField >::InverseDisplacementImageFilter(): m_MaximumNumberOfIterations(100), m_ErrorTolerance(1e-2),
-    m_NumberOfErrorToleranceFailures(0)
+    m_MinimumJacobianDeterminant(0.1), m_NumberOfErrorToleranceFailures(0)
 {
 }
 
-/* Does the real work */
 template< typename TDisplacementField >
-void InverseDisplacementImageFilter<TDisplacementField >::ThreadedGenerateData(const OutputImageRegionType & outputRegionForThread, itk::ThreadIdType threadId)
+void InverseDisplacementImageFilter<TDisplacementField >::GenerateInputRequestedRegion()
+{
+	Superclass::GenerateInputRequestedRegion();
+	DisplacementFieldType *input = const_cast< DisplacementFieldType * >(this->GetInput());
+	if(input)
+		input->SetRequestedRegionToLargestPossibleRegion();
+}
+
+template< typename TDisplacementField >
+void InverseDisplacementImageFilter<TDisplacementField >::BeforeThreadedGenerateData()
 {
-	// In the fixed point iteration, we will need to access non-grid points.
+	// In the iteration, we will need to access non-grid points.
 	// Currently, the best interpolator that is supported by itk for vector
-	// images is the linear interpolater.
-	typename FieldInterpolatorType::Pointer vectorInterpolator =
-			FieldInterpolatorType::New();
-    vectorInterpolator->SetInputImage(this->GetInput());
+	// images is the linear interpolater. Its evaluation is thread safe.
+	m_Interpolator = FieldInterpolatorType::New();
+	m_Interpolator->SetInputImage(this->GetInput());
+	m_PointToIndex = this->GetInput()->GetPhysicalPointToIndex();
+	m_IndexToPoint = this->GetInput()->GetIndexToPhysicalPoint();
+	m_ThreadFailures.assign(this->GetNumberOfThreads(), 0);
+}
+
+template< typename TDisplacementField >
+void InverseDisplacementImageFilter<TDisplacementField >::AfterThreadedGenerateData()
+{
+	m_NumberOfErrorToleranceFailures = 0;
+	for(size_t n=0; n<m_ThreadFailures.size(); ++n)
+		m_NumberOfErrorToleranceFailures += m_ThreadFailures[n];
+	m_Interpolator = NULL;
+}
 
+/* Does the real work */
+template< typename TDisplacementField >
+void InverseDisplacementImageFilter<TDisplacementField >::ThreadedGenerateData(const OutputImageRegionType & outputRegionForThread, itk::ThreadIdType threadId)
+{
+	// The output has the geometry of the input, so the index of a voxel is also its continuous index in the input.
 	DisplacementFieldPointerType output = this->GetOutput();
-	RealValueType sqr_tol = m_ErrorTolerance*m_ErrorTolerance;
-
-	itk::ImageRegionIteratorWithIndex< DisplacementFieldType > it_dis(output, outputRegionForThread);
-	for(it_dis.GoToBegin(); !it_dis.IsAtEnd(); ++it_dis){
-		PointType x;
-		output->TransformIndexToPhysicalPoint(it_dis.GetIndex(), x);
-
-        VectorType v = -vectorInterpolator->Evaluate(x); // change here m_Transform->Direct(x) by the interpolated value of the input displacement field at x
-		VectorType eps = v;
-		unsigned int i = 2;
-		
-		while( (i<m_MaximumNumberOfIterations) && (eps.GetSquaredNorm()>sqr_tol) )
-		{
-            PointType X = x + v;
-            v = -vectorInterpolator->Evaluate(X);
-            PointType y = X - v; // change here m_Transform->Direct(z) by the interpolated value of the input displacement field at z
-
-			eps = y - x;
-            //v = z - y;
-            ++i;
+	itk::ImageScanlineConstIterator< DisplacementFieldType > it_in(this->GetInput(), outputRegionForThread);
+	itk::ImageScanlineIterator< DisplacementFieldType > it_dis(output, outputRegionForThread);
+	unsigned int numOfFailures = 0;
+	ContinuousIndexType c, q;
+	VectorType v;
+	while(!it_dis.IsAtEnd()) {
+		bool warmStart = false;		// previous voxel of the scanline converged.
+		while(!it_dis.IsAtEndOfLine()) {
+			const VectorType u = it_in.Get();
+			bool isZero = true;
+			for(unsigned int d=0; d<Dimension; ++d)
+				isZero = isZero && (u[d] == 0);
+			if(isZero) {	// v = 0 solves v = -u(x + v) exactly.
+				v.Fill(0);
+				warmStart = false;
+			} else {
+				const typename DisplacementFieldType::IndexType index = it_dis.GetIndex();
+				// start from x + v of the previous voxel, else from x - u(x).
+				const VectorType start = (warmStart) ? v : -u;
+				for(unsigned int d=0; d<Dimension; ++d) {
+					c[d] = index[d];
+					RealValueType shift = 0;
+					for(unsigned int e=0; e<Dimension; ++e)
+						shift += m_PointToIndex[d][e]*start[e];
+					q[d] = c[d] + shift;
+				}
+				warmStart = SolveInverse(c, q, v);
+				if(!warmStart) // Find how many did not converge.
+					++numOfFailures;
+			}
+			it_dis.Set( v );
+			++it_in;
+			++it_dis;
 		}
+		it_in.NextLine();
+		it_dis.NextLine();
+	}
+	m_ThreadFailures[threadId] = numOfFailures;
+}
 
-		it_dis.Set( v );
+template< typename TDisplacementField >
+bool InverseDisplacementImageFilter<TDisplacementField >::SolveInverse(const ContinuousIndexType & c, ContinuousIndexType & q, VectorType & v) const
+{
+	// Residual g(q) = q + A u(q) - c in index units, A physical to index map; its physical norm is compared to the tolerance.
+	const DisplacementFieldType *input = this->GetInput();
+	const typename DisplacementFieldType::RegionType &region = input->GetBufferedRegion();
+	const RealValueType sqr_tol = m_ErrorTolerance*m_ErrorTolerance;
+	RealValueType prev_sqr_res = itk::NumericTraits<RealValueType>::max();
+	FieldInterpolatorOutputType u;
+	itk::Vector<RealValueType, Dimension> g, w;
+	for(unsigned int i=1; ; ++i) {
+		u = m_Interpolator->EvaluateAtContinuousIndex(q);
+		for(unsigned int d=0; d<Dimension; ++d)
+			v[d] = -u[d];
+		w = m_PointToIndex*u;
+		for(unsigned int d=0; d<Dimension; ++d)
+			g[d] = q[d] + w[d] - c[d];
+		const RealValueType sqr_res = (m_IndexToPoint*g).GetSquaredNorm();
+		if(sqr_res <= sqr_tol)
+			return true;
+		if(i >= m_MaximumNumberOfIterations)
+			return false;
 
-        // Find how many did not converge.
-		if( eps.GetSquaredNorm()>sqr_tol ){
-            ++m_NumberOfErrorToleranceFailures;
+		// Newton step: Jacobian I + A Du, Du by central differences on the grid around the nearest voxel.
+		bool newton = sqr_res < prev_sqr_res;
+		prev_sqr_res = sqr_res;
+		if(newton) {
+			typename DisplacementFieldType::IndexType k, kp, km;
+			for(unsigned int d=0; d<Dimension; ++d) {
+				k[d] = itk::Math::Round<itk::IndexValueType>(q[d]);
+				k[d] = std::max(k[d], region.GetIndex()[d]);
+				k[d] = std::min(k[d], region.GetIndex()[d] + (itk::IndexValueType)region.GetSize()[d] - 1);
+			}
+			MatrixType jacobian;
+			jacobian.SetIdentity();
+			for(unsigned int e=0; e<Dimension; ++e) {
+				kp = k; km = k;
+				if(kp[e] < region.GetIndex()[e] + (itk::IndexValueType)region.GetSize()[e] - 1) ++kp[e];
+				if(km[e] > region.GetIndex()[e]) --km[e];
+				if(kp[e] == km[e])
+					continue;
+				itk::Vector<RealValueType, Dimension> du;
+				for(unsigned int d=0; d<Dimension; ++d)
+					du[d] = (input->GetPixel(kp)[d] - input->GetPixel(km)[d])/(RealValueType)(kp[e] - km[e]);
+				du = m_PointToIndex*du;
+				for(unsigned int d=0; d<Dimension; ++d)
+					jacobian[d][e] += du[d];
+			}
+			newton = vnl_det(jacobian.GetVnlMatrix()) > m_MinimumJacobianDeterminant;
+			if(newton) {
+				const MatrixType inverse(vnl_inverse(jacobian.GetVnlMatrix()));
+				g = inverse*g;
+				for(unsigned int d=0; d<Dimension; ++d)
+					q[d] -= g[d];
+			}
+		}
+		if(!newton) { // fixed point step: x + v_{i+1} with v_{i+1} = -u(x + v_i).
+			for(unsigned int d=0; d<Dimension; ++d)
+				q[d] = c[d] - w[d];
 		}
 	}
-//    std::cout << "Tolerance not reached for "<<m_NumberOfErrorToleranceFailures<<" pixels" << std::endl;
 }
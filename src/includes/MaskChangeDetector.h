@@ -0,0 +1,211 @@
+#ifndef MASK_CHANGE_DETECTOR_H
+#define MASK_CHANGE_DETECTOR_H
+
+/*
+    class MaskChangeDetector
+        Compares two label images of the same region voxel by voxel, multithreaded, and gives the number
+        of voxels whose label changed, their bounding box and, if requested, the list of their indices
+        (x,y,z triplets relative to the first index of the region, in raster order).
+        With SetStopAtFirstChange(true) only HasChanged() is meaningful: the threads stop as soon as one
+        of them finds a changed voxel.
+*/
+#include <vector>
+#include <algorithm>
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkDomainThreader.h"
+#include "itkThreadedImageRegionPartitioner.h"
+#include "itkImageScanlineConstIterator.h"
+
+template<typename TAssociate>
+class MaskChangeDetectorThreader: public itk::DomainThreader< itk::ThreadedImageRegionPartitioner<TAssociate::Dimension>, TAssociate >
+{
+	public:
+	/* Standard class typedefs. */
+	typedef MaskChangeDetectorThreader																	Self;
+	typedef itk::DomainThreader< itk::ThreadedImageRegionPartitioner<TAssociate::Dimension>, TAssociate >	Superclass;
+	typedef itk::SmartPointer< Self >																	Pointer;
+	typedef itk::SmartPointer< const Self >																ConstPointer;
+
+	typedef typename Superclass::DomainType					DomainType;
+
+	/* Method for creation through the object factory. */
+	itkNewMacro(Self);
+
+	/* Run-time type information (and related methods). */
+	itkTypeMacro(MaskChangeDetectorThreader, itk::DomainThreader);
+
+protected:
+	MaskChangeDetectorThreader() {}
+	~MaskChangeDetectorThreader() {}
+
+	virtual void BeforeThreadedExecution()
+	{
+		this->m_Associate->InitializeThreadResults(this->GetNumberOfThreadsUsed());
+	}
+
+	/** Does the real work. */
+	virtual void ThreadedExecution(const DomainType & subdomain, const itk::ThreadIdType threadId)
+	{
+		this->m_Associate->ThreadedCompare(subdomain, threadId);
+	}
+
+	virtual void AfterThreadedExecution()
+	{
+		this->m_Associate->MergeThreadResults();
+	}
+
+private:
+	MaskChangeDetectorThreader(const Self &);	//purposely not implemented
+	void operator=(const Self &);				//purposely not implemented
+};
+
+template<typename TLabelImage>
+class MaskChangeDetector: public itk::Object
+{
+	public:
+	/* Standard class typedefs. */
+	typedef MaskChangeDetector							Self;
+	typedef itk::Object									Superclass;
+	typedef itk::SmartPointer< Self >					Pointer;
+	typedef itk::SmartPointer< const Self >				ConstPointer;
+
+	/* ImageDimension constants */
+	itkStaticConstMacro(Dimension, unsigned int, TLabelImage::ImageDimension);
+
+	typedef TLabelImage									LabelImageType;
+	typedef typename LabelImageType::RegionType			RegionType;
+	typedef typename LabelImageType::IndexType			IndexType;
+
+	/* Method for creation through the object factory. */
+	itkNewMacro(Self);
+
+	/* Run-time type information (and related methods). */
+	itkTypeMacro(MaskChangeDetector, itk::Object);
+
+	/* Set\get methods */
+	itkSetConstObjectMacro(PreviousMask, LabelImageType);
+	itkSetConstObjectMacro(CurrentMask, LabelImageType);
+	itkSetMacro(CollectChangedVoxels, bool);
+	itkSetMacro(StopAtFirstChange, bool);
+
+	bool HasChanged() const { return m_NumberOfChangedVoxels > 0; }
+	itk::SizeValueType GetNumberOfChangedVoxels() const { return m_NumberOfChangedVoxels; }
+	/* Bounding box of the changed voxels, empty region when none changed. */
+	const RegionType & GetBoundingBox() const { return m_BoundingBox; }
+	/* x,y,z of the changed voxels relative to the region index, with SetCollectChangedVoxels(true). */
+	std::vector<unsigned int> & GetChangedVoxels() { return m_ChangedVoxels; }
+
+	void Compute()
+	{
+		if(m_PreviousMask.IsNull() || m_CurrentMask.IsNull())
+			itkExceptionMacro(<< "both masks must be set.");
+		m_Region = m_CurrentMask->GetLargestPossibleRegion();
+		if(m_PreviousMask->GetLargestPossibleRegion() != m_Region)
+			itkExceptionMacro(<< "the masks must have the same region.");
+		m_FoundChange = false;
+		typedef MaskChangeDetectorThreader<Self> ThreaderType;
+		typename ThreaderType::Pointer threader = ThreaderType::New();
+		threader->Execute(this, m_Region);
+	}
+
+	/* Called by MaskChangeDetectorThreader. */
+	void InitializeThreadResults(itk::ThreadIdType numOfThreads)
+	{
+		m_ThreadResults.assign(numOfThreads, ThreadResult());
+	}
+
+	void ThreadedCompare(const RegionType & subregion, const itk::ThreadIdType threadId)
+	{
+		ThreadResult &result = m_ThreadResults[threadId];
+		typedef itk::ImageScanlineConstIterator<LabelImageType> IteratorType;
+		IteratorType prevIt(m_PreviousMask, subregion);
+		IteratorType currIt(m_CurrentMask, subregion);
+		while(!currIt.IsAtEnd()) {
+			if(m_StopAtFirstChange && m_FoundChange)	//found by another thread.
+				return;
+			while(!currIt.IsAtEndOfLine()) {
+				if(currIt.Get() != prevIt.Get()) {
+					AddChange(result, currIt.GetIndex());
+					if(m_StopAtFirstChange) {
+						m_FoundChange = true;
+						return;
+					}
+				}
+				++currIt;
+				++prevIt;
+			}
+			currIt.NextLine();
+			prevIt.NextLine();
+		}
+	}
+
+	void MergeThreadResults()
+	{
+		m_NumberOfChangedVoxels = 0;
+		m_ChangedVoxels.clear();
+		IndexType lower, upper;
+		for(size_t n=0; n<m_ThreadResults.size(); ++n) {
+			const ThreadResult &result = m_ThreadResults[n];
+			if(result.numOfChanged == 0)
+				continue;
+			for(unsigned int d=0; d<Dimension; ++d) {
+				lower[d] = (m_NumberOfChangedVoxels == 0) ? result.lower[d] : std::min(lower[d], result.lower[d]);
+				upper[d] = (m_NumberOfChangedVoxels == 0) ? result.upper[d] : std::max(upper[d], result.upper[d]);
+			}
+			m_NumberOfChangedVoxels += result.numOfChanged;
+			//the partitioner splits the region in slabs ordered as the threads: the list stays in raster order.
+			m_ChangedVoxels.insert(m_ChangedVoxels.end(), result.changedVoxels.begin(), result.changedVoxels.end());
+		}
+		m_BoundingBox = RegionType();
+		if(m_NumberOfChangedVoxels > 0) {
+			typename RegionType::SizeType size;
+			for(unsigned int d=0; d<Dimension; ++d)
+				size[d] = upper[d] - lower[d] + 1;
+			m_BoundingBox.SetIndex(lower);
+			m_BoundingBox.SetSize(size);
+		}
+		m_ThreadResults.clear();
+	}
+
+protected:
+	MaskChangeDetector(): m_CollectChangedVoxels(false), m_StopAtFirstChange(false), m_FoundChange(false),
+						  m_NumberOfChangedVoxels(0) {}
+	~MaskChangeDetector() {}
+
+private:
+	MaskChangeDetector(const Self &);		//purposely not implemented
+	void operator=(const Self &);			//purposely not implemented
+
+	struct ThreadResult {
+		ThreadResult(): numOfChanged(0) {}
+		itk::SizeValueType			numOfChanged;
+		IndexType					lower, upper;
+		std::vector<unsigned int>	changedVoxels;
+	};
+
+	void AddChange(ThreadResult &result, const IndexType &index) const
+	{
+		for(unsigned int d=0; d<Dimension; ++d) {
+			result.lower[d] = (result.numOfChanged == 0) ? index[d] : std::min(result.lower[d], index[d]);
+			result.upper[d] = (result.numOfChanged == 0) ? index[d] : std::max(result.upper[d], index[d]);
+			if(m_CollectChangedVoxels)
+				result.changedVoxels.push_back(index[d] - m_Region.GetIndex()[d]);
+		}
+		++result.numOfChanged;
+	}
+
+	typename LabelImageType::ConstPointer	m_PreviousMask, m_CurrentMask;
+	bool									m_CollectChangedVoxels;
+	bool									m_StopAtFirstChange;
+	volatile bool							m_FoundChange;	//set by the first thread finding a change, with m_StopAtFirstChange.
+	RegionType								m_Region;
+
+	std::vector<ThreadResult>				m_ThreadResults;
+	itk::SizeValueType						m_NumberOfChangedVoxels;
+	RegionType								m_BoundingBox;
+	std::vector<unsigned int>				m_ChangedVoxels;
+};
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef MPI_CHUNKED_TRANSFER_H
+#define MPI_CHUNKED_TRANSFER_H
+
+/*
+    struct MpiChunkedTransfer
+        Broadcast and point to point transfers of arrays whose number of elements may not fit in the
+        int count of MPI (e.g. a vector image of a large domain): the array is sent in chunks of at most
+        chunkElements elements, in order. Returns the first MPI error, MPI_SUCCESS otherwise.
+*/
+#include <mpi.h>
+#include <cstddef>
+#include <algorithm>
+
+struct MpiChunkedTransfer
+{
+    enum { chunkElements = 1 << 26 };
+
+    static int bcast(void *buffer, size_t count, MPI_Datatype type, int root, MPI_Comm comm)
+    {
+        char *data = static_cast<char *>(buffer);
+        const size_t typeSize = sizeOf(type);
+        for(size_t done=0; done<count; done+=chunkElements) {
+            const int num = (int)std::min<size_t>(chunkElements, count-done);
+            const int err = MPI_Bcast(data + done*typeSize, num, type, root, comm);
+            if(err != MPI_SUCCESS) return err;
+        }
+        return MPI_SUCCESS;
+    }
+
+    static int send(const void *buffer, size_t count, MPI_Datatype type, int dest, int tag, MPI_Comm comm)
+    {
+        const char *data = static_cast<const char *>(buffer);
+        const size_t typeSize = sizeOf(type);
+        for(size_t done=0; done<count; done+=chunkElements) {
+            const int num = (int)std::min<size_t>(chunkElements, count-done);
+            const int err = MPI_Send(const_cast<char *>(data + done*typeSize), num, type, dest, tag, comm);
+            if(err != MPI_SUCCESS) return err;
+        }
+        return MPI_SUCCESS;
+    }
+
+    static int recv(void *buffer, size_t count, MPI_Datatype type, int source, int tag, MPI_Comm comm)
+    {
+        char *data = static_cast<char *>(buffer);
+        const size_t typeSize = sizeOf(type);
+        for(size_t done=0; done<count; done+=chunkElements) {
+            const int num = (int)std::min<size_t>(chunkElements, count-done);
+            const int err = MPI_Recv(data + done*typeSize, num, type, source, tag, comm, MPI_STATUS_IGNORE);
+            if(err != MPI_SUCCESS) return err;
+        }
+        return MPI_SUCCESS;
+    }
+
+private:
+    static size_t sizeOf(MPI_Datatype type)
+    {
+        int typeSize;
+        MPI_Type_size(type, &typeSize);
+        return typeSize;
+    }
+};
+
+#endif
@@ -8,6 +8,7 @@
 
 //base class solver for AdLem3D using Petsc.
 #include<string>
+#include<vector>
 #include<petscsys.h>
 #include<petscdm.h>
 #include<petscdmda.h>
@@ -17,6 +18,12 @@
 template <unsigned int DIM>
 class PetscAdLem3D {
 public:
+    // Where the solution and the rhs are made available to the model after a solve (-solution_layout).
+    enum SolutionLayout {
+        SOLUTION_REPLICATED,    //whole grid on every process.
+        SOLUTION_WRITER,        //whole grid on the first process only.
+        SOLUTION_SLAB           //owned part of the grid with one ghost layer on each process.
+    };
     PetscAdLem3D(AdLem3D<DIM>*, bool set12pointStencilForDiv, const std::string&);
     virtual ~PetscAdLem3D();
     void setContextName(const std::string&);
@@ -30,6 +37,50 @@ public:
     double getSolPressureAt(unsigned int pos[3]);
     double getDivergenceAt(unsigned int pos[3]);
     PetscErrorCode writeResidual(std::string resultPath);
+    SolutionLayout getSolutionLayout() const;
+    static SolutionLayout readSolutionLayout();  //from -solution_layout.
+    //Voxels of the model (start and size in each direction) at which the get*At() fxs can be called
+    //in this process. Empty in the processes other than the first with SOLUTION_WRITER.
+    void getSolutionRegion(PetscInt start[3], PetscInt size[3]);
+
+    // Image buffers filled by fillOutputBuffers(): arrays over the voxels [start, start+size) of the model,
+    // x fastest, in the value type of the model images. NULL for the outputs that are not required.
+    typedef typename AdLem3D<DIM>::PixelValueType OutputValueType;
+    typedef struct {
+        PetscInt        start[3], size[3];
+        OutputValueType *velocity;      //3 components per voxel, at the cell centre.
+        OutputValueType *pressure;
+        OutputValueType *divergence;
+        OutputValueType *force;         //3 components per voxel, the momentum rhs.
+    } OutputBuffers;
+    //Fused conversion of the staggered solution of the voxels [first, first+num) into all the required
+    //outputs in a single pass. The voxels must be in getSolutionRegion(). No PETSc call is done, so that
+    //it can run in several threads on disjoint voxels.
+    void fillOutputBuffers(const OutputBuffers& out, const PetscInt first[3], const PetscInt num[3]) const;
+    void fillOutputBuffers(const OutputBuffers& out, const PetscInt first[3], const PetscInt num[3],
+                           const PetscScalar *solArray, const PetscScalar *rhsArray,
+                           const PetscInt corner[3], const PetscInt dims[3]) const;
+
+    // Diagnostics of the last solution, computed by each process on its ghosted part of mX: divergence with
+    // the stencil of the continuity equation (9 or 12 point), Jacobian determinant of the displacement
+    // x -> x + v and its logarithm.
+    enum DiagnosticField { DIAG_DIVERGENCE = 0, DIAG_JACOBIAN, DIAG_LOG_JACOBIAN, DIAG_NUM_FIELDS };
+    PetscErrorCode computeDiagnostics();
+    //Gathers the diagnostics on the first process only: voxel values x fastest, DIAG_NUM_FIELDS per voxel.
+    //values is left empty in the other processes.
+    PetscErrorCode gatherDiagnostics(std::vector<double>& values);
+
+    // Output written with collective MPI-IO (writeFieldsToMha()): MetaImage files of size voxels, with the
+    // model domain starting at offset, and the geometry of the image. An empty file name skips the field.
+    typedef struct {
+        PetscInt    size[3], offset[3];
+        double      origin[3], spacing[3];
+        double      direction[9];   //row major.
+    } MhaGeometry;
+    typedef struct {
+        std::string velocity, pressure, force, divergence, jacobian, logJacobian;
+    } MhaFileNames;
+    PetscErrorCode writeFieldsToMha(const MhaFileNames& files, const MhaGeometry& geom);
 
 protected:
     AdLem3D<DIM>*            mProblemModel;
@@ -54,6 +105,21 @@ protected:
     VecScatter  mScatterRhsCtx; //context to scatter global mB to mBvLocal and mDivLocal.
     PetscScalar *mRhsArray;     //Array to access mBLocal.
 
+    SolutionLayout  mSolutionLayout;
+    PetscInt        mSolCorner[3];  //first staggered grid point stored in mSolArray and mRhsArray.
+    PetscInt        mSolDims[3];    //number of staggered grid points stored in each direction.
+    PetscInt        solIndex(PetscInt x, PetscInt y, PetscInt z, PetscInt c) const;
+    PetscErrorCode  setSolutionArrayGeometry();
+
+    DM          mDaDiag;        //DIAG_NUM_FIELDS dof DMDA with the partition of mDa, voxel x at grid point x.
+    Vec         mDiag;          //global vector of mDaDiag.
+    VecScatter  mScatterDiagCtx;    //natural ordered mDiag to the first process.
+    Vec         mDiagOnFirst;
+
+    void                    getOwnedVoxels(PetscInt first[3], PetscInt num[3]); //voxels of the owned grid points.
+    template <typename T>
+    PetscErrorCode          writeMhaBlock(const std::string& fileName, const MhaGeometry& geom, PetscInt numOfComps,
+                                          const PetscInt first[3], const PetscInt num[3], const std::vector<T>& block);
     PetscErrorCode          getSolutionArray(); //point mSol to proper solution vector mXLocal.
     PetscErrorCode          getRhsArray(); //point mRhs to proper rhs vector mBLocal.
 };
@@ -3,6 +3,9 @@
 #include "PetscAdLem3D.h"
 
 #include"AdLem3D.hxx"
+#include<limits>
+#include<cmath>
+#include<sstream>
 
 #undef __FUNCT__
 #define __FUNCT__ "PetscAdLem3D"
@@ -16,7 +19,32 @@ PetscAdLem3D<DIM>::PetscAdLem3D(AdLem3D<DIM> *model, bool set12pointStencilForDi
     mSolAllocated = PETSC_FALSE;
     mRhsAllocated = PETSC_FALSE;
     mIsMuConstant = (PetscBool)model->isMuConstant();
+    mScatterCtx = NULL;
+    mScatterRhsCtx = NULL;
+    mDaDiag = NULL;     mDiag = NULL;   mScatterDiagCtx = NULL;     mDiagOnFirst = NULL;
 
+    mSolutionLayout = readSolutionLayout();
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "readSolutionLayout"
+template <unsigned int DIM>
+typename PetscAdLem3D<DIM>::SolutionLayout PetscAdLem3D<DIM>::readSolutionLayout()
+{
+    PetscErrorCode  ierr;
+    char            layoutString[PETSC_MAX_PATH_LEN];
+    PetscBool       layoutFlag;
+    SolutionLayout  layout = SOLUTION_REPLICATED;
+    ierr = PetscOptionsGetString(NULL,"-solution_layout",layoutString,PETSC_MAX_PATH_LEN,&layoutFlag);CHKERRXX(ierr);
+    if(layoutFlag) {
+        if(strcmp(layoutString,"writer")==0)
+            layout = SOLUTION_WRITER;
+        else if(strcmp(layoutString,"slab")==0)
+            layout = SOLUTION_SLAB;
+        else if(strcmp(layoutString,"replicated")!=0)
+            throw "Unknown -solution_layout; use replicated, writer or slab.";
+    }
+    return layout;
 }
 
 template <unsigned int DIM>
@@ -34,6 +62,10 @@ PetscAdLem3D<DIM>::~PetscAdLem3D()
         ierr = VecScatterDestroy(&mScatterRhsCtx);CHKERRXX(ierr);
         ierr = VecDestroy(&mBLocal);CHKERRXX(ierr);
     }
+    ierr = VecScatterDestroy(&mScatterDiagCtx);CHKERRXX(ierr);
+    ierr = VecDestroy(&mDiagOnFirst);CHKERRXX(ierr);
+    ierr = VecDestroy(&mDiag);CHKERRXX(ierr);
+    ierr = DMDestroy(&mDaDiag);CHKERRXX(ierr);
     ierr = KSPDestroy(&mKsp);CHKERRXX(ierr);
     ierr = DMDestroy(&mDa);CHKERRXX(ierr);
 }
@@ -84,20 +116,40 @@ PetscErrorCode PetscAdLem3D<DIM>::writeResidual(std::string resultPath)
 
 #undef __FUNCT__
 #define __FUNCT__ "getSolutionArray"
+//SOLUTION_REPLICATED and SOLUTION_WRITER gather mX in the natural ordering to all the processes or to
+//the first one, SOLUTION_SLAB only updates the ghosted local vector of mDa.
 template <unsigned int DIM>
 PetscErrorCode PetscAdLem3D<DIM>::getSolutionArray()
 {
     PetscErrorCode ierr;
-    Vec xNatural;
-    ierr = DMDACreateNaturalVector(mDa,&xNatural);CHKERRQ(ierr);
-    ierr = DMDAGlobalToNaturalBegin(mDa,mX,INSERT_VALUES,xNatural);CHKERRQ(ierr);
-    ierr = DMDAGlobalToNaturalEnd(mDa,mX,INSERT_VALUES,xNatural);CHKERRQ(ierr);
-    if(!mSolAllocated)
-        ierr = VecScatterCreateToAll(xNatural,&mScatterCtx,&mXLocal);CHKERRQ(ierr);
-    ierr = VecScatterBegin(mScatterCtx,xNatural,mXLocal,INSERT_VALUES,SCATTER_FORWARD);CHKERRQ(ierr);
-    ierr = VecScatterEnd(mScatterCtx,xNatural,mXLocal,INSERT_VALUES,SCATTER_FORWARD);CHKERRQ(ierr);
+    PetscFunctionBeginUser;
+    ierr = setSolutionArrayGeometry();CHKERRQ(ierr);
+    if(mSolAllocated) {
+        ierr = VecRestoreArray(mXLocal,&mSolArray);CHKERRQ(ierr);
+    }
+    if(mSolutionLayout == SOLUTION_SLAB) {
+        if(!mSolAllocated) {
+            ierr = DMCreateLocalVector(mDa,&mXLocal);CHKERRQ(ierr);
+        }
+        ierr = DMGlobalToLocalBegin(mDa,mX,INSERT_VALUES,mXLocal);CHKERRQ(ierr);
+        ierr = DMGlobalToLocalEnd(mDa,mX,INSERT_VALUES,mXLocal);CHKERRQ(ierr);
+    } else {
+        Vec xNatural;
+        ierr = DMDACreateNaturalVector(mDa,&xNatural);CHKERRQ(ierr);
+        ierr = DMDAGlobalToNaturalBegin(mDa,mX,INSERT_VALUES,xNatural);CHKERRQ(ierr);
+        ierr = DMDAGlobalToNaturalEnd(mDa,mX,INSERT_VALUES,xNatural);CHKERRQ(ierr);
+        if(!mSolAllocated) {
+            if(mSolutionLayout == SOLUTION_WRITER)
+                ierr = VecScatterCreateToZero(xNatural,&mScatterCtx,&mXLocal);
+            else
+                ierr = VecScatterCreateToAll(xNatural,&mScatterCtx,&mXLocal);
+            CHKERRQ(ierr);
+        }
+        ierr = VecScatterBegin(mScatterCtx,xNatural,mXLocal,INSERT_VALUES,SCATTER_FORWARD);CHKERRQ(ierr);
+        ierr = VecScatterEnd(mScatterCtx,xNatural,mXLocal,INSERT_VALUES,SCATTER_FORWARD);CHKERRQ(ierr);
+        ierr = VecDestroy(&xNatural);CHKERRQ(ierr);
+    }
     ierr = VecGetArray(mXLocal,&mSolArray);CHKERRQ(ierr);
-    ierr = VecDestroy(&xNatural);CHKERRQ(ierr);
     //    ierr = VecView(mXLocal,PETSC_VIEWER_STDOUT_WORLD);CHKERRQ(ierr);
     mSolAllocated = PETSC_TRUE;
     PetscFunctionReturn(0);
@@ -109,21 +161,433 @@ template <unsigned int DIM>
 PetscErrorCode PetscAdLem3D<DIM>::getRhsArray()
 {
     PetscErrorCode ierr;
-    Vec bNatural;
-    ierr = DMDACreateNaturalVector(mDa,&bNatural);CHKERRQ(ierr);
-    ierr = DMDAGlobalToNaturalBegin(mDa,mB,INSERT_VALUES,bNatural);CHKERRQ(ierr);
-    ierr = DMDAGlobalToNaturalEnd(mDa,mB,INSERT_VALUES,bNatural);CHKERRQ(ierr);
-    if(!mRhsAllocated)
-        ierr = VecScatterCreateToAll(bNatural,&mScatterRhsCtx,&mBLocal);CHKERRQ(ierr);
-    ierr = VecScatterBegin(mScatterRhsCtx,bNatural,mBLocal,INSERT_VALUES,SCATTER_FORWARD);CHKERRQ(ierr);
-    ierr = VecScatterEnd(mScatterRhsCtx,bNatural,mBLocal,INSERT_VALUES,SCATTER_FORWARD);CHKERRQ(ierr);
+    PetscFunctionBeginUser;
+    ierr = setSolutionArrayGeometry();CHKERRQ(ierr);
+    if(mRhsAllocated) {
+        ierr = VecRestoreArray(mBLocal,&mRhsArray);CHKERRQ(ierr);
+    }
+    if(mSolutionLayout == SOLUTION_SLAB) {
+        if(!mRhsAllocated) {
+            ierr = DMCreateLocalVector(mDa,&mBLocal);CHKERRQ(ierr);
+        }
+        ierr = DMGlobalToLocalBegin(mDa,mB,INSERT_VALUES,mBLocal);CHKERRQ(ierr);
+        ierr = DMGlobalToLocalEnd(mDa,mB,INSERT_VALUES,mBLocal);CHKERRQ(ierr);
+    } else {
+        Vec bNatural;
+        ierr = DMDACreateNaturalVector(mDa,&bNatural);CHKERRQ(ierr);
+        ierr = DMDAGlobalToNaturalBegin(mDa,mB,INSERT_VALUES,bNatural);CHKERRQ(ierr);
+        ierr = DMDAGlobalToNaturalEnd(mDa,mB,INSERT_VALUES,bNatural);CHKERRQ(ierr);
+        if(!mRhsAllocated) {
+            if(mSolutionLayout == SOLUTION_WRITER)
+                ierr = VecScatterCreateToZero(bNatural,&mScatterRhsCtx,&mBLocal);
+            else
+                ierr = VecScatterCreateToAll(bNatural,&mScatterRhsCtx,&mBLocal);
+            CHKERRQ(ierr);
+        }
+        ierr = VecScatterBegin(mScatterRhsCtx,bNatural,mBLocal,INSERT_VALUES,SCATTER_FORWARD);CHKERRQ(ierr);
+        ierr = VecScatterEnd(mScatterRhsCtx,bNatural,mBLocal,INSERT_VALUES,SCATTER_FORWARD);CHKERRQ(ierr);
+        ierr = VecDestroy(&bNatural);CHKERRQ(ierr);
+    }
     ierr = VecGetArray(mBLocal,&mRhsArray);CHKERRQ(ierr);
-    ierr = VecDestroy(&bNatural);CHKERRQ(ierr);
     //    ierr = VecView(mBLocal,PETSC_VIEWER_STDOUT_WORLD);CHKERRQ(ierr);
     mRhsAllocated = PETSC_TRUE;
     PetscFunctionReturn(0);
 }
 
+#undef __FUNCT__
+#define __FUNCT__ "setSolutionArrayGeometry"
+template <unsigned int DIM>
+PetscErrorCode PetscAdLem3D<DIM>::setSolutionArrayGeometry()
+{
+    PetscErrorCode ierr;
+    PetscFunctionBeginUser;
+    if(mSolutionLayout == SOLUTION_SLAB) {
+        ierr = DMDAGetGhostCorners(mDa,&mSolCorner[0],&mSolCorner[1],&mSolCorner[2],
+                                   &mSolDims[0],&mSolDims[1],&mSolDims[2]);CHKERRQ(ierr);
+    } else {
+        mSolCorner[0] = mSolCorner[1] = mSolCorner[2] = 0;
+        mSolDims[0] = mProblemModel->getXnum()+1;
+        mSolDims[1] = mProblemModel->getYnum()+1;
+        mSolDims[2] = mProblemModel->getZnum()+1;
+    }
+    PetscFunctionReturn(0);
+}
+
+//Position of the component c of the staggered grid point (x,y,z) in mSolArray and mRhsArray.
+template <unsigned int DIM>
+PetscInt PetscAdLem3D<DIM>::solIndex(PetscInt x, PetscInt y, PetscInt z, PetscInt c) const
+{
+    return ((x-mSolCorner[0]) + mSolDims[0]*((y-mSolCorner[1]) + mSolDims[1]*(z-mSolCorner[2])))*4 + c;
+}
+
+template <unsigned int DIM>
+typename PetscAdLem3D<DIM>::SolutionLayout PetscAdLem3D<DIM>::getSolutionLayout() const
+{
+    return mSolutionLayout;
+}
+
+template <unsigned int DIM>
+void PetscAdLem3D<DIM>::fillOutputBuffers(const OutputBuffers& out, const PetscInt first[3], const PetscInt num[3]) const
+{
+    fillOutputBuffers(out,first,num,mSolArray,mRhsArray,mSolCorner,mSolDims);
+}
+
+//sol and rhs: 4 dof arrays of the staggered grid points [corner, corner+dims).
+template <unsigned int DIM>
+void PetscAdLem3D<DIM>::fillOutputBuffers(const OutputBuffers& out, const PetscInt first[3], const PetscInt num[3],
+                                          const PetscScalar *solArray, const PetscScalar *rhsArray,
+                                          const PetscInt corner[3], const PetscInt dims[3]) const
+{
+    //offsets of the next staggered grid point in x, y and z.
+    const PetscInt dx = 4;
+    const PetscInt dy = 4*dims[0];
+    const PetscInt dz = 4*dims[0]*dims[1];
+    const double hxInv = 1./mProblemModel->getXspacing();
+    const double hyInv = 1./mProblemModel->getYspacing();
+    const double hzInv = 1./mProblemModel->getZspacing();
+    for(PetscInt z=first[2]; z<first[2]+num[2]; ++z) {
+        for(PetscInt y=first[1]; y<first[1]+num[1]; ++y) {
+            PetscInt s = ((first[0]-corner[0]) + dims[0]*((y-corner[1]) + dims[1]*(z-corner[2])))*4;
+            PetscInt o = (first[0]-out.start[0]) + out.size[0]*((y-out.start[1]) + out.size[1]*(z-out.start[2]));
+            for(PetscInt x=first[0]; x<first[0]+num[0]; ++x, s+=dx, ++o) {
+                const PetscScalar *sol = solArray + s;
+                if(out.velocity) { //faces x and x+1 for vx, y and y+1 for vy, z and z+1 for vz.
+                    out.velocity[3*o]   = (sol[0] + sol[dx])/2.;
+                    out.velocity[3*o+1] = (sol[1] + sol[dy+1])/2.;
+                    out.velocity[3*o+2] = (sol[2] + sol[dz+2])/2.;
+                }
+                if(out.pressure) //pressure of the voxel x is at the grid point x+1.
+                    out.pressure[o] = sol[dx+dy+dz+3];
+                if(out.divergence)
+                    out.divergence[o] = (sol[dx]-sol[0])*hxInv + (sol[dy+1]-sol[1])*hyInv + (sol[dz+2]-sol[2])*hzInv;
+                if(out.force) {
+                    out.force[3*o]   = rhsArray[s];
+                    out.force[3*o+1] = rhsArray[s+1];
+                    out.force[3*o+2] = rhsArray[s+2];
+                }
+            }
+        }
+    }
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "computeDiagnostics"
+/*For the voxel x, the Taras cell x+1: the velocity component t lies on the faces x and x+e_t of the
+ grid. The divergence follows the continuity rows of the operator, including the truncation of the
+ 12 point stencil near the walls. For the Jacobian, the diagonal derivatives are the same staggered
+ differences and the others are centred differences of the cell centred velocity, one sided at the
+ first and last voxel. The ghost layer of mDa (2 with the 12 point stencil) covers all the terms.*/
+template <unsigned int DIM>
+PetscErrorCode PetscAdLem3D<DIM>::computeDiagnostics()
+{
+    PetscErrorCode  ierr;
+    PetscInt        xs,ys,zs,xm,ym,zm,numOfFolds = 0,totalFolds;
+    PetscScalar     ****x, ****diag;
+    Vec             xLocal;
+    PetscFunctionBeginUser;
+
+    if(!mDaDiag) {
+        const PetscInt  *lx, *ly, *lz;
+        PetscInt        mx,my,mz,px,py,pz;
+        ierr = DMDAGetInfo(mDa,0,&mx,&my,&mz,&px,&py,&pz,0,0,0,0,0,0);CHKERRQ(ierr);
+        ierr = DMDAGetOwnershipRanges(mDa,&lx,&ly,&lz);CHKERRQ(ierr);
+        ierr = DMDACreate3d(PETSC_COMM_WORLD,DM_BOUNDARY_NONE,DM_BOUNDARY_NONE,DM_BOUNDARY_NONE,DMDA_STENCIL_BOX,
+                            mx,my,mz,px,py,pz,DIAG_NUM_FIELDS,0,lx,ly,lz,&mDaDiag);CHKERRQ(ierr);
+        ierr = DMCreateGlobalVector(mDaDiag,&mDiag);CHKERRQ(ierr);
+    }
+    const PetscInt  num[3] = {mProblemModel->getXnum(), mProblemModel->getYnum(), mProblemModel->getZnum()};
+    const PetscReal hInv[3] = {1./mProblemModel->getXspacing(), 1./mProblemModel->getYspacing(),
+                               1./mProblemModel->getZspacing()};
+
+    ierr = DMGetLocalVector(mDa,&xLocal);CHKERRQ(ierr);
+    ierr = DMGlobalToLocalBegin(mDa,mX,INSERT_VALUES,xLocal);CHKERRQ(ierr);
+    ierr = DMGlobalToLocalEnd(mDa,mX,INSERT_VALUES,xLocal);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(mDa,xLocal,&x);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(mDaDiag,mDiag,&diag);CHKERRQ(ierr);
+    ierr = DMDAGetCorners(mDa,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
+    for (PetscInt k=zs; k<PetscMin(zs+zm,num[2]); ++k) {
+        for (PetscInt j=ys; j<PetscMin(ys+ym,num[1]); ++j) {
+            for (PetscInt i=xs; i<PetscMin(xs+xm,num[0]); ++i) {
+                const PetscInt p[3] = {i, j, k};
+                PetscReal grad[3][3];   //grad[c][t]: derivative of the component c in the direction t.
+                PetscReal div = 0;
+                for (PetscInt c=0; c<3; ++c) {
+                    PetscInt e[3] = {0, 0, 0};
+                    e[c] = 1;
+                    grad[c][c] = (x[k+e[2]][j+e[1]][i+e[0]][c] - x[k][j][i][c])*hInv[c];
+                    if(isDiv12pointStencil()) { //pos[t] of the continuity row is the Taras cell p[c]+1.
+                        PetscScalar d = x[k+e[2]][j+e[1]][i+e[0]][c] - x[k][j][i][c];
+                        if(p[c]+1 < num[c]-1)
+                            d += x[k+2*e[2]][j+2*e[1]][i+2*e[0]][c];
+                        if(p[c]+1 > 2)
+                            d -= x[k-e[2]][j-e[1]][i-e[0]][c];
+                        div += d*hInv[c]/4.;
+                    } else {
+                        div += grad[c][c];
+                    }
+                    for (PetscInt t=0; t<3; ++t) {
+                        if(t == c)
+                            continue;
+                        PetscInt f[3] = {0, 0, 0};
+                        const PetscInt lo = (p[t] > 0) ? -1 : 0;
+                        const PetscInt hi = (p[t] < num[t]-1) ? 1 : 0;
+                        f[t] = hi;
+                        PetscReal uHi = (x[k+f[2]][j+f[1]][i+f[0]][c] + x[k+f[2]+e[2]][j+f[1]+e[1]][i+f[0]+e[0]][c])/2.;
+                        f[t] = lo;
+                        PetscReal uLo = (x[k+f[2]][j+f[1]][i+f[0]][c] + x[k+f[2]+e[2]][j+f[1]+e[1]][i+f[0]+e[0]][c])/2.;
+                        grad[c][t] = (hi > lo) ? (uHi - uLo)*hInv[t]/(hi-lo) : 0;
+                    }
+                }
+                for (PetscInt c=0; c<3; ++c)
+                    grad[c][c] += 1;
+                const PetscReal jac = grad[0][0]*(grad[1][1]*grad[2][2] - grad[1][2]*grad[2][1])
+                    - grad[0][1]*(grad[1][0]*grad[2][2] - grad[1][2]*grad[2][0])
+                    + grad[0][2]*(grad[1][0]*grad[2][1] - grad[1][1]*grad[2][0]);
+                diag[k][j][i][DIAG_DIVERGENCE] = div;
+                diag[k][j][i][DIAG_JACOBIAN] = jac;
+                if(jac > 0) {
+                    diag[k][j][i][DIAG_LOG_JACOBIAN] = log(jac);
+                } else { //folding: the logarithm is not defined.
+                    diag[k][j][i][DIAG_LOG_JACOBIAN] = std::numeric_limits<PetscReal>::quiet_NaN();
+                    ++numOfFolds;
+                }
+            }
+        }
+    }
+    ierr = DMDAVecRestoreArrayDOF(mDaDiag,mDiag,&diag);CHKERRQ(ierr);
+    ierr = DMDAVecRestoreArrayDOF(mDa,xLocal,&x);CHKERRQ(ierr);
+    ierr = DMRestoreLocalVector(mDa,&xLocal);CHKERRQ(ierr);
+    ierr = MPI_Allreduce(&numOfFolds,&totalFolds,1,MPIU_INT,MPI_SUM,PETSC_COMM_WORLD);CHKERRQ(ierr);
+    if(totalFolds > 0)
+        PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n WARNING: non-positive Jacobian determinant in %d voxels, log-Jacobian set to NaN there\n",
+                                totalFolds);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "gatherDiagnostics"
+template <unsigned int DIM>
+PetscErrorCode PetscAdLem3D<DIM>::gatherDiagnostics(std::vector<double>& values)
+{
+    PetscErrorCode      ierr;
+    PetscMPIInt         rank;
+    Vec                 diagNatural;
+    const PetscScalar   *d;
+    PetscFunctionBeginUser;
+
+    ierr = DMDACreateNaturalVector(mDaDiag,&diagNatural);CHKERRQ(ierr);
+    ierr = DMDAGlobalToNaturalBegin(mDaDiag,mDiag,INSERT_VALUES,diagNatural);CHKERRQ(ierr);
+    ierr = DMDAGlobalToNaturalEnd(mDaDiag,mDiag,INSERT_VALUES,diagNatural);CHKERRQ(ierr);
+    if(!mScatterDiagCtx) {
+        ierr = VecScatterCreateToZero(diagNatural,&mScatterDiagCtx,&mDiagOnFirst);CHKERRQ(ierr);
+    }
+    ierr = VecScatterBegin(mScatterDiagCtx,diagNatural,mDiagOnFirst,INSERT_VALUES,SCATTER_FORWARD);CHKERRQ(ierr);
+    ierr = VecScatterEnd(mScatterDiagCtx,diagNatural,mDiagOnFirst,INSERT_VALUES,SCATTER_FORWARD);CHKERRQ(ierr);
+    ierr = VecDestroy(&diagNatural);CHKERRQ(ierr);
+
+    values.clear();
+    ierr = MPI_Comm_rank(PETSC_COMM_WORLD,&rank);CHKERRQ(ierr);
+    if(rank == 0) { //drop the last grid point in each direction, it has no voxel.
+        const PetscInt xn = mProblemModel->getXnum(), yn = mProblemModel->getYnum(), zn = mProblemModel->getZnum();
+        values.reserve(xn*yn*zn*DIAG_NUM_FIELDS);
+        ierr = VecGetArrayRead(mDiagOnFirst,&d);CHKERRQ(ierr);
+        for (PetscInt k=0; k<zn; ++k)
+            for (PetscInt j=0; j<yn; ++j)
+                for (PetscInt i=0; i<xn; ++i)
+                    for (PetscInt c=0; c<DIAG_NUM_FIELDS; ++c)
+                        values.push_back(d[((i + (xn+1)*(j + (yn+1)*k))*DIAG_NUM_FIELDS) + c]);
+        ierr = VecRestoreArrayRead(mDiagOnFirst,&d);CHKERRQ(ierr);
+    }
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "writeFieldsToMha"
+/*Writes the selected fields of the last solution to MetaImage files with collective MPI-IO: each
+ process writes the voxels of its owned grid points, computed from the ghosted local parts of mX and
+ mB (velocity, pressure, force) or from computeDiagnostics(), and nothing is gathered.*/
+template <unsigned int DIM>
+PetscErrorCode PetscAdLem3D<DIM>::writeFieldsToMha(const MhaFileNames& files, const MhaGeometry& geom)
+{
+    PetscErrorCode  ierr;
+    PetscInt        first[3], num[3], corner[3], dims[3];
+    PetscFunctionBeginUser;
+
+    getOwnedVoxels(first,num);
+    const PetscInt numOfVoxels = num[0]*num[1]*num[2];
+    if(!files.velocity.empty() || !files.pressure.empty() || !files.force.empty()) {
+        Vec                 xLocal, bLocal;
+        const PetscScalar   *x, *b;
+        std::vector<OutputValueType> velocity, pressure, force;
+        OutputBuffers       out;
+        for(int d=0; d<3; ++d) {
+            out.start[d] = first[d];
+            out.size[d] = num[d];
+        }
+        if(!files.velocity.empty()) velocity.resize(3*numOfVoxels);
+        if(!files.pressure.empty()) pressure.resize(numOfVoxels);
+        if(!files.force.empty()) force.resize(3*numOfVoxels);
+        out.velocity = (velocity.empty()) ? NULL : &velocity[0];
+        out.pressure = (pressure.empty()) ? NULL : &pressure[0];
+        out.divergence = NULL;
+        out.force = (force.empty()) ? NULL : &force[0];
+
+        ierr = DMGetLocalVector(mDa,&xLocal);CHKERRQ(ierr);
+        ierr = DMGetLocalVector(mDa,&bLocal);CHKERRQ(ierr);
+        ierr = DMGlobalToLocalBegin(mDa,mX,INSERT_VALUES,xLocal);CHKERRQ(ierr);
+        ierr = DMGlobalToLocalEnd(mDa,mX,INSERT_VALUES,xLocal);CHKERRQ(ierr);
+        ierr = DMGlobalToLocalBegin(mDa,mB,INSERT_VALUES,bLocal);CHKERRQ(ierr);
+        ierr = DMGlobalToLocalEnd(mDa,mB,INSERT_VALUES,bLocal);CHKERRQ(ierr);
+        ierr = DMDAGetGhostCorners(mDa,&corner[0],&corner[1],&corner[2],&dims[0],&dims[1],&dims[2]);CHKERRQ(ierr);
+        ierr = VecGetArrayRead(xLocal,&x);CHKERRQ(ierr);
+        ierr = VecGetArrayRead(bLocal,&b);CHKERRQ(ierr);
+        if(numOfVoxels > 0)
+            fillOutputBuffers(out,first,num,x,b,corner,dims);
+        ierr = VecRestoreArrayRead(bLocal,&b);CHKERRQ(ierr);
+        ierr = VecRestoreArrayRead(xLocal,&x);CHKERRQ(ierr);
+        ierr = DMRestoreLocalVector(mDa,&bLocal);CHKERRQ(ierr);
+        ierr = DMRestoreLocalVector(mDa,&xLocal);CHKERRQ(ierr);
+
+        if(!files.velocity.empty()) {
+            ierr = writeMhaBlock(files.velocity,geom,3,first,num,velocity);CHKERRQ(ierr);
+        }
+        if(!files.pressure.empty()) {
+            ierr = writeMhaBlock(files.pressure,geom,1,first,num,pressure);CHKERRQ(ierr);
+        }
+        if(!files.force.empty()) {
+            ierr = writeMhaBlock(files.force,geom,3,first,num,force);CHKERRQ(ierr);
+        }
+    }
+
+    const std::string *diagFiles[DIAG_NUM_FIELDS] = {&files.divergence, &files.jacobian, &files.logJacobian};
+    if(!files.divergence.empty() || !files.jacobian.empty() || !files.logJacobian.empty()) {
+        PetscScalar         ****diag;
+        std::vector<double> field(numOfVoxels);
+        ierr = computeDiagnostics();CHKERRQ(ierr);
+        for(PetscInt c=0; c<DIAG_NUM_FIELDS; ++c) {
+            if(diagFiles[c]->empty())
+                continue;
+            ierr = DMDAVecGetArrayDOF(mDaDiag,mDiag,&diag);CHKERRQ(ierr);
+            PetscInt n = 0;
+            for (PetscInt k=first[2]; k<first[2]+num[2]; ++k)
+                for (PetscInt j=first[1]; j<first[1]+num[1]; ++j)
+                    for (PetscInt i=first[0]; i<first[0]+num[0]; ++i)
+                        field[n++] = diag[k][j][i][c];
+            ierr = DMDAVecRestoreArrayDOF(mDaDiag,mDiag,&diag);CHKERRQ(ierr);
+            ierr = writeMhaBlock(*diagFiles[c],geom,1,first,num,field);CHKERRQ(ierr);
+        }
+    }
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "writeMhaBlock"
+/*The first process writes the MetaImage header (data in the same file, ElementDataFile = LOCAL),
+ then all the processes write their block [first, first+num) of the model voxels, numOfComps values
+ per voxel, at the position geom.offset+first of the image with a collective write. The file is
+ truncated and sized first, so that the voxels outside the model domain read as zero.*/
+template <unsigned int DIM>
+template <typename T>
+PetscErrorCode PetscAdLem3D<DIM>::writeMhaBlock(const std::string& fileName, const MhaGeometry& geom, PetscInt numOfComps,
+                                                const PetscInt first[3], const PetscInt num[3], const std::vector<T>& block)
+{
+    PetscErrorCode  ierr;
+    PetscMPIInt     rank;
+    MPI_File        fh;
+    MPI_Datatype    fileType;
+    MPI_Status      status;
+    long            headerLength = 0;
+    const bool      isFloat = (sizeof(T) == sizeof(float));
+    const MPI_Datatype valueType = (isFloat) ? MPI_FLOAT : MPI_DOUBLE;
+    PetscFunctionBeginUser;
+
+    ierr = MPI_Comm_rank(PETSC_COMM_WORLD,&rank);CHKERRQ(ierr);
+    std::string header;
+    if(rank == 0) {
+        const int one = 1;
+        const bool isLittleEndian = (*reinterpret_cast<const char*>(&one) == 1);
+        std::ostringstream hs;
+        hs.precision(17);
+        hs<<"ObjectType = Image\nNDims = 3\nBinaryData = True\n";
+        hs<<"BinaryDataByteOrderMSB = "<<((isLittleEndian) ? "False" : "True")<<"\nCompressedData = False\n";
+        hs<<"TransformMatrix =";
+        for(int d=0; d<9; ++d) //direction of each axis in turn, as written by itk::MetaImageIO.
+            hs<<" "<<geom.direction[(d%3)*3 + d/3];
+        hs<<"\nOffset = "<<geom.origin[0]<<" "<<geom.origin[1]<<" "<<geom.origin[2];
+        hs<<"\nCenterOfRotation = 0 0 0";
+        hs<<"\nElementSpacing = "<<geom.spacing[0]<<" "<<geom.spacing[1]<<" "<<geom.spacing[2];
+        hs<<"\nDimSize = "<<geom.size[0]<<" "<<geom.size[1]<<" "<<geom.size[2];
+        if(numOfComps > 1)
+            hs<<"\nElementNumberOfChannels = "<<numOfComps;
+        hs<<"\nElementType = "<<((isFloat) ? "MET_FLOAT" : "MET_DOUBLE")<<"\nElementDataFile = LOCAL\n";
+        header = hs.str();
+        headerLength = header.size();
+    }
+    ierr = MPI_Bcast(&headerLength,1,MPI_LONG,0,PETSC_COMM_WORLD);CHKERRQ(ierr);
+
+    ierr = MPI_File_open(PETSC_COMM_WORLD,const_cast<char*>(fileName.c_str()),MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                         MPI_INFO_NULL,&fh);CHKERRQ(ierr);
+    const MPI_Offset fileSize = headerLength
+        + (MPI_Offset)geom.size[0]*geom.size[1]*geom.size[2]*numOfComps*sizeof(T);
+    //MPI_MODE_CREATE keeps the content of an existing file: truncate it, so that the extension reads as zero.
+    ierr = MPI_File_set_size(fh,0);CHKERRQ(ierr);
+    ierr = MPI_File_set_size(fh,fileSize);CHKERRQ(ierr);
+    if(rank == 0) {
+        ierr = MPI_File_write_at(fh,0,const_cast<char*>(header.c_str()),(int)headerLength,MPI_CHAR,&status);CHKERRQ(ierr);
+    }
+
+    const PetscInt numOfValues = num[0]*num[1]*num[2]*numOfComps;
+    if(numOfValues > 0) { //z slowest: C order of (z, y, x*comps).
+        int sizes[3] = {(int)geom.size[2], (int)geom.size[1], (int)(geom.size[0]*numOfComps)};
+        int subSizes[3] = {(int)num[2], (int)num[1], (int)(num[0]*numOfComps)};
+        int starts[3] = {(int)(geom.offset[2]+first[2]), (int)(geom.offset[1]+first[1]),
+                         (int)((geom.offset[0]+first[0])*numOfComps)};
+        ierr = MPI_Type_create_subarray(3,sizes,subSizes,starts,MPI_ORDER_C,valueType,&fileType);CHKERRQ(ierr);
+    } else { //no voxel: takes part in the collective write with nothing.
+        ierr = MPI_Type_contiguous(1,valueType,&fileType);CHKERRQ(ierr);
+    }
+    ierr = MPI_Type_commit(&fileType);CHKERRQ(ierr);
+    ierr = MPI_File_set_view(fh,headerLength,valueType,fileType,const_cast<char*>("native"),MPI_INFO_NULL);CHKERRQ(ierr);
+    ierr = MPI_File_write_all(fh,(numOfValues > 0) ? const_cast<T*>(&block[0]) : NULL,(int)numOfValues,
+                              valueType,&status);CHKERRQ(ierr);
+    ierr = MPI_Type_free(&fileType);CHKERRQ(ierr);
+    ierr = MPI_File_close(&fh);CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+template <unsigned int DIM>
+void PetscAdLem3D<DIM>::getOwnedVoxels(PetscInt first[3], PetscInt num[3])
+{
+    PetscErrorCode  ierr;
+    const PetscInt  voxels[3] = {mProblemModel->getXnum(), mProblemModel->getYnum(), mProblemModel->getZnum()};
+    ierr = DMDAGetCorners(mDa,&first[0],&first[1],&first[2],&num[0],&num[1],&num[2]);CHKERRXX(ierr);
+    for(int d=0; d<3; ++d) //the last grid point has no voxel.
+        num[d] = PetscMax(PetscMin(first[d]+num[d],voxels[d])-first[d],0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "getSolutionRegion"
+//With SOLUTION_SLAB, the voxels of the owned grid points: their velocity, pressure and divergence need
+//at most the next grid point in each direction, which is in the ghost layer.
+template <unsigned int DIM>
+void PetscAdLem3D<DIM>::getSolutionRegion(PetscInt start[3], PetscInt size[3])
+{
+    PetscErrorCode  ierr;
+    PetscMPIInt     rank;
+    const PetscInt  num[3] = {mProblemModel->getXnum(), mProblemModel->getYnum(), mProblemModel->getZnum()};
+    for(int d=0; d<3; ++d) {
+        start[d] = 0;
+        size[d] = num[d];
+    }
+    if(mSolutionLayout == SOLUTION_SLAB) {
+        getOwnedVoxels(start,size);
+    } else if(mSolutionLayout == SOLUTION_WRITER) {
+        ierr = MPI_Comm_rank(PETSC_COMM_WORLD,&rank);CHKERRXX(ierr);
+        if(rank != 0)
+            size[0] = size[1] = size[2] = 0;
+    }
+}
+
 #undef __FUNCT__
 #define __FUNCT__ "getRhsAt"
 template <unsigned int DIM>
@@ -145,7 +609,7 @@ double PetscAdLem3D<DIM>::getRhsAt(unsigned int pos[], unsigned int component)
     //Here we provide staggered grid values themselves as they were used in the momentum
     //equations for each (i,j,k) cell centre.
     if(component == 0 || component == 1 || component == 2 || component == 3) {
-        PetscFunctionReturn(mRhsArray[(x+ xn*y + xn*yn*z)*4 + component]);
+        PetscFunctionReturn(mRhsArray[solIndex(x,y,z,component)]);
     } else
         SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_PLIB,"rhs component should be 0, 1, 2 or 3\n");
 }
@@ -172,14 +636,14 @@ double PetscAdLem3D<DIM>::getSolVelocityAt(unsigned int pos[], unsigned int comp
     //Velocity solution were computed at faces, so interpolate to get at cell centers.
     double solAtcenter;
     if (component == 0) { //x-component vx_c = vx(i,j,k) + vx(i+1,j,k)
-        solAtcenter = mSolArray[(x+ xn*y + xn*yn*z)*4 + component]
-                + mSolArray[(x+1 + xn*y + xn*yn*z)*4 + component];
+        solAtcenter = mSolArray[solIndex(x,y,z,component)]
+                + mSolArray[solIndex(x+1,y,z,component)];
     } else if (component == 1) {
-        solAtcenter = mSolArray[(x + xn*y + xn*yn*z)*4 + component]
-                + mSolArray[(x + xn*(y+1) + xn*yn*z)*4 + component];
+        solAtcenter = mSolArray[solIndex(x,y,z,component)]
+                + mSolArray[solIndex(x,y+1,z,component)];
     } else if (component == 2) {
-        solAtcenter = mSolArray[(x + xn*y + xn*yn*z)*4 + component]
-                + mSolArray[(x + xn*y + xn*yn*(z+1))*4 + component];
+        solAtcenter = mSolArray[solIndex(x,y,z,component)]
+                + mSolArray[solIndex(x,y,z+1,component)];
     } else
         SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_PLIB,"velocity component should be 0, 1 or 2 for 3D\n");
     PetscFunctionReturn(solAtcenter/2.);
@@ -200,7 +664,7 @@ double PetscAdLem3D<DIM>::getSolPressureAt(unsigned int pos[])
 
     if(x<1 || x>=xn || y<1 || y>=yn || z<1 || z>=zn) //<1 because 1 already added in this function!
         SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_ARG_OUTOFRANGE,"out of range position asked for pressure solution.\n");
-    PetscFunctionReturn(mSolArray[(x+ xn*y + xn*yn*z)*4 + 3]);
+    PetscFunctionReturn(mSolArray[solIndex(x,y,z,3)]);
 }
 
 #undef __FUNCT__
@@ -233,12 +697,12 @@ double PetscAdLem3D<DIM>::getDivergenceAt(unsigned int pos[])
     //Velocity solution were computed at faces, so the divergence lies in the cell centers.
     double divergence;
     //a = vx(i+1,j,k) - vx(i,j,k) + vy(i,j+1,k) - vy(i,j,k) + vz(i,j,k+1) - vz(i,j,k)
-    divergence = (mSolArray[(x+1 + xn*y + xn*yn*z)*4 + 0]
-		  -mSolArray[(x + xn*y + xn*yn*z)*4 + 0])/hx;
-    divergence += (mSolArray[(x + xn*(y+1) + xn*yn*z)*4 + 1]
-		   -mSolArray[(x + xn*y + xn*yn*z)*4 + 1])/hy;
-    divergence += (mSolArray[(x + xn*y + xn*yn*(z+1))*4 + 2]
-		   -mSolArray[(x + xn*y + xn*yn*z)*4 + 2])/hz;
+    divergence = (mSolArray[solIndex(x+1,y,z,0)]
+		  -mSolArray[solIndex(x,y,z,0)])/hx;
+    divergence += (mSolArray[solIndex(x,y+1,z,1)]
+		   -mSolArray[solIndex(x,y,z,1)])/hy;
+    divergence += (mSolArray[solIndex(x,y,z+1,2)]
+		   -mSolArray[solIndex(x,y,z,2)])/hz;
     PetscFunctionReturn(divergence);
 }
 
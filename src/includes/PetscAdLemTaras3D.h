@@ -10,12 +10,24 @@
 //#include<petscksp.h>
 //#include<petscdmda.h>
 #include<petscdmcomposite.h>
+#include<vector>
+#include<algorithm>
 
 namespace PetscAdLemTaras3D_SolverOps
 {
 
     const bool RELAX_IC_WITH_ZERO_ROWS = false;
     //const bool RELAX_IC_WITH_ZERO_ROWS = true;
+
+    // Bits of the cell classification stored in the coefficient cache.
+    const PetscInt CELL_GHOST          = 1;  //ghost cell of the staggered grid (i==0 || j==0 || k==0)
+    const PetscInt CELL_SKULL          = 2;  //brain mask has skull label
+    const PetscInt CELL_RELAX_IC       = 4;  //brain mask has relaxIc label
+    const PetscInt CELL_FALX           = 8;  //brain mask has falx cerebri label
+    const PetscInt CELL_ALL_NBRS_SKULL = 16; //all 6-neighbours are skull (set only in owned cells)
+
+    // Maximum number of nonzeros in a row of the operator: 12 point divergence and the pressure coefficient.
+    const PetscInt MAX_ROW_NNZ = 13;
 }
 
 //template <unsigned int DIM>
@@ -46,16 +58,34 @@ public:
     PetscReal lambdaYz(PetscInt x, PetscInt y, PetscInt z);
 
     PetscReal aC(PetscInt x, PetscInt y, PetscInt z);
-    PetscErrorCode solveModel(bool operatorChanged);
+    // changedVoxels: optional x,y,z triplets (model coordinates) of the mask voxels changed
+    // since the previous call; used for the incremental operator update.
+    PetscErrorCode solveModel(bool operatorChanged, const std::vector<unsigned int> *changedVoxels = NULL);
     PetscErrorCode writeToMatFile(const std::string& fileName, bool writeA, const std::string& matFileName);
+    // Warm start state (the stored solutions) in PETSc binary format, natural ordering, so that a
+    // restart may use a different number of processes.
+    PetscErrorCode saveState(const std::string& fileName);
+    PetscErrorCode loadState(const std::string& fileName);
     static PetscErrorCode computeMatrixTaras3d(KSP, Mat, Mat, void*);
     static PetscErrorCode computeRHSTaras3d(KSP, Vec, void*);
     static PetscErrorCode computeNullSpace(MatNullSpace, Vec, void*);
     static PetscErrorCode computeMatrixTaras3dConstantMu(KSP, Mat, Mat, void*);
     static PetscErrorCode computeRHSTaras3dConstantMu(KSP, Vec, void*);
+    static PetscErrorCode createOperatorMatrix(DM, Mat*);
+    static PetscErrorCode shellMult(Mat, Vec, Vec);
+    static PetscErrorCode shellGetDiagonal(Mat, Vec);
+    static PetscErrorCode shellGetSubMatrix(Mat, IS, IS, MatReuse, Mat*);
 
     PetscReal bMaskAt(PetscInt x, PetscInt y, PetscInt z);
 
+    // Fields of the cell-centred coefficient cache. CELL_LAMBDA is the scalar lambda, or the xx
+    // component of a tensor lambda whose 6 components are in the lambda store (cellLambda()).
+    enum CellCoeffField { CELL_MU = 0, CELL_ATROPHY, CELL_FLAGS, CELL_LAMBDA, CELL_NUM_FIELDS };
+    // Fields of the edge-centred viscosity cache (variable viscosity discretization only).
+    enum EdgeCoeffField { EDGE_MU_XY = 0, EDGE_MU_XZ, EDGE_MU_YZ, EDGE_NUM_FIELDS };
+    // Initial guess of the Krylov solve of each time step (-taras_initial_guess).
+    enum InitialGuess { INITIAL_GUESS_ZERO = 0, INITIAL_GUESS_PREVIOUS, INITIAL_GUESS_EXTRAPOLATE };
+
 protected:
     PetscInt	mNumOfSolveCalls;
     PetscBool   mParaVecsCreated;	//by default false but,
@@ -68,6 +98,7 @@ protected:
     PC              mPc;
     DM              mDaP;                    //DMDA for pressure variable.
     Mat             mPcForSc;               //Preconditioner matrix for the Schur Complement.
+    PetscBool       mSchurPreUser;          //-pc_fieldsplit_schur_precondition user: mPcForSc is used.
 
     Vec             mXv, mBv;               //vectors for the velocity field.
     Vec             mXp, mBp;               //vectors for the pressure field.
@@ -78,9 +109,143 @@ protected:
     Vec             mNullBasis;             //Null basis for the global system.
     Vec             mNullBasisP;            //Null basis for the pressure field.
 
+    // Coefficient cache: ghosted DMDA-local arrays with the same partition as mDa, filled
+    // once per mask/atrophy change and read directly by the assembly routines.
+    PetscBool       mCoeffCacheCreated;
+    PetscInt        mNumOfLambdaComps;      //1 for scalar, 6 (xx,xy,xz,yy,yz,zz) for tensor lambda.
+    DM              mDaCell;                //DMDA for the cell-centred coefficients.
+    Vec             mCellLocal;             //ghosted local vector of mDaCell.
+    PetscBool       mEdgeCacheLatest;       //false when edge cache must be recomputed.
+    DM              mDaEdge;                //DMDA for the edge-centred viscosity.
+    Vec             mEdgeLocal;             //ghosted local vector of mDaEdge.
+
     void            setNullSpace();
     PetscErrorCode  createParaVectors();
-    void            createPcForSc();        //Preconditioner for Schur Complement.
+    PetscErrorCode  updatePcForSc();        //Preconditioner for Schur Complement.
+
+    PetscErrorCode  createCoefficientCache();
+    PetscErrorCode  updateCoefficientCache(bool maskChanged, const std::vector<unsigned int> *changedVoxels = NULL);
+    void            fillMaskCoefficients(PetscScalar ****cell, PetscInt i, PetscInt j, PetscInt k);
+    void            setAllNbrsSkullFlag(PetscScalar ****cell, PetscInt i, PetscInt j, PetscInt k,
+                                        PetscInt mx, PetscInt my, PetscInt mz);
+    PetscErrorCode  updateEdgeCoefficientCache();
+    static PetscInt cellFlags(PetscScalar ****cell, PetscInt x, PetscInt y, PetscInt z);
+    static PetscInt lambdaComp(PetscInt Mi, PetscInt Mj);
+
+    // Lambda store: tensor lambda on the ghosted cells of mDaCell, read in place by the assembly
+    // and the rhs. Filled once, then the model releases its image.
+    DM                  mDaLambda;              //6 dof DMDA with the partition of mDaCell.
+    Vec                 mLambdaLocal;           //ghosted local vector of mDaLambda, NULL in float.
+    const PetscScalar   *mLambdaArray;          //read access to mLambdaLocal while the store exists.
+    PetscBool           mLambdaFloatStorage;    //-taras_lambda_float: single precision mLambdaFloat.
+    std::vector<float>  mLambdaFloat;
+    PetscInt            mLambdaCorner[3], mLambdaDims[3];   //ghost corners of mDaLambda.
+    PetscErrorCode      createLambdaStore();
+    PetscScalar         cellLambda(PetscInt i, PetscInt j, PetscInt k, PetscInt comp) const;
+
+    // Constants of the (piecewise) constant viscosity discretization used by operatorRow().
+    typedef struct {
+        PetscInt    mx, my, mz;
+        PetscReal   HyHzdHx, HxHzdHy, HxHydHz;
+        PetscReal   area[3];                //face areas normal to x, y and z.
+        PetscReal   hInv[3];                //reciprocal of the spacings.
+        PetscReal   kBond, kCont;
+        PetscBool   div12, skullBc, zeroVelAtFalx, slidingAtFalx, relaxIcInCsf;
+        PetscInt    falxZeroVelDir;
+        PetscReal   relaxIcCoeff;           //0 => 1/lambda is used.
+    } OperatorParams;
+
+    // Nonzero pattern of the rows owned by this process, in the DMDA global ordering
+    // (k,j,i,component). Columns of each row are sorted in increasing global index and
+    // mOpPerm maps the sorted position to the position in which operatorRow() emits it.
+    PetscBool                   mOpPatternCreated;
+    PetscBool                   mOpMatFromPattern;  //true if the KSP matrix is preallocated with this pattern.
+    std::vector<PetscInt>       mOpRowPtr;
+    std::vector<PetscInt>       mOpCols;
+    std::vector<unsigned char>  mOpPerm;
+
+    PetscBool       mMatrixFree;            //operator applied from the coefficient cache (-taras_matrix_free).
+    Vec             mShellXLocal;           //ghosted local vector of mDa used by the matrix-free product.
+    PetscBool       mOperatorRowsUpdated;   //mA refilled by updateOperatorRows(): the operator callback keeps it.
+
+    PetscErrorCode  getOperatorParams(DM da, OperatorParams& par);
+    PetscErrorCode  createOperatorPattern(DM da);
+    PetscErrorCode  fillOperatorRows(DM da, Mat jac, const std::vector<char> *pointMark);
+    PetscErrorCode  updateOperatorRows(const std::vector<unsigned int> &changedVoxels);
+    PetscErrorCode  createShellOperator(DM da, Mat *A);
+    static MatStencil stencilAt(PetscInt i, PetscInt j, PetscInt k, PetscInt c);
+    static PetscInt operatorRow(const OperatorParams& par, PetscScalar ****cell,
+                                PetscInt i, PetscInt j, PetscInt k, PetscInt c,
+                                MatStencil col[], PetscScalar v[]);
+    static bool     isFixedRow(const OperatorParams& par, PetscScalar ****cell,
+                               PetscInt i, PetscInt j, PetscInt k, PetscInt c, PetscScalar *diag);
+
+    // Geometric multigrid for the velocity block (-fieldsplit_0_pc_type mg). Grid g=0 is the
+    // Taras grid, whose operator is the velocity block of mA; grid g has the cells of grid g-1
+    // merged 2x2x2. The vectors are indexed by g and their entry 0 is not used.
+    PetscInt            mNumOfMgGrids;      //0 until the hierarchy is created.
+    std::vector<DM>     mMgDaV;             //3 dof velocity DMDA of each coarse grid.
+    std::vector<DM>     mMgDaCell;          //coefficient cache of each coarse grid, same layout as mDaCell.
+    std::vector<Vec>    mMgCellLocal;
+    std::vector<Mat>    mMgA;               //rediscretised velocity operator of each coarse grid.
+    std::vector<Mat>    mMgP;               //interpolation from grid g to grid g-1.
+
+    // Prefix sums of the ownership ranges of a DMDA, to get the global index of any grid point.
+    typedef struct {
+        std::vector<PetscInt>   x, y, z;
+        PetscInt                dof;
+    } DmdaOwnership;
+
+    // Preconditioner reuse across operator changes (-taras_pc_reuse): the preconditioner of the
+    // last fresh setup is kept until the iterations grow past mPcReuseFactor times those of that
+    // setup, or for at most mPcReuseMaxSteps solves.
+    PetscBool       mPcReuse;
+    PetscReal       mPcReuseFactor;
+    PetscInt        mPcReuseMaxSteps;
+    PetscInt        mPcSetupIterations;     //iterations of the last solve with a fresh preconditioner, 0 if none.
+    PetscInt        mPcReusedSteps;         //solves with a reused preconditioner since the last setup.
+    PetscBool       mPcReusedInSolve;       //true if the current solve reuses the preconditioner.
+    PetscBool       mPcRebuildRequested;    //iterations grew too much with the reused preconditioner.
+
+    PetscErrorCode  setPcReuse();
+    void            updatePcReuse(PetscInt numOfIterations, bool operatorUpdated);
+
+    // Warm start: the solutions of the last two solves are kept and the next solve starts from the
+    // previous one or from their linear extrapolation, with the unknowns fixed by the mask set to their value.
+    PetscInt        mInitialGuess;          //one of InitialGuess.
+    PetscInt        mNumOfStoredSolutions;  //solutions stored in mXPrev and mXPrev2, at most 2.
+    Vec             mXPrev, mXPrev2;        //solutions of the last and second last solve.
+
+    PetscErrorCode  computeInitialGuess(Vec guess, bool setFixedRows);
+    PetscErrorCode  storeSolution();
+
+    // Reduced system (-taras_reduced_system): the rows fixed to a known value by their diagonal
+    // coefficient alone (ghost layer, walls normal to the component, skull) are eliminated and
+    // only the remaining active rows are solved, with mKspR. mKsp only computes the operator.
+    PetscBool                   mReducedSystem;
+    KSP                         mKspR;
+    Mat                         mAR;                //active rows and columns of mA.
+    IS                          mIsActive;          //owned active rows in the mDa global ordering.
+    VecScatter                  mScatterR;          //mDa global vector to the active rows.
+    Vec                         mXR, mBR;
+    Vec                         mXFull, mBFull;     //full solution and rhs, owned by mKsp (see setUpReducedSystem()).
+    Vec                         mXFixed;            //values of the fixed rows, 0 in the active rows.
+    std::vector<PetscInt>       mFixedRows;         //owned fixed rows in the mDa global ordering.
+    std::vector<PetscScalar>    mFixedDiag;
+    Vec                         mNullBasisR;
+    MatNullSpace                mNullSpaceR;
+
+    PetscErrorCode  setUpReducedSystem();
+    PetscErrorCode  solveReducedSystem();
+
+    PetscErrorCode  setUpVelocityMultigrid(KSP kspV);
+    PetscErrorCode  createVelocityMultigridHierarchy(PetscInt numOfGrids);
+    PetscErrorCode  updateVelocityMultigrid();
+    PetscErrorCode  fillCoarseCoefficients(PetscInt g);
+    PetscErrorCode  fillCoarseOperator(PetscInt g);
+    PetscErrorCode  fillStaggeredInterpolation(PetscInt g);
+    static PetscErrorCode getDmdaOwnership(DM da, PetscInt dof, DmdaOwnership& own);
+    static PetscInt dmdaGlobalIndex(const DmdaOwnership& own, PetscInt i, PetscInt j, PetscInt k, PetscInt c);
 
     // Mi, Mj arguments added for matrix position for the dType that supports tensor.
     // Currently it is only supported for "lambda" dType. For others (Mi,Mj) value is not used.
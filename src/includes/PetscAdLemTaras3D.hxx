@@ -83,7 +83,11 @@ PetscAdLemTaras3D::PetscAdLemTaras3D(AdLem3D<3> *model, bool set12pointStencilFo
     //Linear Solver context:
     ierr = KSPCreate(PETSC_COMM_WORLD,&mKsp);CHKERRXX(ierr);
 
-    //    createPcForSc();
+    mPcForSc = NULL;
+    char        schurPreString[PETSC_MAX_PATH_LEN];
+    PetscBool   schurPreFlag;
+    ierr = PetscOptionsGetString(NULL,"-pc_fieldsplit_schur_precondition",schurPreString,PETSC_MAX_PATH_LEN,&schurPreFlag);CHKERRXX(ierr);
+    mSchurPreUser = (PetscBool)(schurPreFlag && strcmp(schurPreString,"user")==0);
 
 
     if(this->getProblemModel()->relaxIcInCsf()) //non-zero k => no null space present for pressure variable.
@@ -94,6 +98,61 @@ PetscAdLemTaras3D::PetscAdLemTaras3D(AdLem3D<3> *model, bool set12pointStencilFo
         setNullSpace();
     }
     mOperatorComputed = PETSC_FALSE;
+    mCoeffCacheCreated = PETSC_FALSE;
+    mEdgeCacheLatest = PETSC_FALSE;
+    mDaLambda = NULL;
+    mLambdaLocal = NULL;
+    mLambdaArray = NULL;
+    mLambdaFloatStorage = PETSC_FALSE;
+    ierr = PetscOptionsGetBool(NULL,"-taras_lambda_float",&mLambdaFloatStorage,NULL);CHKERRXX(ierr);
+
+    //Preallocate the operator with the exact nonzero pattern of the staggered discretization
+    //unless the default BOX stencil preallocation of the DMDA is asked for.
+    mOpPatternCreated = PETSC_FALSE;
+    mOpMatFromPattern = PETSC_FALSE;
+    PetscBool dmdaPrealloc = PETSC_FALSE;
+    ierr = PetscOptionsGetBool(NULL,"-taras_dmda_prealloc",&dmdaPrealloc,NULL);CHKERRXX(ierr);
+    mMatrixFree = PETSC_FALSE;
+    mShellXLocal = NULL;
+    mOperatorRowsUpdated = PETSC_FALSE;
+    ierr = PetscOptionsGetBool(NULL,"-taras_matrix_free",&mMatrixFree,NULL);CHKERRXX(ierr);
+    if(!dmdaPrealloc || mMatrixFree) {
+        ierr = DMSetApplicationContext(mDa,this);CHKERRXX(ierr);
+        ierr = DMDASetGetMatrix(mDa,createOperatorMatrix);CHKERRXX(ierr);
+    }
+    mNumOfMgGrids = 0;
+
+    mReducedSystem = PETSC_FALSE;
+    ierr = PetscOptionsGetBool(NULL,"-taras_reduced_system",&mReducedSystem,NULL);CHKERRXX(ierr);
+    mKspR = NULL;       mAR = NULL;         mIsActive = NULL;   mScatterR = NULL;
+    mXR = NULL;         mBR = NULL;         mXFull = NULL;      mBFull = NULL;
+    mXFixed = NULL;     mNullBasisR = NULL; mNullSpaceR = NULL;
+
+    mPcReuse = PETSC_FALSE;
+    mPcReuseFactor = 1.5;
+    mPcReuseMaxSteps = 5;
+    ierr = PetscOptionsGetBool(NULL,"-taras_pc_reuse",&mPcReuse,NULL);CHKERRXX(ierr);
+    ierr = PetscOptionsGetReal(NULL,"-taras_pc_reuse_factor",&mPcReuseFactor,NULL);CHKERRXX(ierr);
+    ierr = PetscOptionsGetInt(NULL,"-taras_pc_reuse_max_steps",&mPcReuseMaxSteps,NULL);CHKERRXX(ierr);
+    mPcSetupIterations = 0;
+    mPcReusedSteps = 0;
+    mPcReusedInSolve = PETSC_FALSE;
+    mPcRebuildRequested = PETSC_FALSE;
+
+    mInitialGuess = INITIAL_GUESS_ZERO;
+    char        guessString[PETSC_MAX_PATH_LEN];
+    PetscBool   guessFlag;
+    ierr = PetscOptionsGetString(NULL,"-taras_initial_guess",guessString,PETSC_MAX_PATH_LEN,&guessFlag);CHKERRXX(ierr);
+    if(guessFlag) {
+        if(strcmp(guessString,"previous")==0)
+            mInitialGuess = INITIAL_GUESS_PREVIOUS;
+        else if(strcmp(guessString,"extrapolate")==0)
+            mInitialGuess = INITIAL_GUESS_EXTRAPOLATE;
+        else if(strcmp(guessString,"zero")!=0)
+            throw "Unknown -taras_initial_guess; use zero, previous or extrapolate.";
+    }
+    mNumOfStoredSolutions = 0;
+    mXPrev = NULL;      mXPrev2 = NULL;
 }
 
 #undef __FUNCT__
@@ -112,7 +171,37 @@ PetscAdLemTaras3D::~PetscAdLemTaras3D()
         ierr = VecDestroy(&mNullBasisP);CHKERRXX(ierr);
         ierr = MatNullSpaceDestroy(&mNullSpaceP);CHKERRXX(ierr);
     }
-    //    ierr = MatDestroy(&mPcForSc);CHKERRXX(ierr);
+    if(mCoeffCacheCreated) {
+        ierr = VecDestroy(&mCellLocal);CHKERRXX(ierr);
+        ierr = DMDestroy(&mDaCell);CHKERRXX(ierr);
+        ierr = VecDestroy(&mEdgeLocal);CHKERRXX(ierr);
+        ierr = DMDestroy(&mDaEdge);CHKERRXX(ierr);
+    }
+    if(mLambdaArray) {
+        ierr = VecRestoreArrayRead(mLambdaLocal,&mLambdaArray);CHKERRXX(ierr);
+    }
+    ierr = VecDestroy(&mLambdaLocal);CHKERRXX(ierr);
+    ierr = DMDestroy(&mDaLambda);CHKERRXX(ierr);
+    ierr = VecDestroy(&mShellXLocal);CHKERRXX(ierr);
+    for(PetscInt g=1; g<mNumOfMgGrids; ++g) {
+        ierr = MatDestroy(&mMgP[g]);CHKERRXX(ierr);
+        ierr = MatDestroy(&mMgA[g]);CHKERRXX(ierr);
+        ierr = VecDestroy(&mMgCellLocal[g]);CHKERRXX(ierr);
+        ierr = DMDestroy(&mMgDaCell[g]);CHKERRXX(ierr);
+        ierr = DMDestroy(&mMgDaV[g]);CHKERRXX(ierr);
+    }
+    ierr = KSPDestroy(&mKspR);CHKERRXX(ierr);
+    ierr = MatDestroy(&mAR);CHKERRXX(ierr);
+    ierr = ISDestroy(&mIsActive);CHKERRXX(ierr);
+    ierr = VecScatterDestroy(&mScatterR);CHKERRXX(ierr);
+    ierr = VecDestroy(&mXR);CHKERRXX(ierr);
+    ierr = VecDestroy(&mBR);CHKERRXX(ierr);
+    ierr = VecDestroy(&mXFixed);CHKERRXX(ierr);
+    ierr = MatNullSpaceDestroy(&mNullSpaceR);CHKERRXX(ierr);
+    ierr = VecDestroy(&mXPrev);CHKERRXX(ierr);
+    ierr = VecDestroy(&mXPrev2);CHKERRXX(ierr);
+    ierr = VecDestroy(&mNullBasisR);CHKERRXX(ierr);
+    ierr = MatDestroy(&mPcForSc);CHKERRXX(ierr);
     ierr = DMDestroy(&mDaP);CHKERRXX(ierr);
 }
 
@@ -173,63 +262,100 @@ void PetscAdLemTaras3D::setNullSpace()
 }
 
 #undef __FUNCT__
-#define __FUNCT__ "createPcForSc"
-void PetscAdLemTaras3D::createPcForSc()
+#define __FUNCT__ "updatePcForSc"
+/*Diagonal preconditioner of the Schur complement S = C - B A^-1 G of the pressure, used with
+ -pc_fieldsplit_schur_precondition user. Since A is the viscous operator, B A^-1 G is spectrally
+ equivalent to the pressure mass matrix scaled by 1/mu, so each interior row gets 1/mu + k, with k
+ the pressure coefficient of the continuity row (relaxed IC in CSF, falx). The rows fixed by the
+ boundary conditions (ghost layer, corners, skull) get their own diagonal. Layout of mDaP, which has
+ the partition of mDa, so the rows match the pressure split. Called when the mask changes.*/
+PetscErrorCode PetscAdLemTaras3D::updatePcForSc()
 {
-    PetscInt        i,j,k,mx,my,mz,xm,ym,zm,xs,ys,zs;
-    PetscErrorCode ierr;
+    PetscErrorCode  ierr;
+    PetscInt        xs,ys,zs,xm,ym,zm,row;
+    PetscScalar     ****cell;
+    OperatorParams  par;
+    MatStencil      col[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
+    PetscScalar     v[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
     PetscFunctionBeginUser;
 
-    ierr = DMDAGetInfo(mDaP,0,&mx,&my,&mz,0,0,0,0,0,0,0,0,0);CHKERRXX(ierr);
-    ierr = DMDAGetCorners(mDaP,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRXX(ierr);
-
-    ierr = DMSetMatrixPreallocateOnly(mDaP,PETSC_TRUE);CHKERRXX(ierr);
-//    ierr = DMCreateMatrix(mDaP,MATMPIAIJ,&mPcForSc);CHKERRXX(ierr);
-    ierr = DMCreateMatrix(mDaP,&mPcForSc);CHKERRXX(ierr);
-
-
-    MatStencil row, col;
-    PetscReal v;
-    row.c = 0;
-    for (k=zs; k<zs+zm; ++k) {
-        for (j=ys; j<ys+ym; ++j) {
-            for (i=xs; i<xs+xm; ++i) {
-                /*if (i==0 || j==0 || k==0 //Ghost values
-                        || (i==1 && (j==1 || j==my-1 || k==1 || k==mz-1)) //four edges in x-start face.
-                        || (i==mx-1 && (j==1 || j==my-1 || k==1 || k==mz-1)) //four edges in x-end face.
-                        || (j==1 && (k==1 || k== mz-1)) //two edges in y-start face.
-                        || (j==my-1 && (k==1 || k==mz-1)) //two edges in y-end face
-                        ) {
-                    continue;
-                } else {
-                    ++mNumOfZeroDiag;
-                }*/
-                row.i = i;  row.j = j;  row.k = k;
-                col.i = i;  col.j = j;  col.k = k;
-                //                v = 1.0/muC(i,j,k);
-                v = 0;
-                if(!mPressureNullspacePresent) { //FIXME better to use whether we need to relax IC or not ?
-                    if(this->bMaskAt(i,j,k) == this->getProblemModel()->getRelaxIcLabel())
-                        v = this->getProblemModel()->getRelaxIcPressureCoeff();
+    ierr = DMDAGetCorners(mDaP,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
+    if(!mPcForSc) {
+        ierr = MatCreateAIJ(PETSC_COMM_WORLD,xm*ym*zm,xm*ym*zm,PETSC_DETERMINE,PETSC_DETERMINE,
+                            1,NULL,0,NULL,&mPcForSc);CHKERRQ(ierr);
+        ierr = MatSetOption(mPcForSc,MAT_NEW_NONZERO_ALLOCATION_ERR,PETSC_TRUE);CHKERRQ(ierr);
+    }
+    ierr = getOperatorParams(mDa,par);CHKERRQ(ierr);
+    ierr = MatGetOwnershipRange(mPcForSc,&row,NULL);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(mDaCell,mCellLocal,&cell);CHKERRQ(ierr);
+    for (PetscInt k=zs; k<zs+zm; ++k) {
+        for (PetscInt j=ys; j<ys+ym; ++j) {
+            for (PetscInt i=xs; i<xs+xm; ++i, ++row) {
+                //the pressure coefficient is the last entry of the continuity row.
+                const PetscInt nv = operatorRow(par,cell,i,j,k,3,col,v);
+                bool fixed = true;
+                for (PetscInt m=0; m<nv-1; ++m) {
+                    if(v[m] != 0)
+                        fixed = false;
                 }
-                MatSetValuesStencil(mPcForSc,1,&row,1,&col,&v,INSERT_VALUES);CHKERRXX(ierr);
+                PetscScalar diag = v[nv-1];
+                if(!fixed && cell[k][j][i][CELL_MU] > 0)
+                    diag += 1./cell[k][j][i][CELL_MU];
+                ierr = MatSetValues(mPcForSc,1,&row,1,&row,&diag,INSERT_VALUES);CHKERRQ(ierr);
             }
         }
     }
-    ierr = MatAssemblyBegin(mPcForSc,MAT_FINAL_ASSEMBLY);CHKERRXX(ierr);
-    ierr = MatAssemblyEnd(mPcForSc,MAT_FINAL_ASSEMBLY);CHKERRXX(ierr);
-    PetscFunctionReturnVoid();
+    ierr = DMDAVecRestoreArrayDOF(mDaCell,mCellLocal,&cell);CHKERRQ(ierr);
+    ierr = MatAssemblyBegin(mPcForSc,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+    ierr = MatAssemblyEnd(mPcForSc,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+    PetscFunctionReturn(0);
 }
 
 #undef __FUNCT__
 #define __FUNCT__ "solveModel"
-PetscErrorCode PetscAdLemTaras3D::solveModel(bool operatorChanged)
+PetscErrorCode PetscAdLemTaras3D::solveModel(bool operatorChanged, const std::vector<unsigned int> *changedVoxels)
 {
     PetscErrorCode ierr;
     PetscFunctionBeginUser;
     ++mNumOfSolveCalls;
+    const bool operatorUpdated = !mOperatorComputed || operatorChanged;
+    mPcReusedInSolve = PETSC_FALSE;
+
+    //When only a few mask voxels changed, refill only the rows of the existing operator touched by them.
+    bool incrementalUpdate = false;
+    if(mOperatorComputed && operatorChanged && changedVoxels && (mOpPatternCreated || mMatrixFree)) {
+        PetscBool useIncremental = PETSC_FALSE;
+        PetscReal maxFraction = 0.05;
+        ierr = PetscOptionsGetBool(NULL,"-taras_incremental_update",&useIncremental,NULL);CHKERRQ(ierr);
+        ierr = PetscOptionsGetReal(NULL,"-taras_incremental_max_fraction",&maxFraction,NULL);CHKERRQ(ierr);
+        const PetscReal numOfVoxels = (PetscReal)getProblemModel()->getXnum()*getProblemModel()->getYnum()*getProblemModel()->getZnum();
+        const PetscReal numOfChanged = changedVoxels->size()/3;
+        incrementalUpdate = useIncremental && (numOfChanged <= maxFraction*numOfVoxels);
+        if(useIncremental && !incrementalUpdate)
+            PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n %d mask voxels changed (more than %f of the domain), recomputing the whole operator\n",
+                                    (int)numOfChanged,maxFraction);
+    }
 
-    if(!mOperatorComputed || operatorChanged) { //FIXME: Currently, everytime the operator
+    //atrophy changes at every call, mask dependent coefficients only when operator changes.
+    ierr = updateCoefficientCache(!mOperatorComputed || operatorChanged,(incrementalUpdate) ? changedVoxels : NULL);CHKERRQ(ierr);
+
+    if(incrementalUpdate) { //refill the rows of mA, then hand it again to the KSP so that the pc is rebuilt (or reused).
+        ierr = updateOperatorRows(*changedVoxels);CHKERRQ(ierr);
+        //KSPSetOperators() makes the next KSPSetUp() call the operator callback, which must keep the
+        //refilled mA, and set up the pc with the new operator.
+        mOperatorRowsUpdated = PETSC_TRUE;
+        ierr = KSPSetOperators(mKsp,mA,mA);CHKERRQ(ierr);
+        ierr = setPcReuse();CHKERRQ(ierr);
+        if(mSchurPreUser) { //mPcForSc is already given to the fieldsplit, refill it.
+            ierr = updatePcForSc();CHKERRQ(ierr);
+        }
+        if(mNumOfMgGrids > 0) {
+            ierr = updateVelocityMultigrid();CHKERRQ(ierr);
+        }
+        if(mReducedSystem) {
+            ierr = setUpReducedSystem();CHKERRQ(ierr);
+        }
+    } else if(!mOperatorComputed || operatorChanged) { //FIXME: Currently, everytime the operator
         //is changed pc is recomputed. Later see if this is to be done only when null space
         //is required to be computed. otherwise, may be ask not to recompute
         //pc.
@@ -250,8 +376,23 @@ PetscErrorCode PetscAdLemTaras3D::solveModel(bool operatorChanged)
 	    ierr = KSPSetComputeOperators(mKsp,computeMatrixTaras3dConstantMu,this);CHKERRQ(ierr);
             ierr = KSPSetComputeRHS(mKsp,computeRHSTaras3dConstantMu,this);CHKERRQ(ierr);
         }
-        ierr = KSPSetFromOptions(mKsp);CHKERRQ(ierr);
-	//ierr = KSPSetReusePreconditioner(mKsp, PETSC_FALSE); //This should be called by default when operator changes.
+        if(mReducedSystem) { //mKsp only computes the operator, the solver options are for mKspR.
+            ierr = KSPSetType(mKsp,KSPPREONLY);CHKERRQ(ierr);
+            ierr = KSPGetPC(mKsp,&mPc);CHKERRQ(ierr);
+            ierr = PCSetType(mPc,PCNONE);CHKERRQ(ierr);
+        } else {
+            ierr = KSPSetFromOptions(mKsp);CHKERRQ(ierr);
+        }
+        if(mSchurPreUser) { //Schur complement preconditioner, follows the mask.
+            ierr = updatePcForSc();CHKERRQ(ierr);
+            if(!mReducedSystem) { //else given to the fieldsplit of mKspR in setUpReducedSystem().
+                ierr = KSPGetPC(mKsp,&mPc);CHKERRQ(ierr);
+                ierr = PCFieldSplitSetSchurPre(mPc,PC_FIELDSPLIT_SCHUR_PRE_USER,mPcForSc);CHKERRQ(ierr);
+            }
+        }
+        if(mOperatorComputed) { //keep or rebuild the preconditioner of the previous operator.
+            ierr = setPcReuse();CHKERRQ(ierr);
+        }
 	ierr = KSPSetUp(mKsp);CHKERRQ(ierr); //register the fieldsplits obtained from options.
 	// ---------- MUST CALL kspsetfromoptions() and kspsetup() before kspgetoperators and matsetnullspace
 	// otherwise I'm getting a runtime error of mat object type not set (for mA!!)
@@ -263,7 +404,9 @@ PetscErrorCode PetscAdLemTaras3D::solveModel(bool operatorChanged)
 	// ierr = PetscViewerASCIIOpen(PETSC_COMM_WORLD, mat_file.c_str(),&viewer);CHKERRQ(ierr);
 	// MatView(mA, viewer);
 	// ierr = PetscViewerDestroy(&viewer);CHKERRQ(ierr);
-        if(mPressureNullspacePresent) {
+        if(mReducedSystem) {
+            ierr = setUpReducedSystem();CHKERRQ(ierr);
+        } else if(mPressureNullspacePresent) {
             //ierr = KSPSetNullSpace(mKsp,mNullSpace);CHKERRQ(ierr);//nullSpace for the main system
 	    ierr = MatSetNullSpace(mA,mNullSpace);CHKERRQ(ierr);//nullSpace for the main system, updated for petsc3.6
 	    PetscBool isNull;
@@ -281,16 +424,13 @@ PetscErrorCode PetscAdLemTaras3D::solveModel(bool operatorChanged)
         PetscBool optionFlag = PETSC_FALSE;
         char optionString[PETSC_MAX_PATH_LEN];
         ierr = PetscOptionsGetString(NULL,"-pc_fieldsplit_type",optionString,10,&optionFlag);CHKERRQ(ierr);
-        if(optionFlag) {
+        if(optionFlag && !mReducedSystem) { //fieldsplits of the reduced system are set in setUpReducedSystem().
             if(strcmp(optionString,"schur")==0){
                 PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n using schur complement \n");
                 ierr = PetscOptionsGetString(NULL,"-pc_fieldsplit_0_fields",optionString,10,&optionFlag);CHKERRQ(ierr);
                 if(optionFlag) {
                     if(strcmp(optionString,"0,1,2")==0) {
                         PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n using user defined split \n");
-                        //                    if(getProblemModel()->getPressureMassCoeffCsf() == 0) {
-                        //                                            ierr = PCFieldSplitSchurPrecondition(mPc,PC_FIELDSPLIT_SCHUR_PRE_USER,mPcForSc);CHKERRQ(ierr);
-                        //                    }
                         KSP *subKsp;
                         PetscInt numOfSplits = 1;
                         ierr = PCFieldSplitGetSubKSP(mPc,&numOfSplits,&subKsp);CHKERRQ(ierr);
@@ -311,6 +451,9 @@ PetscErrorCode PetscAdLemTaras3D::solveModel(bool operatorChanged)
                             ierr = KSPGetOperators(subKsp[0],&matA00,NULL);CHKERRQ(ierr);
                             ierr = MatSetNearNullSpace(matA00,rigidBodyModes);CHKERRQ(ierr);
                             ierr = MatNullSpaceDestroy(&rigidBodyModes);CHKERRQ(ierr);
+                        } else if(optionFlag && strcmp(optionString,"mg")==0) {
+                            //geometric multigrid on the staggered velocity grid.
+                            ierr = setUpVelocityMultigrid(subKsp[0]);CHKERRQ(ierr);
                         }
 
                         //If constant pressure nullspace present, set it to SchurComplement matrix.
@@ -335,9 +478,37 @@ PetscErrorCode PetscAdLemTaras3D::solveModel(bool operatorChanged)
         mOperatorComputed = PETSC_TRUE;
     }
 
-    ierr = KSPSolve(mKsp,NULL,NULL);CHKERRQ(ierr);
-    ierr = KSPGetSolution(mKsp,&mX);CHKERRQ(ierr);
-    ierr = KSPGetRhs(mKsp,&mB);CHKERRQ(ierr);
+    PetscLogDouble  solveStart, solveEnd, memory, totalMemory;
+    PetscInt        numOfIterations;
+    ierr = PetscTime(&solveStart);CHKERRQ(ierr);
+    if(mReducedSystem) {
+        ierr = solveReducedSystem();CHKERRQ(ierr);
+    } else {
+        if(mInitialGuess != INITIAL_GUESS_ZERO) { //mX is the solution vector of mKsp since the first solve.
+            if(mNumOfStoredSolutions > 0) {
+                if(!mX) { //stored solutions loaded by loadState() before the first solve.
+                    ierr = KSPGetSolution(mKsp,&mX);CHKERRQ(ierr);
+                }
+                ierr = computeInitialGuess(mX,operatorUpdated);CHKERRQ(ierr);
+            }
+            ierr = KSPSetInitialGuessNonzero(mKsp,(PetscBool)(mNumOfStoredSolutions > 0));CHKERRQ(ierr);
+        }
+        ierr = KSPSolve(mKsp,NULL,NULL);CHKERRQ(ierr);
+    }
+    ierr = PetscTime(&solveEnd);CHKERRQ(ierr);
+    ierr = KSPGetIterationNumber((mReducedSystem) ? mKspR : mKsp,&numOfIterations);CHKERRQ(ierr);
+    updatePcReuse(numOfIterations,operatorUpdated);
+    ierr = PetscMemoryGetCurrentUsage(&memory);CHKERRQ(ierr);
+    ierr = MPI_Allreduce(&memory,&totalMemory,1,MPIU_PETSCLOGDOUBLE,MPI_SUM,PETSC_COMM_WORLD);CHKERRQ(ierr);
+    //Parsed by scripts/benchmark_matrix_free.py, keep the format.
+    PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n solve stats: %d iterations, %f s, %f s per iteration (setup included), memory %f MB, %s operator\n",
+                            numOfIterations,solveEnd-solveStart,(solveEnd-solveStart)/PetscMax(numOfIterations,1),
+                            totalMemory/1048576.,(mMatrixFree) ? "matrix-free" : "assembled");
+    if(!mReducedSystem) { //else set by solveReducedSystem().
+        ierr = KSPGetSolution(mKsp,&mX);CHKERRQ(ierr);
+        ierr = KSPGetRhs(mKsp,&mB);CHKERRQ(ierr);
+    }
+    ierr = storeSolution();CHKERRQ(ierr);
     ierr = getSolutionArray();CHKERRQ(ierr); //to get the local solution vector in each processor.
     ierr = getRhsArray();CHKERRQ(ierr);
 
@@ -345,6 +516,180 @@ PetscErrorCode PetscAdLemTaras3D::solveModel(bool operatorChanged)
 
 }
 
+#undef __FUNCT__
+#define __FUNCT__ "setPcReuse"
+/*Before a solve with a changed operator: decide whether mKsp keeps the preconditioner of the
+ last fresh setup. The reduced system changes size with the mask, so its preconditioner is
+ always rebuilt.*/
+PetscErrorCode PetscAdLemTaras3D::setPcReuse()
+{
+    PetscErrorCode  ierr;
+    PetscFunctionBeginUser;
+    if(!mPcReuse || mReducedSystem)
+        PetscFunctionReturn(0);
+    if(mPcSetupIterations == 0) {
+        PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n preconditioner rebuilt: no previous setup\n");
+    } else if(mPcRebuildRequested) {
+        PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n preconditioner rebuilt: iterations grew past %f times the %d of the last setup\n",
+                                mPcReuseFactor,mPcSetupIterations);
+    } else if(mPcReusedSteps >= mPcReuseMaxSteps) {
+        PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n preconditioner rebuilt: reused for %d steps already\n",mPcReusedSteps);
+    } else {
+        mPcReusedInSolve = PETSC_TRUE;
+        PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n preconditioner reused: step %d of at most %d since the last setup\n",
+                                mPcReusedSteps+1,mPcReuseMaxSteps);
+    }
+    ierr = KSPSetReusePreconditioner(mKsp,mPcReusedInSolve);CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+/*After a solve: a fresh preconditioner sets the reference iterations, a reused one asks for a
+ rebuild at the next operator change when it needed too many iterations.*/
+void PetscAdLemTaras3D::updatePcReuse(PetscInt numOfIterations, bool operatorUpdated)
+{
+    if(!mPcReuse || mReducedSystem)
+        return;
+    if(mPcReusedInSolve) {
+        ++mPcReusedSteps;
+        if(numOfIterations > mPcReuseFactor*mPcSetupIterations) {
+            mPcRebuildRequested = PETSC_TRUE;
+            PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n reused preconditioner: %d iterations, more than %f times the %d of the last setup\n",
+                                    numOfIterations,mPcReuseFactor,mPcSetupIterations);
+        }
+    } else if(operatorUpdated) {
+        mPcSetupIterations = PetscMax(numOfIterations,1);
+        mPcReusedSteps = 0;
+        mPcRebuildRequested = PETSC_FALSE;
+    }
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "computeInitialGuess"
+/*Initial guess from the stored solutions: the last one, or the linear extrapolation 2 x_t - x_(t-1)
+ of the last two with -taras_initial_guess extrapolate. With setFixedRows the unknowns fixed by
+ the current mask (e.g. faces that became skull, walls) are set to their value rhs/diagonal, as in
+ solveReducedSystem(), so that the guess satisfies the boundary conditions.*/
+PetscErrorCode PetscAdLemTaras3D::computeInitialGuess(Vec guess, bool setFixedRows)
+{
+    PetscErrorCode  ierr;
+    PetscFunctionBeginUser;
+    if(mInitialGuess == INITIAL_GUESS_EXTRAPOLATE && mNumOfStoredSolutions > 1) {
+        ierr = VecAXPBYPCZ(guess,2.0,-1.0,0.0,mXPrev,mXPrev2);CHKERRQ(ierr);
+        PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n initial guess extrapolated from the last two solutions\n");
+    } else {
+        ierr = VecCopy(mXPrev,guess);CHKERRQ(ierr);
+        PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n initial guess from the last solution\n");
+    }
+    if(setFixedRows) {
+        PetscInt        xs,ys,zs,xm,ym,zm;
+        PetscScalar     ****cell, ****x, ****b;
+        OperatorParams  par;
+        Vec             rhs;
+        ierr = DMGetGlobalVector(mDa,&rhs);CHKERRQ(ierr);
+        ierr = computeRHSTaras3dConstantMu(mKsp,rhs,this);CHKERRQ(ierr);
+        ierr = getOperatorParams(mDa,par);CHKERRQ(ierr);
+        ierr = DMDAGetCorners(mDa,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
+        ierr = DMDAVecGetArrayDOF(mDaCell,mCellLocal,&cell);CHKERRQ(ierr);
+        ierr = DMDAVecGetArrayDOF(mDa,guess,&x);CHKERRQ(ierr);
+        ierr = DMDAVecGetArrayDOF(mDa,rhs,&b);CHKERRQ(ierr);
+        for (PetscInt k=zs; k<zs+zm; ++k) {
+            for (PetscInt j=ys; j<ys+ym; ++j) {
+                for (PetscInt i=xs; i<xs+xm; ++i) {
+                    for (PetscInt c=0; c<4; ++c) {
+                        PetscScalar diag;
+                        if(isFixedRow(par,cell,i,j,k,c,&diag))
+                            x[k][j][i][c] = b[k][j][i][c]/diag;
+                    }
+                }
+            }
+        }
+        ierr = DMDAVecRestoreArrayDOF(mDa,rhs,&b);CHKERRQ(ierr);
+        ierr = DMDAVecRestoreArrayDOF(mDa,guess,&x);CHKERRQ(ierr);
+        ierr = DMDAVecRestoreArrayDOF(mDaCell,mCellLocal,&cell);CHKERRQ(ierr);
+        ierr = DMRestoreGlobalVector(mDa,&rhs);CHKERRQ(ierr);
+    }
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "storeSolution"
+/*Keep mX for the initial guess of the next solves.*/
+PetscErrorCode PetscAdLemTaras3D::storeSolution()
+{
+    PetscErrorCode  ierr;
+    PetscFunctionBeginUser;
+    if(mInitialGuess == INITIAL_GUESS_ZERO)
+        PetscFunctionReturn(0);
+    if(!mXPrev) {
+        ierr = VecDuplicate(mX,&mXPrev);CHKERRQ(ierr);
+    }
+    if(mInitialGuess == INITIAL_GUESS_EXTRAPOLATE) {
+        if(!mXPrev2) {
+            ierr = VecDuplicate(mX,&mXPrev2);CHKERRQ(ierr);
+        }
+        if(mNumOfStoredSolutions > 0) {
+            ierr = VecCopy(mXPrev,mXPrev2);CHKERRQ(ierr);
+        }
+    }
+    ierr = VecCopy(mX,mXPrev);CHKERRQ(ierr);
+    mNumOfStoredSolutions = PetscMin(mNumOfStoredSolutions+1,2);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "saveState"
+/*Write the number of stored solutions followed by mXPrev and mXPrev2 (if stored).*/
+PetscErrorCode PetscAdLemTaras3D::saveState(const std::string& fileName)
+{
+    PetscErrorCode  ierr;
+    PetscViewer     viewer;
+    PetscFunctionBeginUser;
+    ierr = PetscViewerBinaryOpen(PETSC_COMM_WORLD,fileName.c_str(),FILE_MODE_WRITE,&viewer);CHKERRQ(ierr);
+    ierr = PetscViewerBinaryWrite(viewer,&mNumOfStoredSolutions,1,PETSC_INT,PETSC_FALSE);CHKERRQ(ierr);
+    if(mNumOfStoredSolutions > 0) {
+        ierr = VecView(mXPrev,viewer);CHKERRQ(ierr);
+    }
+    if(mNumOfStoredSolutions > 1) {
+        ierr = VecView(mXPrev2,viewer);CHKERRQ(ierr);
+    }
+    ierr = PetscViewerDestroy(&viewer);CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "loadState"
+/*Read the stored solutions written by saveState(), keeping only those used by -taras_initial_guess.*/
+PetscErrorCode PetscAdLemTaras3D::loadState(const std::string& fileName)
+{
+    PetscErrorCode  ierr;
+    PetscViewer     viewer;
+    PetscInt        numInFile, count;
+    PetscFunctionBeginUser;
+    ierr = PetscViewerBinaryOpen(PETSC_COMM_WORLD,fileName.c_str(),FILE_MODE_READ,&viewer);CHKERRQ(ierr);
+    ierr = PetscViewerBinaryRead(viewer,&numInFile,1,&count,PETSC_INT);CHKERRQ(ierr);
+    PetscInt numToLoad = 0;
+    if(mInitialGuess == INITIAL_GUESS_PREVIOUS)
+        numToLoad = PetscMin(numInFile,1);
+    else if(mInitialGuess == INITIAL_GUESS_EXTRAPOLATE)
+        numToLoad = PetscMin(numInFile,2);
+    if(numToLoad > 0) {
+        if(!mXPrev) {
+            ierr = DMCreateGlobalVector(mDa,&mXPrev);CHKERRQ(ierr);
+        }
+        ierr = VecLoad(mXPrev,viewer);CHKERRQ(ierr);
+    }
+    if(numToLoad > 1) {
+        if(!mXPrev2) {
+            ierr = DMCreateGlobalVector(mDa,&mXPrev2);CHKERRQ(ierr);
+        }
+        ierr = VecLoad(mXPrev2,viewer);CHKERRQ(ierr);
+    }
+    mNumOfStoredSolutions = numToLoad;
+    ierr = PetscViewerDestroy(&viewer);CHKERRQ(ierr);
+    PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n %d stored solution(s) loaded from %s\n",numToLoad,fileName.c_str());
+    PetscFunctionReturn(0);
+}
+
 #undef __FUNCT__
 #define __FUNCT__ "writeToMatFile"
 PetscErrorCode PetscAdLemTaras3D::writeToMatFile(
@@ -393,8 +738,10 @@ PetscErrorCode PetscAdLemTaras3D::writeToMatFile(
         ierr = PetscViewerSetFormat(viewer2,PETSC_VIEWER_BINARY_MATLAB);CHKERRQ(ierr);
         ierr = PetscObjectSetName((PetscObject)mA,"A");CHKERRQ(ierr);
         ierr = MatView(mA,viewer2);CHKERRQ(ierr);
-        //        ierr = PetscObjectSetName((PetscObject)mPcForSc,"PcForSc");CHKERRQ(ierr);
-        ierr = MatView(mPcForSc,viewer2);CHKERRQ(ierr);
+        if(mPcForSc) {
+            ierr = PetscObjectSetName((PetscObject)mPcForSc,"PcForSc");CHKERRQ(ierr);
+            ierr = MatView(mPcForSc,viewer2);CHKERRQ(ierr);
+        }
         ierr = PetscViewerDestroy(&viewer2);CHKERRQ(ierr);
     }
     PetscFunctionReturn(0);
@@ -437,6 +784,257 @@ PetscErrorCode PetscAdLemTaras3D::createParaVectors()
     PetscFunctionReturn(0);
 }
 
+#undef __FUNCT__
+#define __FUNCT__ "createCoefficientCache"
+PetscErrorCode PetscAdLemTaras3D::createCoefficientCache()
+{
+    PetscErrorCode  ierr;
+    PetscInt        M,N,P,m,n,p;
+    const PetscInt  *lx, *ly, *lz;
+    PetscFunctionBeginUser;
+
+    mNumOfLambdaComps = (this->getProblemModel()->isLambdaTensor()) ? 6 : 1;
+    ierr = DMDAGetInfo(mDa,0,&M,&N,&P,&m,&n,&p,0,0,0,0,0,0);CHKERRQ(ierr);
+    ierr = DMDAGetOwnershipRanges(mDa,&lx,&ly,&lz);CHKERRQ(ierr);
+    //Use the same partition as mDa so that a cell owned in mDa is also owned in the cache.
+    ierr = DMDACreate3d(PETSC_COMM_WORLD,DM_BOUNDARY_NONE,DM_BOUNDARY_NONE,DM_BOUNDARY_NONE,
+                        DMDA_STENCIL_BOX,M,N,P,m,n,p,CELL_NUM_FIELDS,1,
+                        lx,ly,lz,&mDaCell);CHKERRQ(ierr);
+    if(mNumOfLambdaComps > 1) {
+        ierr = createLambdaStore();CHKERRQ(ierr);
+    }
+    ierr = DMCreateLocalVector(mDaCell,&mCellLocal);CHKERRQ(ierr);
+    ierr = DMDACreate3d(PETSC_COMM_WORLD,DM_BOUNDARY_NONE,DM_BOUNDARY_NONE,DM_BOUNDARY_NONE,
+                        DMDA_STENCIL_BOX,M,N,P,m,n,p,EDGE_NUM_FIELDS,1,
+                        lx,ly,lz,&mDaEdge);CHKERRQ(ierr);
+    //edge local vector is allocated only if the variable viscosity discretization asks for it.
+    mEdgeLocal = NULL;
+    mCoeffCacheCreated = PETSC_TRUE;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "createLambdaStore"
+/*Tensor lambda on the ghosted cells of mDaCell, in a 6 dof DMDA with the same partition: it does not
+ depend on the mask, so it is read from the model only once and the model then releases its image.
+ With -taras_lambda_float the values are kept in single precision and the local vector is dropped.*/
+PetscErrorCode PetscAdLemTaras3D::createLambdaStore()
+{
+    PetscErrorCode  ierr;
+    PetscInt        M,N,P,m,n,p;
+    const PetscInt  *lx, *ly, *lz;
+    PetscScalar     ****lambda;
+    AdLem3D<3>      *model = this->getProblemModel();
+    PetscFunctionBeginUser;
+
+    ierr = DMDAGetInfo(mDaCell,0,&M,&N,&P,&m,&n,&p,0,0,0,0,0,0);CHKERRQ(ierr);
+    ierr = DMDAGetOwnershipRanges(mDaCell,&lx,&ly,&lz);CHKERRQ(ierr);
+    ierr = DMDACreate3d(PETSC_COMM_WORLD,DM_BOUNDARY_NONE,DM_BOUNDARY_NONE,DM_BOUNDARY_NONE,
+                        DMDA_STENCIL_BOX,M,N,P,m,n,p,6,1,lx,ly,lz,&mDaLambda);CHKERRQ(ierr);
+    ierr = DMCreateLocalVector(mDaLambda,&mLambdaLocal);CHKERRQ(ierr);
+    ierr = DMDAGetGhostCorners(mDaLambda,&mLambdaCorner[0],&mLambdaCorner[1],&mLambdaCorner[2],
+                               &mLambdaDims[0],&mLambdaDims[1],&mLambdaDims[2]);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(mDaLambda,mLambdaLocal,&lambda);CHKERRQ(ierr);
+    for (PetscInt k=mLambdaCorner[2]; k<mLambdaCorner[2]+mLambdaDims[2]; ++k) {
+        for (PetscInt j=mLambdaCorner[1]; j<mLambdaCorner[1]+mLambdaDims[1]; ++j) {
+            for (PetscInt i=mLambdaCorner[0]; i<mLambdaCorner[0]+mLambdaDims[0]; ++i) {
+                //same index shift as in dataCenterAt()
+                const PetscInt x = (i != 0) ? i-1 : 0;
+                const PetscInt y = (j != 0) ? j-1 : 0;
+                const PetscInt z = (k != 0) ? k-1 : 0;
+                for(PetscInt Mi=0; Mi<3; ++Mi)
+                    for(PetscInt Mj=Mi; Mj<3; ++Mj)
+                        lambda[k][j][i][lambdaComp(Mi,Mj)] = model->dataAt("lambda",x,y,z,Mi,Mj);
+            }
+        }
+    }
+    ierr = DMDAVecRestoreArrayDOF(mDaLambda,mLambdaLocal,&lambda);CHKERRQ(ierr);
+    if(mLambdaFloatStorage) {
+        const PetscScalar *values;
+        PetscInt          size;
+        ierr = VecGetLocalSize(mLambdaLocal,&size);CHKERRQ(ierr);
+        ierr = VecGetArrayRead(mLambdaLocal,&values);CHKERRQ(ierr);
+        mLambdaFloat.assign(values,values+size);
+        ierr = VecRestoreArrayRead(mLambdaLocal,&values);CHKERRQ(ierr);
+        ierr = VecDestroy(&mLambdaLocal);CHKERRQ(ierr);
+    } else {
+        ierr = VecGetArrayRead(mLambdaLocal,&mLambdaArray);CHKERRQ(ierr);
+    }
+    model->releaseLambdaImage();
+    PetscFunctionReturn(0);
+}
+
+/*(xx,xy,xz,yy,yz,zz)[comp] of the lambda of cell (i,j,k), a ghosted cell of this process.*/
+PetscScalar PetscAdLemTaras3D::cellLambda(PetscInt i, PetscInt j, PetscInt k, PetscInt comp) const
+{
+    const PetscInt n = (((k-mLambdaCorner[2])*mLambdaDims[1] + (j-mLambdaCorner[1]))*mLambdaDims[0]
+                        + (i-mLambdaCorner[0]))*6 + comp;
+    return (mLambdaFloatStorage) ? (PetscScalar)mLambdaFloat[n] : mLambdaArray[n];
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "updateCoefficientCache"
+/*Fill the ghosted local arrays of the cache from the problem model. Every rank holds the
+ input images (at least the voxels of its ghosted block with distributed input), so the ghost
+ cells are filled directly without any communication.
+ When the mask has not changed only the atrophy field is refreshed. If changedVoxels
+ (x,y,z triplets in the model coordinates) is given, only the mask dependent values of
+ those voxels and of their neighbours are refreshed.*/
+PetscErrorCode PetscAdLemTaras3D::updateCoefficientCache(bool maskChanged, const std::vector<unsigned int> *changedVoxels)
+{
+    PetscErrorCode  ierr;
+    PetscInt        i,j,k,mx,my,mz,xs,ys,zs,xm,ym,zm,gxs,gys,gzs,gxm,gym,gzm;
+    PetscScalar     ****cell;
+    AdLem3D<3>      *model = this->getProblemModel();
+    PetscFunctionBeginUser;
+
+    if(!mCoeffCacheCreated) {
+        ierr = createCoefficientCache();CHKERRQ(ierr);
+        maskChanged = true;
+        changedVoxels = NULL;
+    }
+    ierr = DMDAGetInfo(mDaCell,0,&mx,&my,&mz,0,0,0,0,0,0,0,0,0);CHKERRQ(ierr);
+    ierr = DMDAGetCorners(mDaCell,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
+    ierr = DMDAGetGhostCorners(mDaCell,&gxs,&gys,&gzs,&gxm,&gym,&gzm);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(mDaCell,mCellLocal,&cell);CHKERRQ(ierr);
+
+    const bool fullMaskUpdate = maskChanged && !changedVoxels;
+    for (k=gzs; k<gzs+gzm; ++k) {
+        for (j=gys; j<gys+gym; ++j) {
+            for (i=gxs; i<gxs+gxm; ++i) {
+                //same index shift as in dataCenterAt()
+                cell[k][j][i][CELL_ATROPHY] = model->dataAt("atrophy",(i != 0) ? i-1 : 0,
+                                                            (j != 0) ? j-1 : 0, (k != 0) ? k-1 : 0);
+                if(fullMaskUpdate)
+                    fillMaskCoefficients(cell,i,j,k);
+            }
+        }
+    }
+
+    if(fullMaskUpdate) {
+        for (k=zs; k<zs+zm; ++k)
+            for (j=ys; j<ys+ym; ++j)
+                for (i=xs; i<xs+xm; ++i)
+                    setAllNbrsSkullFlag(cell,i,j,k,mx,my,mz);
+    } else if(maskChanged) {
+        //Cells of a voxel: (x+1,y+1,z+1) and the ghost cells (index 0) when the voxel is on a start face.
+        std::vector<char> nbrMark(xm*ym*zm,0);
+        for (size_t v=0; v+2<changedVoxels->size(); v+=3) {
+            const PetscInt x = (*changedVoxels)[v], y = (*changedVoxels)[v+1], z = (*changedVoxels)[v+2];
+            for (k=(z==0)?0:z+1; k<=z+1; ++k) {
+                for (j=(y==0)?0:y+1; j<=y+1; ++j) {
+                    for (i=(x==0)?0:x+1; i<=x+1; ++i) {
+                        if(i>=gxs && i<gxs+gxm && j>=gys && j<gys+gym && k>=gzs && k<gzs+gzm)
+                            fillMaskCoefficients(cell,i,j,k);
+                        for (PetscInt kk=PetscMax(k-1,zs); kk<=PetscMin(k+1,zs+zm-1); ++kk)
+                            for (PetscInt jj=PetscMax(j-1,ys); jj<=PetscMin(j+1,ys+ym-1); ++jj)
+                                for (PetscInt ii=PetscMax(i-1,xs); ii<=PetscMin(i+1,xs+xm-1); ++ii)
+                                    nbrMark[((kk-zs)*ym + (jj-ys))*xm + (ii-xs)] = 1;
+                    }
+                }
+            }
+        }
+        for (k=zs; k<zs+zm; ++k)
+            for (j=ys; j<ys+ym; ++j)
+                for (i=xs; i<xs+xm; ++i)
+                    if(nbrMark[((k-zs)*ym + (j-ys))*xm + (i-xs)])
+                        setAllNbrsSkullFlag(cell,i,j,k,mx,my,mz);
+    }
+    if(maskChanged)
+        mEdgeCacheLatest = PETSC_FALSE;
+    ierr = DMDAVecRestoreArrayDOF(mDaCell,mCellLocal,&cell);CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+/*Mask dependent fields (mu, lambda and the cell classification) of cell (i,j,k).
+ The ALL_NBRS_SKULL bit is cleared, see setAllNbrsSkullFlag().*/
+void PetscAdLemTaras3D::fillMaskCoefficients(PetscScalar ****cell, PetscInt i, PetscInt j, PetscInt k)
+{
+    AdLem3D<3>      *model = this->getProblemModel();
+    //same index shift as in dataCenterAt()
+    const PetscInt x = (i != 0) ? i-1 : 0;
+    const PetscInt y = (j != 0) ? j-1 : 0;
+    const PetscInt z = (k != 0) ? k-1 : 0;
+    cell[k][j][i][CELL_MU] = model->dataAt("mu",x,y,z);
+    if(mNumOfLambdaComps == 1)
+        cell[k][j][i][CELL_LAMBDA] = model->dataAt("lambda",x,y,z,0,0);
+    else
+        cell[k][j][i][CELL_LAMBDA] = cellLambda(i,j,k,lambdaComp(0,0));
+    const double label = model->brainMaskAt(x,y,z);
+    PetscInt flags = 0;
+    if(i==0 || j==0 || k==0)
+        flags |= PetscAdLemTaras3D_SolverOps::CELL_GHOST;
+    if(label == model->getSkullLabel())
+        flags |= PetscAdLemTaras3D_SolverOps::CELL_SKULL;
+    if(label == model->getRelaxIcLabel())
+        flags |= PetscAdLemTaras3D_SolverOps::CELL_RELAX_IC;
+    if(label == model->getFalxCerebriLabel())
+        flags |= PetscAdLemTaras3D_SolverOps::CELL_FALX;
+    cell[k][j][i][CELL_FLAGS] = flags;
+}
+
+/*Set or clear the ALL_NBRS_SKULL bit of an owned cell: cells surrounded by skull in all 6 directions.
+ A neighbour outside the grid counts as skull.*/
+void PetscAdLemTaras3D::setAllNbrsSkullFlag(PetscScalar ****cell, PetscInt i, PetscInt j, PetscInt k,
+                                            PetscInt mx, PetscInt my, PetscInt mz)
+{
+    const PetscInt skull = PetscAdLemTaras3D_SolverOps::CELL_SKULL;
+    const PetscInt allNbrsSkull = PetscAdLemTaras3D_SolverOps::CELL_ALL_NBRS_SKULL;
+    PetscInt flags = cellFlags(cell,i,j,k) & ~allNbrsSkull;
+    if( (i==mx-1 || (cellFlags(cell,i+1,j,k) & skull)) &&
+        (i==0    || (cellFlags(cell,i-1,j,k) & skull)) &&
+        (j==my-1 || (cellFlags(cell,i,j+1,k) & skull)) &&
+        (j==0    || (cellFlags(cell,i,j-1,k) & skull)) &&
+        (k==mz-1 || (cellFlags(cell,i,j,k+1) & skull)) &&
+        (k==0    || (cellFlags(cell,i,j,k-1) & skull)) ) {
+        flags |= allNbrsSkull;
+    }
+    cell[k][j][i][CELL_FLAGS] = flags;
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "updateEdgeCoefficientCache"
+/*Edge-centred viscosity used only by the variable viscosity discretization.*/
+PetscErrorCode PetscAdLemTaras3D::updateEdgeCoefficientCache()
+{
+    PetscErrorCode  ierr;
+    PetscInt        i,j,k,gxs,gys,gzs,gxm,gym,gzm;
+    PetscScalar     ****edge;
+    PetscFunctionBeginUser;
+
+    if(mEdgeCacheLatest)
+        PetscFunctionReturn(0);
+    if(!mEdgeLocal) {
+        ierr = DMCreateLocalVector(mDaEdge,&mEdgeLocal);CHKERRQ(ierr);
+    }
+    ierr = DMDAGetGhostCorners(mDaEdge,&gxs,&gys,&gzs,&gxm,&gym,&gzm);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(mDaEdge,mEdgeLocal,&edge);CHKERRQ(ierr);
+    for (k=gzs; k<gzs+gzm; ++k) {
+        for (j=gys; j<gys+gym; ++j) {
+            for (i=gxs; i<gxs+gxm; ++i) {
+                edge[k][j][i][EDGE_MU_XY] = muXy(i,j,k);
+                edge[k][j][i][EDGE_MU_XZ] = muXz(i,j,k);
+                edge[k][j][i][EDGE_MU_YZ] = muYz(i,j,k);
+            }
+        }
+    }
+    ierr = DMDAVecRestoreArrayDOF(mDaEdge,mEdgeLocal,&edge);CHKERRQ(ierr);
+    mEdgeCacheLatest = PETSC_TRUE;
+    PetscFunctionReturn(0);
+}
+
+PetscInt PetscAdLemTaras3D::cellFlags(PetscScalar ****cell, PetscInt x, PetscInt y, PetscInt z)
+{
+    return (PetscInt)PetscRealPart(cell[z][y][x][CELL_FLAGS]);
+}
+
+/*Position of the (Mi,Mj) element of the symmetric lambda tensor in the lambda store.*/
+PetscInt PetscAdLemTaras3D::lambdaComp(PetscInt Mi, PetscInt Mj)
+{
+    static const PetscInt comp[3][3] = {{0,1,2},{1,3,4},{2,4,5}};
+    return comp[Mi][Mj];
+}
+
 MatNullSpace PetscAdLemTaras3D::getNullSpace()
 {
     return mNullSpace;
@@ -635,6 +1233,7 @@ PetscErrorCode PetscAdLemTaras3D::computeMatrixTaras3d(
     DM              da;
     PetscReal       kBond = 1.0; //need to change it to scale the coefficients.
     PetscReal       kCont = 1.0; //need to change it to scale the coefficients.
+    PetscScalar     ****cell, ****edge; //coefficient cache, see updateCoefficientCache().
 
     PetscFunctionBeginUser;
     ierr = KSPGetDM(ksp,&da);CHKERRQ(ierr);
@@ -647,6 +1246,9 @@ PetscErrorCode PetscAdLemTaras3D::computeMatrixTaras3d(
     HxHzdHy = (Hx*Hz)/Hy;
     HxHydHz = (Hx*Hy)/Hz;
     ierr = DMDAGetCorners(da,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
+    ierr = user->updateEdgeCoefficientCache();CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(user->mDaCell,user->mCellLocal,&cell);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(user->mDaEdge,user->mEdgeLocal,&edge);CHKERRQ(ierr);
 
     for (k=zs; k<zs+zm; ++k) {
         for (j=ys; j<ys+ym; ++j) {
@@ -698,30 +1300,30 @@ PetscErrorCode PetscAdLemTaras3D::computeMatrixTaras3d(
                     for(int ii=0; ii<7; ++ii)
                         col[ii].c = 0;
 
-                    v[0] = 2.0*user->muC(i+1,j+1,k+1)*HyHzdHx;      col[0].i=i+1;   col[0].j=j;     col[0].k=k;
-                    v[1] = 2.0*user->muC(i,j+1,k+1)*HyHzdHx;        col[1].i=i-1;   col[1].j=j;     col[1].k=k;
-                    v[2] = user->muXy(i,j+1,k)*HxHzdHy;             col[2].i=i;     col[2].j=j+1;   col[2].k=k;
-                    v[3] = user->muXy(i,j,k)*HxHzdHy;               col[3].i=i;     col[3].j=j-1;   col[3].k=k;
-                    v[4] = user->muXz(i,j,k+1)*HxHydHz;             col[4].i=i;     col[4].j=j;     col[4].k=k+1;
-                    v[5] = user->muXz(i,j,k)*HxHydHz;               col[5].i=i;     col[5].j=j;     col[5].k=k-1;
+                    v[0] = 2.0*cell[k+1][j+1][i+1][CELL_MU]*HyHzdHx;      col[0].i=i+1;   col[0].j=j;     col[0].k=k;
+                    v[1] = 2.0*cell[k+1][j+1][i][CELL_MU]*HyHzdHx;        col[1].i=i-1;   col[1].j=j;     col[1].k=k;
+                    v[2] = edge[k][j+1][i][EDGE_MU_XY]*HxHzdHy;             col[2].i=i;     col[2].j=j+1;   col[2].k=k;
+                    v[3] = edge[k][j][i][EDGE_MU_XY]*HxHzdHy;               col[3].i=i;     col[3].j=j-1;   col[3].k=k;
+                    v[4] = edge[k+1][j][i][EDGE_MU_XZ]*HxHydHz;             col[4].i=i;     col[4].j=j;     col[4].k=k+1;
+                    v[5] = edge[k][j][i][EDGE_MU_XZ]*HxHydHz;               col[5].i=i;     col[5].j=j;     col[5].k=k-1;
                     v[6] = -v[0]-v[1]-v[2]-v[3]-v[4]-v[5];          col[6].i=i;     col[6].j=j;     col[6].k=k;
 
                     //vy-coefficients, four terms.
                     for(int ii=7; ii<11; ++ii)
                         col[ii].c = 1;
 
-                    v[7] = user->muXy(i,j+1,k)*Hz;                  col[7].i=i;     col[7].j=j+1;   col[7].k=k;
+                    v[7] = edge[k][j+1][i][EDGE_MU_XY]*Hz;                  col[7].i=i;     col[7].j=j+1;   col[7].k=k;
                     v[8] = -v[7];                                   col[8].i=i-1;   col[8].j=j+1;   col[8].k=k;
-                    v[9] = user->muXy(i,j,k)*Hz;                    col[9].i=i-1;   col[9].j=j;     col[9].k=k;
+                    v[9] = edge[k][j][i][EDGE_MU_XY]*Hz;                    col[9].i=i-1;   col[9].j=j;     col[9].k=k;
                     v[10] = -v[9];                                  col[10].i=i;    col[10].j=j;    col[10].k=k;
 
                     //vz-coefficients, four terms.
                     for(int ii=11; ii<15; ++ii)
                         col[ii].c = 2;
 
-                    v[11] = user->muXz(i,j,k+1)*Hy;                 col[11].i=i;    col[11].j=j;    col[11].k=k+1;
+                    v[11] = edge[k+1][j][i][EDGE_MU_XZ]*Hy;                 col[11].i=i;    col[11].j=j;    col[11].k=k+1;
                     v[12] = -v[11];                                 col[12].i=i-1;  col[12].j=j;    col[12].k=k+1;
-                    v[13] = user->muXz(i,j,k)*Hy;                   col[13].i=i-1;  col[13].j=j;    col[13].k=k;
+                    v[13] = edge[k][j][i][EDGE_MU_XZ]*Hy;                   col[13].i=i-1;  col[13].j=j;    col[13].k=k;
                     v[14] = -v[13];                                 col[14].i=i;    col[14].j=j;    col[14].k=k;
 
                     //p-coefficients, two terms.
@@ -777,30 +1379,30 @@ PetscErrorCode PetscAdLemTaras3D::computeMatrixTaras3d(
                     for(int ii=0; ii<7; ++ii)
                         col[ii].c = 1;
 
-                    v[0] = 2.0*user->muC(i+1,j+1,k+1)*HxHzdHy;      col[0].i=i;     col[0].j=j+1;   col[0].k=k;
-                    v[1] = 2.0*user->muC(i+1,j,k+1)*HxHzdHy;        col[1].i=i;     col[1].j=j-1;   col[1].k=k;
-                    v[2] = user->muXy(i+1,j,k)*HyHzdHx;             col[2].i=i+1;   col[2].j=j;     col[2].k=k;
-                    v[3] = user->muXy(i,j,k)*HyHzdHx;               col[3].i=i-1;   col[3].j=j;     col[3].k=k;
-                    v[4] = user->muYz(i,j,k+1)*HxHydHz;             col[4].i=i;     col[4].j=j;     col[4].k=k+1;
-                    v[5] = user->muYz(i,j,k)*HxHydHz;               col[5].i=i;     col[5].j=j;     col[5].k=k-1;
+                    v[0] = 2.0*cell[k+1][j+1][i+1][CELL_MU]*HxHzdHy;      col[0].i=i;     col[0].j=j+1;   col[0].k=k;
+                    v[1] = 2.0*cell[k+1][j][i+1][CELL_MU]*HxHzdHy;        col[1].i=i;     col[1].j=j-1;   col[1].k=k;
+                    v[2] = edge[k][j][i+1][EDGE_MU_XY]*HyHzdHx;             col[2].i=i+1;   col[2].j=j;     col[2].k=k;
+                    v[3] = edge[k][j][i][EDGE_MU_XY]*HyHzdHx;               col[3].i=i-1;   col[3].j=j;     col[3].k=k;
+                    v[4] = edge[k+1][j][i][EDGE_MU_YZ]*HxHydHz;             col[4].i=i;     col[4].j=j;     col[4].k=k+1;
+                    v[5] = edge[k][j][i][EDGE_MU_YZ]*HxHydHz;               col[5].i=i;     col[5].j=j;     col[5].k=k-1;
                     v[6] = -v[0]-v[1]-v[2]-v[3]-v[4]-v[5];          col[6].i=i;     col[6].j=j;     col[6].k=k;
 
                     //vx-coefficients, four terms.
                     for(int ii=7; ii<11; ++ii)
                         col[ii].c = 0;
 
-                    v[7] = user->muXy(i+1,j,k)*Hz;                  col[7].i=i+1;   col[7].j=j;     col[7].k=k;
+                    v[7] = edge[k][j][i+1][EDGE_MU_XY]*Hz;                  col[7].i=i+1;   col[7].j=j;     col[7].k=k;
                     v[8] = -v[7];                                   col[8].i=i+1;   col[8].j=j-1;   col[8].k=k;
-                    v[9] = user->muXy(i,j,k)*Hz;                    col[9].i=i;     col[9].j=j-1;   col[9].k=k;
+                    v[9] = edge[k][j][i][EDGE_MU_XY]*Hz;                    col[9].i=i;     col[9].j=j-1;   col[9].k=k;
                     v[10] = -v[9];                                  col[10].i=i;    col[10].j=j;    col[10].k=k;
 
                     //vz-coefficients, four terms.
                     for(int ii=11; ii<15; ++ii)
                         col[ii].c = 2;
 
-                    v[11] = user->muYz(i,j,k+1)*Hx;                 col[11].i=i;    col[11].j=j;    col[11].k=k+1;
+                    v[11] = edge[k+1][j][i][EDGE_MU_YZ]*Hx;                 col[11].i=i;    col[11].j=j;    col[11].k=k+1;
                     v[12] = -v[11];                                 col[12].i=i;    col[12].j=j-1;  col[12].k=k+1;
-                    v[13] = user->muYz(i,j,k)*Hx;                   col[13].i=i;    col[13].j=j-1;  col[13].k=k;
+                    v[13] = edge[k][j][i][EDGE_MU_YZ]*Hx;                   col[13].i=i;    col[13].j=j-1;  col[13].k=k;
                     v[14] = -v[13];                                 col[14].i=i;    col[14].j=j;    col[14].k=k;
 
                     //p-coefficients, two terms.
@@ -857,30 +1459,30 @@ PetscErrorCode PetscAdLemTaras3D::computeMatrixTaras3d(
                     for(int ii=0; ii<7; ++ii)
                         col[ii].c = 2;
 
-                    v[0] = 2.0*user->muC(i+1,j+1,k+1)*HxHydHz;      col[0].i=i;     col[0].j=j;     col[0].k=k+1;
-                    v[1] = 2.0*user->muC(i+1,j+1,k)*HxHydHz;        col[1].i=i;     col[1].j=j;     col[1].k=k-1;
-                    v[2] = user->muXz(i+1,j,k)*HyHzdHx;             col[2].i=i+1;   col[2].j=j;     col[2].k=k;
-                    v[3] = user->muXz(i,j,k)*HyHzdHx;               col[3].i=i-1;   col[3].j=j;     col[3].k=k;
-                    v[4] = user->muYz(i,j+1,k)*HxHzdHy;             col[4].i=i;     col[4].j=j+1;   col[4].k=k;
-                    v[5] = user->muYz(i,j,k)*HxHzdHy;               col[5].i=i;     col[5].j=j-1;   col[5].k=k;
+                    v[0] = 2.0*cell[k+1][j+1][i+1][CELL_MU]*HxHydHz;      col[0].i=i;     col[0].j=j;     col[0].k=k+1;
+                    v[1] = 2.0*cell[k][j+1][i+1][CELL_MU]*HxHydHz;        col[1].i=i;     col[1].j=j;     col[1].k=k-1;
+                    v[2] = edge[k][j][i+1][EDGE_MU_XZ]*HyHzdHx;             col[2].i=i+1;   col[2].j=j;     col[2].k=k;
+                    v[3] = edge[k][j][i][EDGE_MU_XZ]*HyHzdHx;               col[3].i=i-1;   col[3].j=j;     col[3].k=k;
+                    v[4] = edge[k][j+1][i][EDGE_MU_YZ]*HxHzdHy;             col[4].i=i;     col[4].j=j+1;   col[4].k=k;
+                    v[5] = edge[k][j][i][EDGE_MU_YZ]*HxHzdHy;               col[5].i=i;     col[5].j=j-1;   col[5].k=k;
                     v[6] = -v[0]-v[1]-v[2]-v[3]-v[4]-v[5];          col[6].i=i;     col[6].j=j;     col[6].k=k;
 
                     //vx-coefficients, four terms.
                     for(int ii=7; ii<11; ++ii)
                         col[ii].c = 0;
 
-                    v[7] = user->muXz(i+1,j,k)*Hy;                  col[7].i=i+1;   col[7].j=j;     col[7].k=k;
+                    v[7] = edge[k][j][i+1][EDGE_MU_XZ]*Hy;                  col[7].i=i+1;   col[7].j=j;     col[7].k=k;
                     v[8] = -v[7];                                   col[8].i=i+1;   col[8].j=j;     col[8].k=k-1;
-                    v[9] = user->muXz(i,j,k)*Hy;                    col[9].i=i;     col[9].j=j;     col[9].k=k-1;
+                    v[9] = edge[k][j][i][EDGE_MU_XZ]*Hy;                    col[9].i=i;     col[9].j=j;     col[9].k=k-1;
                     v[10] = -v[9];                                  col[10].i=i;    col[10].j=j;    col[10].k=k;
 
                     //vy-coefficients, four terms.
                     for(int ii=11; ii<15; ++ii)
                         col[ii].c = 1;
 
-                    v[11] = user->muYz(i,j+1,k)*Hx;                 col[11].i=i;    col[11].j=j+1;  col[11].k=k;
+                    v[11] = edge[k][j+1][i][EDGE_MU_YZ]*Hx;                 col[11].i=i;    col[11].j=j+1;  col[11].k=k;
                     v[12] = -v[11];                                 col[12].i=i;    col[12].j=j+1;  col[12].k=k-1;
-                    v[13] = user->muYz(i,j,k)*Hx;                   col[13].i=i;    col[13].j=j;    col[13].k=k-1;
+                    v[13] = edge[k][j][i][EDGE_MU_YZ]*Hx;                   col[13].i=i;    col[13].j=j;    col[13].k=k-1;
                     v[14] = -v[13];                                 col[14].i=i;    col[14].j=j;    col[14].k=k;
 
                     //p-coefficients, two terms.
@@ -953,6 +1555,8 @@ PetscErrorCode PetscAdLemTaras3D::computeMatrixTaras3d(
             }
         }
     }
+    ierr = DMDAVecRestoreArrayDOF(user->mDaEdge,user->mEdgeLocal,&edge);CHKERRQ(ierr);
+    ierr = DMDAVecRestoreArrayDOF(user->mDaCell,user->mCellLocal,&cell);CHKERRQ(ierr);
     ierr = MatAssemblyBegin(jac,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
     ierr = MatAssemblyEnd(jac,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
 
@@ -970,6 +1574,7 @@ PetscErrorCode PetscAdLemTaras3D::computeRHSTaras3d(KSP ksp, Vec b, void *ctx)
     PetscAdLemTaras3D::Field    ***rhs;
     DM             da;
     PetscReal       kCont=1.0;
+    PetscScalar     ****cell;    //coefficient cache, see updateCoefficientCache().
 
     PetscFunctionBeginUser;
     ierr = KSPGetDM(ksp,&da);CHKERRQ(ierr);
@@ -980,6 +1585,7 @@ PetscErrorCode PetscAdLemTaras3D::computeRHSTaras3d(KSP ksp, Vec b, void *ctx)
 
     ierr = DMDAGetCorners(da,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
     ierr = DMDAVecGetArray(da, b, &rhs);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(user->mDaCell,user->mCellLocal,&cell);CHKERRQ(ierr);
 
     for (k=zs; k<zs+zm; ++k) {
         for (j=ys; j<ys+ym; ++j) {
@@ -988,18 +1594,18 @@ PetscErrorCode PetscAdLemTaras3D::computeRHSTaras3d(KSP ksp, Vec b, void *ctx)
                 if (i==0 || i==mx-1 || j==0 || j==my-2 || j==my-1 || k==0 || k==mz-2 || k==mz-1) {
                     rhs[k][j][i].vx = 0;
                 } else { //interior points, x-momentum equation
-                    rhs[k][j][i].vx = Hy*Hz*(user->muC(i+1,j+1,k+1) + user->muC(i,j+1,k+1)
-                                             +user->lambdaC(i+1,j+1,k+1,0,0) + user->lambdaC(i,j+1,k+1,0,0)
-                                             )*(user->aC(i+1,j+1,k+1) - user->aC(i,j+1,k+1))/2.0;
+                    rhs[k][j][i].vx = Hy*Hz*(cell[k+1][j+1][i+1][CELL_MU] + cell[k+1][j+1][i][CELL_MU]
+                                             +cell[k+1][j+1][i+1][CELL_LAMBDA] + cell[k+1][j+1][i][CELL_LAMBDA]
+                                             )*(cell[k+1][j+1][i+1][CELL_ATROPHY] - cell[k+1][j+1][i][CELL_ATROPHY])/2.0;
                 }
                 // *********************** y-momentum equation *******************
                 //Ghost vy unknowns(x=mx-1,k=mz-1);boundary vy:(i=0,i=mx-2,j=0,j=my-1,k=0,k=mz-2)
                 if (i==0 || i==mx-2 || i==mx-1 || j==0 || j==my-1 || k==0 || k==mz-2 || k==mz-1) {
                     rhs[k][j][i].vy = 0;
                 } else { //interior points, y-momentum equation
-                    rhs[k][j][i].vy = Hx*Hz*(user->muC(i+1,j+1,k+1) + user->muC(i+1,j,k+1)
-                                             +user->lambdaC(i+1,j+1,k+1,0,0) + user->lambdaC(i+1,j,k+1,0,0)
-                                             )*(user->aC(i+1,j+1,k+1) - user->aC(i+1,j,k+1))/2.0;
+                    rhs[k][j][i].vy = Hx*Hz*(cell[k+1][j+1][i+1][CELL_MU] + cell[k+1][j][i+1][CELL_MU]
+                                             +cell[k+1][j+1][i+1][CELL_LAMBDA] + cell[k+1][j][i+1][CELL_LAMBDA]
+                                             )*(cell[k+1][j+1][i+1][CELL_ATROPHY] - cell[k+1][j][i+1][CELL_ATROPHY])/2.0;
                 }
 
                 // *********************** z-momentum equation *******************
@@ -1007,9 +1613,9 @@ PetscErrorCode PetscAdLemTaras3D::computeRHSTaras3d(KSP ksp, Vec b, void *ctx)
                 if (i==0 || i==mx-2 || i==mx-1 || j==0 || j==my-2 || j==my-1 || k==0 || k==mz-1) {
                     rhs[k][j][i].vz = 0;
                 } else { //interior points, z-momentum equation
-                    rhs[k][j][i].vz = Hx*Hy*(user->muC(i+1,j+1,k+1) + user->muC(i+1,j+1,k)
-                                             +user->lambdaC(i+1,j+1,k+1,0,0) + user->lambdaC(i+1,j+1,k,0,0)
-                                             )*(user->aC(i+1,j+1,k+1) - user->aC(i+1,j+1,k))/2.0;
+                    rhs[k][j][i].vz = Hx*Hy*(cell[k+1][j+1][i+1][CELL_MU] + cell[k][j+1][i+1][CELL_MU]
+                                             +cell[k+1][j+1][i+1][CELL_LAMBDA] + cell[k][j+1][i+1][CELL_LAMBDA]
+                                             )*(cell[k+1][j+1][i+1][CELL_ATROPHY] - cell[k][j+1][i+1][CELL_ATROPHY])/2.0;
                 }
 
                 //  ********************** continuity equation *********************
@@ -1023,12 +1629,13 @@ PetscErrorCode PetscAdLemTaras3D::computeRHSTaras3d(KSP ksp, Vec b, void *ctx)
                 //  rhs[k][j][i].p = kCont*user->getP0Cell();
                 //}
                 else {
-                    rhs[k][j][i].p = -kCont*user->aC(i,j,k);
+                    rhs[k][j][i].p = -kCont*cell[k][j][i][CELL_ATROPHY];
                 }
             }
         }
     }
 
+    ierr = DMDAVecRestoreArrayDOF(user->mDaCell,user->mCellLocal,&cell);CHKERRQ(ierr);
     ierr = DMDAVecRestoreArray(da, b, &rhs);CHKERRQ(ierr);
     //    ierr = VecAssemblyBegin(b);CHKERRQ(ierr);
     //    ierr = VecAssemblyEnd(b);CHKERRQ(ierr);
@@ -1039,366 +1646,1156 @@ PetscErrorCode PetscAdLemTaras3D::computeRHSTaras3d(KSP ksp, Vec b, void *ctx)
 
 
 #undef __FUNCT__
-#define __FUNCT__ "computeMatrixTaras3dConstantMu"
-PetscErrorCode PetscAdLemTaras3D::computeMatrixTaras3dConstantMu(
-        KSP ksp, Mat J, Mat jac, void *ctx)
+#define __FUNCT__ "getOperatorParams"
+PetscErrorCode PetscAdLemTaras3D::getOperatorParams(DM da, OperatorParams& par)
 {
-    PetscAdLemTaras3D *user = (PetscAdLemTaras3D*)ctx;
-
     PetscErrorCode  ierr;
-    PetscInt        i,j,k,mx,my,mz,xm,ym,zm,xs,ys,zs;
-    PetscReal       Hx,Hy,Hz,HyHzdHx,HxHzdHy,HxHydHz;
-    const unsigned int nnz = (user->isDiv12pointStencil()) ? 13 : 9;
-    PetscScalar     v[nnz];
-    MatStencil      row, col[nnz];
-    DM              da;
-    PetscReal       kBond = 1.0; //need to change it to scale the coefficients.
-    PetscReal       kCont = 1.0; //need to change it to scale the coefficients.
+    AdLem3D<3>      *model = this->getProblemModel();
+    PetscFunctionBeginUser;
+
+    ierr = DMDAGetInfo(da,0,&par.mx,&par.my,&par.mz,0,0,0,0,0,0,0,0,0);CHKERRQ(ierr);
+    const PetscReal Hx = model->getXspacing();
+    const PetscReal Hy = model->getYspacing();
+    const PetscReal Hz = model->getZspacing();
+    par.HyHzdHx = (Hy*Hz)/Hx;
+    par.HxHzdHy = (Hx*Hz)/Hy;
+    par.HxHydHz = (Hx*Hy)/Hz;
+    par.area[0] = Hy*Hz;    par.area[1] = Hx*Hz;    par.area[2] = Hx*Hy;
+    par.hInv[0] = 1./Hx;    par.hInv[1] = 1./Hy;    par.hInv[2] = 1./Hz;
+    par.kBond = 1.0;    //need to change it to scale the coefficients.
+    par.kCont = 1.0;    //need to change it to scale the coefficients.
+    par.div12 = this->isDiv12pointStencil();
+    par.skullBc = (PetscBool)(model->getBcType() == model->DIRICHLET_AT_SKULL);
+    par.zeroVelAtFalx = (PetscBool)model->zeroVelAtFalx();
+    par.slidingAtFalx = (PetscBool)model->slidingAtFalx();
+    par.falxZeroVelDir = model->getFalxSlidingZeroVelDir();
+    par.relaxIcInCsf = (PetscBool)model->relaxIcInCsf();
+    par.relaxIcCoeff = (fabs(model->getRelaxIcPressureCoeff()) < 1e-6) ? 0 : model->getRelaxIcPressureCoeff();
+    PetscFunctionReturn(0);
+}
+
+MatStencil PetscAdLemTaras3D::stencilAt(PetscInt i, PetscInt j, PetscInt k, PetscInt c)
+{
+    MatStencil s;
+    s.i = i;    s.j = j;    s.k = k;    s.c = c;
+    return s;
+}
+
+/*Row (i,j,k,c) of the operator for the (piecewise) constant viscosity discretization.
+ Returns the number of entries written to col and v. The columns depend only on the
+ position of the row in the grid and never on the mask: rows fixed by the boundary
+ conditions inside the domain (skull, falx) keep the full interior pattern with zero
+ coefficients, so that the same nonzero pattern can be refilled at every time step and
+ no stale coefficient of a previous mask is left in the matrix.*/
+PetscInt PetscAdLemTaras3D::operatorRow(const OperatorParams& par, PetscScalar ****cell,
+                                        PetscInt i, PetscInt j, PetscInt k, PetscInt c,
+                                        MatStencil col[], PetscScalar v[])
+{
+    const PetscInt skull = PetscAdLemTaras3D_SolverOps::CELL_SKULL;
+    const PetscInt allNbrsSkull = PetscAdLemTaras3D_SolverOps::CELL_ALL_NBRS_SKULL;
+    const PetscInt falx = PetscAdLemTaras3D_SolverOps::CELL_FALX;
+    const PetscInt relaxIc = PetscAdLemTaras3D_SolverOps::CELL_RELAX_IC;
+    const PetscInt pos[3] = {i, j, k};
+    const PetscInt num[3] = {par.mx, par.my, par.mz};
+    PetscInt d[3] = {0, 0, 0};  //unit vector in the direction of the velocity component.
+    PetscInt nm = 0;
+
+    if(c < 3) { // ********************* momentum equation for component c *******************
+        d[c] = 1;
+        for(PetscInt t=0; t<3; ++t) {
+            if(t != c && pos[t] == num[t]-1) { //ghost nodes at the end walls.
+                col[0] = stencilAt(i,j,k,c);    v[0] = par.kBond;
+                return 1;
+            }
+        }
+        if(pos[c] == 0 || pos[c] == num[c]-1) { //walls normal to the component: v = wall velocity.
+            col[0] = stencilAt(i,j,k,c);    v[0] = par.kBond;
+            return 1;
+        }
+        for(PetscInt t=0; t<3; ++t) { //walls parallel to the component: 3*v(i,j,k) - v(nbr) = 2*wall velocity.
+            if(t != c && (pos[t] == 0 || pos[t] == num[t]-2)) {
+                const PetscInt s = (pos[t] == 0) ? 1 : -1;
+                col[0] = stencilAt(i,j,k,c);    v[0] = 3*par.kBond;
+                col[1] = stencilAt(i + (t==0)*s, j + (t==1)*s, k + (t==2)*s, c);    v[1] = -par.kBond;
+                return 2;
+            }
+        }
+        //interior points: the two cells sharing the face where the velocity component lies.
+        const PetscInt f1 = cellFlags(cell,i+1,j+1,k+1);
+        const PetscInt f2 = cellFlags(cell,i+1-d[0],j+1-d[1],k+1-d[2]);
+        const bool fixedVel = (par.skullBc && ((f1 | f2) & skull)) //face touches a skull (non-brain region) cell
+            || (par.zeroVelAtFalx && ((f1 | f2) & falx))            //face touches a Falx Cerebri cell
+            || (par.slidingAtFalx && par.falxZeroVelDir == c && ((f1 | f2) & falx));
+        PetscScalar coeff = (cell[k+1][j+1][i+1][CELL_MU] + cell[k+1-d[2]][j+1-d[1]][i+1-d[0]][CELL_MU])/2.;
+        if(fixedVel)
+            coeff = 0;
+        //velocity coefficients, seven terms.
+        v[0] = coeff*par.HyHzdHx;       col[0] = stencilAt(i+1,j,k,c);
+        v[1] = coeff*par.HyHzdHx;       col[1] = stencilAt(i-1,j,k,c);
+        v[2] = coeff*par.HxHzdHy;       col[2] = stencilAt(i,j+1,k,c);
+        v[3] = coeff*par.HxHzdHy;       col[3] = stencilAt(i,j-1,k,c);
+        v[4] = coeff*par.HxHydHz;       col[4] = stencilAt(i,j,k+1,c);
+        v[5] = coeff*par.HxHydHz;       col[5] = stencilAt(i,j,k-1,c);
+        v[6] = (fixedVel) ? par.kBond : -2*(v[0]+v[2]+v[4]);    col[6] = stencilAt(i,j,k,c);
+        //pressure coefficients, two terms.
+        v[7] = (fixedVel) ? 0 : par.kCont*par.area[c];  col[7] = stencilAt(i+1-d[0],j+1-d[1],k+1-d[2],3);
+        v[8] = -v[7];                                   col[8] = stencilAt(i+1,j+1,k+1,3);
+        return 9;
+    }
+
+    //********************** continuity equation *********************
+    if (i==0 || j==0 || k==0 //Ghost values
+            || (i==1 && (j==1 || j==par.my-1 || k==1 || k==par.mz-1)) //west wall corners
+            || (i==par.mx-1 && (j==1 || j==par.my-1 || k==1 || k==par.mz-1)) //east wall corners
+            || (j==1 && (k==1 || k==par.mz-1)) //front wall horizontal corners
+            || (j==par.my-1 && (k==1 || k==par.mz-1)) //back wall horizontal corners
+            ) {
+        col[0] = stencilAt(i,j,k,3);    v[0] = par.kBond;
+        return 1;
+    }
+    const PetscInt flags = cellFlags(cell,i,j,k);
+    //Skull cell or a non-skull cell surrounded by skull cells in all its 6-neigbhor.
+    const bool fixedP = par.skullBc && (flags & (skull | allNbrsSkull));
+    const PetscReal commonCoeff = (par.div12) ? par.kCont/4. : par.kCont;
+    for(PetscInt t=0; t<3; ++t) { //velocity coefficients, two or four terms for each component.
+        d[0] = d[1] = d[2] = 0;
+        d[t] = 1;
+        const PetscScalar coeff = (fixedP) ? 0 : commonCoeff*par.hInv[t];
+        if(par.div12 && pos[t] < num[t]-2) {
+            col[nm] = stencilAt(i-1+2*d[0],j-1+2*d[1],k-1+2*d[2],t);  v[nm++] = coeff;
+        }
+        col[nm] = stencilAt(i-1+d[0],j-1+d[1],k-1+d[2],t);    v[nm++] = coeff;
+        col[nm] = stencilAt(i-1,j-1,k-1,t);                   v[nm++] = -coeff;
+        if(par.div12 && pos[t] > 2) {
+            col[nm] = stencilAt(i-1-d[0],j-1-d[1],k-1-d[2],t);  v[nm++] = -coeff;
+        }
+    }
+    // Pressure coefficient k whose value depends on whether IC is to be relaxed in this row or not.
+    col[nm] = stencilAt(i,j,k,3);
+    if(fixedP) {
+        v[nm++] = par.kBond;
+    } else if(par.relaxIcInCsf && (flags & relaxIc)) {
+        // Relax IC by setting a non-zero coeff. of pressure variable.
+        // Non-integer type RelaxIcLabel could be used to adapt the compressibilty based on partial volumes
+        // However, the variation in k in the eqn div(u) + kp = 0 required to have desirable effect is so big
+        // that this would perhaps only work if the partial volumes are scaled with some function to get desired
+        // big change in k. that is k = vol_fraction_of_IClabel * f(vol_fraction) might work if we find
+        // suitable f(vol_fraction). This is not done here currently, need to test several cases to make this work.
+        if (par.relaxIcCoeff == 0)
+            v[nm++] = 1./cell[k][j][i][CELL_LAMBDA];
+        else
+            v[nm++] = par.relaxIcCoeff;
+    } else if((par.zeroVelAtFalx || par.slidingAtFalx) && (flags & falx)) {
+        //If falx cerebri, just release the IC. This is different than what is done for skull cells
+        //setting p=0. Instead of setting p=0 in the Falx, just release the strict IC, using coeff. 1
+        v[nm++] = 1.0;
+    } else {
+        v[nm++] = 0; //Must set 0 since in multiple solves this row may have been a relax_ic row before.
+    }
+    return nm;
+}
 
+#undef __FUNCT__
+#define __FUNCT__ "createOperatorPattern"
+/*Nonzero pattern of the locally owned rows. Computed once: it depends only on the grid.*/
+PetscErrorCode PetscAdLemTaras3D::createOperatorPattern(DM da)
+{
+    PetscErrorCode          ierr;
+    PetscInt                i,j,k,c,xs,ys,zs,xm,ym,zm,gxs,gys,gzs,gxm,gym,gzm;
+    PetscScalar             ****cell;
+    OperatorParams          par;
+    MatStencil              col[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
+    PetscScalar             v[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
+    PetscInt                idx[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
+    ISLocalToGlobalMapping  ltog;
     PetscFunctionBeginUser;
-    if(user->getProblemModel()->noLameInRhs())
-	PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n RHS will be taken as grad(a), i.e without Lame parameters.\n");
-    else
-	PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n RHS will be taken as (mu + lambda)grad(a), i.e. with Lame parameters.\n");
 
-    PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n computing the operator for linear solve with %d point stencil for divergence\n", (nnz-1));
-    if (PetscAdLemTaras3D_SolverOps::RELAX_IC_WITH_ZERO_ROWS)
-	PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n Relax IC with zero rows corresponding to cells where IC is to be relaxed.\n", (nnz-1));
-    else
-	PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n Relax IC with div(u) + kp = 0 on relax cells\n", (nnz-1));
-    ierr = KSPGetDM(ksp,&da);CHKERRQ(ierr);
-    ierr = DMDAGetInfo(da,0,&mx,&my,&mz,0,0,0,0,0,0,0,0,0);CHKERRQ(ierr);
-    Hx = user->getProblemModel()->getXspacing();
-    Hy = user->getProblemModel()->getYspacing();
-    Hz = user->getProblemModel()->getZspacing();
-    //PetscSynchronizedPrintf(PETSC_COMM_WORLD,"grid spacings hx, hy, hz: (%f, %f, %f)\n", Hx, Hy, Hz);
-    HyHzdHx = (Hy*Hz)/Hx;
-    HxHzdHy = (Hx*Hz)/Hy;
-    HxHydHz = (Hx*Hy)/Hz;
+    ierr = getOperatorParams(da,par);CHKERRQ(ierr);
     ierr = DMDAGetCorners(da,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
-
+    ierr = DMDAGetGhostCorners(da,&gxs,&gys,&gzs,&gxm,&gym,&gzm);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(mDaCell,mCellLocal,&cell);CHKERRQ(ierr);
+
+    const PetscInt nRows = 4*xm*ym*zm;
+    mOpRowPtr.assign(nRows+1,0);
+    mOpCols.clear();
+    mOpCols.reserve(nRows*PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ);
+    PetscInt r = 0;
     for (k=zs; k<zs+zm; ++k) {
         for (j=ys; j<ys+ym; ++j) {
             for (i=xs; i<xs+xm; ++i) {
-                row.i = i; row.j = j; row.k = k;
-                // ********************* x-momentum equation *******************
-                row.c = 0;
-                col[0].c = 0;       col[1].c = 0; //boundary points, has at most two coeffs.
-
-                if(j==my-1 || k==mz-1) {     //back and north wall ghost nodes:
-                    v[0] = kBond;           col[0].i = i;   col[0].j = j;   col[0].k = k;
-                    ierr=MatSetValuesStencil(jac,1,&row,1,col,v,INSERT_VALUES);CHKERRQ(ierr);
-                } else if(i==0 || i==mx-1) { //west and east walls: vx = wx and vx = ex
-                    v[0] = kBond;           col[0].i = i;   col[0].j = j;   col[0].k = k;
-                    ierr=MatSetValuesStencil(jac,1,&row,1,col,v,INSERT_VALUES);CHKERRQ(ierr);
-                } else if(j==0 || j==my-2) { //front and back wall 3*vx(i,j,k) - vx(i,j+-1,k) = 2fx or 2bx
-                    v[0] = 3*kBond;         col[0].i = i;   col[0].j = j;   col[0].k=k;
-                    if (j==0) {
-                        v[1] = -kBond;      col[1].i = i;   col[1].j = j+1; col[1].k=k;
-                    }
-                    else {
-                        v[1] = -kBond;      col[1].i = i;   col[1].j = j-1; col[1].k=k;
-                    }
-                    ierr=MatSetValuesStencil(jac,1,&row,2,col,v,INSERT_VALUES);CHKERRQ(ierr);
-                } else if(k==0 || k==mz-2) { //south and north wall: //3*vx(i,j,k) - vx(i,j,k+-1) = 2sx or 2nx
-                    v[0] = 3*kBond;         col[0].i = i;   col[0].j = j;   col[0].k=k;
-                    if (k==0) {
-                        v[1] = -kBond;      col[1].i = i;   col[1].j = j;   col[1].k=k+1;
-                    }
-                    else {
-                        v[1] = -kBond;      col[1].i = i;   col[1].j = j;   col[1].k=k-1;
+                for (c=0; c<4; ++c) {
+                    const PetscInt n = operatorRow(par,cell,i,j,k,c,col,v);
+                    for (PetscInt m=0; m<n; ++m) { //local (ghosted) index of the column.
+                        mOpCols.push_back(4*(((col[m].k-gzs)*gym + (col[m].j-gys))*gxm + (col[m].i-gxs)) + col[m].c);
                     }
-                    ierr=MatSetValuesStencil(jac,1,&row,2,col,v,INSERT_VALUES);CHKERRQ(ierr);
-                } else if( (user->getProblemModel()->getBcType() == user->getProblemModel()->DIRICHLET_AT_SKULL) &&
-                            (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getSkullLabel() ||
-                             user->bMaskAt(i,j+1,k+1) == user->getProblemModel()->getSkullLabel())
-		    ) { //vx lying in the face that touches a skull (non-brain region) cell
-                    v[0] = kBond;           col[0].i = i;   col[0].j = j;   col[0].k = k;
-                    ierr=MatSetValuesStencil(jac,1,&row,1,col,v,INSERT_VALUES);CHKERRQ(ierr);
-                } else if( (user->getProblemModel()->zeroVelAtFalx()) &&
-			   (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getFalxCerebriLabel() ||
-			    user->bMaskAt(i,j+1,k+1) == user->getProblemModel()->getFalxCerebriLabel())
-		    ) { //vx lying in the face that touches a Falx Cerebri cell
-		    v[0] = kBond;           col[0].i = i;   col[0].j = j;   col[0].k = k;
-                    ierr=MatSetValuesStencil(jac,1,&row,1,col,v,INSERT_VALUES);CHKERRQ(ierr);
-		} else if( (user->getProblemModel()->slidingAtFalx() && (user->getProblemModel()->getFalxSlidingZeroVelDir()==0)) &&
-			   (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getFalxCerebriLabel() ||
-			    user->bMaskAt(i,j+1,k+1) == user->getProblemModel()->getFalxCerebriLabel())
-		    ) { //vx lying in the face that touches a Falx Cerebri cell
-		    v[0] = kBond;           col[0].i = i;   col[0].j = j;   col[0].k = k;
-                    ierr=MatSetValuesStencil(jac,1,&row,1,col,v,INSERT_VALUES);CHKERRQ(ierr);
-		}
-                else { //interior points, x-momentum equation
-                    //vx-coefficients, seven terms.
-                    for(int ii=0; ii<7; ++ii) col[ii].c = 0;
-                    PetscScalar coeff = (user->muC(i+1,j+1,k+1) + user->muC(i,j+1,k+1))/2.;
-                    v[0] = coeff*HyHzdHx;          col[0].i=i+1;   col[0].j=j;     col[0].k=k;
-                    v[1] = coeff*HyHzdHx;          col[1].i=i-1;   col[1].j=j;     col[1].k=k;
-                    v[2] = coeff*HxHzdHy;          col[2].i=i;     col[2].j=j+1;   col[2].k=k;
-                    v[3] = coeff*HxHzdHy;          col[3].i=i;     col[3].j=j-1;   col[3].k=k;
-                    v[4] = coeff*HxHydHz;          col[4].i=i;     col[4].j=j;     col[4].k=k+1;
-                    v[5] = coeff*HxHydHz;          col[5].i=i;     col[5].j=j;     col[5].k=k-1;
-                    v[6] = -2*(v[0]+v[2]+v[4]);    col[6].i=i;     col[6].j=j;     col[6].k=k;
-                    //p-coefficients, two terms.
-                    col[7].c = 3;      col[8].c = 3;
-                    v[7] = kCont*Hy*Hz;        col[7].i=i;    col[7].j=j+1;  col[7].k=k+1;
-                    v[8] = -v[7];              col[8].i=i+1;  col[8].j=j+1;  col[8].k=k+1;
+                    mOpRowPtr[++r] = mOpCols.size();
+                }
+            }
+        }
+    }
+    ierr = DMDAVecRestoreArrayDOF(mDaCell,mCellLocal,&cell);CHKERRQ(ierr);
+
+    ierr = DMGetLocalToGlobalMapping(da,&ltog);CHKERRQ(ierr);
+    ierr = ISLocalToGlobalMappingApply(ltog,mOpCols.size(),&mOpCols[0],&mOpCols[0]);CHKERRQ(ierr);
+    mOpPerm.resize(mOpCols.size());
+    for (r=0; r<nRows; ++r) {
+        const PetscInt s = mOpRowPtr[r];
+        const PetscInt n = mOpRowPtr[r+1] - s;
+        for (PetscInt m=0; m<n; ++m)
+            idx[m] = m;
+        ierr = PetscSortIntWithArray(n,&mOpCols[s],idx);CHKERRQ(ierr);
+        for (PetscInt m=0; m<n; ++m)
+            mOpPerm[s+m] = (unsigned char)idx[m];
+    }
 
-                    ierr=MatSetValuesStencil(jac,1,&row,9,col,v,INSERT_VALUES);
+    PetscInt nnzLocal = mOpCols.size(), nnz;
+    ierr = MPI_Allreduce(&nnzLocal,&nnz,1,MPIU_INT,MPI_SUM,PETSC_COMM_WORLD);CHKERRQ(ierr);
+    PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n operator nonzero pattern with %d nonzeros created\n",nnz);
+    mOpPatternCreated = PETSC_TRUE;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "createOperatorMatrix"
+/*Replaces DMCreateMatrix of mDa: preallocates exactly the nonzero pattern of the staggered
+ discretization instead of the dense BOX stencil of the DMDA, or creates the
+ matrix-free operator.*/
+PetscErrorCode PetscAdLemTaras3D::createOperatorMatrix(DM da, Mat *A)
+{
+    PetscErrorCode          ierr;
+    PetscAdLemTaras3D       *user;
+    PetscInt                starts[3], dims[3], xm, ym, zm;
+    ISLocalToGlobalMapping  ltog;
+    PetscFunctionBeginUser;
+
+    ierr = DMGetApplicationContext(da,&user);CHKERRQ(ierr);
+    if(user->mMatrixFree) {
+        ierr = user->createShellOperator(da,A);CHKERRQ(ierr);
+        PetscFunctionReturn(0);
+    }
+    if(!user->mOpPatternCreated) {
+        ierr = user->createOperatorPattern(da);CHKERRQ(ierr);
+    }
+    ierr = DMDAGetCorners(da,0,0,0,&xm,&ym,&zm);CHKERRQ(ierr);
+    const PetscInt nRows = 4*xm*ym*zm;
+    ierr = MatCreate(PetscObjectComm((PetscObject)da),A);CHKERRQ(ierr);
+    ierr = MatSetSizes(*A,nRows,nRows,PETSC_DETERMINE,PETSC_DETERMINE);CHKERRQ(ierr);
+    ierr = MatSetBlockSize(*A,4);CHKERRQ(ierr);
+    ierr = MatSetType(*A,MATAIJ);CHKERRQ(ierr);
+    ierr = DMGetLocalToGlobalMapping(da,&ltog);CHKERRQ(ierr);
+    ierr = MatSetLocalToGlobalMapping(*A,ltog,ltog);CHKERRQ(ierr);
+    ierr = DMDAGetGhostCorners(da,&starts[0],&starts[1],&starts[2],&dims[0],&dims[1],&dims[2]);CHKERRQ(ierr);
+    ierr = MatSetStencil(*A,3,dims,starts,4);CHKERRQ(ierr);
+    //Only the call matching the matrix type has effect. Zero values are inserted in the pattern.
+    ierr = MatSeqAIJSetPreallocationCSR(*A,&user->mOpRowPtr[0],&user->mOpCols[0],NULL);CHKERRQ(ierr);
+    ierr = MatMPIAIJSetPreallocationCSR(*A,&user->mOpRowPtr[0],&user->mOpCols[0],NULL);CHKERRQ(ierr);
+    ierr = MatSetOption(*A,MAT_NEW_NONZERO_ALLOCATION_ERR,PETSC_TRUE);CHKERRQ(ierr);
+    ierr = MatSetDM(*A,da);CHKERRQ(ierr);
+    user->mOpMatFromPattern = PETSC_TRUE;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "createShellOperator"
+/*Matrix-free operator (-taras_matrix_free): the rows of operatorRow() are applied directly from
+ the coefficient cache, so the only storage is a ghosted local vector of mDa.*/
+PetscErrorCode PetscAdLemTaras3D::createShellOperator(DM da, Mat *A)
+{
+    PetscErrorCode  ierr;
+    PetscInt        xm, ym, zm;
+    PetscFunctionBeginUser;
+
+    ierr = DMDAGetCorners(da,0,0,0,&xm,&ym,&zm);CHKERRQ(ierr);
+    const PetscInt nRows = 4*xm*ym*zm;
+    //same as MatCreateShell() but with the block size, used by -pc_fieldsplit_%d_fields splits.
+    ierr = MatCreate(PetscObjectComm((PetscObject)da),A);CHKERRQ(ierr);
+    ierr = MatSetSizes(*A,nRows,nRows,PETSC_DETERMINE,PETSC_DETERMINE);CHKERRQ(ierr);
+    ierr = MatSetBlockSize(*A,4);CHKERRQ(ierr);
+    ierr = MatSetType(*A,MATSHELL);CHKERRQ(ierr);
+    ierr = MatShellSetContext(*A,this);CHKERRQ(ierr);
+    ierr = MatSetUp(*A);CHKERRQ(ierr);
+    ierr = MatShellSetOperation(*A,MATOP_MULT,(void(*)(void))shellMult);CHKERRQ(ierr);
+    ierr = MatShellSetOperation(*A,MATOP_GET_DIAGONAL,(void(*)(void))shellGetDiagonal);CHKERRQ(ierr);
+    ierr = MatShellSetOperation(*A,MATOP_GET_SUBMATRIX,(void(*)(void))shellGetSubMatrix);CHKERRQ(ierr);
+    if(!mShellXLocal) {
+        ierr = DMCreateLocalVector(da,&mShellXLocal);CHKERRQ(ierr);
+    }
+    PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n using matrix-free operator\n");
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "shellMult"
+PetscErrorCode PetscAdLemTaras3D::shellMult(Mat A, Vec x, Vec y)
+{
+    PetscErrorCode      ierr;
+    PetscAdLemTaras3D   *user;
+    PetscInt            i,j,k,c,xs,ys,zs,xm,ym,zm;
+    MatStencil          col[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
+    PetscScalar         v[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
+    OperatorParams      par;
+    PetscScalar         ****cell, ****xArray, ****yArray;
+    PetscFunctionBeginUser;
+
+    ierr = MatShellGetContext(A,&user);CHKERRQ(ierr);
+    DM da = user->mDa;
+    ierr = user->getOperatorParams(da,par);CHKERRQ(ierr);
+    ierr = DMDAGetCorners(da,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
+    ierr = DMGlobalToLocalBegin(da,x,INSERT_VALUES,user->mShellXLocal);CHKERRQ(ierr);
+    ierr = DMGlobalToLocalEnd(da,x,INSERT_VALUES,user->mShellXLocal);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(da,user->mShellXLocal,&xArray);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(da,y,&yArray);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(user->mDaCell,user->mCellLocal,&cell);CHKERRQ(ierr);
+    for (k=zs; k<zs+zm; ++k) {
+        for (j=ys; j<ys+ym; ++j) {
+            for (i=xs; i<xs+xm; ++i) {
+                for (c=0; c<4; ++c) {
+                    const PetscInt n = operatorRow(par,cell,i,j,k,c,col,v);
+                    PetscScalar sum = 0;
+                    for (PetscInt m=0; m<n; ++m)
+                        sum += v[m]*xArray[col[m].k][col[m].j][col[m].i][col[m].c];
+                    yArray[k][j][i][c] = sum;
                 }
-                //*********************** y-momentum equation *******************
-                row.c = 1;
-                col[0].c = 1;       col[1].c = 1;   //boundary points, at most two coeffs.
-                if(i==mx-1 || k==mz-1) {   //east and north ghost walls.
-                    v[0] = kBond;           col[0].i = i;   col[0].j = j;   col[0].k = k;
-                    ierr=MatSetValuesStencil(jac,1,&row,1,col,v,INSERT_VALUES);CHKERRQ(ierr);
-                } else if(j==0 || j==my-1) { //front or back wall: vy = fy or by
-                    v[0] = kBond;           col[0].i = i;   col[0].j = j;   col[0].k = k;
-                    ierr=MatSetValuesStencil(jac,1,&row,1,col,v,INSERT_VALUES);CHKERRQ(ierr);
-                } else if(i==0 || i==mx-2) { //west or east wall: //3*vy(i,j,k) - vy(i+or-1,j,k) = 2wy or 2ey
-                    v[0] = 3*kBond;         col[0].i = i;   col[0].j = j;   col[0].k=k;
-                    if (i==0) {
-                        v[1] = -kBond;      col[1].i = i+1; col[1].j = j;   col[1].k=k;
-                    }
-                    else {
-                        v[1] = -kBond;      col[1].i = i-1; col[1].j = j;   col[1].k=k;
-                    }
-                    ierr=MatSetValuesStencil(jac,1,&row,2,col,v,INSERT_VALUES);CHKERRQ(ierr);
-                } else if(k==0 || k==mz-2) { //south or north wall:3*vy(i,j,k) - vy(i,j,k+-1) = 2sy or 2ny
-                    v[0] = 3*kBond;         col[0].i = i;   col[0].j = j;   col[0].k=k;
-                    if (k==0) {
-                        v[1] = -kBond;      col[1].i = i;   col[1].j = j;   col[1].k=k+1;
-                    }
-                    else {
-                        v[1] = -kBond;      col[1].i = i;   col[1].j = j;   col[1].k=k-1;
+            }
+        }
+    }
+    ierr = DMDAVecRestoreArrayDOF(user->mDaCell,user->mCellLocal,&cell);CHKERRQ(ierr);
+    ierr = DMDAVecRestoreArrayDOF(da,y,&yArray);CHKERRQ(ierr);
+    ierr = DMDAVecRestoreArrayDOF(da,user->mShellXLocal,&xArray);CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "shellGetDiagonal"
+PetscErrorCode PetscAdLemTaras3D::shellGetDiagonal(Mat A, Vec d)
+{
+    PetscErrorCode      ierr;
+    PetscAdLemTaras3D   *user;
+    PetscInt            i,j,k,c,xs,ys,zs,xm,ym,zm;
+    MatStencil          col[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
+    PetscScalar         v[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
+    OperatorParams      par;
+    PetscScalar         ****cell, ****dArray;
+    PetscFunctionBeginUser;
+
+    ierr = MatShellGetContext(A,&user);CHKERRQ(ierr);
+    DM da = user->mDa;
+    ierr = user->getOperatorParams(da,par);CHKERRQ(ierr);
+    ierr = DMDAGetCorners(da,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(da,d,&dArray);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(user->mDaCell,user->mCellLocal,&cell);CHKERRQ(ierr);
+    for (k=zs; k<zs+zm; ++k) {
+        for (j=ys; j<ys+ym; ++j) {
+            for (i=xs; i<xs+xm; ++i) {
+                for (c=0; c<4; ++c) {
+                    const PetscInt n = operatorRow(par,cell,i,j,k,c,col,v);
+                    dArray[k][j][i][c] = 0;
+                    for (PetscInt m=0; m<n; ++m) {
+                        if(col[m].i == i && col[m].j == j && col[m].k == k && col[m].c == c)
+                            dArray[k][j][i][c] = v[m];
                     }
-                    ierr=MatSetValuesStencil(jac,1,&row,2,col,v,INSERT_VALUES);CHKERRQ(ierr);
-                } else if ( (user->getProblemModel()->getBcType() == user->getProblemModel()->DIRICHLET_AT_SKULL) &&
-                            (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getSkullLabel() ||
-                             user->bMaskAt(i+1,j,k+1) == user->getProblemModel()->getSkullLabel())
-                            ) { //vy lying in the face that touches a skull (non-brain region) cell
-                    v[0] = kBond;           col[0].i = i;   col[0].j = j;   col[0].k = k;
-                    ierr=MatSetValuesStencil(jac,1,&row,1,col,v,INSERT_VALUES);CHKERRQ(ierr);
-                } else if( (user->getProblemModel()->zeroVelAtFalx()) &&
-			   (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getFalxCerebriLabel() ||
-			    user->bMaskAt(i+1,j,k+1) == user->getProblemModel()->getFalxCerebriLabel())
-		    ) { //vy lying in the face that touches a Falx Cerebri cell
-		    v[0] = kBond;           col[0].i = i;   col[0].j = j;   col[0].k = k;
-                    ierr=MatSetValuesStencil(jac,1,&row,1,col,v,INSERT_VALUES);CHKERRQ(ierr);
-		} else if( (user->getProblemModel()->slidingAtFalx() && (user->getProblemModel()->getFalxSlidingZeroVelDir()==1)) &&
-			   (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getFalxCerebriLabel() ||
-			    user->bMaskAt(i+1,j,k+1) == user->getProblemModel()->getFalxCerebriLabel())
-		    ) { //vy lying in the face that touches a Falx Cerebri cell
-		    v[0] = kBond;           col[0].i = i;   col[0].j = j;   col[0].k = k;
-                    ierr=MatSetValuesStencil(jac,1,&row,1,col,v,INSERT_VALUES);CHKERRQ(ierr);
-		}
-                else { //interior points, y-momentum equation
-                    //vy-coefficients, seven terms.
-                    for(int ii=0; ii<7; ++ii) col[ii].c = 1;
-                    PetscScalar coeff = (user->muC(i+1,j+1,k+1) + user->muC(i+1,j,k+1))/2.;
-                    v[0] = coeff*HyHzdHx;          col[0].i=i+1;   col[0].j=j;     col[0].k=k;
-                    v[1] = coeff*HyHzdHx;          col[1].i=i-1;   col[1].j=j;     col[1].k=k;
-                    v[2] = coeff*HxHzdHy;          col[2].i=i;     col[2].j=j+1;   col[2].k=k;
-                    v[3] = coeff*HxHzdHy;          col[3].i=i;     col[3].j=j-1;   col[3].k=k;
-                    v[4] = coeff*HxHydHz;          col[4].i=i;     col[4].j=j;     col[4].k=k+1;
-                    v[5] = coeff*HxHydHz;          col[5].i=i;     col[5].j=j;     col[5].k=k-1;
-                    v[6] = -2*(v[0]+v[2]+v[4]);    col[6].i=i;     col[6].j=j;     col[6].k=k;
+                }
+            }
+        }
+    }
+    ierr = DMDAVecRestoreArrayDOF(user->mDaCell,user->mCellLocal,&cell);CHKERRQ(ierr);
+    ierr = DMDAVecRestoreArrayDOF(da,d,&dArray);CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
 
-                    //p-coefficients, two terms.
-                    col[7].c = 3;      col[8].c = 3;
-                    v[7] = kCont*Hx*Hz;       col[7].i=i+1;  col[7].j=j;    col[7].k=k+1;
-                    v[8] = -v[7];             col[8].i=i+1;  col[8].j=j+1;  col[8].k=k+1;
+#undef __FUNCT__
+#define __FUNCT__ "shellGetSubMatrix"
+/*Assembles the block of the matrix-free operator given by the row and column index sets, e.g.
+ the velocity block and the coupling blocks extracted by PCFIELDSPLIT. Both index sets must
+ contain only rows owned by this process, which is the case for the DMDA field splits.*/
+PetscErrorCode PetscAdLemTaras3D::shellGetSubMatrix(Mat A, IS isRow, IS isCol, MatReuse reuse, Mat *B)
+{
+    PetscErrorCode      ierr;
+    PetscAdLemTaras3D   *user;
+    PetscInt            xs,ys,zs,xm,ym,zm,rStart,rEnd,nRow,nCol,rowEnd,colEnd;
+    const PetscInt      *rowIdx, *colIdx;
+    MatStencil          col[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
+    PetscScalar         v[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
+    PetscInt            subCol[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
+    OperatorParams      par;
+    PetscScalar         ****cell, ****colMapArray, *colMapValues;
+    Vec                 colMap, colMapLocal;
+    PetscFunctionBeginUser;
 
-                    ierr=MatSetValuesStencil(jac,1,&row,9,col,v,INSERT_VALUES);
+    ierr = MatShellGetContext(A,&user);CHKERRQ(ierr);
+    DM da = user->mDa;
+    MPI_Comm comm = PetscObjectComm((PetscObject)A);
+    ierr = user->getOperatorParams(da,par);CHKERRQ(ierr);
+    ierr = DMDAGetCorners(da,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
+    ierr = MatGetOwnershipRange(A,&rStart,&rEnd);CHKERRQ(ierr);
+    ierr = ISGetLocalSize(isRow,&nRow);CHKERRQ(ierr);
+    ierr = ISGetLocalSize(isCol,&nCol);CHKERRQ(ierr);
+    ierr = MPI_Scan(&nRow,&rowEnd,1,MPIU_INT,MPI_SUM,comm);CHKERRQ(ierr);
+    ierr = MPI_Scan(&nCol,&colEnd,1,MPIU_INT,MPI_SUM,comm);CHKERRQ(ierr);
+    const PetscInt rowStart = rowEnd - nRow;
+    const PetscInt colStart = colEnd - nCol;
+
+    //Column index of the submatrix for every dof, -1 if not in isCol; ghosted so that it can
+    //be read at the stencil columns.
+    ierr = DMGetGlobalVector(da,&colMap);CHKERRQ(ierr);
+    ierr = DMGetLocalVector(da,&colMapLocal);CHKERRQ(ierr);
+    ierr = VecSet(colMap,-1.0);CHKERRQ(ierr);
+    ierr = ISGetIndices(isCol,&colIdx);CHKERRQ(ierr);
+    ierr = VecGetArray(colMap,&colMapValues);CHKERRQ(ierr);
+    for (PetscInt p=0; p<nCol; ++p) {
+        if(colIdx[p] < rStart || colIdx[p] >= rEnd)
+            SETERRQ(PETSC_COMM_SELF,PETSC_ERR_SUP,"matrix-free operator: only index sets of locally owned columns are supported.\n");
+        colMapValues[colIdx[p]-rStart] = colStart + p;
+    }
+    ierr = VecRestoreArray(colMap,&colMapValues);CHKERRQ(ierr);
+    ierr = ISRestoreIndices(isCol,&colIdx);CHKERRQ(ierr);
+    ierr = DMGlobalToLocalBegin(da,colMap,INSERT_VALUES,colMapLocal);CHKERRQ(ierr);
+    ierr = DMGlobalToLocalEnd(da,colMap,INSERT_VALUES,colMapLocal);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(da,colMapLocal,&colMapArray);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(user->mDaCell,user->mCellLocal,&cell);CHKERRQ(ierr);
+    ierr = ISGetIndices(isRow,&rowIdx);CHKERRQ(ierr);
+
+    //pass 0 counts the nonzeros for preallocation (only for a new matrix), pass 1 inserts the values.
+    std::vector<PetscInt> dnnz, onnz;
+    if(reuse == MAT_INITIAL_MATRIX) {
+        dnnz.assign(nRow,0);
+        onnz.assign(nRow,0);
+    }
+    for (PetscInt pass=(reuse == MAT_INITIAL_MATRIX) ? 0 : 1; pass<2; ++pass) {
+        if(pass == 1 && reuse == MAT_INITIAL_MATRIX) {
+            ierr = MatCreate(comm,B);CHKERRQ(ierr);
+            ierr = MatSetSizes(*B,nRow,nCol,PETSC_DETERMINE,PETSC_DETERMINE);CHKERRQ(ierr);
+            ierr = MatSetType(*B,MATAIJ);CHKERRQ(ierr);
+            ierr = MatSeqAIJSetPreallocation(*B,0,(nRow) ? &dnnz[0] : NULL);CHKERRQ(ierr);
+            ierr = MatMPIAIJSetPreallocation(*B,0,(nRow) ? &dnnz[0] : NULL,0,(nRow) ? &onnz[0] : NULL);CHKERRQ(ierr);
+        }
+        for (PetscInt r=0; r<nRow; ++r) {
+            if(rowIdx[r] < rStart || rowIdx[r] >= rEnd)
+                SETERRQ(PETSC_COMM_SELF,PETSC_ERR_SUP,"matrix-free operator: only index sets of locally owned rows are supported.\n");
+            //grid point and component of the row in the k-j-i-c ordering of the owned dofs.
+            const PetscInt l = rowIdx[r] - rStart;
+            const PetscInt p = l/4, c = l%4;
+            const PetscInt i = xs + p%xm, j = ys + (p/xm)%ym, k = zs + p/(xm*ym);
+            const PetscInt n = operatorRow(par,cell,i,j,k,c,col,v);
+            PetscInt numOfCols = 0;
+            for (PetscInt m=0; m<n; ++m) {
+                const PetscInt sc = (PetscInt)PetscRealPart(colMapArray[col[m].k][col[m].j][col[m].i][col[m].c]);
+                if(sc < 0)
+                    continue;
+                if(pass == 0) {
+                    if(sc >= colStart && sc < colEnd) ++dnnz[r];
+                    else ++onnz[r];
+                } else {
+                    subCol[numOfCols] = sc;
+                    v[numOfCols++] = v[m];
                 }
+            }
+            if(pass == 1) {
+                const PetscInt subRow = rowStart + r;
+                ierr = MatSetValues(*B,1,&subRow,numOfCols,subCol,v,INSERT_VALUES);CHKERRQ(ierr);
+            }
+        }
+    }
+    ierr = ISRestoreIndices(isRow,&rowIdx);CHKERRQ(ierr);
+    ierr = DMDAVecRestoreArrayDOF(user->mDaCell,user->mCellLocal,&cell);CHKERRQ(ierr);
+    ierr = DMDAVecRestoreArrayDOF(da,colMapLocal,&colMapArray);CHKERRQ(ierr);
+    ierr = DMRestoreLocalVector(da,&colMapLocal);CHKERRQ(ierr);
+    ierr = DMRestoreGlobalVector(da,&colMap);CHKERRQ(ierr);
+    ierr = MatAssemblyBegin(*B,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+    ierr = MatAssemblyEnd(*B,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
 
-                //*********************** z-momentum equation *******************
-                row.c = 2;
-                col[0].c = 2;       col[1].c = 2;       //at most two points for boundary nodes.
+#undef __FUNCT__
+#define __FUNCT__ "fillOperatorRows"
+/*Fills the values of the operator in the fixed nonzero pattern. When the matrix was
+ preallocated by createOperatorMatrix() each row is copied directly into the AIJ storage,
+ otherwise (e.g. -taras_dmda_prealloc) it is inserted with global indices.
+ If pointMark is given, only the rows of the owned grid points with non-zero mark
+ (ordered as the owned points, k-j-i) are filled. The matrix is not assembled here.*/
+PetscErrorCode PetscAdLemTaras3D::fillOperatorRows(DM da, Mat jac, const std::vector<char> *pointMark)
+{
+    PetscErrorCode  ierr;
+    PetscInt        i,j,k,c,xm,ym,zm,xs,ys,zs,rStart;
+    MatStencil      col[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
+    PetscScalar     v[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
+    PetscScalar     vSorted[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
+    OperatorParams  par;
+    PetscBool       isAij, isShell;
+    PetscScalar     ****cell;    //coefficient cache, see updateCoefficientCache().
+    PetscFunctionBeginUser;
 
-                if(i==mx-1 || j==my-1) {   //east and back ghost walls.
-                    v[0] = kBond;           col[0].i = i;   col[0].j = j;   col[0].k = k;
-                    ierr=MatSetValuesStencil(jac,1,&row,1,col,v,INSERT_VALUES);CHKERRQ(ierr);
-                } else if(k==0 || k==mz-1) { //south or north walls: vz = sz or nz
-                    v[0] = kBond;           col[0].i = i;   col[0].j = j;   col[0].k = k;
-                    ierr=MatSetValuesStencil(jac,1,&row,1,col,v,INSERT_VALUES);CHKERRQ(ierr);
-                } else if(i==0 || i==mx-2) { //west or east wall: 3vz(i,j,k)-vz(i+-1,j,k)=2wz or 2ez
-                    v[0] = 3*kBond;         col[0].i = i;   col[0].j = j;   col[0].k=k;
-                    if (i==0) {
-                        v[1] = -kBond;      col[1].i = i+1; col[1].j = j;   col[1].k=k;
-                    }
-                    else if (i==mx-2) {
-                        v[1] = -kBond;      col[1].i = i-1; col[1].j = j;   col[1].k=k;
-                    }
-                    ierr=MatSetValuesStencil(jac,1,&row,2,col,v,INSERT_VALUES);CHKERRQ(ierr);
-                } else if(j==0 || j==my-2) { //front or back wall: 3vz(i,j,k)-vz(i,j+-1,k)=2fz or 2bz
-                    v[0] = 3*kBond;         col[0].i = i;   col[0].j = j;   col[0].k=k;
-                    if (j==0) {
-                        v[1] = -kBond;      col[1].i = i;   col[1].j = j+1; col[1].k=k;
+    //nothing to fill in the matrix-free operator: rows are applied from the coefficient cache.
+    ierr = PetscObjectTypeCompare((PetscObject)jac,MATSHELL,&isShell);CHKERRQ(ierr);
+    if(isShell)
+        PetscFunctionReturn(0);
+    ierr = getOperatorParams(da,par);CHKERRQ(ierr);
+    if(!mOpPatternCreated) {
+        ierr = createOperatorPattern(da);CHKERRQ(ierr);
+    }
+    ierr = DMDAGetCorners(da,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
+    ierr = MatGetOwnershipRange(jac,&rStart,NULL);CHKERRQ(ierr);
+    ierr = PetscObjectTypeCompareAny((PetscObject)jac,&isAij,MATSEQAIJ,MATMPIAIJ,"");CHKERRQ(ierr);
+    const bool copyRows = isAij && mOpMatFromPattern;
+    const PetscInt      *rowPtr = &mOpRowPtr[0];
+    const PetscInt      *cols = &mOpCols[0];
+    const unsigned char *perm = &mOpPerm[0];
+
+    ierr = DMDAVecGetArrayDOF(mDaCell,mCellLocal,&cell);CHKERRQ(ierr);
+    PetscInt p = 0;
+    for (k=zs; k<zs+zm; ++k) {
+        for (j=ys; j<ys+ym; ++j) {
+            for (i=xs; i<xs+xm; ++i, ++p) {
+                if(pointMark && !(*pointMark)[p])
+                    continue;
+                for (c=0; c<4; ++c) {
+                    const PetscInt r = 4*p + c;
+                    const PetscInt n = operatorRow(par,cell,i,j,k,c,col,v);
+                    if(n != rowPtr[r+1]-rowPtr[r])
+                        SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_PLIB,"operator row does not match the nonzero pattern.\n");
+                    for (PetscInt m=0; m<n; ++m)
+                        vSorted[m] = v[perm[rowPtr[r]+m]];
+                    if(copyRows) {
+                        ierr = MatSetValuesRow(jac,rStart+r,vSorted);CHKERRQ(ierr);
+                    } else {
+                        const PetscInt row = rStart+r;
+                        ierr = MatSetValues(jac,1,&row,n,&cols[rowPtr[r]],vSorted,INSERT_VALUES);CHKERRQ(ierr);
                     }
-                    else if (j==my-2) {
-                        v[1] = -kBond;      col[1].i = i;   col[1].j = j-1; col[1].k=k;
+                }
+            }
+        }
+    }
+    ierr = DMDAVecRestoreArrayDOF(mDaCell,mCellLocal,&cell);CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "updateOperatorRows"
+/*Incremental update of the assembled operator mA after a small change of the mask.
+ Refills only the rows whose stencil reads a cell of a changed voxel: the momentum rows
+ read the two cells sharing their face and the continuity rows read their own cell and,
+ through the ALL_NBRS_SKULL flag, its 6-neighbours. So the grid points in [C-1,C+1]^3
+ around each changed cell C cover all of them.*/
+PetscErrorCode PetscAdLemTaras3D::updateOperatorRows(const std::vector<unsigned int> &changedVoxels)
+{
+    PetscErrorCode  ierr;
+    PetscInt        xs,ys,zs,xm,ym,zm,numOfPoints=0,totalPoints;
+    PetscFunctionBeginUser;
+
+    ierr = DMDAGetCorners(mDa,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
+    std::vector<char> pointMark(xm*ym*zm,0);
+    for (size_t v=0; v+2<changedVoxels.size(); v+=3) {
+        const PetscInt x = changedVoxels[v], y = changedVoxels[v+1], z = changedVoxels[v+2];
+        //cells of the voxel are x+1 and, on a start face, the ghost cell 0 as well.
+        for (PetscInt k=PetscMax((z==0)?-1:z,zs); k<=PetscMin(z+2,zs+zm-1); ++k)
+            for (PetscInt j=PetscMax((y==0)?-1:y,ys); j<=PetscMin(y+2,ys+ym-1); ++j)
+                for (PetscInt i=PetscMax((x==0)?-1:x,xs); i<=PetscMin(x+2,xs+xm-1); ++i)
+                    pointMark[((k-zs)*ym + (j-ys))*xm + (i-xs)] = 1;
+    }
+    for (size_t p=0; p<pointMark.size(); ++p)
+        numOfPoints += pointMark[p];
+    ierr = fillOperatorRows(mDa,mA,&pointMark);CHKERRQ(ierr);
+    ierr = MatAssemblyBegin(mA,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+    ierr = MatAssemblyEnd(mA,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+
+    ierr = MPI_Allreduce(&numOfPoints,&totalPoints,1,MPIU_INT,MPI_SUM,PETSC_COMM_WORLD);CHKERRQ(ierr);
+    PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n incremental operator update: %d changed voxels, rows of %d grid points refilled\n",
+                            (int)(changedVoxels.size()/3),totalPoints);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "isFixedRow"
+/*True if the only nonzero coefficient of the row is the diagonal one, returned in diag.*/
+bool PetscAdLemTaras3D::isFixedRow(const OperatorParams& par, PetscScalar ****cell,
+                                   PetscInt i, PetscInt j, PetscInt k, PetscInt c, PetscScalar *diag)
+{
+    MatStencil      col[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
+    PetscScalar     v[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
+    const PetscInt  nv = operatorRow(par,cell,i,j,k,c,col,v);
+    *diag = 0;
+    for (PetscInt m=0; m<nv; ++m) {
+        if(col[m].i == i && col[m].j == j && col[m].k == k && col[m].c == c)
+            *diag = v[m];
+        else if(v[m] != 0)
+            return false;
+    }
+    return (*diag != 0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "setUpReducedSystem"
+/*Split the rows of mA in fixed rows, whose only nonzero coefficient is the diagonal one, and
+ active rows, and set up mKspR on the active rows and columns of mA. The classification uses
+ operatorRow(), so it follows the mask like the operator: with DIRICHLET_AT_SKULL all the
+ unknowns inside the skull are fixed besides the ghost layer and the walls. With a fieldsplit
+ preconditioner the splits "0" (velocity) and "1" (pressure) are given as index sets of the
+ reduced numbering, so the fieldsplit_0_/fieldsplit_1_ options apply as for the full system.
+ Called whenever the operator changes.*/
+PetscErrorCode PetscAdLemTaras3D::setUpReducedSystem()
+{
+    PetscErrorCode  ierr;
+    PetscInt        xs,ys,zs,xm,ym,zm,row,rstart,rstartR,numOfRows[2],totalRows[2];
+    PetscScalar     ****cell;
+    OperatorParams  par;
+    PC              pcR;
+    PetscBool       isFieldsplit;
+    PetscFunctionBeginUser;
+
+    ierr = getOperatorParams(mDa,par);CHKERRQ(ierr);
+    ierr = DMDAGetCorners(mDa,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
+    ierr = MatGetOwnershipRange(mA,&rstart,NULL);CHKERRQ(ierr);
+    std::vector<PetscInt> activeRows;
+    activeRows.reserve(4*xm*ym*zm);
+    mFixedRows.clear();
+    mFixedDiag.clear();
+    ierr = DMDAVecGetArrayDOF(mDaCell,mCellLocal,&cell);CHKERRQ(ierr);
+    row = rstart;
+    for (PetscInt k=zs; k<zs+zm; ++k) {
+        for (PetscInt j=ys; j<ys+ym; ++j) {
+            for (PetscInt i=xs; i<xs+xm; ++i) {
+                for (PetscInt c=0; c<4; ++c, ++row) {
+                    PetscScalar diag;
+                    if(isFixedRow(par,cell,i,j,k,c,&diag)) {
+                        mFixedRows.push_back(row);
+                        mFixedDiag.push_back(diag);
+                    } else {
+                        activeRows.push_back(row);
                     }
-                    ierr=MatSetValuesStencil(jac,1,&row,2,col,v,INSERT_VALUES);CHKERRQ(ierr);
-                } else if ( (user->getProblemModel()->getBcType() == user->getProblemModel()->DIRICHLET_AT_SKULL) &&
-                            (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getSkullLabel() ||
-                             user->bMaskAt(i+1,j+1,k) == user->getProblemModel()->getSkullLabel())
-                            ) { //vz lying in the face that touches a skull (non-brain region) cell
-                    v[0] = kBond;           col[0].i = i;   col[0].j = j;   col[0].k = k;
-                    ierr=MatSetValuesStencil(jac,1,&row,1,col,v,INSERT_VALUES);CHKERRQ(ierr);
-                } else if( (user->getProblemModel()->zeroVelAtFalx()) &&
-			   (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getFalxCerebriLabel() ||
-			    user->bMaskAt(i+1,j+1,k) == user->getProblemModel()->getFalxCerebriLabel())
-		    ) { //vz lying in the face that touches a Falx Cerebri cell
-		    v[0] = kBond;           col[0].i = i;   col[0].j = j;   col[0].k = k;
-                    ierr=MatSetValuesStencil(jac,1,&row,1,col,v,INSERT_VALUES);CHKERRQ(ierr);
-		} else if( (user->getProblemModel()->slidingAtFalx() && (user->getProblemModel()->getFalxSlidingZeroVelDir()==2)) &&
-			   (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getFalxCerebriLabel() ||
-			    user->bMaskAt(i+1,j+1,k) == user->getProblemModel()->getFalxCerebriLabel())
-		    ) { //vz lying in the face that touches a Falx Cerebri cell
-		    v[0] = kBond;           col[0].i = i;   col[0].j = j;   col[0].k = k;
-                    ierr=MatSetValuesStencil(jac,1,&row,1,col,v,INSERT_VALUES);CHKERRQ(ierr);
-		}
-                else { //interior points, z-momentum equation
-                    //vz-coefficients, seven terms.
-                    for(int ii=0; ii<7; ++ii) col[ii].c = 2;
-                    PetscScalar coeff = (user->muC(i+1,j+1,k+1) + user->muC(i+1,j+1,k))/2.;
-                    v[0] = coeff*HyHzdHx;          col[0].i=i+1;   col[0].j=j;     col[0].k=k;
-                    v[1] = coeff*HyHzdHx;          col[1].i=i-1;   col[1].j=j;     col[1].k=k;
-                    v[2] = coeff*HxHzdHy;          col[2].i=i;     col[2].j=j+1;   col[2].k=k;
-                    v[3] = coeff*HxHzdHy;          col[3].i=i;     col[3].j=j-1;   col[3].k=k;
-                    v[4] = coeff*HxHydHz;          col[4].i=i;     col[4].j=j;     col[4].k=k+1;
-                    v[5] = coeff*HxHydHz;          col[5].i=i;     col[5].j=j;     col[5].k=k-1;
-                    v[6] = -2*(v[0]+v[2]+v[4]);    col[6].i=i;     col[6].j=j;     col[6].k=k;
+                }
+            }
+        }
+    }
+    ierr = DMDAVecRestoreArrayDOF(mDaCell,mCellLocal,&cell);CHKERRQ(ierr);
+
+    ierr = KSPDestroy(&mKspR);CHKERRQ(ierr);
+    ierr = MatDestroy(&mAR);CHKERRQ(ierr);
+    ierr = ISDestroy(&mIsActive);CHKERRQ(ierr);
+    ierr = VecScatterDestroy(&mScatterR);CHKERRQ(ierr);
+    ierr = VecDestroy(&mXR);CHKERRQ(ierr);
+    ierr = VecDestroy(&mBR);CHKERRQ(ierr);
+    ierr = MatNullSpaceDestroy(&mNullSpaceR);CHKERRQ(ierr);
+    ierr = VecDestroy(&mNullBasisR);CHKERRQ(ierr);
+
+    ierr = ISCreateGeneral(PETSC_COMM_WORLD,(PetscInt)activeRows.size(),(activeRows.empty()) ? NULL : &activeRows[0],
+                           PETSC_COPY_VALUES,&mIsActive);CHKERRQ(ierr);
+    ierr = MatGetSubMatrix(mA,mIsActive,mIsActive,MAT_INITIAL_MATRIX,&mAR);CHKERRQ(ierr);
+    ierr = MatCreateVecs(mAR,&mXR,&mBR);CHKERRQ(ierr);
+    if(!mXFull) {
+        //The base class still accesses mX and mB in its destructor, after the one of this class:
+        //compose the full vectors with mKsp, which is destroyed last, and keep no reference here.
+        Vec vec;
+        ierr = DMCreateGlobalVector(mDa,&vec);CHKERRQ(ierr);
+        ierr = PetscObjectCompose((PetscObject)mKsp,"reducedSystemX",(PetscObject)vec);CHKERRQ(ierr);
+        mXFull = vec;
+        ierr = VecDestroy(&vec);CHKERRQ(ierr);
+        ierr = DMCreateGlobalVector(mDa,&vec);CHKERRQ(ierr);
+        ierr = PetscObjectCompose((PetscObject)mKsp,"reducedSystemB",(PetscObject)vec);CHKERRQ(ierr);
+        mBFull = vec;
+        ierr = VecDestroy(&vec);CHKERRQ(ierr);
+        ierr = DMCreateGlobalVector(mDa,&mXFixed);CHKERRQ(ierr);
+    }
+    ierr = VecScatterCreate(mXFull,mIsActive,mXR,NULL,&mScatterR);CHKERRQ(ierr);
+
+    numOfRows[0] = activeRows.size();
+    numOfRows[1] = activeRows.size() + mFixedRows.size();
+    ierr = MPI_Allreduce(numOfRows,totalRows,2,MPIU_INT,MPI_SUM,PETSC_COMM_WORLD);CHKERRQ(ierr);
+    PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n reduced system: %d of %d unknowns active (%f %%)\n",
+                            totalRows[0],totalRows[1],100.*totalRows[0]/totalRows[1]);
+
+    ierr = KSPCreate(PETSC_COMM_WORLD,&mKspR);CHKERRQ(ierr);
+    ierr = KSPSetOperators(mKspR,mAR,mAR);CHKERRQ(ierr);
+    ierr = KSPSetFromOptions(mKspR);CHKERRQ(ierr);
+    ierr = KSPGetPC(mKspR,&pcR);CHKERRQ(ierr);
+    ierr = PetscObjectTypeCompare((PetscObject)pcR,PCFIELDSPLIT,&isFieldsplit);CHKERRQ(ierr);
+    IS isP = NULL;
+    if(isFieldsplit) {
+        IS isV;
+        std::vector<PetscInt> rowsV, rowsP;
+        ierr = MatGetOwnershipRange(mAR,&rstartR,NULL);CHKERRQ(ierr);
+        for (size_t a=0; a<activeRows.size(); ++a) {
+            if((activeRows[a]-rstart)%4 == 3)
+                rowsP.push_back(rstartR+(PetscInt)a);
+            else
+                rowsV.push_back(rstartR+(PetscInt)a);
+        }
+        ierr = ISCreateGeneral(PETSC_COMM_WORLD,(PetscInt)rowsV.size(),(rowsV.empty()) ? NULL : &rowsV[0],
+                               PETSC_COPY_VALUES,&isV);CHKERRQ(ierr);
+        ierr = ISCreateGeneral(PETSC_COMM_WORLD,(PetscInt)rowsP.size(),(rowsP.empty()) ? NULL : &rowsP[0],
+                               PETSC_COPY_VALUES,&isP);CHKERRQ(ierr);
+        ierr = PCFieldSplitSetIS(pcR,"0",isV);CHKERRQ(ierr);
+        ierr = PCFieldSplitSetIS(pcR,"1",isP);CHKERRQ(ierr);
+        ierr = ISDestroy(&isV);CHKERRQ(ierr);
+        if(mSchurPreUser) { //active pressure rows of mPcForSc, in the order of isP.
+            IS          isPcForSc;
+            Mat         pcForScR;
+            PetscInt    rstartP;
+            ierr = MatGetOwnershipRange(mPcForSc,&rstartP,NULL);CHKERRQ(ierr);
+            rowsP.clear();
+            for (size_t a=0; a<activeRows.size(); ++a) {
+                if((activeRows[a]-rstart)%4 == 3)
+                    rowsP.push_back(rstartP+(activeRows[a]-rstart)/4);
+            }
+            ierr = ISCreateGeneral(PETSC_COMM_WORLD,(PetscInt)rowsP.size(),(rowsP.empty()) ? NULL : &rowsP[0],
+                                   PETSC_COPY_VALUES,&isPcForSc);CHKERRQ(ierr);
+            ierr = MatGetSubMatrix(mPcForSc,isPcForSc,isPcForSc,MAT_INITIAL_MATRIX,&pcForScR);CHKERRQ(ierr);
+            ierr = PCFieldSplitSetSchurPre(pcR,PC_FIELDSPLIT_SCHUR_PRE_USER,pcForScR);CHKERRQ(ierr);
+            ierr = MatDestroy(&pcForScR);CHKERRQ(ierr);
+            ierr = ISDestroy(&isPcForSc);CHKERRQ(ierr);
+        }
+    }
+    if(mPressureNullspacePresent) {
+        ierr = VecDuplicate(mXR,&mNullBasisR);CHKERRQ(ierr);
+        ierr = VecScatterBegin(mScatterR,mNullBasis,mNullBasisR,INSERT_VALUES,SCATTER_FORWARD);CHKERRQ(ierr);
+        ierr = VecScatterEnd(mScatterR,mNullBasis,mNullBasisR,INSERT_VALUES,SCATTER_FORWARD);CHKERRQ(ierr);
+        ierr = VecNormalize(mNullBasisR,NULL);CHKERRQ(ierr);
+        ierr = MatNullSpaceCreate(PETSC_COMM_WORLD,PETSC_FALSE,1,&mNullBasisR,&mNullSpaceR);CHKERRQ(ierr);
+        ierr = MatSetNullSpace(mAR,mNullSpaceR);CHKERRQ(ierr);
+    }
+    ierr = KSPSetUp(mKspR);CHKERRQ(ierr);
+
+    //As for the full system, the pressure null space is also set to the Schur complement.
+    if(isFieldsplit && mPressureNullspacePresent) {
+        KSP             *subKsp;
+        PetscInt        numOfSplits;
+        ierr = PCFieldSplitGetSubKSP(pcR,&numOfSplits,&subKsp);CHKERRQ(ierr);
+        if(numOfSplits == 2) {
+            Mat             matSc;
+            Vec             nullBasisP, subVec;
+            MatNullSpace    nullSpaceP;
+            ierr = KSPGetOperators(subKsp[1],&matSc,NULL);CHKERRQ(ierr);
+            ierr = VecGetSubVector(mNullBasisR,isP,&subVec);CHKERRQ(ierr);
+            ierr = VecDuplicate(subVec,&nullBasisP);CHKERRQ(ierr);
+            ierr = VecCopy(subVec,nullBasisP);CHKERRQ(ierr);
+            ierr = VecRestoreSubVector(mNullBasisR,isP,&subVec);CHKERRQ(ierr);
+            ierr = VecNormalize(nullBasisP,NULL);CHKERRQ(ierr);
+            ierr = MatNullSpaceCreate(PETSC_COMM_WORLD,PETSC_FALSE,1,&nullBasisP,&nullSpaceP);CHKERRQ(ierr);
+            ierr = MatSetNullSpace(matSc,nullSpaceP);CHKERRQ(ierr);
+            ierr = MatNullSpaceDestroy(&nullSpaceP);CHKERRQ(ierr);
+            ierr = VecDestroy(&nullBasisP);CHKERRQ(ierr);
+        }
+        ierr = PetscFree(subKsp);CHKERRQ(ierr);
+    }
+    ierr = ISDestroy(&isP);CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
 
-                    //p-coefficients, two terms.
-                    col[7].c = 3;      col[8].c = 3;
-                    v[7] = kCont*Hx*Hy;        col[7].i=i+1;  col[7].j=j+1;  col[7].k=k;
-                    v[8] = -v[7];              col[8].i=i+1;  col[8].j=j+1;  col[8].k=k+1;
+#undef __FUNCT__
+#define __FUNCT__ "solveReducedSystem"
+/*Solve A x = b through the reduced system: the fixed rows give x_f = b_f/a_ff, their columns
+ are moved to the rhs of the active rows, b_a - A_af x_f, and the active unknowns solved with
+ mKspR are scattered back. mX and mB are set to the full vectors.*/
+PetscErrorCode PetscAdLemTaras3D::solveReducedSystem()
+{
+    PetscErrorCode      ierr;
+    PetscInt            rstart;
+    const PetscScalar   *b;
+    PetscScalar         *x;
+    PetscFunctionBeginUser;
+
+    //The fixed rows are not in mXR, so the guess needs no correction for the mask.
+    const PetscBool nonzeroGuess = (PetscBool)(mInitialGuess != INITIAL_GUESS_ZERO && mNumOfStoredSolutions > 0);
+    if(nonzeroGuess) {
+        ierr = computeInitialGuess(mXFixed,false);CHKERRQ(ierr);
+        ierr = VecScatterBegin(mScatterR,mXFixed,mXR,INSERT_VALUES,SCATTER_FORWARD);CHKERRQ(ierr);
+        ierr = VecScatterEnd(mScatterR,mXFixed,mXR,INSERT_VALUES,SCATTER_FORWARD);CHKERRQ(ierr);
+    } else {
+        ierr = VecSet(mXR,0);CHKERRQ(ierr);
+    }
+
+    ierr = computeRHSTaras3dConstantMu(mKsp,mBFull,this);CHKERRQ(ierr);
+    ierr = VecGetOwnershipRange(mBFull,&rstart,NULL);CHKERRQ(ierr);
+    ierr = VecSet(mXFull,0);CHKERRQ(ierr);
+    ierr = VecGetArrayRead(mBFull,&b);CHKERRQ(ierr);
+    ierr = VecGetArray(mXFull,&x);CHKERRQ(ierr);
+    for (size_t f=0; f<mFixedRows.size(); ++f)
+        x[mFixedRows[f]-rstart] = b[mFixedRows[f]-rstart]/mFixedDiag[f];
+    ierr = VecRestoreArray(mXFull,&x);CHKERRQ(ierr);
+    ierr = VecRestoreArrayRead(mBFull,&b);CHKERRQ(ierr);
+    ierr = MatMult(mA,mXFull,mXFixed);CHKERRQ(ierr);
+    ierr = VecScale(mXFixed,-1.0);CHKERRQ(ierr);
+
+    ierr = VecScatterBegin(mScatterR,mBFull,mBR,INSERT_VALUES,SCATTER_FORWARD);CHKERRQ(ierr);
+    ierr = VecScatterEnd(mScatterR,mBFull,mBR,INSERT_VALUES,SCATTER_FORWARD);CHKERRQ(ierr);
+    ierr = VecScatterBegin(mScatterR,mXFixed,mBR,ADD_VALUES,SCATTER_FORWARD);CHKERRQ(ierr);
+    ierr = VecScatterEnd(mScatterR,mXFixed,mBR,ADD_VALUES,SCATTER_FORWARD);CHKERRQ(ierr);
+    ierr = KSPSetInitialGuessNonzero(mKspR,nonzeroGuess);CHKERRQ(ierr);
+    ierr = KSPSolve(mKspR,mBR,mXR);CHKERRQ(ierr);
+    ierr = VecScatterBegin(mScatterR,mXR,mXFull,INSERT_VALUES,SCATTER_REVERSE);CHKERRQ(ierr);
+    ierr = VecScatterEnd(mScatterR,mXR,mXFull,INSERT_VALUES,SCATTER_REVERSE);CHKERRQ(ierr);
+    mX = mXFull;
+    mB = mBFull;
+    PetscFunctionReturn(0);
+}
 
-                    ierr=MatSetValuesStencil(jac,1,&row,9,col,v,INSERT_VALUES);CHKERRQ(ierr);
+#undef __FUNCT__
+#define __FUNCT__ "setUpVelocityMultigrid"
+/*Geometric multigrid for the velocity block, used with -fieldsplit_0_pc_type mg.
+ The levels are the staggered grids obtained by merging 2x2x2 cells, the interpolation
+ follows the position of each velocity component on the staggered grid and the coarse
+ operators are rediscretised with operatorRow() from coefficients averaged over the merged
+ cells, so that no Galerkin product is formed. The finest level uses the velocity block
+ extracted by the fieldsplit. The number of levels is read from -fieldsplit_0_pc_mg_levels,
+ by default the grid is coarsened while each direction keeps at least 4 cells.*/
+PetscErrorCode PetscAdLemTaras3D::setUpVelocityMultigrid(KSP kspV)
+{
+    PetscErrorCode  ierr;
+    PC              pcV;
+    PetscInt        numOfLevels = 1;
+    PetscBool       optionFlag;
+    PetscMPIInt     size;
+    AdLem3D<3>      *model = this->getProblemModel();
+    PetscFunctionBeginUser;
+
+    if(mNumOfMgGrids > 0) { //levels already set in kspV, only the coarse operators change with the mask.
+        ierr = updateVelocityMultigrid();CHKERRQ(ierr);
+        PetscFunctionReturn(0);
+    }
+    ierr = PetscOptionsGetInt(NULL,"-fieldsplit_0_pc_mg_levels",&numOfLevels,&optionFlag);CHKERRQ(ierr);
+    if(!optionFlag) {
+        ierr = MPI_Comm_size(PETSC_COMM_WORLD,&size);CHKERRQ(ierr);
+        PetscInt nx = model->getXnum(), ny = model->getYnum(), nz = model->getZnum();
+        while(numOfLevels < 5 && PetscMin(nx,PetscMin(ny,nz)) >= 8
+              && ((nx+1)/2+1)*((ny+1)/2+1)*((nz+1)/2+1) >= 64*size) {
+            nx = (nx+1)/2;  ny = (ny+1)/2;  nz = (nz+1)/2;
+            ++numOfLevels;
+        }
+    }
+    ierr = createVelocityMultigridHierarchy(numOfLevels);CHKERRQ(ierr);
+    ierr = updateVelocityMultigrid();CHKERRQ(ierr);
+
+    //The options of the fieldsplit have already given kspV a mg without interpolation whose levels
+    //cannot be set again: switching the type destroys it, the operators of kspV are kept.
+    ierr = KSPGetPC(kspV,&pcV);CHKERRQ(ierr);
+    ierr = PCSetType(pcV,PCNONE);CHKERRQ(ierr);
+    ierr = PCSetType(pcV,PCMG);CHKERRQ(ierr);
+    ierr = PCMGSetLevels(pcV,mNumOfMgGrids,NULL);CHKERRQ(ierr);
+    ierr = PCMGSetGalerkin(pcV,PETSC_FALSE);CHKERRQ(ierr);
+    ierr = PCSetFromOptions(pcV);CHKERRQ(ierr);
+    for(PetscInt g=1; g<mNumOfMgGrids; ++g) {
+        const PetscInt level = mNumOfMgGrids-1-g; //PCMG numbers the levels from the coarsest one.
+        KSP kspLevel;
+        ierr = PCMGSetInterpolation(pcV,level+1,mMgP[g]);CHKERRQ(ierr);
+        ierr = PCMGGetSmoother(pcV,level,&kspLevel);CHKERRQ(ierr);
+        ierr = KSPSetOperators(kspLevel,mMgA[g],mMgA[g]);CHKERRQ(ierr);
+    }
+    PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n using staggered geometric multigrid with %d levels for A00 \n",mNumOfMgGrids);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "createVelocityMultigridHierarchy"
+/*DMDAs, coefficient caches, operators and interpolations of the coarse grids. Grid g has
+ ceil(n/2) cells where grid g-1 has n, so that it may extend half a coarse cell past the
+ end walls of grid g-1. Coarsening stops early if a direction would have less than 2 cells.*/
+PetscErrorCode PetscAdLemTaras3D::createVelocityMultigridHierarchy(PetscInt numOfGrids)
+{
+    PetscErrorCode  ierr;
+    PetscInt        m,n,p,mc,nc,pc,xm,ym,zm,numOfFine,numOfCoarse;
+    const PetscInt  *lx, *ly, *lz;
+    //velocity components are coupled only to the same component of the star neighbours.
+    PetscInt        fill[9] = {1,0,0, 0,1,0, 0,0,1};
+    AdLem3D<3>      *model = this->getProblemModel();
+    PetscFunctionBeginUser;
+
+    ierr = DMDAGetInfo(mDa,0,0,0,0,&m,&n,&p,0,0,0,0,0,0);CHKERRQ(ierr);
+    PetscInt nx = model->getXnum(), ny = model->getYnum(), nz = model->getZnum();
+    mMgDaV.assign(numOfGrids,(DM)NULL);
+    mMgDaCell.assign(numOfGrids,(DM)NULL);
+    mMgCellLocal.assign(numOfGrids,(Vec)NULL);
+    mMgA.assign(numOfGrids,(Mat)NULL);
+    mMgP.assign(numOfGrids,(Mat)NULL);
+    mNumOfMgGrids = 1;
+    for(PetscInt g=1; g<numOfGrids; ++g) {
+        if(PetscMin(nx,PetscMin(ny,nz)) < 4)
+            break;
+        nx = (nx+1)/2;  ny = (ny+1)/2;  nz = (nz+1)/2;
+        //keep the process grid of mDa while each process still gets two points in each direction.
+        ierr = DMDACreate3d(PETSC_COMM_WORLD,DM_BOUNDARY_NONE,DM_BOUNDARY_NONE,DM_BOUNDARY_NONE,
+                            DMDA_STENCIL_STAR,nx+1,ny+1,nz+1,
+                            (nx+1 >= 2*m) ? m : PETSC_DECIDE,(ny+1 >= 2*n) ? n : PETSC_DECIDE,
+                            (nz+1 >= 2*p) ? p : PETSC_DECIDE,3,1,0,0,0,&mMgDaV[g]);CHKERRQ(ierr);
+        ierr = DMDASetBlockFills(mMgDaV[g],fill,fill);CHKERRQ(ierr);
+        ierr = DMCreateMatrix(mMgDaV[g],&mMgA[g]);CHKERRQ(ierr);
+        ierr = DMDAGetInfo(mMgDaV[g],0,0,0,0,&mc,&nc,&pc,0,0,0,0,0,0);CHKERRQ(ierr);
+        ierr = DMDAGetOwnershipRanges(mMgDaV[g],&lx,&ly,&lz);CHKERRQ(ierr);
+        ierr = DMDACreate3d(PETSC_COMM_WORLD,DM_BOUNDARY_NONE,DM_BOUNDARY_NONE,DM_BOUNDARY_NONE,
+                            DMDA_STENCIL_BOX,nx+1,ny+1,nz+1,mc,nc,pc,CELL_NUM_FIELDS,1,
+                            lx,ly,lz,&mMgDaCell[g]);CHKERRQ(ierr);
+        ierr = DMCreateLocalVector(mMgDaCell[g],&mMgCellLocal[g]);CHKERRQ(ierr);
+
+        ierr = DMDAGetCorners((g == 1) ? mDa : mMgDaV[g-1],0,0,0,&xm,&ym,&zm);CHKERRQ(ierr);
+        numOfFine = 3*xm*ym*zm;
+        ierr = DMDAGetCorners(mMgDaV[g],0,0,0,&xm,&ym,&zm);CHKERRQ(ierr);
+        numOfCoarse = 3*xm*ym*zm;
+        //trilinear interpolation: at most 8 coarse values for each fine value.
+        ierr = MatCreateAIJ(PETSC_COMM_WORLD,numOfFine,numOfCoarse,PETSC_DETERMINE,PETSC_DETERMINE,
+                            8,NULL,8,NULL,&mMgP[g]);CHKERRQ(ierr);
+        mNumOfMgGrids = g+1;
+        ierr = fillStaggeredInterpolation(g);CHKERRQ(ierr);
+        PetscSynchronizedPrintf(PETSC_COMM_WORLD,"velocity multigrid grid %d: dmda of size (%d,%d,%d)\n",g,nx+1,ny+1,nz+1);
+    }
+    if(mNumOfMgGrids < numOfGrids)
+        PetscSynchronizedPrintf(PETSC_COMM_WORLD,"grid too small for %d multigrid levels, using %d\n",numOfGrids,mNumOfMgGrids);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "updateVelocityMultigrid"
+/*Coefficients and operators of the coarse grids, to be called whenever the mask changes.*/
+PetscErrorCode PetscAdLemTaras3D::updateVelocityMultigrid()
+{
+    PetscErrorCode  ierr;
+    PetscFunctionBeginUser;
+    for(PetscInt g=1; g<mNumOfMgGrids; ++g) {
+        ierr = fillCoarseCoefficients(g);CHKERRQ(ierr);
+        ierr = fillCoarseOperator(g);CHKERRQ(ierr);
+    }
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "fillCoarseCoefficients"
+/*Ghosted coefficient cache of coarse grid g, averaged over the 2^g x 2^g x 2^g voxels of each
+ coarse cell directly from the model, as in updateCoefficientCache(). A coarse cell gets a label
+ bit if at least half of its voxels have that label. Only the fields read by the momentum rows
+ are filled: the atrophy, lambda and the ALL_NBRS_SKULL bit are not used by the velocity block.*/
+PetscErrorCode PetscAdLemTaras3D::fillCoarseCoefficients(PetscInt g)
+{
+    PetscErrorCode  ierr;
+    PetscInt        gxs,gys,gzs,gxm,gym,gzm;
+    PetscScalar     ****cell;
+    AdLem3D<3>      *model = this->getProblemModel();
+    const PetscInt  s = 1 << g; //voxels of a coarse cell in each direction.
+    const PetscInt  nx = model->getXnum(), ny = model->getYnum(), nz = model->getZnum();
+    PetscFunctionBeginUser;
+
+    ierr = DMDAGetGhostCorners(mMgDaCell[g],&gxs,&gys,&gzs,&gxm,&gym,&gzm);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(mMgDaCell[g],mMgCellLocal[g],&cell);CHKERRQ(ierr);
+    for (PetscInt k=gzs; k<gzs+gzm; ++k) {
+        for (PetscInt j=gys; j<gys+gym; ++j) {
+            for (PetscInt i=gxs; i<gxs+gxm; ++i) {
+                //the ghost cell 0 takes the values of cell 1, as in fillMaskCoefficients(). Cells past
+                //the end walls of the model take the values of the last voxel.
+                const PetscInt xa = PetscMin((PetscMax(i,1)-1)*s,nx-1), xb = PetscMax(PetscMin(xa+s,nx),xa+1);
+                const PetscInt ya = PetscMin((PetscMax(j,1)-1)*s,ny-1), yb = PetscMax(PetscMin(ya+s,ny),ya+1);
+                const PetscInt za = PetscMin((PetscMax(k,1)-1)*s,nz-1), zb = PetscMax(PetscMin(za+s,nz),za+1);
+                PetscScalar mu = 0;
+                PetscInt numOfVoxels = 0, numOfSkull = 0, numOfRelaxIc = 0, numOfFalx = 0;
+                for (PetscInt z=za; z<zb; ++z) {
+                    for (PetscInt y=ya; y<yb; ++y) {
+                        for (PetscInt x=xa; x<xb; ++x) {
+                            mu += model->dataAt("mu",x,y,z);
+                            const double label = model->brainMaskAt(x,y,z);
+                            numOfSkull += (label == model->getSkullLabel());
+                            numOfRelaxIc += (label == model->getRelaxIcLabel());
+                            numOfFalx += (label == model->getFalxCerebriLabel());
+                            ++numOfVoxels;
+                        }
+                    }
                 }
-		// PetscSynchronizedPrintf(PETSC_COMM_WORLD,"(%d,%d,%d): s=%d, m=%d\n",
-		// 			i, j, k, (int)user->bMaskAt(i, j, k), (int)user->muC(i, j, k));
+                cell[k][j][i][CELL_MU] = mu/numOfVoxels;
+                cell[k][j][i][CELL_ATROPHY] = 0;
+                cell[k][j][i][CELL_LAMBDA] = 0;
+                PetscInt flags = 0;
+                if(i==0 || j==0 || k==0)
+                    flags |= PetscAdLemTaras3D_SolverOps::CELL_GHOST;
+                if(2*numOfSkull >= numOfVoxels)
+                    flags |= PetscAdLemTaras3D_SolverOps::CELL_SKULL;
+                if(2*numOfRelaxIc >= numOfVoxels)
+                    flags |= PetscAdLemTaras3D_SolverOps::CELL_RELAX_IC;
+                if(2*numOfFalx >= numOfVoxels)
+                    flags |= PetscAdLemTaras3D_SolverOps::CELL_FALX;
+                cell[k][j][i][CELL_FLAGS] = flags;
+            }
+        }
+    }
+    ierr = DMDAVecRestoreArrayDOF(mMgDaCell[g],mMgCellLocal[g],&cell);CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
 
-                //********************** continuity equation *********************
-                row.c = 3;
-                col[0].c = 3;       //boundary or ghost nodes; at most one point.
-                if (i==0 || j==0 || k==0 //Ghost values
-                        || (i==1 && (j==1 || j==my-1 || k==1 || k==mz-1)) //west wall corners
-                        || (i==mx-1 && (j==1 || j==my-1 || k==1 || k==mz-1)) //east wall corners
-                        || (j==1 && (k==1 || k==mz-1)) //front wall horizontal corners
-                        || (j==my-1 && (k==1 || k==mz-1)) //back wall horizontal corners
-                        ) {
-                    v[0] = kBond;       col[0].i=i; col[0].j=j; col[0].k=k;
-                    ierr=MatSetValuesStencil(jac,1,&row,1,col,v,INSERT_VALUES);CHKERRQ(ierr);
-                } else if (
-		    (user->getProblemModel()->getBcType() == user->getProblemModel()->DIRICHLET_AT_SKULL) &&
-                           (user->bMaskAt(i,j,k) == user->getProblemModel()->getSkullLabel() ||
-                             ( user->bMaskAt(i+1,j,k) == user->getProblemModel()->getSkullLabel() &&
-                               user->bMaskAt(i-1,j,k) == user->getProblemModel()->getSkullLabel() &&
-                               user->bMaskAt(i,j+1,k) == user->getProblemModel()->getSkullLabel() &&
-                               user->bMaskAt(i,j-1,k) == user->getProblemModel()->getSkullLabel() &&
-                               user->bMaskAt(i,j,k+1) == user->getProblemModel()->getSkullLabel() &&
-                               user->bMaskAt(i,j,k-1) == user->getProblemModel()->getSkullLabel()
-                             )
-                           )
-                          ) { //Skull cell or a non-skull cell surrounded by skull cells in all its 6-neigbhor.
-                    v[0] = kBond;       col[0].i=i; col[0].j=j; col[0].k=k;
-                    ierr=MatSetValuesStencil(jac,1,&row,1,col,v,INSERT_VALUES);CHKERRQ(ierr);
+#undef __FUNCT__
+#define __FUNCT__ "fillCoarseOperator"
+/*Velocity block of the operator on coarse grid g: the momentum rows of operatorRow() with
+ the spacings of grid g, without the pressure columns.*/
+PetscErrorCode PetscAdLemTaras3D::fillCoarseOperator(PetscInt g)
+{
+    PetscErrorCode  ierr;
+    PetscInt        xs,ys,zs,xm,ym,zm;
+    PetscScalar     ****cell;
+    OperatorParams  par;
+    MatStencil      row, col[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
+    PetscScalar     v[PetscAdLemTaras3D_SolverOps::MAX_ROW_NNZ];
+    const PetscReal s = 1 << g;
+    PetscFunctionBeginUser;
+
+    ierr = getOperatorParams(mMgDaV[g],par);CHKERRQ(ierr);
+    par.HyHzdHx *= s;   par.HxHzdHy *= s;   par.HxHydHz *= s;
+    for(PetscInt t=0; t<3; ++t) {
+        par.area[t] *= s*s;
+        par.hInv[t] /= s;
+    }
+    ierr = DMDAGetCorners(mMgDaV[g],&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(mMgDaCell[g],mMgCellLocal[g],&cell);CHKERRQ(ierr);
+    for (PetscInt k=zs; k<zs+zm; ++k) {
+        for (PetscInt j=ys; j<ys+ym; ++j) {
+            for (PetscInt i=xs; i<xs+xm; ++i) {
+                for (PetscInt c=0; c<3; ++c) {
+                    const PetscInt nv = operatorRow(par,cell,i,j,k,c,col,v);
+                    PetscInt numOfCols = 0;
+                    for (PetscInt m=0; m<nv; ++m) {
+                        if(col[m].c < 3) {
+                            col[numOfCols] = col[m];
+                            v[numOfCols++] = v[m];
+                        }
+                    }
+                    row = stencilAt(i,j,k,c);
+                    ierr = MatSetValuesStencil(mMgA[g],1,&row,numOfCols,col,v,INSERT_VALUES);CHKERRQ(ierr);
                 }
-                else {
-		    PetscReal common_coeff;
-		    if(user->isDiv12pointStencil())
-			common_coeff = kCont/4.;
-		    else
-			common_coeff = kCont;
-		    int nm = 0;
-		    //vx-coefficients, two or four terms
-		    PetscReal coeff = common_coeff/Hx;
-		    if(user->isDiv12pointStencil() && i<mx-2)
-		    {
-			col[nm].c = 0; col[nm].i = i+1;   col[nm].j=j-1;   col[nm].k=k-1;
-			v[nm++] = coeff;
-		    }
-                    col[nm].c = 0; col[nm].i = i;   col[nm].j=j-1;   col[nm].k=k-1; v[nm++] = coeff;
-		    col[nm].c = 0; col[nm].i = i-1; col[nm].j=j-1;   col[nm].k=k-1; v[nm++] = -1*coeff;
-		    if(user->isDiv12pointStencil() && i>2)
-		    {
-			col[nm].c = 0; col[nm].i = i-2; col[nm].j=j-1;   col[nm].k=k-1; v[nm++] = -1*coeff;
-		    }
+            }
+        }
+    }
+    ierr = DMDAVecRestoreArrayDOF(mMgDaCell[g],mMgCellLocal[g],&cell);CHKERRQ(ierr);
+    ierr = MatAssemblyBegin(mMgA[g],MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+    ierr = MatAssemblyEnd(mMgA[g],MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
 
-                    //vy-coefficients, two or four terms
-		    coeff = common_coeff/Hy;
-		    if(user->isDiv12pointStencil() && j<my-2)
-		    {
-			col[nm].c = 1; col[nm].i = i-1; col[nm].j=j+1;     col[nm].k=k-1;
-			v[nm++] = coeff;
-		    }
-                    col[nm].c = 1; col[nm].i = i-1; col[nm].j=j;     col[nm].k=k-1; v[nm++] = coeff;
-		    col[nm].c = 1; col[nm].i = i-1; col[nm].j=j-1;   col[nm].k=k-1; v[nm++] = -1 * coeff;
-		    if(user->isDiv12pointStencil() && j>2)
-		    {
-			col[nm].c = 1; col[nm].i = i-1; col[nm].j=j-2;   col[nm].k=k-1; v[nm++] = -1 * coeff;
-		    }
-                    //vz-coefficients, two or four terms
-		    coeff = common_coeff/Hz;
-		    if(user->isDiv12pointStencil() && k<mz-2)
-		    {
-			col[nm].c = 2; col[nm].i = i-1; col[nm].j=j-1;   col[nm].k=k+1;
-			v[nm++] = coeff;
-		    }
-                    col[nm].c = 2; col[nm].i = i-1; col[nm].j=j-1;   col[nm].k=k; v[nm++] = coeff;
-		    col[nm].c = 2; col[nm].i = i-1; col[nm].j=j-1;   col[nm].k=k-1; v[nm++] = -1*coeff;
-		    if(user->isDiv12pointStencil() && k>2)
-		    {
-			col[nm].c = 2; col[nm].i = i-1; col[nm].j=j-1;   col[nm].k=k-2; v[nm++] = -1*coeff;
-		    }
+#undef __FUNCT__
+#define __FUNCT__ "fillStaggeredInterpolation"
+/*Interpolation from the velocities of grid g to the ones of grid g-1. In units of the cells of
+ grid g-1, component c of point (i,j,k) lies at i (face between the cells i and i+1) along c
+ and at j+1/2 (centre of cell j+1) along the other directions, and the coarse points lie at
+ twice those positions. Each fine value is the trilinear interpolation of the coarse values
+ of the same component, clamped to the coarse grid; the ghost rows at the end walls get none.
+ Restriction is the transpose, as by default in PCMG.*/
+PetscErrorCode PetscAdLemTaras3D::fillStaggeredInterpolation(PetscInt g)
+{
+    PetscErrorCode  ierr;
+    PetscInt        xs,ys,zs,xm,ym,zm,mx,my,mz,row;
+    DmdaOwnership   own;
+    DM              daFine = (g == 1) ? mDa : mMgDaV[g-1];
+    PetscFunctionBeginUser;
 
-		    // Pressure coefficient k whose value depends on whether IC is to be relaxed in this row or not.
-		    col[nm].c = 3; col[nm].i = i;   col[nm].j = j;   col[nm].k = k;
-                    if((user->getProblemModel()->relaxIcInCsf()) &&
-                            (user->bMaskAt(i,j,k) == user->getProblemModel()->getRelaxIcLabel()))
-		    { //If relax IC option set and if this row corresponds to the IC relaxation cell.
-			// Non-integer type RelaxIcLabel could be used to adapt the compressibilty based on partial volumes
-			// However, the variation in k in the eqn div(u) + kp = 0 required to have desirable effect is so big
-			// that this would perhaps only work if the partial volumes are scaled with some function to get desired
-			// big change in k. that is k = vol_fraction_of_IClabel * f(vol_fraction) might work if we find
-			// suitable f(vol_fraction). This is not done here currently, need to test several cases to make this work.
-			if (!PetscAdLemTaras3D_SolverOps::RELAX_IC_WITH_ZERO_ROWS)
-			{   // Relax IC by setting a non-zero coeff. of pressure variable.
-			    if (fabs(user->getProblemModel()->getRelaxIcPressureCoeff()) < 1e-6)
-				v[nm++] = 1./user->lambdaC(i, j, k, 0, 0);
-			    else
-				v[nm++] = user->getProblemModel()->getRelaxIcPressureCoeff();
-			    ierr=MatSetValuesStencil(jac,1,&row,nm,col,v,INSERT_VALUES);CHKERRQ(ierr);
-			}
-			else
-			{ //Relax IC with zero rows i.e. NO div(u) + kp = 0!
-			    //Set the row explicitly to zero. DON'T leave by just skipping setting zero because this can create problem for  multiple time-step solve.
-			    //Some of the rows corresponding to non-relax_ic cells in the previous solve might be a relax_ic cell now. In these cells the previous non-zero
-			    //values are not modified if I don't explicitly set them to zero!!!
-			    SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_PLIB,"Relax IC by setting zero rows not supported yet.\n");
-			    //I need to figure out a safer way to set the whole row to zero without disturbing the non-zero pattern first.
-			}
+    ierr = getDmdaOwnership(mMgDaV[g],3,own);CHKERRQ(ierr);
+    ierr = DMDAGetInfo(daFine,0,&mx,&my,&mz,0,0,0,0,0,0,0,0,0);CHKERRQ(ierr);
+    ierr = DMDAGetCorners(daFine,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
+    ierr = MatGetOwnershipRange(mMgP[g],&row,NULL);CHKERRQ(ierr);
+    const PetscInt num[3] = {mx, my, mz};
+    const PetscInt numC[3] = {own.x.back(), own.y.back(), own.z.back()};
+    for (PetscInt k=zs; k<zs+zm; ++k) {
+        for (PetscInt j=ys; j<ys+ym; ++j) {
+            for (PetscInt i=xs; i<xs+xm; ++i) {
+                const PetscInt pos[3] = {i, j, k};
+                for (PetscInt c=0; c<3; ++c, ++row) {
+                    PetscInt    lo[3];
+                    PetscReal   w[3][2];
+                    bool        ghost = false;
+                    for (PetscInt t=0; t<3; ++t) {
+                        PetscReal posC;
+                        PetscInt hi;
+                        if(t == c) {
+                            posC = pos[t]/2.;
+                            hi = numC[t]-1;
+                        } else {
+                            ghost = ghost || (pos[t] == num[t]-1);
+                            posC = (pos[t]-0.5)/2.;
+                            hi = numC[t]-2;
+                        }
+                        posC = PetscMin(PetscMax(posC,0.),(PetscReal)hi);
+                        lo[t] = PetscMin((PetscInt)posC,hi-1);
+                        w[t][1] = posC - lo[t];
+                        w[t][0] = 1. - w[t][1];
                     }
-		    else if( (user->getProblemModel()->zeroVelAtFalx() ||  user->getProblemModel()->slidingAtFalx()) &&
-			     (user->bMaskAt(i,j,k) == user->getProblemModel()->getFalxCerebriLabel())
-			)
-		    { //If falx cerebri, just release the IC. This is different than what I did for skull cells above setting
-			//p=0. Instead of setting p=0 in the Falx, I'm just releasing the strict IC, using coeff. 1
-			v[nm++] = 1.0;
-			ierr=MatSetValuesStencil(jac,1,&row,nm,col,v,INSERT_VALUES);CHKERRQ(ierr);
-		    }
-		    else
-		    {
-			v[nm++] = 0; //Must set 0 since when doing multiple solves, there can be non-zero rows in previous time-step that now corrsponds to relax_ic cells
-			ierr=MatSetValuesStencil(jac,1,&row,nm,col,v,INSERT_VALUES);CHKERRQ(ierr);
-		    }
+                    if(ghost)
+                        continue;
+                    PetscInt    cols[8], numOfCols = 0;
+                    PetscScalar vals[8];
+                    for (PetscInt c2=0; c2<2; ++c2) {
+                        for (PetscInt c1=0; c1<2; ++c1) {
+                            for (PetscInt c0=0; c0<2; ++c0) {
+                                const PetscReal weight = w[0][c0]*w[1][c1]*w[2][c2];
+                                if(weight > 0) {
+                                    cols[numOfCols] = dmdaGlobalIndex(own,lo[0]+c0,lo[1]+c1,lo[2]+c2,c);
+                                    vals[numOfCols++] = weight;
+                                }
+                            }
+                        }
+                    }
+                    ierr = MatSetValues(mMgP[g],1,&row,numOfCols,cols,vals,INSERT_VALUES);CHKERRQ(ierr);
                 }
             }
         }
     }
+    ierr = MatAssemblyBegin(mMgP[g],MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+    ierr = MatAssemblyEnd(mMgP[g],MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "getDmdaOwnership"
+PetscErrorCode PetscAdLemTaras3D::getDmdaOwnership(DM da, PetscInt dof, DmdaOwnership& own)
+{
+    PetscErrorCode  ierr;
+    PetscInt        m,n,p;
+    const PetscInt  *lx, *ly, *lz;
+    PetscFunctionBeginUser;
+
+    ierr = DMDAGetInfo(da,0,0,0,0,&m,&n,&p,0,0,0,0,0,0);CHKERRQ(ierr);
+    ierr = DMDAGetOwnershipRanges(da,&lx,&ly,&lz);CHKERRQ(ierr);
+    own.x.assign(m+1,0);    own.y.assign(n+1,0);    own.z.assign(p+1,0);
+    for (PetscInt r=0; r<m; ++r) own.x[r+1] = own.x[r] + lx[r];
+    for (PetscInt r=0; r<n; ++r) own.y[r+1] = own.y[r] + ly[r];
+    for (PetscInt r=0; r<p; ++r) own.z[r+1] = own.z[r] + lz[r];
+    own.dof = dof;
+    PetscFunctionReturn(0);
+}
+
+/*Global index of (i,j,k,c) in the PETSc ordering of the DMDA: processes are numbered with x
+ fastest, and each one numbers its own box k,j,i,c.*/
+PetscInt PetscAdLemTaras3D::dmdaGlobalIndex(const DmdaOwnership& own, PetscInt i, PetscInt j, PetscInt k, PetscInt c)
+{
+    const PetscInt rx = std::upper_bound(own.x.begin(),own.x.end(),i) - own.x.begin() - 1;
+    const PetscInt ry = std::upper_bound(own.y.begin(),own.y.end(),j) - own.y.begin() - 1;
+    const PetscInt rz = std::upper_bound(own.z.begin(),own.z.end(),k) - own.z.begin() - 1;
+    const PetscInt wx = own.x[rx+1] - own.x[rx];
+    const PetscInt wy = own.y[ry+1] - own.y[ry];
+    const PetscInt wz = own.z[rz+1] - own.z[rz];
+    const PetscInt start = own.x.back()*own.y.back()*own.z[rz] + own.x.back()*own.y[ry]*wz + own.x[rx]*wy*wz;
+    return (start + ((k-own.z[rz])*wy + (j-own.y[ry]))*wx + (i-own.x[rx]))*own.dof + c;
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "computeMatrixTaras3dConstantMu"
+PetscErrorCode PetscAdLemTaras3D::computeMatrixTaras3dConstantMu(
+        KSP ksp, Mat J, Mat jac, void *ctx)
+{
+    PetscAdLemTaras3D *user = (PetscAdLemTaras3D*)ctx;
+
+    PetscErrorCode  ierr;
+    DM              da;
+
+    PetscFunctionBeginUser;
+    if(user->mOperatorRowsUpdated) { //jac already refilled by updateOperatorRows().
+        user->mOperatorRowsUpdated = PETSC_FALSE;
+        PetscFunctionReturn(0);
+    }
+    if(user->getProblemModel()->noLameInRhs())
+	PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n RHS will be taken as grad(a), i.e without Lame parameters.\n");
+    else
+	PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n RHS will be taken as (mu + lambda)grad(a), i.e. with Lame parameters.\n");
+
+    PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n computing the operator for linear solve with %d point stencil for divergence\n",
+                            (user->isDiv12pointStencil()) ? 12 : 8);
+    if (PetscAdLemTaras3D_SolverOps::RELAX_IC_WITH_ZERO_ROWS) {
+	PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n Relax IC with zero rows corresponding to cells where IC is to be relaxed.\n");
+        //Zero rows would have to be set explicitly without disturbing the non-zero pattern.
+        if(user->getProblemModel()->relaxIcInCsf())
+            SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_PLIB,"Relax IC by setting zero rows not supported yet.\n");
+    } else
+	PetscSynchronizedPrintf(PETSC_COMM_WORLD,"\n Relax IC with div(u) + kp = 0 on relax cells\n");
+    ierr = KSPGetDM(ksp,&da);CHKERRQ(ierr);
+    ierr = user->fillOperatorRows(da,jac,NULL);CHKERRQ(ierr);
     ierr = MatAssemblyBegin(jac,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
     ierr = MatAssemblyEnd(jac,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
 
@@ -1422,6 +2819,7 @@ PetscErrorCode PetscAdLemTaras3D::computeRHSTaras3dConstantMu(KSP ksp, Vec b, vo
     PetscAdLemTaras3D::Field    ***rhs;
     DM             da;
     PetscReal      kCont=1.0;
+    PetscScalar    ****cell;    //coefficient cache, see updateCoefficientCache().
 
     PetscFunctionBeginUser;
     ierr = KSPGetDM(ksp,&da);CHKERRQ(ierr);
@@ -1441,15 +2839,25 @@ PetscErrorCode PetscAdLemTaras3D::computeRHSTaras3dConstantMu(KSP ksp, Vec b, vo
 
     ierr = DMDAGetCorners(da,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
     ierr = DMDAVecGetArray(da, b, &rhs);CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayDOF(user->mDaCell,user->mCellLocal,&cell);CHKERRQ(ierr);
+
+    const bool skullBc = (user->getProblemModel()->getBcType() == user->getProblemModel()->DIRICHLET_AT_SKULL);
+    const bool zeroVelAtFalx = user->getProblemModel()->zeroVelAtFalx();
+    const bool slidingAtFalx = user->getProblemModel()->slidingAtFalx();
+    const int  falxZeroVelDir = user->getProblemModel()->getFalxSlidingZeroVelDir();
+    const PetscInt skull = PetscAdLemTaras3D_SolverOps::CELL_SKULL;
+    const PetscInt allNbrsSkull = PetscAdLemTaras3D_SolverOps::CELL_ALL_NBRS_SKULL;
+    const PetscInt falx = PetscAdLemTaras3D_SolverOps::CELL_FALX;
+    const PetscInt relaxIc = PetscAdLemTaras3D_SolverOps::CELL_RELAX_IC;
 
     for (k=zs; k<zs+zm; ++k) {
         for (j=ys; j<ys+ym; ++j) {
             for (i=xs; i<xs+xm; ++i) {
                 //---*********** Compute gradient ----*************************//
                 if (i<mx-1 && j<my-1 && k<mz-1) {
-                    gradAx = (user->aC(i+1,j+1,k+1) - user->aC(i,j+1,k+1));
-                    gradAy = (user->aC(i+1,j+1,k+1) - user->aC(i+1,j,k+1));
-                    gradAz = (user->aC(i+1,j+1,k+1) - user->aC(i+1,j+1,k));
+                    gradAx = (cell[k+1][j+1][i+1][CELL_ATROPHY] - cell[k+1][j+1][i][CELL_ATROPHY]);
+                    gradAy = (cell[k+1][j+1][i+1][CELL_ATROPHY] - cell[k+1][j][i+1][CELL_ATROPHY]);
+                    gradAz = (cell[k+1][j+1][i+1][CELL_ATROPHY] - cell[k][j+1][i+1][CELL_ATROPHY]);
                 }
                 //---****************** x-momentum equation ********************---//
                 if(j==my-1 || k==mz-1) {     //back and north wall ghost nodes:
@@ -1466,30 +2874,30 @@ PetscErrorCode PetscAdLemTaras3D::computeRHSTaras3dConstantMu(KSP ksp, Vec b, vo
                     rhs[k][j][i].vx = 2*wallVel.at(sWall);
                 } else if(k==mz-2) {    //north wall:    2nx
                     rhs[k][j][i].vx = 2*wallVel.at(nWall);
-                } else if ( (user->getProblemModel()->getBcType() == user->getProblemModel()->DIRICHLET_AT_SKULL) &&
-                            (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getSkullLabel() ||
-                             user->bMaskAt(i,j+1,k+1) == user->getProblemModel()->getSkullLabel())
+                } else if ( skullBc &&
+                            ((cellFlags(cell,i+1,j+1,k+1) & skull) ||
+                             (cellFlags(cell,i,j+1,k+1) & skull))
                             ) { //skull or non-brain region:
                     rhs[k][j][i].vx = 0;
-                } else if( (user->getProblemModel()->zeroVelAtFalx()) &&
-			   (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getFalxCerebriLabel() ||
-			    user->bMaskAt(i,j+1,k+1) == user->getProblemModel()->getFalxCerebriLabel())
+                } else if( zeroVelAtFalx &&
+			   ((cellFlags(cell,i+1,j+1,k+1) & falx) ||
+			    (cellFlags(cell,i,j+1,k+1) & falx))
 		    ) { //vx lying in the face that touches a Falx Cerebri cell
 		    rhs[k][j][i].vx = 0;
-		} else if( (user->getProblemModel()->slidingAtFalx() && (user->getProblemModel()->getFalxSlidingZeroVelDir()==0)) &&
-			   (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getFalxCerebriLabel() ||
-			    user->bMaskAt(i,j+1,k+1) == user->getProblemModel()->getFalxCerebriLabel())
+		} else if( (slidingAtFalx && falxZeroVelDir==0) &&
+			   ((cellFlags(cell,i+1,j+1,k+1) & falx) ||
+			    (cellFlags(cell,i,j+1,k+1) & falx))
 		    ) { //vx lying in the face that touches a Falx Cerebri cell
 		    rhs[k][j][i].vx = 0;
 		}
                 else { //interior points, x-momentum equation
-		    if (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getRelaxIcLabel() || user->bMaskAt(i,j+1,k+1) == user->getProblemModel()->getRelaxIcLabel())
+		    if ((cellFlags(cell,i+1,j+1,k+1) & relaxIc) || (cellFlags(cell,i,j+1,k+1) & relaxIc))
 			rhs[k][j][i].vx = 0; //no force when gradAx computed using at least one value from CSF voxel.
                     else if(user->getProblemModel()->noLameInRhs()) //make force independent of Lame parameters.
 			rhs[k][j][i].vx = Hy*Hz*gradAx;
 		    else if (user->getProblemModel()->isLambdaTensor()) {
-                        rhs[k][j][i].vx = Hy*Hz*( gradAx*0.5*(user->muC(i+1,j+1,k+1) + user->muC(i,j+1,k+1)) +
-						  user->lambdaC(i,j,k,0,0)*gradAx + user->lambdaC(i,j,k,0,1)*gradAy + user->lambdaC(i,j,k,0,2)*gradAz
+                        rhs[k][j][i].vx = Hy*Hz*( gradAx*0.5*(cell[k+1][j+1][i+1][CELL_MU] + cell[k+1][j+1][i][CELL_MU]) +
+						  user->cellLambda(i,j,k,lambdaComp(0,0))*gradAx + user->cellLambda(i,j,k,lambdaComp(0,1))*gradAy + user->cellLambda(i,j,k,lambdaComp(0,2))*gradAz
 			    );
                     } else {
                         // rhs[k][j][i].vx = Hy*Hz*(
@@ -1505,8 +2913,8 @@ PetscErrorCode PetscAdLemTaras3D::computeRHSTaras3dConstantMu(KSP ksp, Vec b, vo
 			// This is perhaps because using f_csf as above and with lambda_csf = lambda_tissue will
 			// create equal balancing force in csf voxels next to the tissue since with non-zero grad(a).
 			//rhs[k][j][i].vx = Hy*Hz*(user->muC(i,j,k) + user->lambdaC(i,j,k,0,0)) * gradAx;
-			rhs[k][j][i].vx = Hy*Hz*gradAx*( 0.5*(user->muC(i+1,j+1,k+1) + user->muC(i,j+1,k+1)) +
-							 user->lambdaC(i,j,k,0,0)
+			rhs[k][j][i].vx = Hy*Hz*gradAx*( 0.5*(cell[k+1][j+1][i+1][CELL_MU] + cell[k+1][j+1][i][CELL_MU]) +
+							 cell[k][j][i][CELL_LAMBDA]
 			    );
 		    }
 		}
@@ -1526,30 +2934,30 @@ PetscErrorCode PetscAdLemTaras3D::computeRHSTaras3dConstantMu(KSP ksp, Vec b, vo
                     rhs[k][j][i].vy = 2*wallVel.at(sWall+1);
                 } else if(k==mz-2) {    //north wall:    2ny
                     rhs[k][j][i].vy = 2*wallVel.at(nWall+1);
-                } else if ( (user->getProblemModel()->getBcType() == user->getProblemModel()->DIRICHLET_AT_SKULL) &&
-                            (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getSkullLabel() ||
-                             user->bMaskAt(i+1,j,k+1) == user->getProblemModel()->getSkullLabel())
+                } else if ( skullBc &&
+                            ((cellFlags(cell,i+1,j+1,k+1) & skull) ||
+                             (cellFlags(cell,i+1,j,k+1) & skull))
                             ) { //Skull or non-brain region:
                     rhs[k][j][i].vy = 0;
-                } else if( (user->getProblemModel()->zeroVelAtFalx()) &&
-			   (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getFalxCerebriLabel() ||
-			    user->bMaskAt(i+1,j,k+1) == user->getProblemModel()->getFalxCerebriLabel())
+                } else if( zeroVelAtFalx &&
+			   ((cellFlags(cell,i+1,j+1,k+1) & falx) ||
+			    (cellFlags(cell,i+1,j,k+1) & falx))
 		    ) { //vy lying in the face that touches a Falx Cerebri cell
 		    rhs[k][j][i].vy = 0;
-		} else if( (user->getProblemModel()->slidingAtFalx() && (user->getProblemModel()->getFalxSlidingZeroVelDir()==1)) &&
-			   (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getFalxCerebriLabel() ||
-			    user->bMaskAt(i+1,j,k+1) == user->getProblemModel()->getFalxCerebriLabel())
+		} else if( (slidingAtFalx && falxZeroVelDir==1) &&
+			   ((cellFlags(cell,i+1,j+1,k+1) & falx) ||
+			    (cellFlags(cell,i+1,j,k+1) & falx))
 		    ) { //vy lying in the face that touches a Falx Cerebri cell
 		    rhs[k][j][i].vy = 0;
 		}
                 else { //interior points, y-momentum equation
-		    if (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getRelaxIcLabel() || user->bMaskAt(i+1,j,k+1) == user->getProblemModel()->getRelaxIcLabel())
+		    if ((cellFlags(cell,i+1,j+1,k+1) & relaxIc) || (cellFlags(cell,i+1,j,k+1) & relaxIc))
 			rhs[k][j][i].vy = 0; //no force when gradAy computed using at least one value from CSF voxel.
                     else if(user->getProblemModel()->noLameInRhs()) //make force independent of Lame parameters.
 			rhs[k][j][i].vy = Hx*Hz*gradAy;
                     else if (user->getProblemModel()->isLambdaTensor()) {
-                        rhs[k][j][i].vy = Hx*Hz*( gradAy*0.5*(user->muC(i+1,j+1,k+1) + user->muC(i+1,j,k+1)) +
-						  user->lambdaC(i,j,k,1,0)*gradAx + user->lambdaC(i,j,k,1,1)*gradAy + user->lambdaC(i,j,k,1,2)*gradAz
+                        rhs[k][j][i].vy = Hx*Hz*( gradAy*0.5*(cell[k+1][j+1][i+1][CELL_MU] + cell[k+1][j][i+1][CELL_MU]) +
+						  user->cellLambda(i,j,k,lambdaComp(1,0))*gradAx + user->cellLambda(i,j,k,lambdaComp(1,1))*gradAy + user->cellLambda(i,j,k,lambdaComp(1,2))*gradAz
 			    );
                     }else {
                     //     rhs[k][j][i].vy = Hx*Hz*(
@@ -1565,8 +2973,8 @@ PetscErrorCode PetscAdLemTaras3D::computeRHSTaras3dConstantMu(KSP ksp, Vec b, vo
 			// This is perhaps because using f_csf as above and with lambda_csf = lambda_tissue will
 			// create equal balancing force in csf voxels next to the tissue since with non-zero grad(a).
 			//rhs[k][j][i].vy = Hx*Hz*(user->muC(i,j,k) + user->lambdaC(i,j,k,0,0)) * gradAy;
-			rhs[k][j][i].vy = Hx*Hz*gradAy*( 0.5*(user->muC(i+1,j+1,k+1) + user->muC(i+1,j,k+1)) +
-							 user->lambdaC(i,j,k,0,0)
+			rhs[k][j][i].vy = Hx*Hz*gradAy*( 0.5*(cell[k+1][j+1][i+1][CELL_MU] + cell[k+1][j][i+1][CELL_MU]) +
+							 cell[k][j][i][CELL_LAMBDA]
 			    );
 		    }
                 }
@@ -1586,31 +2994,31 @@ PetscErrorCode PetscAdLemTaras3D::computeRHSTaras3dConstantMu(KSP ksp, Vec b, vo
                     rhs[k][j][i].vz = 2*wallVel.at(fWall+2);
                 } else if(j==my-2) {    //back wall:   2bz
                     rhs[k][j][i].vz = 2*wallVel.at(bWall+2);
-                } else if ( (user->getProblemModel()->getBcType() == user->getProblemModel()->DIRICHLET_AT_SKULL) &&
-                            ( user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getSkullLabel() ||
-                              user->bMaskAt(i+1,j+1,k) == user->getProblemModel()->getSkullLabel()
+                } else if ( skullBc &&
+                            ( (cellFlags(cell,i+1,j+1,k+1) & skull) ||
+                              (cellFlags(cell,i+1,j+1,k) & skull)
                             )
                           ) { //skull or non-brain region:
                     rhs[k][j][i].vz = 0;
-                } else if( (user->getProblemModel()->zeroVelAtFalx()) &&
-			   (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getFalxCerebriLabel() ||
-			    user->bMaskAt(i+1,j+1,k) == user->getProblemModel()->getFalxCerebriLabel())
+                } else if( zeroVelAtFalx &&
+			   ((cellFlags(cell,i+1,j+1,k+1) & falx) ||
+			    (cellFlags(cell,i+1,j+1,k) & falx))
 		    ) { //vz lying in the face that touches a Falx Cerebri cell
 		    rhs[k][j][i].vz = 0;
-		} else if( (user->getProblemModel()->slidingAtFalx() && (user->getProblemModel()->getFalxSlidingZeroVelDir()==2)) &&
-			   (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getFalxCerebriLabel() ||
-			    user->bMaskAt(i+1,j+1,k) == user->getProblemModel()->getFalxCerebriLabel())
+		} else if( (slidingAtFalx && falxZeroVelDir==2) &&
+			   ((cellFlags(cell,i+1,j+1,k+1) & falx) ||
+			    (cellFlags(cell,i+1,j+1,k) & falx))
 		    ) { //vz lying in the face that touches a Falx Cerebri cell
 		    rhs[k][j][i].vz = 0;
 		}
                 else { //interior points, z-momentum equation
-		    if (user->bMaskAt(i+1,j+1,k+1) == user->getProblemModel()->getRelaxIcLabel() || user->bMaskAt(i+1,j+1,k) == user->getProblemModel()->getRelaxIcLabel())
+		    if ((cellFlags(cell,i+1,j+1,k+1) & relaxIc) || (cellFlags(cell,i+1,j+1,k) & relaxIc))
 			rhs[k][j][i].vz = 0; //no force when gradAz computed using at least one value from CSF voxel.
                     else if(user->getProblemModel()->noLameInRhs()) //make force independent of Lame parameters.
 			rhs[k][j][i].vz = Hx*Hy*gradAz;
                     else if (user->getProblemModel()->isLambdaTensor()) {
-                        rhs[k][j][i].vz = Hx*Hy*( gradAz*0.5*(user->muC(i+1,j+1,k+1) + user->muC(i+1,j+1,k)) +
-						  user->lambdaC(i,j,k,2,0)*gradAx + user->lambdaC(i,j,k,2,1)*gradAy + user->lambdaC(i,j,k,2,2)*gradAz
+                        rhs[k][j][i].vz = Hx*Hy*( gradAz*0.5*(cell[k+1][j+1][i+1][CELL_MU] + cell[k][j+1][i+1][CELL_MU]) +
+						  user->cellLambda(i,j,k,lambdaComp(2,0))*gradAx + user->cellLambda(i,j,k,lambdaComp(2,1))*gradAy + user->cellLambda(i,j,k,lambdaComp(2,2))*gradAz
 			    );
                     } else {
                     //     rhs[k][j][i].vz = Hx*Hy*(
@@ -1626,8 +3034,8 @@ PetscErrorCode PetscAdLemTaras3D::computeRHSTaras3dConstantMu(KSP ksp, Vec b, vo
 			// This is perhaps because using f_csf as above and with lambda_csf = lambda_tissue will
 			// create equal balancing force in csf voxels next to the tissue since with non-zero grad(a).
 			//rhs[k][j][i].vz = Hx*Hy*(user->muC(i,j,k) + user->lambdaC(i,j,k,0,0)) * gradAz;
-			rhs[k][j][i].vz = Hx*Hy*gradAz*( 0.5*(user->muC(i+1,j+1,k+1) + user->muC(i+1,j+1,k))
-							 + user->lambdaC(i,j,k,0,0)
+			rhs[k][j][i].vz = Hx*Hy*gradAz*( 0.5*(cell[k+1][j+1][i+1][CELL_MU] + cell[k][j+1][i+1][CELL_MU])
+							 + cell[k][j][i][CELL_LAMBDA]
 			    );
 		    }
                 }
@@ -1641,26 +3049,19 @@ PetscErrorCode PetscAdLemTaras3D::computeRHSTaras3dConstantMu(KSP ksp, Vec b, vo
                         ) {
                     rhs[k][j][i].p = 0;
                 }  else if (
-		    (user->getProblemModel()->getBcType() == user->getProblemModel()->DIRICHLET_AT_SKULL) &&
-                            (user->bMaskAt(i,j,k) == user->getProblemModel()->getSkullLabel() ||
-                              ( user->bMaskAt(i+1,j,k) == user->getProblemModel()->getSkullLabel() &&
-                                user->bMaskAt(i-1,j,k) == user->getProblemModel()->getSkullLabel() &&
-                                user->bMaskAt(i,j+1,k) == user->getProblemModel()->getSkullLabel() &&
-                                user->bMaskAt(i,j-1,k) == user->getProblemModel()->getSkullLabel() &&
-                                user->bMaskAt(i,j,k+1) == user->getProblemModel()->getSkullLabel() &&
-                                user->bMaskAt(i,j,k-1) == user->getProblemModel()->getSkullLabel()
-                              )
-                            )
+		    skullBc &&
+                            (cellFlags(cell,i,j,k) & (skull | allNbrsSkull))
                            ) { //Skull cell or a non-skull cell surrounded by skull cells in all its 6-neigbhor.
                     rhs[k][j][i].p = 0;
                 }
                 else {
-                    rhs[k][j][i].p = -kCont*user->aC(i,j,k);
+                    rhs[k][j][i].p = -kCont*cell[k][j][i][CELL_ATROPHY];
                 }
             }
         }
     }
 
+    ierr = DMDAVecRestoreArrayDOF(user->mDaCell,user->mCellLocal,&cell);CHKERRQ(ierr);
     ierr = DMDAVecRestoreArray(da, b, &rhs);CHKERRQ(ierr);
     //    ierr = VecAssemblyBegin(b);CHKERRQ(ierr);
     //    ierr = VecAssemblyEnd(b);CHKERRQ(ierr);
@@ -0,0 +1,58 @@
+#ifndef SOLUTION_IMAGES_THREADER_H
+#define SOLUTION_IMAGES_THREADER_H
+
+/*
+    class SolutionImagesThreader
+        Splits the voxels whose solution is available in this process among the threads, each of which
+        converts its part of the staggered solution into the output image buffers with
+        TSolver::fillOutputBuffers(). The domain is the region in the model coordinates given by
+        TSolver::getSolutionRegion().
+*/
+#include <petscsys.h>
+#include "itkDomainThreader.h"
+#include "itkThreadedImageRegionPartitioner.h"
+
+template<typename TSolver>
+class SolutionImagesThreader: public itk::DomainThreader< itk::ThreadedImageRegionPartitioner<3>, TSolver >
+{
+	public:
+	/* Standard class typedefs. */
+	typedef SolutionImagesThreader													Self;
+	typedef itk::DomainThreader< itk::ThreadedImageRegionPartitioner<3>, TSolver >	Superclass;
+	typedef itk::SmartPointer< Self >												Pointer;
+	typedef itk::SmartPointer< const Self >											ConstPointer;
+
+	typedef typename Superclass::DomainType					DomainType;
+	typedef typename TSolver::OutputBuffers					OutputBuffersType;
+
+	/* Method for creation through the object factory. */
+	itkNewMacro(Self);
+
+	/* Run-time type information (and related methods). */
+	itkTypeMacro(SolutionImagesThreader, itk::DomainThreader);
+
+	void SetOutputBuffers(const OutputBuffersType & buffers) { m_OutputBuffers = buffers; }
+
+protected:
+	SolutionImagesThreader() {}
+	~SolutionImagesThreader() {}
+
+	/** Does the real work. */
+	virtual void ThreadedExecution(const DomainType & subdomain, const itk::ThreadIdType)
+	{
+		PetscInt first[3], num[3];
+		for(unsigned int d=0; d<3; ++d) {
+			first[d] = subdomain.GetIndex()[d];
+			num[d] = subdomain.GetSize()[d];
+		}
+		this->m_Associate->fillOutputBuffers(m_OutputBuffers, first, num);
+	}
+
+private:
+	SolutionImagesThreader(const Self &);	//purposely not implemented
+	void operator=(const Self &);			//purposely not implemented
+
+	OutputBuffersType m_OutputBuffers;
+};
+
+#endif